@@ -0,0 +1,204 @@
+#include "kvm/boot-trace.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/mutex.h"
+#include "kvm/kvm.h"
+
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Time stamps of the steps of a boot, each taken the first time the step is
+ * reached. With --boot-trace, the time spent setting up the VM and loading
+ * the kernel is printed when the first vCPU starts, and the time the guest
+ * took to reach init is printed when it says so.
+ *
+ * With --startup-trace, the init callbacks are timed as well, and the steps
+ * and callbacks are written to a file in the Chrome trace event format, which
+ * chrome://tracing and Perfetto open. The file is rewritten as the boot goes.
+ */
+struct boot_trace_span {
+	char	name[32];
+	u64	start_ns;
+	u64	end_ns;
+	pid_t	tid;
+};
+
+static const char *boot_trace_names[BOOT_TRACE_NR] = {
+	[BOOT_TRACE_START]		= "start",
+	[BOOT_TRACE_KERNEL_LOAD]	= "kernel load",
+	[BOOT_TRACE_KERNEL_LOADED]	= "kernel loaded",
+	[BOOT_TRACE_VCPU_RUN]		= "vcpu run",
+	[BOOT_TRACE_GUEST_INIT]		= "guest init",
+};
+
+static u64 boot_trace_ns[BOOT_TRACE_NR];
+
+static DEFINE_MUTEX(boot_trace_lock);
+static struct boot_trace_span *boot_trace_spans;
+static unsigned int boot_trace_nr_spans;
+static unsigned int boot_trace_max_spans;
+
+u64 boot_trace__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double boot_trace__ms(enum boot_trace_event from,
+			     enum boot_trace_event to)
+{
+	return (boot_trace_ns[to] - boot_trace_ns[from]) / 1e6;
+}
+
+/* Record a span from start_ns to now, in the calling thread */
+void boot_trace__span(struct kvm *kvm, const char *name, u64 start_ns)
+{
+	struct boot_trace_span *span;
+	u64 end_ns = boot_trace__now();
+
+	if (!kvm->cfg.startup_trace)
+		return;
+
+	mutex_lock(&boot_trace_lock);
+	if (boot_trace_nr_spans == boot_trace_max_spans) {
+		unsigned int max = max(32U, boot_trace_max_spans * 2);
+
+		span = realloc(boot_trace_spans, max * sizeof(*span));
+		if (!span) {
+			mutex_unlock(&boot_trace_lock);
+			return;
+		}
+		boot_trace_spans = span;
+		boot_trace_max_spans = max;
+	}
+
+	span = &boot_trace_spans[boot_trace_nr_spans++];
+	snprintf(span->name, sizeof(span->name), "%s", name);
+	span->start_ns	= start_ns;
+	span->end_ns	= end_ns;
+	span->tid	= syscall(SYS_gettid);
+	mutex_unlock(&boot_trace_lock);
+
+	pr_debug("%s: %.3f ms", name, (end_ns - start_ns) / 1e6);
+}
+
+/* Microseconds since the start, as trace timestamps */
+static double boot_trace__us(u64 ns)
+{
+	return (double)(ns - boot_trace_ns[BOOT_TRACE_START]) / 1e3;
+}
+
+void boot_trace__write(struct kvm *kvm)
+{
+	const char *sep = "";
+	struct boot_trace_span *span;
+	unsigned int i;
+	pid_t pid = getpid();
+	FILE *f;
+
+	if (!kvm->cfg.startup_trace)
+		return;
+
+	mutex_lock(&boot_trace_lock);
+	f = fopen(kvm->cfg.startup_trace, "w");
+	if (!f) {
+		pr_warning("Failed to write startup trace to %s: %s",
+			   kvm->cfg.startup_trace, strerror(errno));
+		goto out_unlock;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	for (i = 0; i < boot_trace_nr_spans; i++) {
+		span = &boot_trace_spans[i];
+		fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"init\",\"ph\":\"X\","
+			"\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			sep, span->name, pid, span->tid,
+			boot_trace__us(span->start_ns),
+			(span->end_ns - span->start_ns) / 1e3);
+		sep = ",";
+	}
+
+	for (i = 0; i < BOOT_TRACE_NR; i++) {
+		if (!boot_trace_ns[i])
+			continue;
+
+		fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"boot\",\"ph\":\"i\","
+			"\"s\":\"g\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+			sep, boot_trace_names[i], pid, pid,
+			boot_trace__us(boot_trace_ns[i]));
+		sep = ",";
+	}
+
+	fprintf(f, "\n]}\n");
+
+	if (fclose(f))
+		pr_warning("Failed to write startup trace to %s: %s",
+			   kvm->cfg.startup_trace, strerror(errno));
+out_unlock:
+	mutex_unlock(&boot_trace_lock);
+}
+
+void boot_trace__mark(struct kvm *kvm, enum boot_trace_event event)
+{
+	if (!__sync_bool_compare_and_swap(&boot_trace_ns[event], 0,
+					  boot_trace__now()))
+		return;
+
+	switch (event) {
+	case BOOT_TRACE_VCPU_RUN:
+		if (kvm->cfg.boot_trace)
+			pr_info("# Boot trace: host setup %.3f ms, including kernel load %.3f ms",
+				boot_trace__ms(BOOT_TRACE_START, BOOT_TRACE_VCPU_RUN),
+				boot_trace__ms(BOOT_TRACE_KERNEL_LOAD,
+					       BOOT_TRACE_KERNEL_LOADED));
+		boot_trace__write(kvm);
+		break;
+	case BOOT_TRACE_GUEST_INIT:
+		if (kvm->cfg.boot_trace)
+			pr_info("# Boot trace: guest init after %.3f ms in the guest, %.3f ms total",
+				boot_trace__ms(BOOT_TRACE_VCPU_RUN, BOOT_TRACE_GUEST_INIT),
+				boot_trace__ms(BOOT_TRACE_START, BOOT_TRACE_GUEST_INIT));
+		boot_trace__write(kvm);
+		break;
+	default:
+		break;
+	}
+}
+
+static void boot_trace__io(struct kvm_cpu *vcpu, u64 addr, u8 *data, u32 len,
+			   u8 is_write, void *ptr)
+{
+	if (is_write && len == 1 && *data == BOOT_TRACE_MAGIC)
+		boot_trace__mark(vcpu->kvm, BOOT_TRACE_GUEST_INIT);
+}
+
+static bool boot_trace__enabled(struct kvm *kvm)
+{
+	return kvm->cfg.boot_trace || kvm->cfg.startup_trace;
+}
+
+static int boot_trace__init(struct kvm *kvm)
+{
+	if (!boot_trace__enabled(kvm))
+		return 0;
+
+	return kvm__register_pio(kvm, BOOT_TRACE_PORT, 1, boot_trace__io, NULL);
+}
+dev_init(boot_trace__init);
+
+static int boot_trace__exit(struct kvm *kvm)
+{
+	if (boot_trace__enabled(kvm))
+		kvm__deregister_pio(kvm, BOOT_TRACE_PORT);
+
+	free(boot_trace_spans);
+	boot_trace_spans = NULL;
+	boot_trace_nr_spans = boot_trace_max_spans = 0;
+
+	return 0;
+}
+dev_exit(boot_trace__exit);
@@ -1,6 +1,7 @@
 #include "kvm/builtin-run.h"
 
 #include "kvm/builtin-setup.h"
+#include "kvm/boot-trace.h"
 #include "kvm/virtio-balloon.h"
 #include "kvm/virtio-console.h"
 #include "kvm/parse-options.h"
@@ -214,6 +215,17 @@ static int loglevel_parser(const struct option *opt, const char *arg, int unset)
 		     " guest", virtio_9p_rootdir_parser, kvm),		\
 	OPT_STRING('\0', "console", &(cfg)->console, "serial, virtio or"\
 			" hv", "Console to use"),			\
+	OPT_STRING('\0', "console-overflow", &(cfg)->console_overflow,	\
+			"block or drop", "What to do with guest console"\
+			" output when the host can't keep up"),		\
+	OPT_STRING('\0', "console-log", &(cfg)->console_log, "file",	\
+			"Also write guest console output to a file"),	\
+	OPT_INTEGER('\0', "console-log-size", &(cfg)->console_log_size,\
+			"Rotate the console log after this many MB"),	\
+	OPT_CALLBACK('\0', "console-port", NULL,			\
+		     "name=<name>,socket=<path>|fd=<fd>",		\
+		     "Add a virtio-console data port",			\
+		     virtio_console_port_parser, kvm),			\
 	OPT_U64('\0', "vsock", &(cfg)->vsock_cid,			\
 			"Guest virtio socket CID"),			\
 	OPT_STRING('\0', "dev", &(cfg)->dev, "device_file",		\
@@ -226,6 +238,10 @@ static int loglevel_parser(const struct option *opt, const char *arg, int unset)
 			" rootfs"),					\
 	OPT_STRING('\0', "hugetlbfs", &(cfg)->hugetlbfs_path, "path",	\
 			"Hugetlbfs path"),				\
+	OPT_STRING('\0', "threadpool-affinity",			\
+			&(cfg)->threadpool_affinity, "cpulist",		\
+			"Run one thread pool worker pinned to each CPU"	\
+			" in the list"),				\
 	OPT_CALLBACK_NOOPT('\0', "virtio-legacy",			\
 			   &(cfg)->virtio_transport, "",		\
 			   "Use legacy virtio transport (Deprecated:"	\
@@ -276,6 +292,12 @@ static int loglevel_parser(const struct option *opt, const char *arg, int unset)
 			"Enable MMIO debugging"),			\
 	OPT_INTEGER('\0', "debug-iodelay", &(cfg)->debug_iodelay,	\
 			"Delay IO by millisecond"),			\
+	OPT_BOOLEAN('\0', "boot-trace", &(cfg)->boot_trace,		\
+			"Print the host setup time and the time to"	\
+			" guest init"),					\
+	OPT_STRING('\0', "startup-trace", &(cfg)->startup_trace,	\
+			"file", "Write the duration of each startup"	\
+			" step to a Chrome trace file"),		\
 									\
 	OPT_ARCH(RUN, cfg)						\
 	OPT_END()							\
@@ -665,6 +687,8 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 	if (IS_ERR(kvm))
 		return kvm;
 
+	boot_trace__mark(kvm, BOOT_TRACE_START);
+
 	nr_online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
 	kvm->cfg.custom_rootfs_name = "default";
 	/*
@@ -784,7 +808,7 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 
 	if (!kvm->cfg.nodefaults &&
 	    !kvm->cfg.using_rootfs &&
-	    !kvm->cfg.disk_image[0].filename &&
+	    !kvm->nr_disks &&
 	    !kvm->cfg.initrd_filename) {
 		char tmp[PATH_MAX];
 
@@ -830,6 +854,7 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 
 static int kvm_cmd_run_work(struct kvm *kvm)
 {
+	u64 start = boot_trace__now();
 	int i;
 
 	for (i = 0; i < kvm->nrcpus; i++) {
@@ -837,6 +862,9 @@ static int kvm_cmd_run_work(struct kvm *kvm)
 			die("unable to create KVM VCPU thread");
 	}
 
+	boot_trace__span(kvm, "vcpu threads", start);
+	boot_trace__write(kvm);
+
 	/* Only VCPU #0 is going to exit by itself when shutting down */
 	if (pthread_join(kvm->cpus[0]->thread, NULL) != 0)
 		die("unable to join with vcpu 0");
@@ -4,6 +4,8 @@
 #include <kvm/kvm.h>
 #include <kvm/parse-options.h>
 #include <kvm/kvm-ipc.h>
+#include <kvm/disk-image.h>
+#include <kvm/read-write.h>
 
 #include <sys/select.h>
 #include <stdio.h>
@@ -13,6 +15,7 @@
 #include <linux/virtio_balloon.h>
 
 static bool mem;
+static bool disk;
 static bool all;
 static const char *instance_name;
 
@@ -24,6 +27,7 @@ static const char * const stat_usage[] = {
 static const struct option stat_options[] = {
 	OPT_GROUP("Commands options:"),
 	OPT_BOOLEAN('m', "memory", &mem, "Display memory statistics"),
+	OPT_BOOLEAN('d', "disk", &disk, "Display disk statistics"),
 	OPT_GROUP("Instance options:"),
 	OPT_BOOLEAN('a', "all", &all, "All instances"),
 	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
@@ -112,6 +116,50 @@ static int do_memstat(const char *name, int sock)
 	return 0;
 }
 
+static int do_diskstat(const char *name, int sock)
+{
+	struct disk_image_stats stats;
+	u32 idx = 0;
+	int r;
+
+	printf("\n\t*** Disk statistics of %s ***\n\n", name);
+	do {
+		r = kvm_ipc__send_msg(sock, KVM_IPC_DISK_STAT, sizeof(idx),
+				      (u8 *)&idx);
+		if (r < 0)
+			return r;
+
+		if (read_in_full(sock, &stats, sizeof(stats)) != sizeof(stats))
+			return -EIO;
+
+		if (stats.status < 0)
+			break;
+
+		printf("Disk %u: %llu MB", idx,
+		       (unsigned long long)stats.size >> 20);
+		if (stats.overlay_max)
+			printf(", overlay %llu/%llu MB",
+			       (unsigned long long)stats.overlay_used >> 20,
+			       (unsigned long long)stats.overlay_max >> 20);
+		printf("\n");
+	} while (++idx < stats.nr_disks);
+	printf("\n");
+
+	return 0;
+}
+
+static int do_stat(const char *name, int sock)
+{
+	int r = 0;
+
+	if (mem)
+		r = do_memstat(name, sock);
+	if (disk && r >= 0)
+		r = do_diskstat(name, sock);
+
+	return r;
+}
+
 int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 {
 	int instance;
@@ -119,11 +167,11 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 
 	parse_stat_options(argc, argv);
 
-	if (!mem)
+	if (!mem && !disk)
 		usage_with_options(stat_usage, stat_options);
 
-	if (mem && all)
-		return kvm__enumerate_instances(do_memstat);
+	if (all)
+		return kvm__enumerate_instances(do_stat);
 
 	if (instance_name == NULL)
 		kvm_stat_help();
@@ -133,8 +181,7 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 	if (instance <= 0)
 		die("Failed locating instance");
 
-	if (mem)
-		r = do_memstat(instance_name, instance);
+	r = do_stat(instance_name, instance);
 
 	close(instance);
 
@@ -0,0 +1,155 @@
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-throttle.h>
+#include <kvm/disk-throttle.h>
+#include <kvm/kvm.h>
+#include <kvm/parse-options.h>
+#include <kvm/kvm-ipc.h>
+#include <kvm/read-write.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define UNCHANGED	((u64)-1)
+
+static const char *instance_name;
+static int disk;
+static u64 iops_rd = UNCHANGED;
+static u64 iops_wr = UNCHANGED;
+static u64 bw_rd = UNCHANGED;
+static u64 bw_wr = UNCHANGED;
+static u64 burst = UNCHANGED;
+
+static const char * const throttle_usage[] = {
+	"lkvm throttle [-n name] [-d disk] [--iops-rd n] [--iops-wr n] [--bw-rd MB] [--bw-wr MB] [--burst s]",
+	NULL
+};
+
+static const struct option throttle_options[] = {
+	OPT_GROUP("Instance options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_INTEGER('d', "disk", &disk, "Index of the disk, in --disk order"),
+	OPT_GROUP("Throttle options (0 removes the limit):"),
+	OPT_U64('\0', "iops-rd", &iops_rd, "Read requests per second"),
+	OPT_U64('\0', "iops-wr", &iops_wr, "Write requests per second"),
+	OPT_U64('\0', "bw-rd", &bw_rd, "Read bandwidth (in MB/s)"),
+	OPT_U64('\0', "bw-wr", &bw_wr, "Write bandwidth (in MB/s)"),
+	OPT_U64('\0', "burst", &burst, "Seconds worth of requests allowed in a burst"),
+	OPT_END()
+};
+
+void kvm_throttle_help(void)
+{
+	usage_with_options(throttle_usage, throttle_options);
+}
+
+static void parse_throttle_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, throttle_options, throttle_usage,
+				PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_throttle_help();
+	}
+}
+
+static int throttle_request(int sock, struct disk_throttle_cmd_params *cmd,
+			    struct disk_throttle_stats *stats)
+{
+	int r;
+
+	r = kvm_ipc__send_msg(sock, KVM_IPC_DISK_THROTTLE, sizeof(*cmd),
+			      (u8 *)cmd);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, stats, sizeof(*stats)) != sizeof(*stats))
+		return -EIO;
+
+	return stats->status;
+}
+
+static void update_limit(u64 *rate, u64 val, int shift)
+{
+	if (val != UNCHANGED)
+		*rate = val << shift;
+}
+
+static void print_limit(const char *name, u64 rate, const char *unit, int shift)
+{
+	if (rate)
+		printf("  %-12s %llu%s\n", name,
+		       (unsigned long long)rate >> shift, unit);
+	else
+		printf("  %-12s unlimited\n", name);
+}
+
+static int do_throttle(const char *name, int sock)
+{
+	struct disk_throttle_cmd_params cmd = { .disk = disk };
+	struct disk_throttle_stats stats;
+	struct disk_throttle_limits *limits = &cmd.limits;
+	int r;
+
+	/* Fetch the current limits, to only change the requested ones */
+	r = throttle_request(sock, &cmd, &stats);
+	if (r < 0)
+		return r;
+
+	if (iops_rd != UNCHANGED || iops_wr != UNCHANGED ||
+	    bw_rd != UNCHANGED || bw_wr != UNCHANGED || burst != UNCHANGED) {
+		*limits = stats.limits;
+		update_limit(&limits->rate[DISK_THROTTLE_IOPS_RD], iops_rd, 0);
+		update_limit(&limits->rate[DISK_THROTTLE_IOPS_WR], iops_wr, 0);
+		update_limit(&limits->rate[DISK_THROTTLE_BPS_RD], bw_rd, 20);
+		update_limit(&limits->rate[DISK_THROTTLE_BPS_WR], bw_wr, 20);
+		if (burst != UNCHANGED)
+			limits->burst = burst;
+
+		cmd.set = 1;
+		r = throttle_request(sock, &cmd, &stats);
+		if (r < 0)
+			return r;
+	}
+
+	printf("Disk %d of %s:\n", disk, name);
+	print_limit("iops-rd", stats.limits.rate[DISK_THROTTLE_IOPS_RD], "", 0);
+	print_limit("iops-wr", stats.limits.rate[DISK_THROTTLE_IOPS_WR], "", 0);
+	print_limit("bw-rd", stats.limits.rate[DISK_THROTTLE_BPS_RD], " MB/s", 20);
+	print_limit("bw-wr", stats.limits.rate[DISK_THROTTLE_BPS_WR], " MB/s", 20);
+	printf("  %-12s %u s\n", "burst", stats.limits.burst);
+	printf("  %-12s %u\n", "queued", stats.queued);
+	printf("  %-12s %llu requests, waited %llu ms\n", "throttled rd",
+	       (unsigned long long)stats.nr_throttled[0],
+	       (unsigned long long)stats.wait_ns[0] / 1000000);
+	printf("  %-12s %llu requests, waited %llu ms\n", "throttled wr",
+	       (unsigned long long)stats.nr_throttled[1],
+	       (unsigned long long)stats.wait_ns[1] / 1000000);
+
+	return 0;
+}
+
+int kvm_cmd_throttle(int argc, const char **argv, const char *prefix)
+{
+	int instance;
+	int r;
+
+	parse_throttle_options(argc, argv);
+
+	if (instance_name == NULL)
+		kvm_throttle_help();
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	r = do_throttle(instance_name, instance);
+	if (r < 0)
+		pr_err("Cannot throttle disk %d of %s: %s", disk, instance_name,
+		       strerror(-r));
+
+	close(instance);
+
+	return r;
+}
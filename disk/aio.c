@@ -2,138 +2,340 @@
 #include <pthread.h>
 #include <sys/eventfd.h>
 
-#include "kvm/brlock.h"
 #include "kvm/disk-image.h"
+#include "kvm/mutex.h"
 #include "kvm/kvm.h"
-#include "linux/list.h"
+#include "linux/kernel.h"
 
-#define AIO_MAX 256
+/*
+ * All disks share a few AIO contexts, each with a completion thread: a shard.
+ * Disks are spread over the shards when they are opened, and a new shard is
+ * only started once the others serve AIO_SHARD_DISKS disks, up to one per
+ * host CPU.
+ *
+ * A disk has at most AIO_DISK_DEPTH requests in flight. Submitters of a disk
+ * that reached its depth wait for one of its requests to complete, so that a
+ * busy disk cannot take all the slots of a context and starve the others.
+ *
+ * A context has room for AIO_SHARD_DISKS disks at full depth. Once every CPU
+ * has a shard, more disks share them, and submitters wait for a slot of the
+ * context to free up rather than have io_submit() fail.
+ */
+#define AIO_DISK_DEPTH		128
+#define AIO_SHARD_DISKS		8
+#define AIO_MAX			(AIO_DISK_DEPTH * AIO_SHARD_DISKS)
+#define AIO_BATCH		256
+
+struct disk_aio_shard {
+	io_context_t		ctx;
+	int			evt;
+	pthread_t		thread;
+	unsigned int		nr_disks;
+	struct mutex		mutex;
+	pthread_cond_t		cond;
+	unsigned int		nr_free;
+	unsigned int		waiters;
+};
+
+struct disk_aio_req {
+	struct iocb		iocb;
+	struct disk_image	*disk;
+	void			*param;
+};
+
+struct disk_aio {
+	struct disk_aio_shard	*shard;
+	struct mutex		mutex;
+	pthread_cond_t		cond;
+	struct disk_aio_req	reqs[AIO_DISK_DEPTH];
+	struct disk_aio_req	*free[AIO_DISK_DEPTH];
+	unsigned int		nr_free;
+	unsigned int		waiters;
+};
+
+static DEFINE_MUTEX(shards_lock);
+static struct disk_aio_shard	*shards;
+static unsigned int		nr_shards;
+
+static struct disk_aio_req *disk_aio_get_req(struct disk_image *disk)
+{
+	struct disk_aio *aio = disk->aio;
+	struct disk_aio_req *req;
+
+	mutex_lock(&aio->mutex);
+	while (!aio->nr_free) {
+		aio->waiters++;
+		pthread_cond_wait(&aio->cond, &aio->mutex.mutex);
+		aio->waiters--;
+	}
+	req = aio->free[--aio->nr_free];
+	mutex_unlock(&aio->mutex);
+
+	return req;
+}
+
+static void disk_aio_put_req(struct disk_aio_req *req)
+{
+	struct disk_aio *aio = req->disk->aio;
+
+	mutex_lock(&aio->mutex);
+	aio->free[aio->nr_free++] = req;
+	if (aio->waiters)
+		pthread_cond_broadcast(&aio->cond);
+	mutex_unlock(&aio->mutex);
+}
+
+static void disk_aio_shard_get_slot(struct disk_aio_shard *shard)
+{
+	mutex_lock(&shard->mutex);
+	while (!shard->nr_free) {
+		shard->waiters++;
+		pthread_cond_wait(&shard->cond, &shard->mutex.mutex);
+		shard->waiters--;
+	}
+	shard->nr_free--;
+	mutex_unlock(&shard->mutex);
+}
+
+static void disk_aio_shard_put_slots(struct disk_aio_shard *shard,
+				     unsigned int nr)
+{
+	mutex_lock(&shard->mutex);
+	shard->nr_free += nr;
+	if (shard->waiters)
+		pthread_cond_broadcast(&shard->cond);
+	mutex_unlock(&shard->mutex);
+}
 
-static int aio_submit(struct disk_image *disk, int nr, struct iocb **ios)
+static int aio_submit(struct disk_image *disk, struct disk_aio_req *req)
 {
+	struct disk_aio_shard *shard = disk->aio->shard;
+	struct iocb *ios[1] = { &req->iocb };
 	int ret;
 
-	__sync_fetch_and_add(&disk->aio_inflight, nr);
-	/*
-	 * A wmb() is needed here, to ensure disk_aio_thread() sees this
-	 * increase after receiving the events. It is included in the
-	 * __sync_fetch_and_add (as a full barrier).
-	 */
-restart:
-	ret = io_submit(disk->ctx, nr, ios);
-	if (ret == -EAGAIN)
-		goto restart;
-	else if (ret <= 0)
-		/* disk_aio_thread() is never going to see those */
-		__sync_fetch_and_sub(&disk->aio_inflight, nr);
+	io_set_eventfd(&req->iocb, shard->evt);
+	disk_aio_shard_get_slot(shard);
+
+	ret = io_submit(shard->ctx, 1, ios);
+	if (ret <= 0) {
+		/* disk_aio_thread() is never going to see it */
+		disk_aio_shard_put_slots(shard, 1);
+		disk_aio_put_req(req);
+	}
 
 	return ret;
 }
 
-ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
-			      const struct iovec *iov, int iovcount,
-			      void *param)
+/* Read from fd, which need not be the one of the image, for the disk */
+ssize_t disk_aio_read(struct disk_image *disk, int fd, u64 sector,
+		      const struct iovec *iov, int iovcount, void *param)
 {
-	struct iocb iocb;
+	struct disk_aio_req *req = disk_aio_get_req(disk);
 	u64 offset = sector << SECTOR_SHIFT;
-	struct iocb *ios[1] = { &iocb };
 
-	io_prep_preadv(&iocb, disk->fd, iov, iovcount, offset);
-	io_set_eventfd(&iocb, disk->evt);
-	iocb.data = param;
+	io_prep_preadv(&req->iocb, fd, iov, iovcount, offset);
+	req->param = param;
 
-	return aio_submit(disk, 1, ios);
+	return aio_submit(disk, req);
+}
+
+ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
+			      const struct iovec *iov, int iovcount,
+			      void *param)
+{
+	return disk_aio_read(disk, disk->fd, sector, iov, iovcount, param);
 }
 
 ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
 			       const struct iovec *iov, int iovcount,
 			       void *param)
 {
-	struct iocb iocb;
+	struct disk_aio_req *req = disk_aio_get_req(disk);
 	u64 offset = sector << SECTOR_SHIFT;
-	struct iocb *ios[1] = { &iocb };
 
-	io_prep_pwritev(&iocb, disk->fd, iov, iovcount, offset);
-	io_set_eventfd(&iocb, disk->evt);
-	iocb.data = param;
+	io_prep_pwritev(&req->iocb, disk->fd, iov, iovcount, offset);
+	req->param = param;
 
-	return aio_submit(disk, 1, ios);
+	return aio_submit(disk, req);
 }
 
 /*
  * When this function returns there are no in-flight I/O. Caller ensures that
  * io_submit() isn't called concurrently.
  *
- * Returns an inaccurate number of I/O that was in-flight when the function was
- * called.
+ * Returns the number of I/O that were in-flight when the function was called.
  */
 int raw_image__wait(struct disk_image *disk)
 {
-	u64 inflight = disk->aio_inflight;
+	struct disk_aio *aio = disk->aio;
+	int inflight;
 
-	while (disk->aio_inflight) {
-		usleep(100);
-		barrier();
+	mutex_lock(&aio->mutex);
+	inflight = AIO_DISK_DEPTH - aio->nr_free;
+	while (aio->nr_free != AIO_DISK_DEPTH) {
+		aio->waiters++;
+		pthread_cond_wait(&aio->cond, &aio->mutex.mutex);
+		aio->waiters--;
 	}
+	mutex_unlock(&aio->mutex);
 
 	return inflight;
 }
 
-static int disk_aio_get_events(struct disk_image *disk)
+static void disk_aio_get_events(struct disk_aio_shard *shard)
 {
-	struct io_event event[AIO_MAX];
+	struct io_event event[AIO_BATCH];
 	struct timespec notime = {0};
+	struct disk_aio_req *req;
 	int nr, i;
 
 	do {
-		nr = io_getevents(disk->ctx, 1, ARRAY_SIZE(event), event, &notime);
-		for (i = 0; i < nr; i++)
-			disk->disk_req_cb(event[i].data, event[i].res);
-
-		/* Pairs with wmb() in aio_submit() */
-		rmb();
-		__sync_fetch_and_sub(&disk->aio_inflight, nr);
+		nr = io_getevents(shard->ctx, 1, ARRAY_SIZE(event), event, &notime);
+		for (i = 0; i < nr; i++) {
+			req = container_of(event[i].obj, struct disk_aio_req, iocb);
+			req->disk->disk_req_cb(req->param, event[i].res);
+			disk_aio_put_req(req);
+		}
 
+		if (nr > 0)
+			disk_aio_shard_put_slots(shard, nr);
 	} while (nr > 0);
-
-	return 0;
 }
 
 static void *disk_aio_thread(void *param)
 {
-	struct disk_image *disk = param;
+	struct disk_aio_shard *shard = param;
 	u64 dummy;
 
 	kvm__set_thread_name("disk-image-io");
 
-	while (read(disk->evt, &dummy, sizeof(dummy)) > 0) {
-		if (disk_aio_get_events(disk))
-			break;
-	}
+	while (read(shard->evt, &dummy, sizeof(dummy)) > 0)
+		disk_aio_get_events(shard);
 
 	return NULL;
 }
 
-int disk_aio_setup(struct disk_image *disk)
+static int disk_aio_shard_start(struct disk_aio_shard *shard)
 {
 	int r;
 
+	*shard = (struct disk_aio_shard) {
+		.mutex		= MUTEX_INITIALIZER,
+		.cond		= PTHREAD_COND_INITIALIZER,
+		.nr_free	= AIO_MAX,
+	};
+
+	shard->evt = eventfd(0, 0);
+	if (shard->evt < 0)
+		return -errno;
+
+	r = io_setup(AIO_MAX, &shard->ctx);
+	if (r < 0)
+		goto err_close;
+
+	r = -pthread_create(&shard->thread, NULL, disk_aio_thread, shard);
+	if (r < 0) {
+		io_destroy(shard->ctx);
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	close(shard->evt);
+	return r;
+}
+
+static void disk_aio_shard_stop(struct disk_aio_shard *shard)
+{
+	pthread_cancel(shard->thread);
+	pthread_join(shard->thread, NULL);
+	close(shard->evt);
+	io_destroy(shard->ctx);
+}
+
+/* Pick the least loaded shard, or start a new one if they are all busy */
+static struct disk_aio_shard *disk_aio_shard_get(void)
+{
+	struct disk_aio_shard *shard = NULL;
+	unsigned int i, max_shards;
+
+	max_shards = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+
+	mutex_lock(&shards_lock);
+	if (!shards) {
+		shards = calloc(max_shards, sizeof(*shards));
+		if (!shards)
+			goto out_unlock;
+	}
+
+	for (i = 0; i < nr_shards; i++) {
+		if (!shard || shards[i].nr_disks < shard->nr_disks)
+			shard = &shards[i];
+	}
+
+	if ((!shard || shard->nr_disks >= AIO_SHARD_DISKS) &&
+	    nr_shards < max_shards) {
+		if (disk_aio_shard_start(&shards[nr_shards]) == 0)
+			shard = &shards[nr_shards++];
+	}
+
+	if (shard)
+		shard->nr_disks++;
+out_unlock:
+	mutex_unlock(&shards_lock);
+
+	return shard;
+}
+
+static void disk_aio_shard_put(struct disk_aio_shard *shard)
+{
+	unsigned int i;
+
+	mutex_lock(&shards_lock);
+	shard->nr_disks--;
+
+	/* Shards are only stopped once no disk is left */
+	for (i = 0; i < nr_shards; i++) {
+		if (shards[i].nr_disks)
+			goto out_unlock;
+	}
+
+	for (i = 0; i < nr_shards; i++)
+		disk_aio_shard_stop(&shards[i]);
+	nr_shards = 0;
+out_unlock:
+	mutex_unlock(&shards_lock);
+}
+
+int disk_aio_setup(struct disk_image *disk)
+{
+	struct disk_aio *aio;
+	int i;
+
 	/* No need to setup AIO if the disk ops won't make use of it */
 	if (!disk->ops->async)
 		return 0;
 
-	disk->evt = eventfd(0, 0);
-	if (disk->evt < 0)
-		return -errno;
+	aio = calloc(1, sizeof(*aio));
+	if (!aio)
+		return -ENOMEM;
 
-	io_setup(AIO_MAX, &disk->ctx);
-	r = pthread_create(&disk->thread, NULL, disk_aio_thread, disk);
-	if (r) {
-		r = -errno;
-		close(disk->evt);
-		return r;
+	aio->shard = disk_aio_shard_get();
+	if (!aio->shard) {
+		free(aio);
+		return -ENOMEM;
 	}
 
+	mutex_init(&aio->mutex);
+	pthread_cond_init(&aio->cond, NULL);
+	for (i = 0; i < AIO_DISK_DEPTH; i++) {
+		aio->reqs[i].disk = disk;
+		aio->free[i] = &aio->reqs[i];
+	}
+	aio->nr_free = AIO_DISK_DEPTH;
+
+	disk->aio = aio;
 	disk->async = true;
 	return 0;
 }
@@ -143,8 +345,10 @@ void disk_aio_destroy(struct disk_image *disk)
 	if (!disk->async)
 		return;
 
-	pthread_cancel(disk->thread);
-	pthread_join(disk->thread, NULL);
-	close(disk->evt);
-	io_destroy(disk->ctx);
+	/* The shard thread may still complete requests of this disk */
+	raw_image__wait(disk);
+
+	disk_aio_shard_put(disk->aio->shard);
+	free(disk->aio);
+	disk->aio = NULL;
 }
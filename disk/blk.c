@@ -1,16 +1,53 @@
 #include "kvm/disk-image.h"
 
 #include <linux/err.h>
+#include <linux/kernel.h>
 #include <mntent.h>
 
+static int blkdev__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT };
+
+	if (!ioctl(disk->fd, BLKDISCARD, range))
+		return 0;
+
+	/* Discard is only a hint, the guest doesn't care if nothing happened */
+	if (errno == EOPNOTSUPP)
+		return 0;
+
+	return -errno;
+}
+
+static int blkdev__write_zeroes(struct disk_image *disk, u64 sector,
+				u64 nr_sectors, bool unmap)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT };
+
+	/*
+	 * Punching a hole in a block device lets it unmap the range when it
+	 * guarantees that it reads back as zeroes. BLKZEROOUT never unmaps,
+	 * and writes the zeroes itself if the device can't offload it.
+	 */
+	if (unmap && !fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, range[0], range[1]))
+		return 0;
+
+	if (ioctl(disk->fd, BLKZEROOUT, range) < 0)
+		return -errno;
+
+	return 0;
+}
+
 /*
  * raw image and blk dev are similar, so reuse raw image ops.
  */
 static struct disk_image_operations blk_dev_ops = {
-	.read	= raw_image__read,
-	.write	= raw_image__write,
-	.wait	= raw_image__wait,
-	.async	= true,
+	.read		= raw_image__read,
+	.write		= raw_image__write,
+	.discard	= blkdev__discard,
+	.write_zeroes	= blkdev__write_zeroes,
+	.wait		= raw_image__wait,
+	.async		= true,
 };
 
 static bool is_mounted(struct stat *st)
@@ -37,7 +74,9 @@ static bool is_mounted(struct stat *st)
 
 struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *st)
 {
-	int fd, r;
+	unsigned int phys_blk_size;
+	struct disk_image *disk;
+	int fd, r, blk_size;
 	u64 size;
 
 	if (!S_ISBLK(st->st_mode))
@@ -68,5 +107,15 @@ struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *s
 	 * mmap large disk. There is not enough virtual address space
 	 * in 32-bit host. However, this works on 64-bit host.
 	 */
-	return disk_image__new(fd, size, &blk_dev_ops, DISK_IMAGE_REGULAR);
+	disk = disk_image__new(fd, size, &blk_dev_ops, DISK_IMAGE_REGULAR);
+	if (IS_ERR_OR_NULL(disk))
+		return disk;
+
+	/* Tell the guest the block sizes of the device */
+	if (ioctl(fd, BLKSSZGET, &blk_size) == 0 && blk_size > (int)SECTOR_SIZE)
+		disk->blk_size = blk_size;
+	if (ioctl(fd, BLKPBSZGET, &phys_blk_size) == 0)
+		disk->phys_blk_size = max(phys_blk_size, disk->blk_size);
+
+	return disk;
 }
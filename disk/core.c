@@ -3,29 +3,38 @@
 #include "kvm/virtio-blk.h"
 #include "kvm/kvm.h"
 #include "kvm/iovec.h"
+#include "kvm/threadpool.h"
+#include "kvm/kvm-ipc.h"
 
 #include <linux/err.h>
 #include <poll.h>
 
 int debug_iodelay;
 
-static int disk_image__close(struct disk_image *disk);
-
 int disk_img_name_parser(const struct option *opt, const char *arg, int unset)
 {
+	struct disk_throttle_limits *limits;
+	struct disk_image_params *params;
 	const char *cur;
 	char *sep;
 	struct kvm *kvm = opt->ptr;
 
-	if (kvm->nr_disks >= MAX_DISK_IMAGES)
-		die("Currently only 4 images are supported");
+	params = realloc(kvm->cfg.disk_image,
+			 sizeof(*params) * (kvm->nr_disks + 1));
+	if (!params)
+		die("Cannot allocate disk image parameters");
 
-	kvm->cfg.disk_image[kvm->nr_disks].filename = arg;
+	kvm->cfg.disk_image = params;
+	params = &params[kvm->nr_disks];
+	*params = (struct disk_image_params) {
+		.filename	= arg,
+	};
+	limits = &params->throttle;
 	cur = arg;
 
 	if (strncmp(arg, "scsi:", 5) == 0) {
 		sep = strstr(arg, ":");
-		kvm->cfg.disk_image[kvm->nr_disks].wwpn = sep + 1;
+		params->wwpn = sep + 1;
 
 		/* Old invocation had two parameters. Ignore the second one. */
 		sep = strstr(sep + 1, ":");
@@ -39,9 +48,23 @@ int disk_img_name_parser(const struct option *opt, const char *arg, int unset)
 		sep = strstr(cur, ",");
 		if (sep) {
 			if (strncmp(sep + 1, "ro", 2) == 0)
-				kvm->cfg.disk_image[kvm->nr_disks].readonly = true;
+				params->readonly = true;
 			else if (strncmp(sep + 1, "direct", 6) == 0)
-				kvm->cfg.disk_image[kvm->nr_disks].direct = true;
+				params->direct = true;
+			else if (strncmp(sep + 1, "overlay", 7) == 0) {
+				params->overlay = true;
+				if (sep[8] == '=')
+					params->overlay_max = strtoull(sep + 9, NULL, 0);
+			} else if (strncmp(sep + 1, "iops_rd=", 8) == 0)
+				limits->rate[DISK_THROTTLE_IOPS_RD] = strtoull(sep + 9, NULL, 0);
+			else if (strncmp(sep + 1, "iops_wr=", 8) == 0)
+				limits->rate[DISK_THROTTLE_IOPS_WR] = strtoull(sep + 9, NULL, 0);
+			else if (strncmp(sep + 1, "bw_rd=", 6) == 0)
+				limits->rate[DISK_THROTTLE_BPS_RD] = strtoull(sep + 7, NULL, 0) << 20;
+			else if (strncmp(sep + 1, "bw_wr=", 6) == 0)
+				limits->rate[DISK_THROTTLE_BPS_WR] = strtoull(sep + 7, NULL, 0) << 20;
+			else if (strncmp(sep + 1, "burst=", 6) == 0)
+				limits->burst = strtoul(sep + 7, NULL, 0);
 			*sep = 0;
 			cur = sep + 1;
 		}
@@ -64,9 +87,11 @@ struct disk_image *disk_image__new(int fd, u64 size,
 		return ERR_PTR(-ENOMEM);
 
 	*disk = (struct disk_image) {
-		.fd	= fd,
-		.size	= size,
-		.ops	= ops,
+		.fd		= fd,
+		.size		= size,
+		.ops		= ops,
+		.blk_size	= SECTOR_SIZE,
+		.phys_blk_size	= SECTOR_SIZE,
 	};
 
 	if (use_mmap == DISK_IMAGE_MMAP) {
@@ -94,7 +119,10 @@ err_free_disk:
 	return ERR_PTR(r);
 }
 
-static struct disk_image *disk_image__open(const char *filename, bool readonly, bool direct)
+/* depth counts the images this one backs, to catch loops */
+static struct disk_image *disk_image__open_depth(const char *filename,
+						 bool readonly, bool direct,
+						 int depth)
 {
 	struct disk_image *disk;
 	struct stat st;
@@ -104,16 +132,21 @@ static struct disk_image *disk_image__open(const char *filename, bool readonly,
 		flags = O_RDONLY;
 	else
 		flags = O_RDWR;
-	if (direct)
-		flags |= O_DIRECT;
 
 	if (stat(filename, &st) < 0)
 		return ERR_PTR(-errno);
 
+	/*
+	 * O_DIRECT is only set once the format is known: probing reads into
+	 * unaligned buffers, and only raw images and block devices handle it.
+	 */
+
 	/* blk device ?*/
 	disk = blkdev__probe(filename, flags, &st);
 	if (!IS_ERR_OR_NULL(disk)) {
 		disk->readonly = readonly;
+		if (direct && disk_image__direct_init(disk) < 0)
+			pr_warning("%s: direct I/O not supported", filename);
 		return disk;
 	}
 
@@ -122,17 +155,26 @@ static struct disk_image *disk_image__open(const char *filename, bool readonly,
 		return ERR_PTR(fd);
 
 	/* qcow image ?*/
-	disk = qcow_probe(fd, true);
-	if (!IS_ERR_OR_NULL(disk)) {
-		pr_warning("Forcing read-only support for QCOW");
-		disk->readonly = true;
+	disk = qcow_probe(fd, filename, readonly, depth);
+	if (IS_ERR(disk)) {
+		close(fd);
+		return disk;
+	}
+	if (disk) {
+		disk->readonly = readonly || !disk->ops->write;
+		if (direct)
+			pr_warning("%s: direct I/O is only supported on raw images",
+				   filename);
 		return disk;
 	}
 
 	/* raw image ?*/
-	disk = raw_image__probe(fd, &st, readonly);
+	disk = raw_image__probe(fd, filename, &st, readonly);
 	if (!IS_ERR_OR_NULL(disk)) {
 		disk->readonly = readonly;
+		/* Read-only images are read through the overlay */
+		if (direct && (readonly || disk_image__direct_init(disk) < 0))
+			pr_warning("%s: direct I/O not supported", filename);
 		return disk;
 	}
 
@@ -142,6 +184,16 @@ static struct disk_image *disk_image__open(const char *filename, bool readonly,
 	return ERR_PTR(-ENOSYS);
 }
 
+struct disk_image *disk_image__open(const char *filename, bool readonly, bool direct)
+{
+	return disk_image__open_depth(filename, readonly, direct, 0);
+}
+
+struct disk_image *disk_image__open_backing(const char *filename, int depth)
+{
+	return disk_image__open_depth(filename, true, false, depth);
+}
+
 static struct disk_image **disk_image__open_all(struct kvm *kvm)
 {
 	struct disk_image **disks;
@@ -151,13 +203,11 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 	bool direct;
 	void *err;
 	int i;
-	struct disk_image_params *params = (struct disk_image_params *)&kvm->cfg.disk_image;
+	struct disk_image_params *params = kvm->cfg.disk_image;
 	int count = kvm->nr_disks;
 
 	if (!count)
 		return ERR_PTR(-EINVAL);
-	if (count > MAX_DISK_IMAGES)
-		return ERR_PTR(-ENOSPC);
 
 	disks = calloc(count, sizeof(*disks));
 	if (!disks)
@@ -170,7 +220,7 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 		wwpn = params[i].wwpn;
 
 		if (wwpn) {
-			disks[i] = malloc(sizeof(struct disk_image));
+			disks[i] = calloc(1, sizeof(struct disk_image));
 			if (!disks[i])
 				return ERR_PTR(-ENOMEM);
 			disks[i]->wwpn = wwpn;
@@ -180,13 +230,31 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 		if (!filename)
 			continue;
 
-		disks[i] = disk_image__open(filename, readonly, direct);
+		disks[i] = disk_image__open(filename,
+					    readonly || params[i].overlay, direct);
 		if (IS_ERR_OR_NULL(disks[i])) {
 			pr_err("Loading disk image '%s' failed", filename);
 			err = disks[i];
 			goto error;
 		}
+
+		/* The guest writes to the overlay, the image is left alone */
+		if (params[i].overlay) {
+			if (raw_image__set_overlay(disks[i],
+						   params[i].overlay_max) < 0) {
+				pr_err("'%s': overlay requires a raw image", filename);
+				err = ERR_PTR(-EINVAL);
+				goto error;
+			}
+			disks[i]->readonly = readonly;
+		}
 		disks[i]->debug_iodelay = kvm->cfg.debug_iodelay;
+
+		if (disk_throttle__init(kvm, disks[i], &params[i].throttle) < 0) {
+			pr_err("'%s': cannot set up I/O throttling", filename);
+			err = ERR_PTR(-EINVAL);
+			goto error;
+		}
 	}
 
 	return disks;
@@ -201,6 +269,8 @@ error:
 
 int disk_image__wait(struct disk_image *disk)
 {
+	disk_throttle__flush(disk);
+
 	if (disk->ops->wait)
 		return disk->ops->wait(disk);
 
@@ -215,12 +285,57 @@ int disk_image__flush(struct disk_image *disk)
 	return fsync(disk->fd);
 }
 
-static int disk_image__close(struct disk_image *disk)
+bool disk_image__can_discard(struct disk_image *disk)
+{
+	return !disk->readonly && disk->ops->discard && disk->ops->write_zeroes;
+}
+
+/*
+ * Discard and write zeroes requests don't carry any data and the AIO engine
+ * has no way to submit them, so the image does them synchronously. Devices
+ * run them from the thread pool with disk_image__queue_job().
+ */
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	if (!disk->ops->discard)
+		return -EOPNOTSUPP;
+
+	return disk->ops->discard(disk, sector, nr_sectors);
+}
+
+int disk_image__write_zeroes(struct disk_image *disk, u64 sector,
+			     u64 nr_sectors, bool unmap)
+{
+	if (!disk->ops->write_zeroes)
+		return -EOPNOTSUPP;
+
+	return disk->ops->write_zeroes(disk, sector, nr_sectors, unmap);
+}
+
+/*
+ * Run a job that does synchronous I/O on the image, and writes len bytes,
+ * from the thread pool rather than from the virtqueue thread. It goes through
+ * the throttle like a write, and completes the request with disk_req_cb.
+ */
+void disk_image__queue_job(struct disk_image *disk, size_t len,
+			   struct thread_pool__job *job)
+{
+	if (debug_iodelay)
+		msleep(debug_iodelay);
+
+	if (disk_throttle__queue_job(disk, len, job))
+		return;
+
+	thread_pool__do_job(job);
+}
+
+int disk_image__close(struct disk_image *disk)
 {
 	/* If there was no disk image then there's nothing to do: */
 	if (!disk)
 		return 0;
 
+	disk_throttle__exit(disk);
 	disk_aio_destroy(disk);
 
 	if (disk->ops && disk->ops->close)
@@ -245,61 +360,82 @@ static int disk_image__close_all(struct disk_image **disks, int count)
 }
 
 /*
- * Fill iov with disk data, starting from sector 'sector'.
- * Return amount of bytes read.
+ * Hand a request to the image, bypassing the throttle. Synchronous images
+ * complete it right away, and requests that can't be submitted complete
+ * with the error, otherwise the guest would wait for them forever.
  */
-ssize_t disk_image__read(struct disk_image *disk, u64 sector,
-			 const struct iovec *iov, int iovcount, void *param)
+ssize_t disk_image__submit(struct disk_image *disk, bool write, u64 sector,
+			   const struct iovec *iov, int iovcount, void *param)
 {
+	bool sync = !disk->async;
 	ssize_t total = 0;
 
-	if (debug_iodelay)
-		msleep(debug_iodelay);
-
-	if (disk->ops->read) {
+	if (disk->direct &&
+	    !disk_image__direct_aligned(disk, sector, iov, iovcount)) {
+		total = disk_image__direct_rw(disk, write, sector, iov, iovcount);
+		sync = true;
+	} else if (write && disk->ops->write) {
+		total = disk->ops->write(disk, sector, iov, iovcount, param);
+	} else if (!write && disk->ops->read) {
 		total = disk->ops->read(disk, sector, iov, iovcount, param);
-		if (total < 0) {
-			pr_info("disk_image__read error: total=%ld\n", (long)total);
-			return total;
-		}
 	}
 
-	if (!disk->async && disk->disk_req_cb)
+	if (total < 0)
+		pr_info("disk_image__%s error: total=%ld\n",
+			write ? "write" : "read", (long)total);
+
+	if ((sync || total < 0) && disk->disk_req_cb)
 		disk->disk_req_cb(param, total);
 
 	return total;
 }
 
+/*
+ * Fill iov with disk data, starting from sector 'sector'.
+ * Return amount of bytes read, or 0 if the request was queued by the throttle.
+ */
+ssize_t disk_image__read(struct disk_image *disk, u64 sector,
+			 const struct iovec *iov, int iovcount, void *param)
+{
+	if (debug_iodelay)
+		msleep(debug_iodelay);
+
+	if (disk_throttle__queue(disk, false, sector, iov, iovcount, param))
+		return 0;
+
+	return disk_image__submit(disk, false, sector, iov, iovcount, param);
+}
+
+/*
+ * Read without going through the completion callback, for images backing
+ * other images. Asynchronous engines only drive raw images, which can be
+ * read directly.
+ */
+ssize_t disk_image__read_sync(struct disk_image *disk, u64 sector,
+			      const struct iovec *iov, int iovcount)
+{
+	if (disk->async)
+		return preadv_in_full(disk->fd, iov, iovcount,
+				      sector << SECTOR_SHIFT);
+
+	return disk->ops->read(disk, sector, iov, iovcount, NULL);
+}
+
 /*
  * Write iov to disk, starting from sector 'sector'.
- * Return amount of bytes written.
+ * Return amount of bytes written, or 0 if the request was queued by the
+ * throttle.
  */
 ssize_t disk_image__write(struct disk_image *disk, u64 sector,
 			  const struct iovec *iov, int iovcount, void *param)
 {
-	ssize_t total = 0;
-
 	if (debug_iodelay)
 		msleep(debug_iodelay);
 
-	if (disk->ops->write) {
-		/*
-		 * Try writev based operation first
-		 */
-
-		total = disk->ops->write(disk, sector, iov, iovcount, param);
-		if (total < 0) {
-			pr_info("disk_image__write error: total=%ld\n", (long)total);
-			return total;
-		}
-	} else {
-		/* Do nothing */
-	}
-
-	if (!disk->async && disk->disk_req_cb)
-		disk->disk_req_cb(param, total);
+	if (disk_throttle__queue(disk, true, sector, iov, iovcount, param))
+		return 0;
 
-	return total;
+	return disk_image__submit(disk, true, sector, iov, iovcount, param);
 }
 
 ssize_t disk_image__get_serial(struct disk_image *disk, struct iovec *iov,
@@ -347,10 +483,47 @@ int disk_image__init(struct kvm *kvm)
 
 	return 0;
 }
-dev_base_init(disk_image__init);
+dev_base_init_parallel(disk_image__init);
 
 int disk_image__exit(struct kvm *kvm)
 {
 	return disk_image__close_all(kvm->disks, kvm->nr_disks);
 }
 dev_base_exit(disk_image__exit);
+
+static void disk_image__handle_stat(struct kvm *kvm, int fd, u32 type,
+				    u32 len, u8 *msg)
+{
+	struct disk_image_stats stats = {
+		.status		= -EINVAL,
+		.nr_disks	= kvm->nr_disks,
+	};
+	struct disk_image *disk;
+	u32 idx;
+
+	if (WARN_ON(type != KVM_IPC_DISK_STAT || len != sizeof(idx)))
+		return;
+
+	memcpy(&idx, msg, sizeof(idx));
+	if (idx >= (u32)kvm->nr_disks || !kvm->disks)
+		goto out;
+
+	disk = kvm->disks[idx];
+	if (!disk)
+		goto out;
+
+	stats.status = 0;
+	stats.size = disk->size;
+	raw_image__overlay_stats(disk, &stats.overlay_used, &stats.overlay_max);
+
+out:
+	if (write_in_full(fd, &stats, sizeof(stats)) < 0)
+		pr_warning("Failed sending disk statistics");
+}
+
+static int disk_image__ipc_init(struct kvm *kvm)
+{
+	return kvm_ipc__register_handler(KVM_IPC_DISK_STAT,
+					 disk_image__handle_stat);
+}
+dev_base_init(disk_image__ipc_init);
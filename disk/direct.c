@@ -0,0 +1,230 @@
+#include "kvm/disk-image.h"
+#include "kvm/iovec.h"
+#include "kvm/mutex.h"
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+
+/*
+ * With O_DIRECT, offsets and lengths must be multiples of the logical block
+ * size of the backing device, and buffers must be aligned in memory as well.
+ * The guest is told the block size so its requests are normally aligned, and
+ * go straight to the image. The segments that aren't aligned are copied
+ * through bounce buffers, kept in a small pool so that they are reused.
+ */
+#define DIRECT_MAX_ALIGN	4096
+#define BOUNCE_MIN_SIZE		(64 * 1024)
+#define BOUNCE_POOL_MAX		16
+
+struct bounce_buf {
+	struct list_head	list;
+	size_t			size;
+	void			*data;
+};
+
+static DEFINE_MUTEX(bounce_lock);
+static LIST_HEAD(bounce_pool);
+static unsigned int bounce_pool_size;
+
+static struct bounce_buf *bounce_get(size_t size)
+{
+	struct bounce_buf *buf;
+
+	mutex_lock(&bounce_lock);
+	list_for_each_entry(buf, &bounce_pool, list) {
+		if (buf->size >= size) {
+			list_del(&buf->list);
+			bounce_pool_size--;
+			mutex_unlock(&bounce_lock);
+			return buf;
+		}
+	}
+	mutex_unlock(&bounce_lock);
+
+	buf = malloc(sizeof(*buf));
+	if (!buf)
+		return NULL;
+
+	buf->size = ALIGN(size, BOUNCE_MIN_SIZE);
+	if (posix_memalign(&buf->data, DIRECT_MAX_ALIGN, buf->size)) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+static void bounce_put(struct bounce_buf *buf)
+{
+	mutex_lock(&bounce_lock);
+	if (bounce_pool_size < BOUNCE_POOL_MAX) {
+		list_add(&buf->list, &bounce_pool);
+		bounce_pool_size++;
+		buf = NULL;
+	}
+	mutex_unlock(&bounce_lock);
+
+	if (buf) {
+		free(buf->data);
+		free(buf);
+	}
+}
+
+static bool direct_aligned(struct disk_image *disk, u64 offset,
+			   const struct iovec *iov)
+{
+	return IS_ALIGNED(offset, disk->blk_size) &&
+	       IS_ALIGNED(iov->iov_len, disk->blk_size) &&
+	       IS_ALIGNED((unsigned long)iov->iov_base, disk->dio_align);
+}
+
+bool disk_image__direct_aligned(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	int i;
+
+	for (i = 0; i < iovcount; i++) {
+		if (!direct_aligned(disk, offset, &iov[i]))
+			return false;
+		offset += iov[i].iov_len;
+	}
+
+	return true;
+}
+
+/*
+ * Copy len bytes at offset through a bounce buffer covering whole blocks.
+ * The partial blocks at the edges of a write are read first.
+ */
+static ssize_t direct_bounce(struct disk_image *disk, bool write, u64 offset,
+			     const struct iovec *iov, size_t len)
+{
+	u64 start = round_down(offset, disk->blk_size);
+	u64 end = ALIGN(offset + len, disk->blk_size);
+	struct bounce_buf *buf;
+	ssize_t r;
+
+	buf = bounce_get(end - start);
+	if (!buf)
+		return -ENOMEM;
+
+	if (write) {
+		r = 0;
+		if (start != offset)
+			r = pread_in_full(disk->fd, buf->data, disk->blk_size,
+					  start);
+		if (r >= 0 && end != offset + len)
+			r = pread_in_full(disk->fd, buf->data + end - start -
+					  disk->blk_size, disk->blk_size,
+					  end - disk->blk_size);
+		if (r >= 0) {
+			memcpy_fromiovecend(buf->data + offset - start, iov, 0,
+					    len);
+			r = pwrite_in_full(disk->fd, buf->data, end - start,
+					   start);
+		}
+	} else {
+		r = pread_in_full(disk->fd, buf->data, end - start, start);
+		if (r >= 0)
+			memcpy_toiovecend(iov, buf->data + offset - start, 0,
+					  len);
+	}
+
+	bounce_put(buf);
+
+	return r < 0 ? -errno : (ssize_t)len;
+}
+
+/*
+ * Synchronous I/O for requests that have misaligned segments. Runs of
+ * aligned segments still go straight to the image.
+ */
+ssize_t disk_image__direct_rw(struct disk_image *disk, bool write, u64 sector,
+			      const struct iovec *iov, int iovcount)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	ssize_t r, total = 0;
+	size_t len;
+	int i, n;
+
+	for (i = 0; i < iovcount; i += n) {
+		len = 0;
+		for (n = 0; i + n < iovcount &&
+		     direct_aligned(disk, offset + len, &iov[i + n]); n++)
+			len += iov[i + n].iov_len;
+
+		if (n) {
+			if (write)
+				r = pwritev_in_full(disk->fd, &iov[i], n, offset);
+			else
+				r = preadv_in_full(disk->fd, &iov[i], n, offset);
+		} else {
+			/* Bounce until the end of the run is aligned again */
+			do {
+				len += iov[i + n].iov_len;
+				n++;
+			} while (i + n < iovcount &&
+				 !IS_ALIGNED(offset + len, disk->blk_size));
+
+			r = direct_bounce(disk, write, offset, &iov[i], len);
+		}
+
+		if (r < 0)
+			return r;
+
+		offset	+= len;
+		total	+= len;
+	}
+
+	return total;
+}
+
+static bool direct_read_ok(int fd, void *buf, size_t len)
+{
+	return pread(fd, buf, len, 0) >= 0 || errno != EINVAL;
+}
+
+/*
+ * Switch the image to O_DIRECT, and find out the alignment it needs by
+ * trying reads of increasing size, then at decreasing memory alignments.
+ */
+int disk_image__direct_init(struct disk_image *disk)
+{
+	int flags = fcntl(disk->fd, F_GETFL);
+	u32 align, mem_align;
+	void *buf;
+
+	if (flags < 0 || fcntl(disk->fd, F_SETFL, flags | O_DIRECT) < 0)
+		return -errno;
+
+	if (posix_memalign(&buf, DIRECT_MAX_ALIGN, 2 * DIRECT_MAX_ALIGN)) {
+		fcntl(disk->fd, F_SETFL, flags);
+		return -ENOMEM;
+	}
+
+	for (align = disk->blk_size; align <= DIRECT_MAX_ALIGN; align <<= 1) {
+		if (direct_read_ok(disk->fd, buf, align))
+			break;
+	}
+
+	for (mem_align = SECTOR_SIZE; mem_align < DIRECT_MAX_ALIGN; mem_align <<= 1) {
+		if (direct_read_ok(disk->fd, buf + mem_align, align))
+			break;
+	}
+
+	free(buf);
+
+	/* The last block of the image couldn't be written */
+	if (align > DIRECT_MAX_ALIGN || !IS_ALIGNED(disk->size, align)) {
+		fcntl(disk->fd, F_SETFL, flags);
+		return -EINVAL;
+	}
+
+	disk->blk_size		= align;
+	disk->phys_blk_size	= max(disk->phys_blk_size, align);
+	disk->dio_align		= mem_align;
+	disk->direct		= true;
+
+	return 0;
+}
@@ -4,6 +4,8 @@
 #include "kvm/read-write.h"
 #include "kvm/mutex.h"
 #include "kvm/util.h"
+#include "kvm/iovec.h"
+#include "kvm/threadpool.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -13,6 +15,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #ifdef CONFIG_HAS_ZLIB
 #include <zlib.h>
 #endif
@@ -21,11 +24,13 @@
 #include <linux/byteorder.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
+#include <pthread.h>
 
 static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append);
 static int qcow_write_refcount_table(struct qcow *q);
 static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref);
 static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size);
+static int qcow_write_refcount_blocks(struct qcow *q);
 
 static inline int qcow_pwrite_sync(int fd,
 	void *buf, size_t count, off_t offset)
@@ -117,7 +122,7 @@ static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
 
 	size = 1 << header->l2_bits;
 
-	if (qcow_pwrite_sync(q->fd, c->table,
+	if (pwrite_in_full(q->fd, c->table,
 		size * sizeof(u64), c->offset) < 0)
 		return -1;
 
@@ -139,6 +144,17 @@ static int cache_table(struct qcow *q, struct qcow_l2_table *c)
 		 */
 		lru = list_first_entry(&l1t->lru_list, struct qcow_l2_table, list);
 
+		/*
+		 * A dirty table may point to newly allocated clusters, whose
+		 * refcount has to reach the disk first.
+		 */
+		if (lru->dirty) {
+			if (qcow_write_refcount_blocks(q) < 0 ||
+			    fdatasync(q->fd) < 0 ||
+			    qcow_l2_cache_write(q, lru) < 0)
+				goto error;
+		}
+
 		/* Remove the node from the cache */
 		rb_erase(&lru->node, r);
 		list_del_init(&lru->list);
@@ -283,6 +299,376 @@ static int qcow_decompress_buffer(u8 *out_buf, int out_buf_size,
 #endif
 }
 
+/*
+ * Decompressed clusters are kept in an LRU cache, so that small sequential
+ * reads don't inflate the same cluster over and over. Entries are reference
+ * counted and only protected by their own lock: readers copy from them, and
+ * decompress into them, without holding the image mutex. Compressed clusters
+ * are never rewritten in place, so the offset of the compressed data is a
+ * good enough key.
+ *
+ * Clusters prefetched for large reads are queued for a few thread pool jobs
+ * of the image. A reader that needs a queued cluster before a job got to it
+ * takes it off the queue and inflates it itself, so readers only ever wait
+ * for a cluster that is being inflated.
+ */
+enum {
+	QCOW_INFLATE_PENDING,
+	QCOW_INFLATE_DONE,
+	QCOW_INFLATE_ERROR,
+};
+
+static void qcow_inflate_job(struct kvm *kvm, void *data);
+
+static void qcow_inflate_init(struct qcow *q)
+{
+	int i;
+
+	mutex_init(&q->inflate_lock);
+	pthread_cond_init(&q->inflate_cond, NULL);
+	q->inflate_root = (struct rb_root) RB_ROOT;
+	INIT_LIST_HEAD(&q->inflate_lru);
+	INIT_LIST_HEAD(&q->inflate_queue);
+	q->max_inflated = max_t(u64, QCOW_INFLATE_CACHE_SIZE / q->cluster_size,
+				QCOW_INFLATE_CACHE_MIN);
+
+	for (i = 0; i < QCOW_INFLATE_JOBS; i++)
+		thread_pool__init_job(&q->inflate_jobs[i], NULL,
+				      qcow_inflate_job, q);
+}
+
+static struct qcow_inflated *qcow_inflated_lookup(struct qcow *q, u64 offset)
+{
+	struct rb_node *link = q->inflate_root.rb_node;
+	struct qcow_inflated *c;
+
+	while (link) {
+		c = rb_entry(link, struct qcow_inflated, node);
+
+		if (c->offset > offset)
+			link = link->rb_left;
+		else if (c->offset < offset)
+			link = link->rb_right;
+		else
+			return c;
+	}
+
+	return NULL;
+}
+
+static void qcow_inflated_insert(struct qcow *q, struct qcow_inflated *new)
+{
+	struct rb_node **link = &q->inflate_root.rb_node, *parent = NULL;
+	struct qcow_inflated *c;
+
+	while (*link) {
+		c = rb_entry(*link, struct qcow_inflated, node);
+		parent = *link;
+
+		if (c->offset > new->offset)
+			link = &(*link)->rb_left;
+		else
+			link = &(*link)->rb_right;
+	}
+
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &q->inflate_root);
+	list_add_tail(&new->list, &q->inflate_lru);
+	q->nr_inflated++;
+}
+
+static void qcow_inflated_remove(struct qcow *q, struct qcow_inflated *c)
+{
+	rb_erase(&c->node, &q->inflate_root);
+	list_del(&c->list);
+	q->nr_inflated--;
+	free(c);
+}
+
+/*
+ * Entries in use can't be evicted, so the cache can briefly grow past its
+ * size when many readers are busy.
+ */
+static void qcow_put_inflated(struct qcow *q, struct qcow_inflated *c)
+{
+	struct qcow_inflated *pos, *n;
+
+	mutex_lock(&q->inflate_lock);
+
+	/* Let the next reader try again */
+	if (--c->refcount == 0 && c->state == QCOW_INFLATE_ERROR)
+		qcow_inflated_remove(q, c);
+
+	list_for_each_entry_safe(pos, n, &q->inflate_lru, list) {
+		if (q->nr_inflated <= q->max_inflated)
+			break;
+		if (!pos->refcount)
+			qcow_inflated_remove(q, pos);
+	}
+
+	mutex_unlock(&q->inflate_lock);
+}
+
+/*
+ * Return a reference to the cache entry for the compressed data at offset.
+ * If it is new, the caller has to inflate it, or queue it for the inflate
+ * jobs if prefetch is set. The queue then owns the reference.
+ */
+static struct qcow_inflated *qcow_get_inflated(struct qcow *q, u64 offset,
+					       u32 len, bool prefetch,
+					       bool *load)
+{
+	struct qcow_inflated *c;
+
+	mutex_lock(&q->inflate_lock);
+
+	c = qcow_inflated_lookup(q, offset);
+	if (c) {
+		list_move_tail(&c->list, &q->inflate_lru);
+		c->refcount++;
+		*load = false;
+		goto out;
+	}
+
+	c = malloc(sizeof(*c) + q->cluster_size);
+	if (!c)
+		goto out;
+
+	*c = (struct qcow_inflated) {
+		.q		= q,
+		.offset		= offset,
+		.len		= len,
+		.refcount	= 1,
+		.state		= QCOW_INFLATE_PENDING,
+		.started	= !prefetch,
+	};
+	INIT_LIST_HEAD(&c->queue);
+	if (prefetch)
+		list_add_tail(&c->queue, &q->inflate_queue);
+	qcow_inflated_insert(q, c);
+	*load = true;
+out:
+	mutex_unlock(&q->inflate_lock);
+	return c;
+}
+
+static void qcow_inflate(struct qcow *q, struct qcow_inflated *c)
+{
+	int state = QCOW_INFLATE_ERROR;
+	ssize_t len;
+	void *buf;
+
+	buf = malloc(c->len);
+	if (buf) {
+		/* The last compressed cluster may end before its last sector */
+		len = pread_in_full(q->fd, buf, c->len, c->offset);
+		if (len > 0 && qcow_decompress_buffer(c->data, q->cluster_size,
+						      buf, len) == 0)
+			state = QCOW_INFLATE_DONE;
+		free(buf);
+	}
+
+	mutex_lock(&q->inflate_lock);
+	c->state = state;
+	pthread_cond_broadcast(&q->inflate_cond);
+	mutex_unlock(&q->inflate_lock);
+}
+
+/* Take a queued cluster off the queue, with the reference the queue had */
+static bool qcow_claim_inflated(struct qcow *q, struct qcow_inflated *c)
+{
+	if (c->started)
+		return false;
+
+	c->started = true;
+	list_del_init(&c->queue);
+
+	return true;
+}
+
+static void qcow_inflate_job(struct kvm *kvm, void *data)
+{
+	struct qcow *q = data;
+	struct qcow_inflated *c;
+
+	for (;;) {
+		mutex_lock(&q->inflate_lock);
+		if (list_empty(&q->inflate_queue)) {
+			mutex_unlock(&q->inflate_lock);
+			break;
+		}
+		c = list_first_entry(&q->inflate_queue, struct qcow_inflated,
+				     queue);
+		qcow_claim_inflated(q, c);
+		mutex_unlock(&q->inflate_lock);
+
+		qcow_inflate(q, c);
+		qcow_put_inflated(q, c);
+	}
+}
+
+static ssize_t qcow_read_compressed(struct qcow *q, u64 coffset, u32 csize,
+				    void *dst, u64 clust_offset, u32 len)
+{
+	struct qcow_inflated *c;
+	bool load, claimed = false;
+	int state;
+
+	q->has_compressed = true;
+
+	c = qcow_get_inflated(q, coffset, csize, false, &load);
+	if (!c)
+		return -1;
+
+	if (!load) {
+		mutex_lock(&q->inflate_lock);
+		claimed = qcow_claim_inflated(q, c);
+		mutex_unlock(&q->inflate_lock);
+	}
+
+	if (load || claimed)
+		qcow_inflate(q, c);
+
+	/* Drop the reference the queue had */
+	if (claimed)
+		qcow_put_inflated(q, c);
+
+	mutex_lock(&q->inflate_lock);
+	while (c->state == QCOW_INFLATE_PENDING)
+		pthread_cond_wait(&q->inflate_cond, &q->inflate_lock.mutex);
+	state = c->state;
+	mutex_unlock(&q->inflate_lock);
+
+	if (state == QCOW_INFLATE_DONE)
+		memcpy(dst, c->data + clust_offset, len);
+
+	qcow_put_inflated(q, c);
+
+	return state == QCOW_INFLATE_DONE ? (ssize_t)len : -1;
+}
+
+static void qcow_inflate_exit(struct qcow *q)
+{
+	struct qcow_inflated *c, *n;
+	int i;
+
+	/* Waits for the jobs that are running */
+	for (i = 0; i < QCOW_INFLATE_JOBS; i++)
+		thread_pool__cancel_job(&q->inflate_jobs[i]);
+
+	list_for_each_entry_safe(c, n, &q->inflate_lru, list)
+		qcow_inflated_remove(q, c);
+}
+
+/*
+ * Reads and in-place writes of cluster data happen without the mutex, so
+ * the cluster is pinned meanwhile. A discard could otherwise release it, and
+ * the data would land in whatever the cluster got reused for. Called with the
+ * mutex held.
+ */
+static void qcow_pin_cluster(struct qcow *q, struct qcow_cluster_pin *pin,
+			     u64 clust_start)
+{
+	pin->offset = clust_start & ~(q->cluster_size - 1);
+	list_add_tail(&pin->list, &q->pins);
+}
+
+static void qcow_unpin_cluster(struct qcow *q, struct qcow_cluster_pin *pin)
+{
+	mutex_lock(&q->mutex);
+	list_del(&pin->list);
+	mutex_unlock(&q->mutex);
+}
+
+static bool qcow_extent_pinned(struct qcow *q, u64 offset, u64 size)
+{
+	struct qcow_cluster_pin *pin;
+
+	list_for_each_entry(pin, &q->pins, list) {
+		if (pin->offset + q->cluster_size > offset &&
+		    pin->offset < offset + size)
+			return true;
+	}
+
+	return false;
+}
+
+/* Where the compressed data of a cluster lies, from its L2 entry */
+static void qcow_compressed_extent(struct qcow *q, u64 entry, u64 *coffset,
+				   u32 *csize)
+{
+	u32 nb_csectors;
+
+	if (q->version == QCOW1_VERSION) {
+		*coffset = entry & q->cluster_offset_mask;
+		*csize = (entry >> (63 - q->header->cluster_bits)) &
+			 (q->cluster_size - 1);
+		return;
+	}
+
+	*coffset = entry & q->cluster_offset_mask;
+	nb_csectors = ((entry >> q->csize_shift) & q->csize_mask) + 1;
+	*csize = nb_csectors * SECTOR_SIZE - (*coffset & (SECTOR_SIZE - 1));
+}
+
+/*
+ * Start inflating the compressed clusters that a large read covers on the
+ * thread pool, while the reader goes through them in order. The first
+ * cluster is left to the reader.
+ */
+static void qcow_prefetch_compressed(struct qcow *q, u64 offset, u64 len)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *l2t;
+	struct qcow_inflated *c;
+	u64 end = min(offset + len, q->header->size);
+	u64 l2t_offset, entry, coffset;
+	u64 compressed_flag;
+	u64 l1_idx;
+	unsigned int job;
+	u32 csize;
+	bool load;
+
+	compressed_flag = q->version == QCOW1_VERSION ?
+			  QCOW1_OFLAG_COMPRESSED : QCOW2_OFLAG_COMPRESSED;
+
+	offset = ALIGN(offset + 1, q->cluster_size);
+	for (; offset < end; offset += q->cluster_size) {
+		mutex_lock(&q->mutex);
+
+		l1_idx = get_l1_index(q, offset);
+		if (l1_idx >= l1t->table_size)
+			goto next;
+
+		l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
+		l2t_offset &= ~QCOW2_OFLAG_COPIED;
+		if (!l2t_offset)
+			goto next;
+
+		l2t = qcow_read_l2_table(q, l2t_offset);
+		if (!l2t)
+			goto next;
+
+		entry = be64_to_cpu(l2t->table[get_l2_index(q, offset)]);
+		if (!(entry & compressed_flag))
+			goto next;
+
+		qcow_compressed_extent(q, entry, &coffset, &csize);
+		mutex_unlock(&q->mutex);
+
+		c = qcow_get_inflated(q, coffset, csize, true, &load);
+		if (c && load) {
+			job = __sync_fetch_and_add(&q->next_inflate_job, 1);
+			job %= QCOW_INFLATE_JOBS;
+			thread_pool__do_job(&q->inflate_jobs[job]);
+		} else if (c)
+			qcow_put_inflated(q, c);
+		continue;
+next:
+		mutex_unlock(&q->mutex);
+	}
+}
+
 static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 	void *dst, u32 dst_len)
 {
@@ -296,8 +682,8 @@ static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 	u64 l2t_size;
 	u64 l1_idx;
 	u64 l2_idx;
-	int coffset;
-	int csize;
+	u64 coffset;
+	u32 csize;
 
 	l1_idx = get_l1_index(q, offset);
 	if (l1_idx >= l1t->table_size)
@@ -330,20 +716,12 @@ static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 
 	clust_start = be64_to_cpu(l2t->table[l2_idx]);
 	if (clust_start & QCOW1_OFLAG_COMPRESSED) {
-		coffset	= clust_start & q->cluster_offset_mask;
-		csize	= clust_start >> (63 - q->header->cluster_bits);
-		csize	&= (q->cluster_size - 1);
-
-		if (pread_in_full(q->fd, q->cluster_data, csize,
-				  coffset) < 0)
-			goto out_error;
-
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data, csize) < 0)
-			goto out_error;
-
-		memcpy(dst, q->cluster_cache + clust_offset, length);
+		qcow_compressed_extent(q, clust_start, &coffset, &csize);
 		mutex_unlock(&q->mutex);
+
+		if (qcow_read_compressed(q, coffset, csize, dst, clust_offset,
+					 length) < 0)
+			return -1;
 	} else {
 		if (!clust_start)
 			goto zero_cluster;
@@ -368,12 +746,38 @@ out_error:
 	return -1;
 }
 
+/*
+ * Clusters that are not allocated in the image read from its backing image,
+ * or as zeroes if there isn't any. The backing image may be smaller.
+ */
+static ssize_t qcow_read_backing(struct qcow *q, u64 offset, void *dst,
+				 u32 dst_len)
+{
+	struct disk_image *backing = q->backing;
+	struct iovec iov;
+	u64 len = 0;
+
+	if (backing && offset < backing->size) {
+		len = min_t(u64, dst_len, backing->size - offset);
+		iov = (struct iovec) { dst, len };
+
+		if (disk_image__read_sync(backing, offset >> SECTOR_SHIFT,
+					  &iov, 1) < 0)
+			return -1;
+	}
+
+	memset(dst + len, 0, dst_len - len);
+
+	return dst_len;
+}
+
 static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 	void *dst, u32 dst_len)
 {
 	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
 	struct qcow_l2_table *l2t;
+	struct qcow_cluster_pin pin;
 	u64 clust_offset;
 	u64 clust_start;
 	u64 l2t_offset;
@@ -381,10 +785,9 @@ static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 	u64 l2t_size;
 	u64 l1_idx;
 	u64 l2_idx;
-	int coffset;
-	int sector_offset;
-	int nb_csectors;
-	int csize;
+	u64 coffset;
+	u32 csize;
+	int r;
 
 	l1_idx = get_l1_index(q, offset);
 	if (l1_idx >= l1t->table_size)
@@ -419,35 +822,24 @@ static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 
 	clust_start = be64_to_cpu(l2t->table[l2_idx]);
 	if (clust_start & QCOW2_OFLAG_COMPRESSED) {
-		coffset = clust_start & q->cluster_offset_mask;
-		nb_csectors = ((clust_start >> q->csize_shift)
-			& q->csize_mask) + 1;
-		sector_offset = coffset & (SECTOR_SIZE - 1);
-		csize = nb_csectors * SECTOR_SIZE - sector_offset;
-
-		if (pread_in_full(q->fd, q->cluster_data,
-				  nb_csectors * SECTOR_SIZE,
-				  coffset & ~(SECTOR_SIZE - 1)) < 0) {
-			goto out_error;
-		}
-
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data + sector_offset,
-					csize) < 0) {
-			goto out_error;
-		}
-
-		memcpy(dst, q->cluster_cache + clust_offset, length);
+		qcow_compressed_extent(q, clust_start, &coffset, &csize);
 		mutex_unlock(&q->mutex);
+
+		if (qcow_read_compressed(q, coffset, csize, dst, clust_offset,
+					 length) < 0)
+			return -1;
 	} else {
 		clust_start &= QCOW2_OFFSET_MASK;
 		if (!clust_start)
 			goto zero_cluster;
 
+		qcow_pin_cluster(q, &pin, clust_start);
 		mutex_unlock(&q->mutex);
 
-		if (pread_in_full(q->fd, dst, length,
-				  clust_start + clust_offset) < 0)
+		r = pread_in_full(q->fd, dst, length,
+				  clust_start + clust_offset);
+		qcow_unpin_cluster(q, &pin);
+		if (r < 0)
 			return -1;
 	}
 
@@ -455,8 +847,7 @@ static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 
 zero_cluster:
 	mutex_unlock(&q->mutex);
-	memset(dst, 0, length);
-	return length;
+	return qcow_read_backing(q, offset, dst, length);
 
 out_error:
 	mutex_unlock(&q->mutex);
@@ -503,7 +894,13 @@ static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
 static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param)
 {
+	struct qcow *q = disk->priv;
 	ssize_t nr, total = 0;
+	u64 len;
+
+	len = iov_size(iov, iovcount);
+	if (len > q->cluster_size && q->has_compressed)
+		qcow_prefetch_compressed(q, sector << SECTOR_SHIFT, len);
 
 	while (iovcount--) {
 		nr = qcow_read_sector_single(disk, sector, iov->iov_base, iov->iov_len);
@@ -572,7 +969,7 @@ static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
 	if (!rfb->dirty)
 		return 0;
 
-	if (qcow_pwrite_sync(q->fd, rfb->entries,
+	if (pwrite_in_full(q->fd, rfb->entries,
 		rfb->size * sizeof(u16), rfb->offset) < 0)
 		return -1;
 
@@ -590,6 +987,9 @@ static int cache_refcount_block(struct qcow *q, struct qcow_refcount_block *c)
 	if (rft->nr_cached == MAX_CACHE_NODES) {
 		lru = list_first_entry(&rft->lru_list, struct qcow_refcount_block, list);
 
+		if (write_refcount_block(q, lru) < 0)
+			goto error;
+
 		rb_erase(&lru->node, r);
 		list_del_init(&lru->list);
 		rft->nr_cached--;
@@ -689,10 +1089,6 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 	memset(rfb->entries, 0x00, q->cluster_size);
 	rfb->dirty = 1;
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0)
-		goto free_rfb;
-
 	if (cache_refcount_block(q, rfb) < 0)
 		goto free_rfb;
 
@@ -701,6 +1097,10 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 		    header->cluster_bits, 1) < 0)
 		goto recover_rft;
 
+	/* The table can only point to the block once it is on disk */
+	if (qcow_write_refcount_blocks(q) < 0 || fdatasync(q->fd) < 0)
+		goto recover_rft;
+
 	if (qcow_write_refcount_table(q) < 0)
 		goto recover_rft;
 
@@ -708,6 +1108,9 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 
 recover_rft:
 	rft->rf_table[rft_idx] = 0;
+	rb_erase(&rfb->node, &rft->root);
+	list_del(&rfb->list);
+	rft->nr_cached--;
 free_rfb:
 	free(rfb);
 	return NULL;
@@ -802,16 +1205,11 @@ static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
 		return -1;
 	}
 
+	/* The block is written back on the next flush */
 	refcount = be16_to_cpu(rfb->entries[rfb_idx]) + append;
 	rfb->entries[rfb_idx] = cpu_to_be16(refcount);
 	rfb->dirty = 1;
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0) {
-		pr_warning("refcount block index out of bounds");
-		return -1;
-	}
-
 	/* update free_clust_idx since refcount becomes zero */
 	if (!refcount && clust_idx < q->free_clust_idx)
 		q->free_clust_idx = clust_idx;
@@ -830,6 +1228,88 @@ static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size)
 		update_cluster_refcount(q, offset >> header->cluster_bits, -1);
 }
 
+static int qcow_write_refcount_blocks(struct qcow *q)
+{
+	struct qcow_refcount_block *rfb;
+
+	list_for_each_entry(rfb, &q->refcount_table.lru_list, list) {
+		if (write_refcount_block(q, rfb) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int qcow_write_l2_tables(struct qcow *q)
+{
+	struct qcow_l2_table *l2t;
+
+	list_for_each_entry(l2t, &q->table.lru_list, list) {
+		if (qcow_l2_cache_write(q, l2t) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Refcount and L2 updates stay in the caches until the guest flushes, and
+ * are then written back in an order that keeps the image consistent if we
+ * crash halfway through: first the refcounts of the new clusters along with
+ * their data, then the L2 tables pointing to them, and last the refcounts of
+ * the clusters that are no longer used. A crash can only leak clusters.
+ */
+static int qcow_flush_metadata(struct qcow *q)
+{
+	struct qcow_free_extent *ext;
+	u32 i, nr = 0;
+
+	if (qcow_write_refcount_blocks(q) < 0 || fdatasync(q->fd) < 0)
+		return -1;
+
+	if (qcow_write_l2_tables(q) < 0 || fdatasync(q->fd) < 0)
+		return -1;
+
+	for (i = 0; i < q->nr_pending_frees; i++) {
+		ext = &q->pending_frees[i];
+
+		/* Still read or written, so keep it for the next flush */
+		if (qcow_extent_pinned(q, ext->offset, ext->size)) {
+			q->pending_frees[nr++] = *ext;
+			continue;
+		}
+
+		qcow_free_clusters(q, ext->offset, ext->size);
+	}
+	q->nr_pending_frees = nr;
+
+	return qcow_write_refcount_blocks(q);
+}
+
+/*
+ * Clusters can't be released while an L2 table on disk still points to them,
+ * or they could be reused before that table is written back.
+ */
+static int qcow_defer_free(struct qcow *q, u64 clust_start, u64 size)
+{
+	if (q->nr_pending_frees == QCOW_MAX_PENDING_FREES &&
+	    qcow_flush_metadata(q) < 0)
+		return -1;
+
+	/* Only pinned clusters were left, the cluster is leaked */
+	if (q->nr_pending_frees == QCOW_MAX_PENDING_FREES) {
+		pr_warning("qcow: too many clusters pending release");
+		return -1;
+	}
+
+	q->pending_frees[q->nr_pending_frees++] = (struct qcow_free_extent) {
+		.offset	= clust_start,
+		.size	= size,
+	};
+
+	return 0;
+}
+
 /*
  * Allocate clusters according to the size. Find a postion that
  * can satisfy the size. free_clust_idx is initialized to zero and
@@ -878,6 +1358,27 @@ static int qcow_write_l1_table(struct qcow *q)
 	return 0;
 }
 
+/*
+ * Release the clusters an L2 entry points to, once it has been replaced.
+ */
+static int qcow_free_l2_entry(struct qcow *q, u64 entry)
+{
+	u64 clust_start = entry & QCOW2_OFFSET_MASK;
+	int size;
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		size = ((clust_start >> q->csize_shift) & q->csize_mask) + 1;
+		size *= 512;
+		clust_start &= q->cluster_offset_mask;
+		clust_start &= ~511;
+
+		return qcow_defer_free(q, clust_start, size);
+	} else if (clust_start)
+		return qcow_defer_free(q, clust_start, q->cluster_size);
+
+	return 0;
+}
+
 /*
  * Get l2 table. If the table has been copied, read table directly.
  * If the table exists, allocate a new cluster and copy the table
@@ -888,7 +1389,7 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 {
 	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
+	struct qcow_l2_table *l2t, *old_l2t;
 	u64 l1t_idx;
 	u64 l2t_offset;
 	u64 l2t_idx;
@@ -915,7 +1416,7 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 		l2t_new_offset = qcow_alloc_clusters(q,
 			l2t_size*sizeof(u64), 1);
 
-		if (l2t_new_offset != (u64)-1)
+		if (l2t_new_offset == (u64)-1)
 			goto error;
 
 		l2t = new_cache_table(q, l2t_new_offset);
@@ -923,15 +1424,21 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 			goto free_cluster;
 
 		if (l2t_offset) {
-			l2t = qcow_read_l2_table(q, l2t_offset);
-			if (!l2t)
+			old_l2t = qcow_read_l2_table(q, l2t_offset);
+			if (!old_l2t)
 				goto free_cache;
-		} else
-			memset(l2t->table, 0x00, l2t_size * sizeof(u64));
+			memcpy(l2t->table, old_l2t->table,
+			       l2t_size * sizeof(u64));
+		}
 
-		/* write l2 table */
+		/*
+		 * The L1 table is written right away, so the new table and
+		 * its refcount have to be on disk first.
+		 */
 		l2t->dirty = 1;
-		if (qcow_l2_cache_write(q, l2t) < 0)
+		if (qcow_write_refcount_blocks(q) < 0 ||
+		    qcow_l2_cache_write(q, l2t) < 0 ||
+		    fdatasync(q->fd) < 0)
 			goto free_cache;
 
 		/* cache l2 table */
@@ -943,11 +1450,14 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 			| QCOW2_OFLAG_COPIED);
 		if (qcow_write_l1_table(q)) {
 			pr_warning("Update l1 table error");
-			goto free_cache;
+			l1t->l1_table[l1t_idx] = cpu_to_be64(l2t_offset);
+			goto error;
 		}
 
 		/* free old cluster */
-		qcow_free_clusters(q, l2t_offset, q->cluster_size);
+		if (l2t_offset &&
+		    qcow_defer_free(q, l2t_offset, q->cluster_size) < 0)
+			goto error;
 	}
 
 	*result_l2t = l2t;
@@ -965,23 +1475,42 @@ error:
 	return -1;
 }
 
+static bool qcow_cluster_busy(struct qcow *q, u64 offset)
+{
+	struct qcow_cluster_alloc *alloc;
+
+	list_for_each_entry(alloc, &q->allocs, list) {
+		if (alloc->offset == offset)
+			return true;
+	}
+
+	return false;
+}
+
 /*
- * If the cluster has been copied, write data directly. If not,
- * read the original data and write it to the new cluster with
- * modification.
+ * If the cluster has been copied, write data directly. If not, allocate a
+ * new cluster, and fill the parts of it that the guest doesn't write with the
+ * original data. The mutex is only held to update the metadata, so writers
+ * to different clusters go on in parallel, and writers to a cluster being
+ * copied wait until its L2 entry is updated.
  */
 static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
 		void *buf, u32 src_len)
 {
+	struct qcow_cluster_alloc alloc;
+	struct qcow_cluster_pin pin;
 	struct qcow_l2_table *l2t;
+	struct iovec iov[3];
+	void *head = NULL;
+	void *tail = NULL;
 	u64 clust_new_start;
 	u64 clust_start;
-	u64 clust_flags;
 	u64 clust_off;
+	u64 tail_len;
 	u64 l2t_idx;
+	ssize_t ret;
 	u64 len;
-
-	l2t = NULL;
+	int nr;
 
 	clust_off = get_cluster_offset(q, offset);
 	if (clust_off >= q->cluster_size)
@@ -991,79 +1520,100 @@ static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
 	if (len > src_len)
 		len = src_len;
 
+	tail_len = q->cluster_size - clust_off - len;
+	offset &= ~(q->cluster_size - 1);
+
 	mutex_lock(&q->mutex);
 
+again:
 	if (get_cluster_table(q, offset, &l2t, &l2t_idx)) {
 		pr_warning("Get l2 table error");
 		goto error;
 	}
 
 	clust_start = be64_to_cpu(l2t->table[l2t_idx]);
-	clust_flags = clust_start & QCOW2_OFLAGS_MASK;
+	if (clust_start & QCOW2_OFLAG_COPIED) {
+		clust_start &= QCOW2_OFFSET_MASK;
+		qcow_pin_cluster(q, &pin, clust_start);
+		mutex_unlock(&q->mutex);
 
-	clust_start &= QCOW2_OFFSET_MASK;
-	if (!(clust_flags & QCOW2_OFLAG_COPIED)) {
-		clust_new_start	= qcow_alloc_clusters(q, q->cluster_size, 1);
-		if (clust_new_start != (u64)-1) {
-			pr_warning("Cluster alloc error");
-			goto error;
-		}
+		/* Write actual data */
+		ret = pwrite_in_full(q->fd, buf, len, clust_start + clust_off);
+		qcow_unpin_cluster(q, &pin);
+		if (ret < 0)
+			return -1;
 
-		offset &= ~(q->cluster_size - 1);
+		return len;
+	}
 
-		/* if clust_start is not zero, read the original data*/
-		if (clust_start) {
-			mutex_unlock(&q->mutex);
-			if (qcow2_read_cluster(q, offset, q->copy_buff,
-				q->cluster_size) < 0) {
-				pr_warning("Read copy cluster error");
-				qcow_free_clusters(q, clust_new_start,
-					q->cluster_size);
-				return -1;
-			}
-			mutex_lock(&q->mutex);
-		} else
-			memset(q->copy_buff, 0x00, q->cluster_size);
+	if (qcow_cluster_busy(q, offset)) {
+		pthread_cond_wait(&q->alloc_cond, &q->mutex.mutex);
+		goto again;
+	}
 
-		memcpy(q->copy_buff + clust_off, buf, len);
+	clust_new_start	= qcow_alloc_clusters(q, q->cluster_size, 1);
+	if (clust_new_start == (u64)-1) {
+		pr_warning("Cluster alloc error");
+		goto error;
+	}
+
+	alloc.offset = offset;
+	list_add_tail(&alloc.list, &q->allocs);
+
+	mutex_unlock(&q->mutex);
 
-		 /* Write actual data */
-		if (pwrite_in_full(q->fd, q->copy_buff, q->cluster_size,
-			clust_new_start) < 0)
+	/* Only copy the head and tail of the cluster, around the new data */
+	nr = 0;
+	if (clust_off) {
+		head = malloc(clust_off);
+		if (!head || qcow2_read_cluster(q, offset, head, clust_off) < 0)
 			goto free_cluster;
+		iov[nr++] = (struct iovec) { head, clust_off };
+	}
 
-		/* update l2 table*/
-		l2t->table[l2t_idx] = cpu_to_be64(clust_new_start
-			| QCOW2_OFLAG_COPIED);
-		l2t->dirty = 1;
+	iov[nr++] = (struct iovec) { buf, len };
 
-		if (qcow_l2_cache_write(q, l2t))
+	if (tail_len) {
+		tail = malloc(tail_len);
+		if (!tail || qcow2_read_cluster(q, offset + clust_off + len,
+						tail, tail_len) < 0)
 			goto free_cluster;
+		iov[nr++] = (struct iovec) { tail, tail_len };
+	}
 
-		/* free old cluster*/
-		if (clust_flags & QCOW2_OFLAG_COMPRESSED) {
-			int size;
-			size = ((clust_start >> q->csize_shift) &
-				q->csize_mask) + 1;
-			size *= 512;
-			clust_start &= q->cluster_offset_mask;
-			clust_start &= ~511;
+	if (pwritev_in_full(q->fd, iov, nr, clust_new_start) < 0)
+		goto free_cluster;
 
-			qcow_free_clusters(q, clust_start, size);
-		} else if (clust_start)
-			qcow_free_clusters(q, clust_start, q->cluster_size);
+	mutex_lock(&q->mutex);
 
-	} else {
-		/* Write actual data */
-		if (pwrite_in_full(q->fd, buf, len,
-			clust_start + clust_off) < 0)
-			goto error;
-	}
-	mutex_unlock(&q->mutex);
-	return len;
+	/* The table may have been evicted from the cache meanwhile */
+	if (get_cluster_table(q, offset, &l2t, &l2t_idx))
+		goto free_cluster_locked;
+
+	/* update l2 table, it is written back on the next flush */
+	l2t->table[l2t_idx] = cpu_to_be64(clust_new_start
+		| QCOW2_OFLAG_COPIED);
+	l2t->dirty = 1;
+
+	/* free old cluster*/
+	if (qcow_free_l2_entry(q, clust_start) < 0)
+		ret = -1;
+	else
+		ret = len;
+	goto out;
 
 free_cluster:
+	mutex_lock(&q->mutex);
+free_cluster_locked:
 	qcow_free_clusters(q, clust_new_start, q->cluster_size);
+	ret = -1;
+out:
+	list_del(&alloc.list);
+	pthread_cond_broadcast(&q->alloc_cond);
+	mutex_unlock(&q->mutex);
+	free(head);
+	free(tail);
+	return ret;
 
 error:
 	mutex_unlock(&q->mutex);
@@ -1119,42 +1669,125 @@ static ssize_t qcow_write_sector(struct disk_image *disk, u64 sector,
 	return total;
 }
 
-static int qcow_disk_flush(struct disk_image *disk)
+/*
+ * Unmap the cluster containing offset, which then reads back as zeroes.
+ */
+static int qcow_discard_cluster(struct qcow *q, u64 offset)
 {
-	struct qcow *q = disk->priv;
-	struct qcow_refcount_table *rft;
-	struct list_head *pos, *n;
-	struct qcow_l1_table *l1t;
-
-	l1t = &q->table;
-	rft = &q->refcount_table;
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *l2t;
+	u64 l1t_idx;
+	u64 l2t_idx;
+	u64 entry;
+	int ret = 0;
 
 	mutex_lock(&q->mutex);
 
-	list_for_each_safe(pos, n, &rft->lru_list) {
-		struct qcow_refcount_block *c = list_entry(pos, struct qcow_refcount_block, list);
+	while (qcow_cluster_busy(q, offset))
+		pthread_cond_wait(&q->alloc_cond, &q->mutex.mutex);
+
+	/* Don't allocate an L2 table just to clear one of its entries */
+	l1t_idx = get_l1_index(q, offset);
+	if (l1t_idx >= l1t->table_size || !l1t->l1_table[l1t_idx])
+		goto out;
 
-		if (write_refcount_block(q, c) < 0)
-			goto error_unlock;
+	if (get_cluster_table(q, offset, &l2t, &l2t_idx)) {
+		pr_warning("Get l2 table error");
+		ret = -EIO;
+		goto out;
 	}
 
-	list_for_each_safe(pos, n, &l1t->lru_list) {
-		struct qcow_l2_table *c = list_entry(pos, struct qcow_l2_table, list);
+	entry = be64_to_cpu(l2t->table[l2t_idx]);
+	if (!(entry & QCOW2_OFFSET_MASK))
+		goto out;
+
+	l2t->table[l2t_idx] = 0;
+	l2t->dirty = 1;
+
+	if (qcow_free_l2_entry(q, entry))
+		ret = -EIO;
+out:
+	mutex_unlock(&q->mutex);
+	return ret;
+}
 
-		if (qcow_l2_cache_write(q, c) < 0)
-			goto error_unlock;
+/*
+ * Only whole clusters can be unmapped, the head and tail of the range are
+ * left alone.
+ */
+static int qcow_disk_discard(struct disk_image *disk, u64 sector,
+			     u64 nr_sectors)
+{
+	struct qcow *q = disk->priv;
+	u64 start, end, offset;
+	int ret;
+
+	if (q->version != QCOW2_VERSION)
+		return 0;
+
+	start = ALIGN(sector << SECTOR_SHIFT, q->cluster_size);
+	end = min((sector + nr_sectors) << SECTOR_SHIFT, q->header->size);
+	end &= ~(q->cluster_size - 1);
+
+	for (offset = start; offset < end; offset += q->cluster_size) {
+		ret = qcow_discard_cluster(q, offset);
+		if (ret)
+			return ret;
 	}
 
-	if (qcow_write_l1_table < 0)
-		goto error_unlock;
+	return 0;
+}
 
-	mutex_unlock(&q->mutex);
+static int qcow_disk_write_zeroes(struct disk_image *disk, u64 sector,
+				  u64 nr_sectors, bool unmap)
+{
+	struct qcow *q = disk->priv;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 end = (sector + nr_sectors) << SECTOR_SHIFT;
+	void *zeroes;
+	ssize_t nr;
+	u32 len;
+
+	zeroes = calloc(1, q->cluster_size);
+	if (!zeroes)
+		return -ENOMEM;
+
+	while (offset < end) {
+		len = min(end, ALIGN(offset + 1, q->cluster_size)) - offset;
+
+		/* Without a backing image, unallocated clusters read as zeroes */
+		if (unmap && q->version == QCOW2_VERSION && !q->backing &&
+		    len == q->cluster_size) {
+			if (qcow_discard_cluster(q, offset))
+				break;
+		} else {
+			nr = qcow_write_sector_single(disk, offset >> SECTOR_SHIFT,
+						      zeroes, len);
+			if (nr != len)
+				break;
+		}
 
-	return fsync(disk->fd);
+		offset += len;
+	}
+
+	free(zeroes);
+
+	return offset < end ? -EIO : 0;
+}
 
-error_unlock:
+static int qcow_disk_flush(struct disk_image *disk)
+{
+	struct qcow *q = disk->priv;
+	int ret;
+
+	mutex_lock(&q->mutex);
+	ret = qcow_flush_metadata(q);
 	mutex_unlock(&q->mutex);
-	return -1;
+
+	if (ret < 0)
+		return ret;
+
+	return fsync(disk->fd);
 }
 
 static int qcow_disk_close(struct disk_image *disk)
@@ -1166,11 +1799,15 @@ static int qcow_disk_close(struct disk_image *disk)
 
 	q = disk->priv;
 
+	if (disk->ops->flush && qcow_disk_flush(disk) < 0)
+		pr_warning("Failed to write back qcow metadata");
+
+	if (q->backing)
+		disk_image__close(q->backing);
+
 	refcount_table_free_cache(&q->refcount_table);
 	l1_table_free_cache(&q->table);
-	free(q->copy_buff);
-	free(q->cluster_data);
-	free(q->cluster_cache);
+	qcow_inflate_exit(q);
 	free(q->refcount_table.rf_table);
 	free(q->table.l1_table);
 	free(q->header);
@@ -1180,15 +1817,17 @@ static int qcow_disk_close(struct disk_image *disk)
 }
 
 static struct disk_image_operations qcow_disk_readonly_ops = {
-	.read	= qcow_read_sector,
-	.close	= qcow_disk_close,
+	.read		= qcow_read_sector,
+	.close		= qcow_disk_close,
 };
 
 static struct disk_image_operations qcow_disk_ops = {
-	.read	= qcow_read_sector,
-	.write	= qcow_write_sector,
-	.flush	= qcow_disk_flush,
-	.close	= qcow_disk_close,
+	.read		= qcow_read_sector,
+	.write		= qcow_write_sector,
+	.flush		= qcow_disk_flush,
+	.discard	= qcow_disk_discard,
+	.write_zeroes	= qcow_disk_write_zeroes,
+	.close		= qcow_disk_close,
 };
 
 static int qcow_read_refcount_table(struct qcow *q)
@@ -1232,6 +1871,68 @@ static int qcow_read_l1_table(struct qcow *q)
 	return pread_in_full(q->fd, table->l1_table, sizeof(u64) * table->table_size, header->l1_table_offset);
 }
 
+/*
+ * The backing image is opened read-only, so all the guests started from the
+ * same base share its pages in the host page cache. Relative names are
+ * relative to the directory of the image, and depth is the number of images
+ * this one backs.
+ */
+static int qcow_open_backing(struct qcow *q, const char *filename, int depth)
+{
+	struct qcow_header *header = q->header;
+	char path[PATH_MAX];
+	const char *dir_end;
+	char *name;
+	int len = 0;
+	int ret = 0;
+
+	if (!header->backing_file_offset)
+		return 0;
+
+	if (!header->backing_file_size || header->backing_file_size >= PATH_MAX) {
+		pr_err("Invalid backing file name");
+		return -EINVAL;
+	}
+
+	if (depth >= QCOW_MAX_BACKING_DEPTH) {
+		pr_err("Too many backing images");
+		return -ELOOP;
+	}
+
+	name = calloc(1, header->backing_file_size + 1);
+	if (!name)
+		return -ENOMEM;
+
+	if (pread_in_full(q->fd, name, header->backing_file_size,
+			  header->backing_file_offset) < 0) {
+		ret = -errno;
+		goto out_free;
+	}
+
+	dir_end = strrchr(filename, '/');
+	if (name[0] != '/' && dir_end)
+		len = snprintf(path, sizeof(path), "%.*s/",
+			       (int)(dir_end - filename), filename);
+
+	if (snprintf(path + len, sizeof(path) - len, "%s", name) >=
+	    (int)sizeof(path) - len) {
+		ret = -ENAMETOOLONG;
+		goto out_free;
+	}
+
+	q->backing = disk_image__open_backing(path, depth + 1);
+
+	if (IS_ERR_OR_NULL(q->backing)) {
+		pr_err("Loading backing image '%s' failed", path);
+		ret = q->backing ? PTR_ERR(q->backing) : -EINVAL;
+		q->backing = NULL;
+	}
+
+out_free:
+	free(name);
+	return ret;
+}
+
 static void *qcow2_read_header(int fd)
 {
 	struct qcow2_header_disk f_header;
@@ -1268,23 +1969,31 @@ static void *qcow2_read_header(int fd)
 		.l2_bits		= f_header.cluster_bits - 3,
 		.refcount_table_offset	= f_header.refcount_table_offset,
 		.refcount_table_size	= f_header.refcount_table_clusters,
+		.backing_file_offset	= f_header.backing_file_offset,
+		.backing_file_size	= f_header.backing_file_size,
 	};
 
 	return header;
 }
 
-static struct disk_image *qcow2_probe(int fd, bool readonly)
+static struct disk_image *qcow2_probe(int fd, const char *filename,
+				      bool readonly, int depth)
 {
 	struct disk_image *disk_image;
 	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
+	void *err = NULL;
+	int r;
 
 	q = calloc(1, sizeof(struct qcow));
 	if (!q)
 		return NULL;
 
 	mutex_init(&q->mutex);
+	pthread_cond_init(&q->alloc_cond, NULL);
+	INIT_LIST_HEAD(&q->allocs);
+	INIT_LIST_HEAD(&q->pins);
 	q->fd = fd;
 
 	l1t = &q->table;
@@ -1302,30 +2011,21 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 	q->cluster_offset_mask = (1LL << q->csize_shift) - 1;
 	q->cluster_size = 1 << q->header->cluster_bits;
 
-	q->copy_buff = malloc(q->cluster_size);
-	if (!q->copy_buff) {
-		pr_warning("copy buff malloc error");
-		goto free_header;
-	}
-
-	q->cluster_data = malloc(q->cluster_size);
-	if (!q->cluster_data) {
-		pr_warning("cluster data malloc error");
-		goto free_copy_buff;
-	}
-
-	q->cluster_cache = malloc(q->cluster_size);
-	if (!q->cluster_cache) {
-		pr_warning("cluster cache malloc error");
-		goto free_cluster_data;
-	}
+	qcow_inflate_init(q);
 
 	if (qcow_read_l1_table(q) < 0)
-		goto free_cluster_cache;
+		goto free_header;
 
 	if (qcow_read_refcount_table(q) < 0)
 		goto free_l1_table;
 
+	/* Don't let the image be probed as raw if its backing image is missing */
+	r = qcow_open_backing(q, filename, depth);
+	if (r < 0) {
+		err = ERR_PTR(r);
+		goto free_refcount_table;
+	}
+
 	/*
 	 * Do not use mmap use read/write instead
 	 */
@@ -1335,34 +2035,29 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
 
 	if (IS_ERR_OR_NULL(disk_image))
-		goto free_refcount_table;
+		goto close_backing;
 
 	disk_image->priv = q;
+	disk_image->discard_granularity = q->cluster_size >> SECTOR_SHIFT;
 
 	return disk_image;
 
+close_backing:
+	if (q->backing)
+		disk_image__close(q->backing);
 free_refcount_table:
 	if (q->refcount_table.rf_table)
 		free(q->refcount_table.rf_table);
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
-free_cluster_cache:
-	if (q->cluster_cache)
-		free(q->cluster_cache);
-free_cluster_data:
-	if (q->cluster_data)
-		free(q->cluster_data);
-free_copy_buff:
-	if (q->copy_buff)
-		free(q->copy_buff);
 free_header:
 	if (q->header)
 		free(q->header);
 free_qcow:
 	free(q);
 
-	return NULL;
+	return err;
 }
 
 static bool qcow2_check_image(int fd)
@@ -1447,29 +2142,19 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 	q->cluster_offset_mask = (1LL << (63 - q->header->cluster_bits)) - 1;
 	q->free_clust_idx = 0;
 
-	q->cluster_data = malloc(q->cluster_size);
-	if (!q->cluster_data) {
-		pr_warning("cluster data malloc error");
-		goto free_header;
-	}
-
-	q->cluster_cache = malloc(q->cluster_size);
-	if (!q->cluster_cache) {
-		pr_warning("cluster cache malloc error");
-		goto free_cluster_data;
-	}
+	qcow_inflate_init(q);
 
 	if (qcow_read_l1_table(q) < 0)
-		goto free_cluster_cache;
+		goto free_header;
 
 	/*
-	 * Do not use mmap use read/write instead
+	 * Do not use mmap use read/write instead. Only version 2 images can
+	 * be written.
 	 */
-	if (readonly)
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
-	else
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
+	if (!readonly)
+		pr_warning("Forcing read-only support for QCOW version 1");
 
+	disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
 	if (!disk_image)
 		goto free_l1_table;
 
@@ -1480,12 +2165,6 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
-free_cluster_cache:
-	if (q->cluster_cache)
-		free(q->cluster_cache);
-free_cluster_data:
-	if (q->cluster_data)
-		free(q->cluster_data);
 free_header:
 	if (q->header)
 		free(q->header);
@@ -1514,13 +2193,14 @@ static bool qcow1_check_image(int fd)
 	return true;
 }
 
-struct disk_image *qcow_probe(int fd, bool readonly)
+struct disk_image *qcow_probe(int fd, const char *filename, bool readonly,
+			      int depth)
 {
 	if (qcow1_check_image(fd))
 		return qcow1_probe(fd, readonly);
 
 	if (qcow2_check_image(fd))
-		return qcow2_probe(fd, readonly);
+		return qcow2_probe(fd, filename, readonly, depth);
 
 	return NULL;
 }
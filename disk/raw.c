@@ -1,6 +1,36 @@
 #include "kvm/disk-image.h"
+#include "kvm/iovec.h"
+#include "kvm/mutex.h"
+#include "kvm/kvm.h"
 
+#include <linux/bitmap.h>
 #include <linux/err.h>
+#include <linux/kernel.h>
+
+/*
+ * Writes to a read-only raw image land in a sparse temporary file, the
+ * overlay, which has the size of the image. A bitmap tells which blocks of
+ * the overlay hold data, the others are read from the image. The overlay is
+ * only created on the first write, and deleted when the disk is closed.
+ *
+ * Reads that come from a single file go through the AIO engine. Writes, and
+ * reads that mix both files, are done synchronously.
+ */
+#define RAW_OVERLAY_BLOCK_SHIFT		12
+#define RAW_OVERLAY_BLOCK_SIZE		(1UL << RAW_OVERLAY_BLOCK_SHIFT)
+
+struct raw_overlay {
+	struct mutex		mutex;
+	char			*filename;
+	int			fd;
+	unsigned long		*map;
+	u64			nr_blocks;
+	/* Blocks present in the overlay, and how many of them are allowed */
+	u64			used;
+	u64			max;
+	bool			full;
+	char			block[RAW_OVERLAY_BLOCK_SIZE];
+};
 
 ssize_t raw_image__read_sync(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
@@ -51,6 +81,65 @@ ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector, const struct
 	return total;
 }
 
+/*
+ * Fallback for filesystems that can't zero a range: write the zeroes. The
+ * buffer is aligned so that it also works for images opened with O_DIRECT.
+ */
+static int raw_image__zero_fill(struct disk_image *disk, u64 offset, u64 len)
+{
+	static const char zeroes[64 * 1024] __attribute__((aligned(4096)));
+	size_t count;
+
+	while (len) {
+		count = min_t(u64, len, sizeof(zeroes));
+		if (pwrite_in_full(disk->fd, zeroes, count, offset) < 0)
+			return -errno;
+
+		offset	+= count;
+		len	-= count;
+	}
+
+	return 0;
+}
+
+static int raw_image__discard(struct disk_image *disk, u64 sector,
+			      u64 nr_sectors)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 len = nr_sectors << SECTOR_SHIFT;
+
+	if (!fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		       offset, len))
+		return 0;
+
+	/* Discard is only a hint, the guest doesn't care if nothing happened */
+	if (errno == EOPNOTSUPP || errno == ENOSYS)
+		return 0;
+
+	return -errno;
+}
+
+static int raw_image__write_zeroes(struct disk_image *disk, u64 sector,
+				   u64 nr_sectors, bool unmap)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 len = nr_sectors << SECTOR_SHIFT;
+
+	/* A hole reads back as zeroes */
+	if (unmap && !fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, offset, len))
+		return 0;
+
+	if (!fallocate(disk->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+		       offset, len))
+		return 0;
+
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		return -errno;
+
+	return raw_image__zero_fill(disk, offset, len);
+}
+
 int raw_image__close(struct disk_image *disk)
 {
 	int ret = 0;
@@ -65,43 +154,358 @@ int raw_image__close(struct disk_image *disk)
  * multiple buffer based disk image operations
  */
 static struct disk_image_operations raw_image_regular_ops = {
-	.read	= raw_image__read,
-	.write	= raw_image__write,
-	.wait	= raw_image__wait,
-	.async	= true,
+	.read		= raw_image__read,
+	.write		= raw_image__write,
+	.discard	= raw_image__discard,
+	.write_zeroes	= raw_image__write_zeroes,
+	.wait		= raw_image__wait,
+	.async		= true,
 };
 
-struct disk_image_operations ro_ops = {
-	.read	= raw_image__read_mmap,
-	.write	= raw_image__write_mmap,
-	.close	= raw_image__close,
-};
+static int raw_overlay__create(struct disk_image *disk)
+{
+	struct raw_overlay *ovl = disk->priv;
+	char path[PATH_MAX];
+	int fd;
+
+	fd = open(kvm__get_dir(), O_TMPFILE | O_RDWR, 0600);
+	if (fd < 0) {
+		snprintf(path, sizeof(path), "%s/overlayXXXXXX", kvm__get_dir());
+		fd = mkstemp(path);
+		if (fd < 0)
+			return -errno;
+		unlink(path);
+	}
+
+	if (ftruncate(fd, disk->size) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	ovl->fd = fd;
+
+	return 0;
+}
+
+static bool raw_overlay__present(struct raw_overlay *ovl, u64 first, u64 last)
+{
+	while (first <= last) {
+		if (!test_bit(first++, ovl->map))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Blocks are marked under the overlay lock, but tested without it. The
+ * barrier orders the data and the overlay fd before the bit.
+ */
+static void raw_overlay__mark(struct raw_overlay *ovl, u64 block)
+{
+	__sync_fetch_and_or(&ovl->map[BIT_WORD(block)],
+			    1UL << (block % BITS_PER_LONG));
+}
+
+/* Copy a block from the image, before a write covering only part of it */
+static int raw_overlay__populate(struct disk_image *disk, u64 block)
+{
+	struct raw_overlay *ovl = disk->priv;
+	u64 offset = block << RAW_OVERLAY_BLOCK_SHIFT;
+	size_t count = min_t(u64, RAW_OVERLAY_BLOCK_SIZE, disk->size - offset);
+
+	if (pread_in_full(disk->fd, ovl->block, count, offset) < 0)
+		return -errno;
+
+	if (pwrite_in_full(ovl->fd, ovl->block, count, offset) < 0)
+		return -errno;
+
+	raw_overlay__mark(ovl, block);
+
+	return 0;
+}
+
+/* Called with the overlay lock held */
+static int raw_overlay__reserve(struct disk_image *disk, u64 offset, u64 len)
+{
+	struct raw_overlay *ovl = disk->priv;
+	u64 first = offset >> RAW_OVERLAY_BLOCK_SHIFT;
+	u64 last = (offset + len - 1) >> RAW_OVERLAY_BLOCK_SHIFT;
+	u64 block, nr_new = 0;
+	int r;
+
+	for (block = first; block <= last; block++)
+		nr_new += !test_bit(block, ovl->map);
+
+	if (ovl->used + nr_new > ovl->max) {
+		if (!ovl->full)
+			pr_warning("%s: overlay is full (%llu MB), failing writes",
+				   ovl->filename, (unsigned long long)
+				   (ovl->max << RAW_OVERLAY_BLOCK_SHIFT) >> 20);
+		ovl->full = true;
+		return -ENOSPC;
+	}
+
+	if (ovl->fd < 0) {
+		r = raw_overlay__create(disk);
+		if (r < 0) {
+			pr_err("%s: cannot create overlay: %s", ovl->filename,
+			       strerror(-r));
+			return r;
+		}
+	}
+
+	if (!IS_ALIGNED(offset, RAW_OVERLAY_BLOCK_SIZE) &&
+	    !test_bit(first, ovl->map)) {
+		r = raw_overlay__populate(disk, first);
+		if (r < 0)
+			return r;
+	}
+
+	if (!IS_ALIGNED(offset + len, RAW_OVERLAY_BLOCK_SIZE) &&
+	    offset + len < disk->size && !test_bit(last, ovl->map)) {
+		r = raw_overlay__populate(disk, last);
+		if (r < 0)
+			return r;
+	}
+
+	ovl->used += nr_new;
+
+	return 0;
+}
+
+/*
+ * With AIO, the caller only completes requests that failed to submit. The
+ * overlay completes those it did synchronously itself.
+ */
+static ssize_t raw_overlay__done(struct disk_image *disk, ssize_t ret,
+				 void *param)
+{
+	if (disk->async && ret >= 0 && disk->disk_req_cb)
+		disk->disk_req_cb(param, ret);
+
+	return ret;
+}
+
+static ssize_t raw_overlay__write(struct disk_image *disk, u64 sector,
+				  const struct iovec *iov, int iovcount,
+				  void *param)
+{
+	struct raw_overlay *ovl = disk->priv;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 len = iov_size(iov, iovcount);
+	u64 first = offset >> RAW_OVERLAY_BLOCK_SHIFT;
+	u64 last = (offset + len - 1) >> RAW_OVERLAY_BLOCK_SHIFT;
+	ssize_t ret;
+	u64 block;
+
+	if (!len)
+		return raw_overlay__done(disk, 0, param);
+
+	/* Blocks already in the overlay are simply overwritten */
+	if (raw_overlay__present(ovl, first, last)) {
+		ret = pwritev_in_full(ovl->fd, iov, iovcount, offset);
+		return raw_overlay__done(disk, ret, param);
+	}
+
+	/*
+	 * Hold the lock until the blocks are marked present, otherwise a
+	 * concurrent write to the same edge block could copy it again from
+	 * the image, on top of our data.
+	 */
+	mutex_lock(&ovl->mutex);
+	ret = raw_overlay__reserve(disk, offset, len);
+	if (ret == 0) {
+		ret = pwritev_in_full(ovl->fd, iov, iovcount, offset);
+		if (ret >= 0) {
+			for (block = first; block <= last; block++)
+				raw_overlay__mark(ovl, block);
+		}
+	}
+	mutex_unlock(&ovl->mutex);
+
+	return raw_overlay__done(disk, ret, param);
+}
+
+/* The file all of a range comes from, or -1 if it spans both */
+static int raw_overlay__source(struct disk_image *disk, u64 offset, u64 len)
+{
+	struct raw_overlay *ovl = disk->priv;
+	u64 block = offset >> RAW_OVERLAY_BLOCK_SHIFT;
+	u64 last = (offset + len - 1) >> RAW_OVERLAY_BLOCK_SHIFT;
+	bool present = test_bit(block, ovl->map);
+
+	while (block++ < last) {
+		if (test_bit(block, ovl->map) != present)
+			return -1;
+	}
+
+	return present ? ovl->fd : disk->fd;
+}
+
+static ssize_t raw_overlay__read(struct disk_image *disk, u64 sector,
+				 const struct iovec *iov, int iovcount,
+				 void *param)
+{
+	struct raw_overlay *ovl = disk->priv;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 block, end, run_end;
+	ssize_t total = 0;
+	size_t count;
+	u64 len = iov_size(iov, iovcount);
+	bool present;
+	int fd;
+
+	if (!len)
+		return raw_overlay__done(disk, 0, param);
+
+	fd = ovl->used ? raw_overlay__source(disk, offset, len) : disk->fd;
+	if (fd >= 0)
+		return disk_aio_read(disk, fd, sector, iov, iovcount, param);
+
+	/* Split each buffer into runs of blocks that come from the same file */
+	for (; iovcount--; iov++) {
+		end = offset + iov->iov_len;
+		count = 0;
+
+		while (offset < end) {
+			block = offset >> RAW_OVERLAY_BLOCK_SHIFT;
+			present = test_bit(block, ovl->map);
+			run_end = (block + 1) << RAW_OVERLAY_BLOCK_SHIFT;
+
+			while (run_end < end &&
+			       test_bit(++block, ovl->map) == present)
+				run_end += RAW_OVERLAY_BLOCK_SIZE;
+			run_end = min(run_end, end);
+
+			fd = present ? ovl->fd : disk->fd;
+			if (pread_in_full(fd, iov->iov_base + count,
+					  run_end - offset, offset) < 0)
+				return -errno;
+
+			count	+= run_end - offset;
+			offset	= run_end;
+		}
+
+		total += count;
+	}
 
-struct disk_image_operations ro_ops_nowrite = {
-	.read	= raw_image__read,
+	return raw_overlay__done(disk, total, param);
+}
+
+/* The overlay is thrown away on exit, there is nothing to make durable */
+static int raw_overlay__flush(struct disk_image *disk)
+{
+	return 0;
+}
+
+static int raw_overlay__close(struct disk_image *disk)
+{
+	struct raw_overlay *ovl = disk->priv;
+
+	if (ovl->used)
+		pr_info("%s: discarding %llu MB of writes to the overlay",
+			ovl->filename, (unsigned long long)
+			(ovl->used << RAW_OVERLAY_BLOCK_SHIFT) >> 20);
+
+	if (ovl->fd >= 0)
+		close(ovl->fd);
+
+	free(ovl->filename);
+	free(ovl->map);
+	free(ovl);
+
+	return 0;
+}
+
+static struct disk_image_operations raw_overlay_ops = {
+	.read	= raw_overlay__read,
+	.write	= raw_overlay__write,
+	.flush	= raw_overlay__flush,
 	.wait	= raw_image__wait,
+	.close	= raw_overlay__close,
 	.async	= true,
 };
 
-struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
+static struct disk_image *raw_overlay__probe(int fd, const char *filename,
+					     struct stat *st)
 {
-	if (readonly) {
-		/*
-		 * Use mmap's MAP_PRIVATE to implement non-persistent write
-		 * FIXME: This does not work on 32-bit host.
-		 */
-		struct disk_image *disk;
+	struct disk_image *disk;
+	struct raw_overlay *ovl;
 
-		disk = disk_image__new(fd, st->st_size, &ro_ops, DISK_IMAGE_MMAP);
-		if (IS_ERR_OR_NULL(disk)) {
-			disk = disk_image__new(fd, st->st_size, &ro_ops_nowrite, DISK_IMAGE_REGULAR);
-		}
+	ovl = calloc(1, sizeof(*ovl));
+	if (!ovl)
+		return ERR_PTR(-ENOMEM);
+
+	ovl->nr_blocks = DIV_ROUND_UP(st->st_size, RAW_OVERLAY_BLOCK_SIZE);
+	ovl->max = ovl->nr_blocks;
+	ovl->fd = -1;
+	mutex_init(&ovl->mutex);
 
-		return disk;
-	} else {
-		/*
-		 * Use read/write instead of mmap
-		 */
-		return disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
+	/* Only touched pages of the bitmap take memory */
+	ovl->map = calloc(BITS_TO_LONGS(ovl->nr_blocks), sizeof(long));
+	ovl->filename = strdup(filename);
+	if (!ovl->map || !ovl->filename) {
+		disk = ERR_PTR(-ENOMEM);
+		goto err_free;
 	}
+
+	disk = disk_image__new(fd, st->st_size, &raw_overlay_ops,
+			       DISK_IMAGE_REGULAR);
+	if (IS_ERR_OR_NULL(disk))
+		goto err_free;
+
+	disk->priv = ovl;
+
+	return disk;
+
+err_free:
+	free(ovl->filename);
+	free(ovl->map);
+	free(ovl);
+	return disk;
+}
+
+/*
+ * Bound the overlay to max_mb megabytes. Writes that would grow it further
+ * fail, and the guest sees an I/O error.
+ */
+int raw_image__set_overlay(struct disk_image *disk, u64 max_mb)
+{
+	struct raw_overlay *ovl = disk->priv;
+
+	if (disk->ops != &raw_overlay_ops)
+		return -EINVAL;
+
+	if (max_mb)
+		ovl->max = min(ovl->nr_blocks,
+			       (max_mb << 20) >> RAW_OVERLAY_BLOCK_SHIFT);
+
+	return 0;
+}
+
+/* Bytes held in the overlay, and the most it may hold */
+int raw_image__overlay_stats(struct disk_image *disk, u64 *used, u64 *max)
+{
+	struct raw_overlay *ovl = disk->priv;
+
+	if (disk->ops != &raw_overlay_ops)
+		return -EINVAL;
+
+	mutex_lock(&ovl->mutex);
+	*used = ovl->used << RAW_OVERLAY_BLOCK_SHIFT;
+	*max = ovl->max << RAW_OVERLAY_BLOCK_SHIFT;
+	mutex_unlock(&ovl->mutex);
+
+	return 0;
+}
+
+struct disk_image *raw_image__probe(int fd, const char *filename,
+				    struct stat *st, bool readonly)
+{
+	/* Writes to a read-only image are not persistent */
+	if (readonly)
+		return raw_overlay__probe(fd, filename, st);
+
+	return disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
 }
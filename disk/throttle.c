@@ -0,0 +1,516 @@
+#include "kvm/disk-throttle.h"
+#include "kvm/disk-image.h"
+#include "kvm/threadpool.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/iovec.h"
+#include "kvm/mutex.h"
+#include "kvm/epoll.h"
+#include "kvm/kvm.h"
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+/*
+ * Each disk has token buckets for the requests and the bytes it reads and
+ * writes. A bucket fills at the configured rate, up to burst seconds worth of
+ * tokens. A request goes through as soon as the buckets it draws from aren't
+ * in debt, and its whole cost is then taken from them, so that requests
+ * larger than a bucket still make progress.
+ *
+ * Requests that can't go through yet are queued in order, and the virtqueue
+ * thread moves on. Requests the image runs from the thread pool, like write
+ * zeroes, are queued as their job and count as writes. A timer fires when the oldest one can go, and the queue is
+ * then submitted from the thread pool.
+ *
+ * Queued requests point into the device's rings, so they are all submitted
+ * right away when the disk is waited for, before a reset tears the rings
+ * down.
+ */
+#define NSEC_PER_SEC		1000000000ULL
+
+struct disk_throttle_req {
+	struct list_head	list;
+	bool			write;
+	u64			sector;
+	const struct iovec	*iov;
+	int			iovcount;
+	size_t			len;
+	void			*param;
+	struct thread_pool__job	*job;
+	u64			queued_ns;
+};
+
+struct disk_throttle {
+	/* On the throttles list, while the timer is registered */
+	struct list_head		list;
+	struct mutex			mutex;
+	struct disk_image		*disk;
+	struct disk_throttle_limits	limits;
+	bool				active;
+	/* Tokens in each bucket, negative when in debt */
+	double				level[DISK_THROTTLE_NR];
+	u64				last_ns;
+	struct list_head		queue;
+	int				timerfd;
+	bool				registered;
+	struct thread_pool__job		job;
+	struct disk_throttle_stats	stats;
+};
+
+static DEFINE_MUTEX(throttle_lock);
+static LIST_HEAD(throttles);
+static struct kvm__epoll throttle_epoll;
+static bool throttle_epoll_running;
+
+static u64 disk_throttle__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void disk_throttle__refill(struct disk_throttle *throttle, u64 now)
+{
+	double elapsed = (double)(now - throttle->last_ns) / NSEC_PER_SEC;
+	u64 rate;
+	int i;
+
+	throttle->last_ns = now;
+
+	for (i = 0; i < DISK_THROTTLE_NR; i++) {
+		rate = throttle->limits.rate[i];
+		if (!rate)
+			continue;
+
+		throttle->level[i] = min(throttle->level[i] + rate * elapsed,
+					 (double)rate * throttle->limits.burst);
+	}
+}
+
+/*
+ * Nanoseconds until a request in the given direction may go, 0 if it can go
+ * right away.
+ */
+static u64 disk_throttle__delay(struct disk_throttle *throttle, bool write)
+{
+	int buckets[] = {
+		write ? DISK_THROTTLE_IOPS_WR : DISK_THROTTLE_IOPS_RD,
+		write ? DISK_THROTTLE_BPS_WR : DISK_THROTTLE_BPS_RD,
+	};
+	u64 rate, delay = 0;
+	unsigned int i;
+	int b;
+
+	for (i = 0; i < ARRAY_SIZE(buckets); i++) {
+		b = buckets[i];
+		rate = throttle->limits.rate[b];
+		if (!rate || throttle->level[b] >= 0)
+			continue;
+
+		delay = max(delay, (u64)(-throttle->level[b] * NSEC_PER_SEC / rate) + 1);
+	}
+
+	return delay;
+}
+
+static void disk_throttle__charge(struct disk_throttle *throttle, bool write,
+				  size_t len)
+{
+	if (write) {
+		throttle->level[DISK_THROTTLE_IOPS_WR] -= 1;
+		throttle->level[DISK_THROTTLE_BPS_WR] -= len;
+	} else {
+		throttle->level[DISK_THROTTLE_IOPS_RD] -= 1;
+		throttle->level[DISK_THROTTLE_BPS_RD] -= len;
+	}
+}
+
+static void disk_throttle__arm(struct disk_throttle *throttle, u64 delay)
+{
+	struct itimerspec its = {
+		.it_value.tv_sec	= delay / NSEC_PER_SEC,
+		.it_value.tv_nsec	= delay % NSEC_PER_SEC,
+	};
+
+	if (timerfd_settime(throttle->timerfd, 0, &its, NULL) < 0)
+		pr_warning("Failed to arm disk throttle timer: %s",
+			   strerror(errno));
+}
+
+static void disk_throttle__submit(struct disk_throttle *throttle,
+				  struct list_head *reqs)
+{
+	struct disk_throttle_req *req, *next;
+
+	list_for_each_entry_safe(req, next, reqs, list) {
+		list_del(&req->list);
+		if (req->job)
+			thread_pool__do_job(req->job);
+		else
+			disk_image__submit(throttle->disk, req->write,
+					   req->sector, req->iov, req->iovcount,
+					   req->param);
+		free(req);
+	}
+}
+
+static void disk_throttle__dequeue(struct disk_throttle *throttle,
+				   struct disk_throttle_req *req, u64 now,
+				   struct list_head *ready)
+{
+	disk_throttle__charge(throttle, req->write, req->len);
+	throttle->stats.nr_throttled[req->write]++;
+	throttle->stats.wait_ns[req->write] += now - req->queued_ns;
+	throttle->stats.queued--;
+	list_move_tail(&req->list, ready);
+}
+
+/* Submit the requests at the head of the queue that can go */
+static void disk_throttle__run(struct kvm *kvm, void *data)
+{
+	struct disk_throttle *throttle = data;
+	struct disk_throttle_req *req, *next;
+	LIST_HEAD(ready);
+	u64 now, delay = 0;
+
+	mutex_lock(&throttle->mutex);
+	now = disk_throttle__now();
+	disk_throttle__refill(throttle, now);
+
+	list_for_each_entry_safe(req, next, &throttle->queue, list) {
+		delay = disk_throttle__delay(throttle, req->write);
+		if (delay)
+			break;
+
+		disk_throttle__dequeue(throttle, req, now, &ready);
+	}
+
+	if (delay)
+		disk_throttle__arm(throttle, delay);
+	mutex_unlock(&throttle->mutex);
+
+	disk_throttle__submit(throttle, &ready);
+}
+
+static void disk_throttle__handle_event(struct kvm *kvm, struct epoll_event *ev)
+{
+	struct disk_throttle *throttle;
+	u64 expirations;
+
+	/*
+	 * The event may have been fetched before the disk went away, so only
+	 * trust it if the throttle is still registered.
+	 */
+	mutex_lock(&throttle_lock);
+	list_for_each_entry(throttle, &throttles, list) {
+		if (throttle != ev->data.ptr)
+			continue;
+
+		if (read(throttle->timerfd, &expirations,
+			 sizeof(expirations)) > 0)
+			thread_pool__do_job(&throttle->job);
+		break;
+	}
+	mutex_unlock(&throttle_lock);
+}
+
+/* The timer thread is only started once a disk gets a limit */
+static int disk_throttle__start(struct disk_throttle *throttle)
+{
+	struct epoll_event ev = {
+		.events		= EPOLLIN,
+		.data.ptr	= throttle,
+	};
+	int r = 0;
+
+	mutex_lock(&throttle_lock);
+	if (!throttle_epoll_running) {
+		r = epoll__init(throttle->job.kvm, &throttle_epoll,
+				"disk-throttle", disk_throttle__handle_event);
+		if (r < 0)
+			goto out_unlock;
+		throttle_epoll_running = true;
+	}
+
+	if (!throttle->registered) {
+		r = epoll_ctl(throttle_epoll.fd, EPOLL_CTL_ADD,
+			      throttle->timerfd, &ev);
+		if (r < 0) {
+			r = -errno;
+			goto out_unlock;
+		}
+		list_add_tail(&throttle->list, &throttles);
+		throttle->registered = true;
+	}
+out_unlock:
+	mutex_unlock(&throttle_lock);
+
+	return r;
+}
+
+static bool __disk_throttle__queue(struct disk_image *disk,
+				   struct disk_throttle_req *tmpl)
+{
+	struct disk_throttle *throttle = disk->throttle;
+	struct disk_throttle_req *req;
+	bool write = tmpl->write;
+
+	if (!throttle || !throttle->active)
+		return false;
+
+	mutex_lock(&throttle->mutex);
+	if (list_empty(&throttle->queue)) {
+		disk_throttle__refill(throttle, disk_throttle__now());
+		if (!disk_throttle__delay(throttle, write)) {
+			disk_throttle__charge(throttle, write, tmpl->len);
+			mutex_unlock(&throttle->mutex);
+			return false;
+		}
+	}
+
+	req = malloc(sizeof(*req));
+	if (!req) {
+		mutex_unlock(&throttle->mutex);
+		return false;
+	}
+
+	*req = *tmpl;
+	req->queued_ns = disk_throttle__now();
+
+	if (list_empty(&throttle->queue))
+		disk_throttle__arm(throttle, disk_throttle__delay(throttle, write));
+	list_add_tail(&req->list, &throttle->queue);
+	throttle->stats.queued++;
+	mutex_unlock(&throttle->mutex);
+
+	return true;
+}
+
+/*
+ * Returns true if the request was queued, in which case the completion
+ * callback is called once it is eventually submitted.
+ */
+bool disk_throttle__queue(struct disk_image *disk, bool write, u64 sector,
+			  const struct iovec *iov, int iovcount, void *param)
+{
+	struct disk_throttle_req req = {
+		.write		= write,
+		.sector		= sector,
+		.iov		= iov,
+		.iovcount	= iovcount,
+		.param		= param,
+	};
+
+	if (!disk->throttle || !disk->throttle->active)
+		return false;
+
+	req.len = iov_size(iov, iovcount);
+
+	return __disk_throttle__queue(disk, &req);
+}
+
+/*
+ * Returns true if the job, which writes len bytes, was queued. It is then
+ * queued on the thread pool once it can go.
+ */
+bool disk_throttle__queue_job(struct disk_image *disk, size_t len,
+			      struct thread_pool__job *job)
+{
+	struct disk_throttle_req req = {
+		.write		= true,
+		.len		= len,
+		.job		= job,
+	};
+
+	return __disk_throttle__queue(disk, &req);
+}
+
+int disk_throttle__set(struct disk_image *disk,
+		       struct disk_throttle_limits *limits)
+{
+	struct disk_throttle *throttle = disk->throttle;
+	bool active = false;
+	int i, r;
+
+	for (i = 0; i < DISK_THROTTLE_NR; i++)
+		active |= !!limits->rate[i];
+
+	if (active) {
+		r = disk_throttle__start(throttle);
+		if (r < 0)
+			return r;
+	}
+
+	mutex_lock(&throttle->mutex);
+	disk_throttle__refill(throttle, disk_throttle__now());
+	throttle->limits = *limits;
+	if (!throttle->limits.burst)
+		throttle->limits.burst = 1;
+
+	/* Start with full buckets, and forget the debt of the old limits */
+	for (i = 0; i < DISK_THROTTLE_NR; i++)
+		throttle->level[i] = (double)throttle->limits.rate[i] *
+				     throttle->limits.burst;
+	throttle->active = active;
+
+	/* Let the queue go with the new limits */
+	if (!list_empty(&throttle->queue))
+		thread_pool__do_job(&throttle->job);
+	mutex_unlock(&throttle->mutex);
+
+	return 0;
+}
+
+int disk_throttle__init(struct kvm *kvm, struct disk_image *disk,
+			struct disk_throttle_limits *limits)
+{
+	struct disk_throttle *throttle;
+	int r;
+
+	throttle = calloc(1, sizeof(*throttle));
+	if (!throttle)
+		return -ENOMEM;
+
+	mutex_init(&throttle->mutex);
+	INIT_LIST_HEAD(&throttle->queue);
+	thread_pool__init_job(&throttle->job, kvm, disk_throttle__run, throttle);
+	throttle->disk = disk;
+	throttle->last_ns = disk_throttle__now();
+
+	throttle->timerfd = timerfd_create(CLOCK_MONOTONIC,
+					   TFD_CLOEXEC | TFD_NONBLOCK);
+	if (throttle->timerfd < 0) {
+		r = -errno;
+		goto err_free;
+	}
+
+	disk->throttle = throttle;
+
+	r = disk_throttle__set(disk, limits);
+	if (r < 0)
+		goto err_close;
+
+	return 0;
+
+err_close:
+	close(throttle->timerfd);
+err_free:
+	disk->throttle = NULL;
+	free(throttle);
+	return r;
+}
+
+/*
+ * Submit all queued requests regardless of the limits, and wait for a
+ * submission that is already running. The caller stops queueing new ones.
+ */
+void disk_throttle__flush(struct disk_image *disk)
+{
+	struct disk_throttle *throttle = disk->throttle;
+	struct disk_throttle_req *req, *next;
+	LIST_HEAD(ready);
+	u64 now;
+
+	if (!throttle)
+		return;
+
+	mutex_lock(&throttle->mutex);
+	now = disk_throttle__now();
+	disk_throttle__refill(throttle, now);
+	list_for_each_entry_safe(req, next, &throttle->queue, list)
+		disk_throttle__dequeue(throttle, req, now, &ready);
+	disk_throttle__arm(throttle, 0);
+	mutex_unlock(&throttle->mutex);
+
+	/* Keep the timer thread from queueing the job meanwhile */
+	mutex_lock(&throttle_lock);
+	thread_pool__cancel_job(&throttle->job);
+	mutex_unlock(&throttle_lock);
+
+	disk_throttle__submit(throttle, &ready);
+}
+
+void disk_throttle__exit(struct disk_image *disk)
+{
+	struct disk_throttle *throttle = disk->throttle;
+	struct disk_throttle_req *req, *next;
+
+	if (!throttle)
+		return;
+
+	/* Once off the list, the timer thread doesn't look at it anymore */
+	mutex_lock(&throttle_lock);
+	if (throttle->registered) {
+		epoll_ctl(throttle_epoll.fd, EPOLL_CTL_DEL, throttle->timerfd,
+			  NULL);
+		list_del(&throttle->list);
+		throttle->registered = false;
+	}
+	mutex_unlock(&throttle_lock);
+
+	close(throttle->timerfd);
+	thread_pool__cancel_job(&throttle->job);
+
+	list_for_each_entry_safe(req, next, &throttle->queue, list) {
+		list_del(&req->list);
+		free(req);
+	}
+
+	disk->throttle = NULL;
+	free(throttle);
+}
+
+static void disk_throttle__handle_ipc(struct kvm *kvm, int fd, u32 type,
+				      u32 len, u8 *msg)
+{
+	struct disk_throttle_cmd_params *params = (void *)msg;
+	struct disk_throttle_stats stats = { .status = -EINVAL };
+	struct disk_throttle *throttle;
+	struct disk_image *disk;
+
+	if (WARN_ON(type != KVM_IPC_DISK_THROTTLE || len != sizeof(*params)))
+		return;
+
+	if (params->disk >= (u32)kvm->nr_disks)
+		goto out;
+
+	disk = kvm->disks[params->disk];
+	throttle = disk ? disk->throttle : NULL;
+	if (!throttle)
+		goto out;
+
+	if (params->set) {
+		stats.status = disk_throttle__set(disk, &params->limits);
+		if (stats.status < 0)
+			goto out;
+	}
+
+	mutex_lock(&throttle->mutex);
+	stats = throttle->stats;
+	stats.limits = throttle->limits;
+	mutex_unlock(&throttle->mutex);
+
+out:
+	if (write_in_full(fd, &stats, sizeof(stats)) < 0)
+		pr_warning("Failed sending disk throttle statistics");
+}
+
+static int disk_throttle__ipc_init(struct kvm *kvm)
+{
+	return kvm_ipc__register_handler(KVM_IPC_DISK_THROTTLE,
+					 disk_throttle__handle_ipc);
+}
+dev_base_init(disk_throttle__ipc_init);
+
+static int disk_throttle__stop(struct kvm *kvm)
+{
+	if (throttle_epoll_running)
+		epoll__exit(&throttle_epoll);
+	throttle_epoll_running = false;
+
+	return 0;
+}
+base_exit(disk_throttle__stop);
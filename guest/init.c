@@ -11,6 +11,22 @@
 #include <sys/wait.h>
 #include <sys/reboot.h>
 
+#if defined(__i386__) || defined(__x86_64__)
+#include <sys/io.h>
+
+/* See include/kvm/boot-trace.h */
+#define BOOT_TRACE_PORT		0x3f0
+#define BOOT_TRACE_MAGIC	0x7b
+
+static void boot_trace(void)
+{
+	if (ioperm(BOOT_TRACE_PORT, 1, 1) == 0)
+		outb(BOOT_TRACE_MAGIC, BOOT_TRACE_PORT);
+}
+#else
+static void boot_trace(void) { }
+#endif
+
 static int run_process(char *filename)
 {
 	char *new_argv[] = { filename, NULL };
@@ -45,6 +61,8 @@ int main(int argc, char *argv[])
 	pid_t child;
 	int status;
 
+	boot_trace();
+
 	puts("Mounting...");
 
 	do_mounts();
@@ -0,0 +1,30 @@
+#ifndef KVM__BOOT_TRACE_H
+#define KVM__BOOT_TRACE_H
+
+#include <linux/types.h>
+
+struct kvm;
+
+/*
+ * The guest tells when its init starts by writing BOOT_TRACE_MAGIC to this
+ * I/O port. It is the floppy controller's, which kvmtool doesn't emulate.
+ */
+#define BOOT_TRACE_PORT		0x3f0
+#define BOOT_TRACE_MAGIC	0x7b
+
+enum boot_trace_event {
+	BOOT_TRACE_START,
+	BOOT_TRACE_KERNEL_LOAD,
+	BOOT_TRACE_KERNEL_LOADED,
+	BOOT_TRACE_VCPU_RUN,
+	BOOT_TRACE_GUEST_INIT,
+	BOOT_TRACE_NR,
+};
+
+void boot_trace__mark(struct kvm *kvm, enum boot_trace_event event);
+
+u64 boot_trace__now(void);
+void boot_trace__span(struct kvm *kvm, const char *name, u64 start_ns);
+void boot_trace__write(struct kvm *kvm);
+
+#endif /* KVM__BOOT_TRACE_H */
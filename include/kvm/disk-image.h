@@ -1,6 +1,7 @@
 #ifndef KVM__DISK_IMAGE_H
 #define KVM__DISK_IMAGE_H
 
+#include "kvm/disk-throttle.h"
 #include "kvm/read-write.h"
 #include "kvm/util.h"
 #include "kvm/parse-options.h"
@@ -19,10 +20,6 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-#ifdef CONFIG_HAS_AIO
-#include <libaio.h>
-#endif
-
 #define SECTOR_SHIFT		9
 #define SECTOR_SIZE		(1UL << SECTOR_SHIFT)
 
@@ -31,9 +28,9 @@ enum {
 	DISK_IMAGE_MMAP,
 };
 
-#define MAX_DISK_IMAGES         4
-
 struct disk_image;
+struct disk_aio;
+struct thread_pool__job;
 
 struct disk_image_operations {
 	ssize_t (*read)(struct disk_image *disk, u64 sector, const struct iovec *iov,
@@ -41,6 +38,9 @@ struct disk_image_operations {
 	ssize_t (*write)(struct disk_image *disk, u64 sector, const struct iovec *iov,
 			int iovcount, void *param);
 	int (*flush)(struct disk_image *disk);
+	int (*discard)(struct disk_image *disk, u64 sector, u64 nr_sectors);
+	int (*write_zeroes)(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			    bool unmap);
 	int (*wait)(struct disk_image *disk);
 	int (*close)(struct disk_image *disk);
 	bool async;
@@ -52,6 +52,20 @@ struct disk_image_params {
 	const char *wwpn;
 	bool readonly;
 	bool direct;
+	/* Send writes to a disposable overlay, bounded to this many MB */
+	bool overlay;
+	u64 overlay_max;
+	struct disk_throttle_limits throttle;
+};
+
+/* KVM_IPC_DISK_STAT request is the index of the disk, answered with this */
+struct disk_image_stats {
+	s32 status;
+	u32 nr_disks;
+	u64 size;
+	/* Bytes in the overlay, and how many it may hold; 0 without one */
+	u64 overlay_used;
+	u64 overlay_max;
 };
 
 struct disk_image {
@@ -63,30 +77,58 @@ struct disk_image {
 	void				(*disk_req_cb)(void *param, long len);
 	bool				readonly;
 	bool				async;
+	/* Unit in which the image can release space, in sectors */
+	u32				discard_granularity;
+	/* Logical and physical block sizes, in bytes */
+	u32				blk_size;
+	u32				phys_blk_size;
+	/* With O_DIRECT, alignment of the buffers */
+	bool				direct;
+	u32				dio_align;
 #ifdef CONFIG_HAS_AIO
-	io_context_t			ctx;
-	int				evt;
-	pthread_t			thread;
-	u64				aio_inflight;
+	struct disk_aio			*aio;
 #endif /* CONFIG_HAS_AIO */
 	const char			*wwpn;
 	int				debug_iodelay;
+	struct disk_throttle		*throttle;
 };
 
 int disk_img_name_parser(const struct option *opt, const char *arg, int unset);
 int disk_image__init(struct kvm *kvm);
 int disk_image__exit(struct kvm *kvm);
 struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operations *ops, int mmap);
+struct disk_image *disk_image__open(const char *filename, bool readonly, bool direct);
+struct disk_image *disk_image__open_backing(const char *filename, int depth);
+int disk_image__close(struct disk_image *disk);
 int disk_image__flush(struct disk_image *disk);
 int disk_image__wait(struct disk_image *disk);
+bool disk_image__can_discard(struct disk_image *disk);
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors);
+int disk_image__write_zeroes(struct disk_image *disk, u64 sector,
+			     u64 nr_sectors, bool unmap);
+void disk_image__queue_job(struct disk_image *disk, size_t len,
+			   struct thread_pool__job *job);
 ssize_t disk_image__read(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
 ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
+ssize_t disk_image__submit(struct disk_image *disk, bool write, u64 sector,
+			   const struct iovec *iov, int iovcount, void *param);
+ssize_t disk_image__read_sync(struct disk_image *disk, u64 sector,
+			      const struct iovec *iov, int iovcount);
 ssize_t disk_image__get_serial(struct disk_image *disk, struct iovec *iov,
 			       int iovcount, ssize_t len);
 
-struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly);
+int disk_image__direct_init(struct disk_image *disk);
+bool disk_image__direct_aligned(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount);
+ssize_t disk_image__direct_rw(struct disk_image *disk, bool write, u64 sector,
+			      const struct iovec *iov, int iovcount);
+
+struct disk_image *raw_image__probe(int fd, const char *filename,
+				    struct stat *st, bool readonly);
+int raw_image__set_overlay(struct disk_image *disk, u64 max_mb);
+int raw_image__overlay_stats(struct disk_image *disk, u64 *used, u64 *max);
 struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *st);
 
 ssize_t raw_image__read_sync(struct disk_image *disk, u64 sector,
@@ -103,6 +145,8 @@ void disk_image__set_callback(struct disk_image *disk, void (*disk_req_cb)(void
 #ifdef CONFIG_HAS_AIO
 int disk_aio_setup(struct disk_image *disk);
 void disk_aio_destroy(struct disk_image *disk);
+ssize_t disk_aio_read(struct disk_image *disk, int fd, u64 sector,
+		      const struct iovec *iov, int iovcount, void *param);
 ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
 			      const struct iovec *iov, int iovcount, void *param);
 ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
@@ -122,6 +166,13 @@ static inline void disk_aio_destroy(struct disk_image *disk)
 {
 }
 
+static inline ssize_t disk_aio_read(struct disk_image *disk, int fd,
+				    u64 sector, const struct iovec *iov,
+				    int iovcount, void *param)
+{
+	return preadv_in_full(fd, iov, iovcount, sector << SECTOR_SHIFT);
+}
+
 static inline int raw_image__wait(struct disk_image *disk)
 {
 	return 0;
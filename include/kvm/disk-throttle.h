@@ -0,0 +1,53 @@
+#ifndef KVM__DISK_THROTTLE_H
+#define KVM__DISK_THROTTLE_H
+
+#include <linux/types.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+struct disk_image;
+struct kvm;
+struct thread_pool__job;
+
+enum {
+	DISK_THROTTLE_IOPS_RD,
+	DISK_THROTTLE_IOPS_WR,
+	DISK_THROTTLE_BPS_RD,
+	DISK_THROTTLE_BPS_WR,
+	DISK_THROTTLE_NR,
+};
+
+/* A rate of 0 means no limit. burst is in seconds worth of the rate. */
+struct disk_throttle_limits {
+	u64 rate[DISK_THROTTLE_NR];
+	u32 burst;
+};
+
+/* KVM_IPC_DISK_THROTTLE request, answered with struct disk_throttle_stats */
+struct disk_throttle_cmd_params {
+	u32 disk;
+	u32 set;
+	struct disk_throttle_limits limits;
+};
+
+struct disk_throttle_stats {
+	s32 status;
+	u32 queued;
+	struct disk_throttle_limits limits;
+	/* Requests that had to wait, and how long they waited, per direction */
+	u64 nr_throttled[2];
+	u64 wait_ns[2];
+};
+
+int disk_throttle__init(struct kvm *kvm, struct disk_image *disk,
+			struct disk_throttle_limits *limits);
+void disk_throttle__exit(struct disk_image *disk);
+void disk_throttle__flush(struct disk_image *disk);
+int disk_throttle__set(struct disk_image *disk,
+		       struct disk_throttle_limits *limits);
+bool disk_throttle__queue(struct disk_image *disk, bool write, u64 sector,
+			  const struct iovec *iov, int iovcount, void *param);
+bool disk_throttle__queue_job(struct disk_image *disk, size_t len,
+			      struct thread_pool__job *job);
+
+#endif /* KVM__DISK_THROTTLE_H */
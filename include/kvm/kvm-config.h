@@ -21,7 +21,7 @@
 
 struct kvm_config {
 	struct kvm_config_arch arch;
-	struct disk_image_params disk_image[MAX_DISK_IMAGES];
+	struct disk_image_params *disk_image;
 	struct vfio_device_params *vfio_devices;
 	u64 ram_addr;		/* Guest memory physical base address, in bytes */
 	u64 ram_size;		/* Guest memory size, in bytes */
@@ -40,6 +40,9 @@ struct kvm_config {
 	const char *firmware_filename;
 	const char *flash_filename;
 	const char *console;
+	const char *console_overflow;
+	const char *console_log;
+	int console_log_size;
 	const char *dev;
 	const char *network;
 	const char *host_ip;
@@ -50,6 +53,7 @@ struct kvm_config {
 	const char *guest_name;
 	const char *sandbox;
 	const char *hugetlbfs_path;
+	const char *threadpool_affinity;
 	const char *custom_rootfs_name;
 	const char *real_cmdline;
 	struct virtio_net_params *net_params;
@@ -64,6 +68,8 @@ struct kvm_config {
 	bool no_dhcp;
 	bool ioport_debug;
 	bool mmio_debug;
+	bool boot_trace;
+	const char *startup_trace;
 	int virtio_transport;
 };
 
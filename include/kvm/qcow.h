@@ -2,11 +2,13 @@
 #define KVM__QCOW_H
 
 #include "kvm/mutex.h"
+#include "kvm/threadpool.h"
 
 #include <linux/types.h>
 #include <stdbool.h>
 #include <linux/rbtree.h>
 #include <linux/list.h>
+#include <pthread.h>
 
 #define QCOW_MAGIC		(('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
 
@@ -71,6 +73,48 @@ struct qcow_header {
 	u8				l2_bits;
 	u64				refcount_table_offset;
 	u32				refcount_table_size;
+	u64				backing_file_offset;
+	u32				backing_file_size;
+};
+
+#define QCOW_MAX_PENDING_FREES	256
+#define QCOW_INFLATE_CACHE_SIZE	(16 << 20)
+#define QCOW_INFLATE_CACHE_MIN	8
+#define QCOW_MAX_BACKING_DEPTH	16
+#define QCOW_INFLATE_JOBS	4
+
+struct qcow;
+
+struct qcow_inflated {
+	struct qcow			*q;
+	u64				offset;	/* of the compressed data */
+	u32				len;
+	struct rb_node			node;
+	struct list_head		list;
+	int				refcount;
+	int				state;
+	/* Claimed by a reader or a prefetch job, off inflate_queue */
+	bool				started;
+	struct list_head		queue;
+	u8				data[];
+};
+
+/* Host clusters to release on the next metadata flush */
+struct qcow_free_extent {
+	u64				offset;
+	u64				size;
+};
+
+/* Guest cluster being copied on write */
+struct qcow_cluster_alloc {
+	u64				offset;
+	struct list_head		list;
+};
+
+/* A host cluster with data I/O in flight, which can't be released yet */
+struct qcow_cluster_pin {
+	u64				offset;
+	struct list_head		list;
 };
 
 struct qcow {
@@ -85,9 +129,29 @@ struct qcow {
 	u64				cluster_size;
 	u64				cluster_offset_mask;
 	u64				free_clust_idx;
-	void				*cluster_cache;
-	void				*cluster_data;
-	void				*copy_buff;
+	struct disk_image		*backing;
+
+	/* Decompressed clusters, see qcow_get_inflated() */
+	struct mutex			inflate_lock;
+	pthread_cond_t			inflate_cond;
+	struct rb_root			inflate_root;
+	struct list_head		inflate_lru;
+	int				nr_inflated;
+	int				max_inflated;
+	/* Prefetched clusters waiting for the inflate jobs */
+	struct list_head		inflate_queue;
+	struct thread_pool__job		inflate_jobs[QCOW_INFLATE_JOBS];
+	unsigned int			next_inflate_job;
+	/* Reads have met a compressed cluster, so prefetching may pay */
+	bool				has_compressed;
+
+	/* Copy-on-write allocations in flight, and their waiters */
+	struct list_head		allocs;
+	pthread_cond_t			alloc_cond;
+	struct list_head		pins;
+
+	struct qcow_free_extent		pending_frees[QCOW_MAX_PENDING_FREES];
+	u32				nr_pending_frees;
 };
 
 struct qcow1_header_disk {
@@ -128,6 +192,7 @@ struct qcow2_header_disk {
 	u64				snapshots_offset;
 };
 
-struct disk_image *qcow_probe(int fd, bool readonly);
+struct disk_image *qcow_probe(int fd, const char *filename, bool readonly,
+			      int depth);
 
 #endif /* KVM__QCOW_H */
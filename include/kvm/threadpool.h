@@ -1,8 +1,6 @@
 #ifndef KVM__THREADPOOL_H
 #define KVM__THREADPOOL_H
 
-#include "kvm/mutex.h"
-
 #include <linux/list.h>
 
 struct kvm;
@@ -15,7 +13,7 @@ struct thread_pool__job {
 	void				*data;
 
 	int				signalcount;
-	struct mutex			mutex;
+	int				worker;
 
 	struct list_head		queue;
 };
@@ -26,7 +24,7 @@ static inline void thread_pool__init_job(struct thread_pool__job *job, struct kv
 		.kvm		= kvm,
 		.callback	= callback,
 		.data		= data,
-		.mutex		= MUTEX_INITIALIZER,
+		.worker		= -1,
 	};
 	INIT_LIST_HEAD(&job->queue);
 }
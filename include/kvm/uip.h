@@ -7,12 +7,11 @@
 #include <netinet/in.h>
 #include <sys/uio.h>
 
-#define UIP_BUF_STATUS_FREE	0
-#define UIP_BUF_STATUS_INUSE	1
-#define UIP_BUF_STATUS_USED	2
+#define UIP_ETH_MTU		1500
 
 #define UIP_ETH_P_IP		0X0800
 #define UIP_ETH_P_ARP		0X0806
+#define UIP_ETH_P_IPV6		0X86DD
 
 #define UIP_IP_VER_4		0X40
 #define UIP_IP_HDR_LEN		0X05
@@ -20,6 +19,27 @@
 #define UIP_IP_P_UDP		0X11
 #define UIP_IP_P_TCP		0X06
 #define UIP_IP_P_ICMP		0X01
+#define UIP_IP_P_ICMPV6		0X3A
+
+#define UIP_IP6_VER		0X60
+#define UIP_IP6_HOP_LIMIT	0XFF
+#define UIP_IP6_PREFIX		"fd00:6b76:6d00::"
+#define UIP_IP6_PREFIX_LEN	64
+
+#define UIP_ICMP6_ECHO_REQUEST		128
+#define UIP_ICMP6_ECHO_REPLY		129
+#define UIP_ICMP6_ROUTER_SOLICIT	133
+#define UIP_ICMP6_ROUTER_ADVERT		134
+#define UIP_ICMP6_NEIGH_SOLICIT		135
+#define UIP_ICMP6_NEIGH_ADVERT		136
+
+#define UIP_NDP_OPT_SRC_LLADDR		1
+#define UIP_NDP_OPT_TGT_LLADDR		2
+#define UIP_NDP_OPT_PREFIX_INFO		3
+#define UIP_NDP_OPT_MTU			5
+#define UIP_NDP_OPT_RDNSS		25
+#define UIP_NDP_ROUTER_LIFETIME		1800
+#define UIP_NDP_PREFIX_LIFETIME		86400
 
 #define UIP_TCP_HDR_LEN		0x50
 #define UIP_TCP_WIN_SIZE	14600
@@ -29,6 +49,9 @@
 #define UIP_TCP_FLAG_PSH	8
 #define UIP_TCP_FLAG_ACK	16
 #define UIP_TCP_FLAG_URG	32
+#define UIP_TCP_HASH_SIZE	1024
+#define UIP_TCP_MSS		(UIP_ETH_MTU - 20 - 20)
+#define UIP_TCP6_MSS		(UIP_ETH_MTU - 40 - 20)
 
 #define UIP_BOOTP_VENDOR_SPECIFIC_LEN	64
 #define UIP_BOOTP_MAX_PAYLOAD_LEN	300
@@ -155,6 +178,62 @@ struct uip_tcp {
 	u16 urgent;
 } __attribute__((packed));
 
+struct uip_ip6 {
+	struct uip_eth eth;
+	/*
+	 * version, traffic class and flow label
+	 */
+	u32 vtcflow;
+	/*
+	 * plen = IP payload, without this header
+	 */
+	u16 plen;
+	u8 nxt;
+	u8 hlim;
+	struct in6_addr sip;
+	struct in6_addr dip;
+} __attribute__((packed));
+
+struct uip_icmp6 {
+	struct uip_ip6 ip6;
+	u8 type;
+	u8 code;
+	u16 csum;
+	u8 data[0];
+} __attribute__((packed));
+
+/*
+ * The TCP header alone, as it follows either IP header
+ */
+struct uip_tcp_hdr {
+	u16 sport;
+	u16 dport;
+	u32 seq;
+	u32 ack;
+	u8  off;
+	u8  flg;
+	u16 win;
+	u16 csum;
+	u16 urgent;
+} __attribute__((packed));
+
+struct uip_tcp6 {
+	/*
+	 * FIXME: IPv6 extension headers are not supported
+	 */
+	struct uip_ip6 ip6;
+	struct uip_tcp_hdr tcp;
+} __attribute__((packed));
+
+struct uip_udp6 {
+	struct uip_ip6 ip6;
+	u16 sport;
+	u16 dport;
+	u16 len;
+	u16 csum;
+	u8 payload[0];
+} __attribute__((packed));
+
 struct uip_pseudo_hdr {
 	u32 sip;
 	u32 dip;
@@ -184,58 +263,114 @@ struct uip_dhcp {
 	u8 option[UIP_DHCP_OPTION_LEN];
 } __attribute__((packed));
 
+struct uip_buf_slot {
+	u32 seq;
+	struct uip_buf *buf;
+};
+
+/*
+ * Bounded ring of buffers that producers and consumers access without
+ * locking. The lock and condition are only used to sleep on an empty ring.
+ */
+struct uip_buf_ring {
+	struct uip_buf_slot *slots;
+	u32 mask;
+	u32 head;
+	u32 tail;
+	int waiters;
+	struct mutex lock;
+	pthread_cond_t cond;
+};
+
 struct uip_info {
 	struct list_head udp_socket_head;
-	struct list_head tcp_socket_head;
+	struct hlist_head tcp_socket_hash[UIP_TCP_HASH_SIZE];
+	struct list_head tcp_pending_head;
 	struct mutex udp_socket_lock;
 	struct mutex tcp_socket_lock;
 	struct uip_eth_addr guest_mac;
 	struct uip_eth_addr host_mac;
-	pthread_cond_t buf_free_cond;
-	pthread_cond_t buf_used_cond;
-	struct list_head buf_head;
-	struct mutex buf_lock;
+	struct uip_buf_ring buf_free;
+	struct uip_buf_ring buf_used;
+	struct uip_buf *bufs;
+	u8 *buf_mem;
 	pthread_t udp_thread;
 	u8 *udp_buf;
 	int udp_epollfd;
-	int buf_free_nr;
-	int buf_used_nr;
+	pthread_t tcp_thread;
+	int tcp_epollfd;
+	int tcp_eventfd;
 	u32 guest_ip;
 	u32 guest_netmask;
 	u32 host_ip;
+	/*
+	 * The host routes the ULA prefix and answers on prefix::1 and on
+	 * its link-local address, the guest configures itself with SLAAC
+	 */
+	struct in6_addr prefix6;
+	struct in6_addr host_ip6;
+	struct in6_addr host_ll6;
 	u32 dns_ip[UIP_DHCP_MAX_DNS_SERVER_NR];
 	char *domain_name;
 	u32 buf_nr;
+	/*
+	 * Largest ethernet frame a buffer holds: 64KB when the guest takes
+	 * GSO packets, one MTU otherwise
+	 */
+	u32 buf_size;
+	bool guest_gso;
+	/* Which TCP segments the guest takes unsegmented */
+	bool guest_tso4;
+	bool guest_tso6;
+	/*
+	 * The guest accepts packets flagged with a valid checksum, so TCP and
+	 * UDP checksums towards it are skipped
+	 */
+	bool guest_csum;
+	u16 vnet_endian;
 	u32 vnet_hdr_len;
 };
 
 struct uip_buf {
-	struct list_head list;
 	struct uip_info *info;
 	int vnet_len;
 	int eth_len;
-	int status;
 	unsigned char *vnet;
 	unsigned char *eth;
 	int id;
 };
 
 struct uip_udp_socket {
-	struct sockaddr_in addr;
+	union {
+		struct sockaddr_in addr;
+		struct sockaddr_in6 addr6;
+	};
 	struct list_head list;
 	struct mutex *lock;
 	u32 dport, sport;
 	u32 dip, sip;
+	struct in6_addr dip6, sip6;
+	bool ipv6;
 	int fd;
 };
 
 struct uip_tcp_socket {
-	struct sockaddr_in addr;
-	struct list_head list;
+	union {
+		struct sockaddr_in addr;
+		struct sockaddr_in6 addr6;
+	};
+	struct hlist_node node;
+	/*
+	 * Queued for the event thread, to tear the socket down or to start
+	 * reading again once the guest opened its window
+	 */
+	struct list_head pending;
 	struct uip_info *info;
-	pthread_cond_t	cond;
 	struct mutex *lock;
-	pthread_t thread;
+	int refcnt;
+	bool connected;
+	bool stalled;
+	bool dead;
 	u32 dport, sport;
 	u32 guest_acked;
 	u16 window_size;
@@ -249,8 +384,9 @@ struct uip_tcp_socket {
 	int write_done;
 	int read_done;
 	u32 dip, sip;
+	struct in6_addr dip6, sip6;
+	bool ipv6;
 	u8 *payload;
-	u8 *buf;
 	int fd;
 };
 
@@ -316,6 +452,11 @@ static inline bool uip_tcp_is_fin(struct uip_tcp *tcp)
 	return (tcp->flg & UIP_TCP_FLAG_FIN) != 0;
 }
 
+static inline bool uip_tcp_is_rst(struct uip_tcp *tcp)
+{
+	return (tcp->flg & UIP_TCP_FLAG_RST) != 0;
+}
+
 static inline u32 uip_tcp_isn(struct uip_tcp *tcp)
 {
 	return ntohl(tcp->seq);
@@ -329,6 +470,36 @@ static inline u32 uip_tcp_isn_alloc(void)
 	return 10000000;
 }
 
+static inline u16 uip_ip6_len(struct uip_ip6 *ip6)
+{
+	return ntohs(ip6->plen);
+}
+
+static inline u16 uip_udp6_len(struct uip_udp6 *udp6)
+{
+	return ntohs(udp6->len);
+}
+
+static inline u16 uip_tcp6_len(struct uip_tcp6 *tcp6)
+{
+	return uip_ip6_len(&tcp6->ip6);
+}
+
+static inline u16 uip_tcp6_hdrlen(struct uip_tcp6 *tcp6)
+{
+	return (tcp6->tcp.off >> 4) * 4;
+}
+
+static inline u16 uip_tcp6_payloadlen(struct uip_tcp6 *tcp6)
+{
+	return uip_tcp6_len(tcp6) - uip_tcp6_hdrlen(tcp6);
+}
+
+static inline u8 *uip_tcp6_payload(struct uip_tcp6 *tcp6)
+{
+	return (u8 *)&tcp6->tcp + uip_tcp6_hdrlen(tcp6);
+}
+
 static inline u16 uip_eth_hdrlen(struct uip_eth *eth)
 {
 	return sizeof(*eth);
@@ -347,13 +518,30 @@ int uip_tx_do_ipv4_icmp(struct uip_tx_arg *arg);
 int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg);
 int uip_tx_do_ipv4_udp(struct uip_tx_arg *arg);
 int uip_tx_do_ipv4(struct uip_tx_arg *arg);
+int uip_tx_do_ipv6_icmp(struct uip_tx_arg *arg);
+int uip_tx_do_ipv6_tcp(struct uip_tx_arg *arg);
+int uip_tx_do_ipv6_udp(struct uip_tx_arg *arg);
+int uip_tx_do_ipv6(struct uip_tx_arg *arg);
+void uip_ip6_init(struct uip_info *info);
+bool uip_ip6_is_host(struct uip_info *info, struct in6_addr *addr);
 int uip_tx_do_arp(struct uip_tx_arg *arg);
 
 u16 uip_csum_icmp(struct uip_icmp *icmp);
 u16 uip_csum_udp(struct uip_udp *udp);
+u16 uip_csum_udp_partial(struct uip_udp *udp);
 u16 uip_csum_tcp(struct uip_tcp *tcp);
+u16 uip_csum_tcp_partial(struct uip_tcp *tcp);
+u16 uip_csum_icmp6(struct uip_icmp6 *icmp6);
+u16 uip_csum_udp6(struct uip_udp6 *udp6);
+u16 uip_csum_udp6_partial(struct uip_udp6 *udp6);
+u16 uip_csum_tcp6(struct uip_tcp6 *tcp6);
+u16 uip_csum_tcp6_partial(struct uip_tcp6 *tcp6);
 u16 uip_csum_ip(struct uip_ip *ip);
+u16 uip_csum_replace2(u16 csum, u16 from, u16 to);
+u16 uip_csum_replace4(u16 csum, u32 from, u32 to);
 
+int uip_buf_ring_init(struct uip_buf_ring *ring, u32 nr);
+void uip_buf_ring_exit(struct uip_buf_ring *ring);
 struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf);
 struct uip_buf *uip_buf_set_free(struct uip_info *info, struct uip_buf *buf);
 struct uip_buf *uip_buf_get_used(struct uip_info *info);
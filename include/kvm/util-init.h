@@ -7,6 +7,8 @@ struct init_item {
 	struct hlist_node n;
 	const char *fn_name;
 	int (*init)(struct kvm *);
+	/* Doesn't depend on the other callbacks of its level */
+	bool parallel;
 };
 
 int init_list__init(struct kvm *kvm);
@@ -25,6 +27,18 @@ static void __attribute__ ((constructor)) __init__##cb(void)		\
 	init_list_add(&t, cb, l, name);					\
 }
 
+/*
+ * Parallel callbacks run in their own thread, concurrently with the other
+ * callbacks of the same level. The level is over when they all returned.
+ */
+#define __init_list_add_parallel(cb, l)					\
+static void __attribute__ ((constructor)) __init__##cb(void)		\
+{									\
+	static char name[] = #cb;					\
+	static struct init_item t = { .parallel = true };		\
+	init_list_add(&t, cb, l, name);					\
+}
+
 #define __exit_list_add(cb, l)						\
 static void __attribute__ ((constructor)) __init__##cb(void)		\
 {									\
@@ -41,6 +55,14 @@ static void __attribute__ ((constructor)) __init__##cb(void)		\
 #define firmware_init(cb) __init_list_add(cb, 7)
 #define late_init(cb) __init_list_add(cb, 9)
 
+#define core_init_parallel(cb) __init_list_add_parallel(cb, 0)
+#define base_init_parallel(cb) __init_list_add_parallel(cb, 2)
+#define dev_base_init_parallel(cb) __init_list_add_parallel(cb, 4)
+#define dev_init_parallel(cb) __init_list_add_parallel(cb, 5)
+#define virtio_dev_init_parallel(cb) __init_list_add_parallel(cb, 6)
+#define firmware_init_parallel(cb) __init_list_add_parallel(cb, 7)
+#define late_init_parallel(cb) __init_list_add_parallel(cb, 9)
+
 #define core_exit(cb) __exit_list_add(cb, 0)
 #define base_exit(cb) __exit_list_add(cb, 2)
 #define dev_base_exit(cb) __exit_list_add(cb, 4)
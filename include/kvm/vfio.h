@@ -7,6 +7,8 @@
 
 #include <linux/vfio.h>
 
+struct kvm_cpu;
+
 #define vfio_dev_err(vdev, fmt, ...) \
 	pr_err("%s: " fmt, (vdev)->params->name, ##__VA_ARGS__)
 #define vfio_dev_warn(vdev, fmt, ...) \
@@ -43,7 +45,9 @@ struct vfio_pci_msi_entry {
 struct vfio_pci_msix_table {
 	size_t				size;
 	unsigned int			bar;
+	u32				bar_offset; /* in the BAR, if mappable */
 	u32				guest_phys_addr;
+	bool				mappable; /* rest of the BAR is mmapped */
 };
 
 struct vfio_pci_msix_pba {
@@ -81,6 +85,10 @@ struct vfio_pci_device {
 	struct vfio_pci_msi_common	msix;
 	struct vfio_pci_msix_table	msix_table;
 	struct vfio_pci_msix_pba	msix_pba;
+
+	/* Number of trapped accesses to the MSI-X table and PBA */
+	u64				msix_table_exits;
+	u64				msix_pba_exits;
 };
 
 struct vfio_region {
@@ -123,6 +131,8 @@ int vfio_device_parser(const struct option *opt, const char *arg, int unset);
 int vfio_map_region(struct kvm *kvm, struct vfio_device *vdev,
 		    struct vfio_region *region);
 void vfio_unmap_region(struct kvm *kvm, struct vfio_region *region);
+void vfio_mmio_access(struct kvm_cpu *vcpu, u64 addr, u8 *data, u32 len,
+		      u8 is_write, void *ptr);
 int vfio_pci_setup_device(struct kvm *kvm, struct vfio_device *device);
 void vfio_pci_teardown_device(struct kvm *kvm, struct vfio_device *vdev);
 
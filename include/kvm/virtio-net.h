@@ -12,6 +12,8 @@ struct virtio_net_params {
 	const char *downscript;
 	const char *trans;
 	const char *tapif;
+	const char *xdpif;
+	const char *cpus;
 	char guest_mac[6];
 	char host_mac[6];
 	struct kvm *kvm;
@@ -19,6 +21,8 @@ struct virtio_net_params {
 	int vhost;
 	int fd;
 	int mq;
+	int xdp_queue;
+	int busy_poll;
 };
 
 int virtio_net__init(struct kvm *kvm);
@@ -27,7 +31,8 @@ int netdev_parser(const struct option *opt, const char *arg, int unset);
 
 enum {
 	NET_MODE_USER,
-	NET_MODE_TAP
+	NET_MODE_TAP,
+	NET_MODE_XDP
 };
 
 #endif /* KVM__VIRTIO_NET_H */
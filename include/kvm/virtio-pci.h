@@ -56,6 +56,11 @@ struct virtio_pci {
 	u64			msix_pba;
 	struct msix_table	msix_table[VIRTIO_PCI_MAX_VQ + VIRTIO_PCI_MAX_CONFIG];
 
+	/* Eventfds bound to the GSIs above, signalled instead of an ioctl */
+	int			config_irqfd;
+	int			vq_irqfd[VIRTIO_PCI_MAX_VQ];
+	u64			msix_injections[VIRTIO_NR_MSIX];
+
 	/* virtio queue */
 	u16			queue_selector;
 	struct virtio_pci_ioevent_param ioeventfds[VIRTIO_PCI_MAX_VQ];
@@ -90,6 +95,8 @@ static inline u32 virtio_pci__msix_io_addr(struct virtio_pci *vpci)
 }
 
 int virtio_pci__add_msix_route(struct virtio_pci *vpci, u32 vec);
+void virtio_pci__set_config_gsi(struct virtio_pci *vpci, u32 gsi);
+void virtio_pci__set_vq_gsi(struct virtio_pci *vpci, u32 vq, u32 gsi);
 int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 			       u32 vq);
 int virtio_pci_init_vq(struct kvm *kvm, struct virtio_device *vdev, int vq);
@@ -219,7 +219,8 @@ bool virtio_queue_split__should_signal(struct virt_queue *vq);
 u16 virt_queue_split__get_iov(struct virt_queue *vq, struct iovec iov[],
 			u16 *out, u16 *in, struct kvm *kvm);
 u16 virt_queue_split__get_head_iov(struct virt_queue *vq, struct iovec iov[],
-			     u16 *out, u16 *in, u16 head, struct kvm *kvm);
+			     u16 iov_max, u16 *out, u16 *in, u16 head,
+			     struct kvm *kvm);
 u16 virt_queue_split__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 			      struct iovec in_iov[], struct iovec out_iov[],
 			      u16 *in, u16 *out);
@@ -229,7 +230,7 @@ int virtio__get_dev_specific_field(int offset, bool msix, u32 *config_off);
 #define VRING_DESC_F_AVAIL (1 << VRING_PACKED_DESC_F_AVAIL)
 #define VRING_DESC_F_USED (1<< VRING_PACKED_DESC_F_USED)
 
-u16 virt_queue_packed__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm);
+u16 virt_queue_packed__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 iov_max, u16 *out, u16 *in, u16 head, struct kvm *kvm);
 bool virtio_queue_packed__should_signal(struct virt_queue *vq);
 void virt_queue_packed__set_used_elem(struct virt_queue *queue, u32 head, u32 len, u32 sgs);
 
@@ -273,7 +274,8 @@ static inline u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[],
 	if (!vq->is_packed) {
 		head = virt_queue_split__get_iov(vq, iov, out, in, kvm);
 	} else {
-		head = virt_queue_packed__get_head_iov(vq, iov, out, in, vq->last_avail_idx, kvm);
+		head = virt_queue_packed__get_head_iov(vq, iov, vq->packed_vring.num,
+						       out, in, vq->last_avail_idx, kvm);
 		virt_queue_packed__pop(vq, *in + *out);
 	}
 	return head;
@@ -0,0 +1,70 @@
+#ifndef KVM__XDP_H
+#define KVM__XDP_H
+
+#include "linux/types.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define XDP_FRAME_SIZE		4096
+#define XDP_RX_FRAMES		2048
+#define XDP_TX_FRAMES		2048
+#define XDP_NR_FRAMES		(XDP_RX_FRAMES + XDP_TX_FRAMES)
+#define XDP_BATCH		64
+
+/*
+ * One of the four rings shared with the kernel. The producer and consumer
+ * indexes are free running, only the ring size is a power of two.
+ */
+struct xdp_ring {
+	u32			*producer;
+	u32			*consumer;
+	u32			*flags;
+	void			*ring;
+	u32			mask;
+	void			*map;
+	size_t			map_len;
+};
+
+struct xdp_info {
+	const char		*ifname;
+	u32			queue;
+	int			busy_poll;
+	int			vnet_hdr_len;
+
+	int			ifindex;
+	int			fd;
+	int			map_fd;
+	int			prog_fd;
+	/* The program is ours to detach, not another owner's */
+	bool			attached;
+
+	void			*umem;
+	size_t			umem_len;
+
+	struct xdp_ring		fill;
+	struct xdp_ring		comp;
+	struct xdp_ring		rx;
+	struct xdp_ring		tx;
+
+	/* Only touched by the virtio-net RX thread */
+	u32			rx_cons;
+	u32			rx_avail;
+	u32			rx_done;
+
+	/* Only touched by the virtio-net TX thread */
+	u64			*tx_frames;
+	u32			tx_nr_free;
+	u32			tx_prod;
+	u32			tx_pending;
+	u32			comp_cons;
+};
+
+int xdp_init(struct xdp_info *info);
+void xdp_exit(struct xdp_info *info);
+int xdp_rx(struct iovec *iov, u16 in, struct xdp_info *info);
+int xdp_tx(struct iovec *iov, u16 out, struct xdp_info *info);
+void xdp_tx_flush(struct xdp_info *info);
+
+#endif /* KVM__XDP_H */
@@ -1,5 +1,6 @@
 #include "kvm/kvm-cpu.h"
 
+#include "kvm/boot-trace.h"
 #include "kvm/symbol.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
@@ -156,6 +157,9 @@ int kvm_cpu__start(struct kvm_cpu *cpu)
 
 	kvm_cpu__reset_vcpu(cpu);
 
+	if (cpu->cpu_id == 0)
+		boot_trace__mark(cpu->kvm, BOOT_TRACE_VCPU_RUN);
+
 	if (cpu->kvm->cfg.single_step)
 		kvm_cpu__enable_singlestep(cpu);
 
@@ -302,7 +306,7 @@ fail_alloc:
 		free(kvm->cpus[i]);
 	return -ENOMEM;
 }
-base_init(kvm_cpu__init);
+base_init_parallel(kvm_cpu__init);
 
 int kvm_cpu__exit(struct kvm *kvm)
 {
@@ -1,4 +1,5 @@
 #include "kvm/kvm.h"
+#include "kvm/boot-trace.h"
 #include "kvm/read-write.h"
 #include "kvm/util.h"
 #include "kvm/strbuf.h"
@@ -485,9 +486,11 @@ int kvm__init(struct kvm *kvm)
 	kvm__init_ram(kvm);
 
 	if (!kvm->cfg.firmware_filename) {
+		boot_trace__mark(kvm, BOOT_TRACE_KERNEL_LOAD);
 		if (!kvm__load_kernel(kvm, kvm->cfg.kernel_filename,
 				kvm->cfg.initrd_filename, kvm->cfg.real_cmdline))
 			die("unable to load kernel %s", kvm->cfg.kernel_filename);
+		boot_trace__mark(kvm, BOOT_TRACE_KERNEL_LOADED);
 	}
 
 	if (kvm->cfg.firmware_filename) {
@@ -1,7 +1,7 @@
 #include "kvm/kvm.h"
 #include "kvm/kvm-cpu.h"
 #include "kvm/rbtree-interval.h"
-#include "kvm/mutex.h"
+#include "kvm/rwsem.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,7 +15,12 @@
 
 #define mmio_node(n) rb_entry(n, struct mmio_mapping, node)
 
-static DEFINE_MUTEX(mmio_lock);
+/*
+ * Lookups only take the lock for reading, so that vCPUs handling exits on
+ * different devices (e.g. MSI-X table accesses) don't serialize on it.
+ * Registration and removal take it for writing.
+ */
+static DECLARE_RWSEM(mmio_lock);
 
 struct mmio_mapping {
 	struct rb_int_node	node;
@@ -77,16 +82,19 @@ static struct mmio_mapping *mmio_get(struct rb_root *root, u64 phys_addr, u32 le
 {
 	struct mmio_mapping *mmio;
 
-	mutex_lock(&mmio_lock);
+	down_read(&mmio_lock);
 	mmio = mmio_search(root, phys_addr, len);
+	/* A region pending removal is already gone as far as we're concerned */
+	if (mmio && mmio->remove)
+		mmio = NULL;
 	if (mmio)
-		mmio->refcount++;
-	mutex_unlock(&mmio_lock);
+		__sync_fetch_and_add(&mmio->refcount, 1);
+	up_read(&mmio_lock);
 
 	return mmio;
 }
 
-/* Called with mmio_lock held. */
+/* Called with mmio_lock held for writing. */
 static void mmio_deregister(struct kvm *kvm, struct rb_root *root, struct mmio_mapping *mmio)
 {
 	struct kvm_coalesced_mmio_zone zone = (struct kvm_coalesced_mmio_zone) {
@@ -101,11 +109,24 @@ static void mmio_deregister(struct kvm *kvm, struct rb_root *root, struct mmio_m
 
 static void mmio_put(struct kvm *kvm, struct rb_root *root, struct mmio_mapping *mmio)
 {
-	mutex_lock(&mmio_lock);
-	mmio->refcount--;
-	if (mmio->remove && mmio->refcount == 0)
+	bool remove;
+
+	/*
+	 * The read lock keeps kvm__deregister_iotrap() from freeing the node
+	 * under our feet. Once remove is set no new reference can be taken, so
+	 * only the last user sees the count drop to zero. The node then belongs
+	 * to that user: kvm__deregister_iotrap() leaves nodes pending removal
+	 * alone, so it can't be freed between the two lock sections.
+	 */
+	down_read(&mmio_lock);
+	remove = __sync_sub_and_fetch(&mmio->refcount, 1) == 0 && mmio->remove;
+	up_read(&mmio_lock);
+
+	if (remove) {
+		down_write(&mmio_lock);
 		mmio_deregister(kvm, root, mmio);
-	mutex_unlock(&mmio_lock);
+		up_write(&mmio_lock);
+	}
 }
 
 static bool trap_is_mmio(unsigned int flags)
@@ -149,12 +170,12 @@ int kvm__register_iotrap(struct kvm *kvm, u64 phys_addr, u64 phys_addr_len,
 		}
 	}
 
-	mutex_lock(&mmio_lock);
+	down_write(&mmio_lock);
 	if (trap_is_mmio(flags))
 		ret = mmio_insert(&mmio_tree, mmio);
 	else
 		ret = mmio_insert(&pio_tree, mmio);
-	mutex_unlock(&mmio_lock);
+	up_write(&mmio_lock);
 
 	return ret;
 }
@@ -169,10 +190,11 @@ bool kvm__deregister_iotrap(struct kvm *kvm, u64 phys_addr, unsigned int flags)
 	else
 		tree = &pio_tree;
 
-	mutex_lock(&mmio_lock);
+	down_write(&mmio_lock);
 	mmio = mmio_search_single(tree, phys_addr);
-	if (mmio == NULL) {
-		mutex_unlock(&mmio_lock);
+	/* A node pending removal is freed by its last user, in mmio_put() */
+	if (mmio == NULL || mmio->remove) {
+		up_write(&mmio_lock);
 		return false;
 	}
 	/*
@@ -190,7 +212,7 @@ bool kvm__deregister_iotrap(struct kvm *kvm, u64 phys_addr, unsigned int flags)
 		mmio_deregister(kvm, tree, mmio);
 	else
 		mmio->remove = true;
-	mutex_unlock(&mmio_lock);
+	up_write(&mmio_lock);
 
 	return true;
 }
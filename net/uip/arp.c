@@ -8,6 +8,8 @@ int uip_tx_do_arp(struct uip_tx_arg *arg)
 
 	info = arg->info;
 	buf = uip_buf_clone(arg);
+	if (!buf)
+		return -1;
 
 	arp	 = (struct uip_arp *)(arg->eth);
 	arp2	 = (struct uip_arp *)(buf->eth);
@@ -24,6 +26,8 @@ int uip_tx_do_arp(struct uip_tx_arg *arg)
 		arp2->sip = htonl(info->host_ip);
 
 		uip_buf_set_used(info, buf);
+	} else {
+		uip_buf_set_free(info, buf);
 	}
 
 	return 0;
@@ -1,86 +1,162 @@
 #include "kvm/uip.h"
+#include "kvm/barrier.h"
+#include "kvm/util.h"
 
 #include <linux/kernel.h>
 #include <linux/list.h>
 
-struct uip_buf *uip_buf_get_used(struct uip_info *info)
+/*
+ * Buffers travel between two rings: the free ring, from which the uip threads
+ * take buffers to fill, and the used ring, which the virtio-net RX thread
+ * drains into the guest. Each slot carries a sequence number telling whether
+ * it was last written by a producer or read by a consumer, so any number of
+ * threads can push and pop without a lock. Consumers only take the ring lock
+ * to sleep when the ring is empty, and producers only take it to wake them.
+ */
+int uip_buf_ring_init(struct uip_buf_ring *ring, u32 nr)
 {
-	struct uip_buf *buf;
-	bool found = false;
-
-	mutex_lock(&info->buf_lock);
-
-	while (!(info->buf_used_nr > 0))
-		pthread_cond_wait(&info->buf_used_cond, &info->buf_lock.mutex);
-
-	list_for_each_entry(buf, &info->buf_head, list) {
-		if (buf->status == UIP_BUF_STATUS_USED) {
-			/*
-			 * Set status to INUSE immediately to prevent
-			 * someone from using this buf until we free it
-			 */
-			buf->status = UIP_BUF_STATUS_INUSE;
-			info->buf_used_nr--;
-			found = true;
+	u32 i;
+
+	nr = roundup_pow_of_two(nr);
+
+	ring->slots = calloc(nr, sizeof(*ring->slots));
+	if (!ring->slots)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++)
+		ring->slots[i].seq = i;
+
+	ring->mask	= nr - 1;
+	ring->head	= 0;
+	ring->tail	= 0;
+	ring->waiters	= 0;
+
+	return 0;
+}
+
+void uip_buf_ring_exit(struct uip_buf_ring *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+static bool uip_buf_ring_push(struct uip_buf_ring *ring, struct uip_buf *buf)
+{
+	struct uip_buf_slot *slot;
+	u32 pos, seq;
+
+	pos = ring->tail;
+	for (;;) {
+		slot = &ring->slots[pos & ring->mask];
+		seq = *(volatile u32 *)&slot->seq;
+		rmb();
+
+		if ((int)(seq - pos) < 0)
+			return false;
+
+		if (seq == pos &&
+		    __sync_bool_compare_and_swap(&ring->tail, pos, pos + 1))
 			break;
-		}
+
+		pos = *(volatile u32 *)&ring->tail;
 	}
 
-	mutex_unlock(&info->buf_lock);
+	slot->buf = buf;
+	wmb();
+	slot->seq = pos + 1;
 
-	return found ? buf : NULL;
+	return true;
 }
 
-struct uip_buf *uip_buf_get_free(struct uip_info *info)
+static struct uip_buf *uip_buf_ring_pop(struct uip_buf_ring *ring)
 {
+	struct uip_buf_slot *slot;
 	struct uip_buf *buf;
-	bool found = false;
-
-	mutex_lock(&info->buf_lock);
-
-	while (!(info->buf_free_nr > 0))
-		pthread_cond_wait(&info->buf_free_cond, &info->buf_lock.mutex);
-
-	list_for_each_entry(buf, &info->buf_head, list) {
-		if (buf->status == UIP_BUF_STATUS_FREE) {
-			/*
-			 * Set status to INUSE immediately to prevent
-			 * someone from using this buf until we free it
-			 */
-			buf->status = UIP_BUF_STATUS_INUSE;
-			info->buf_free_nr--;
-			found = true;
+	u32 pos, seq;
+
+	pos = ring->head;
+	for (;;) {
+		slot = &ring->slots[pos & ring->mask];
+		seq = *(volatile u32 *)&slot->seq;
+		rmb();
+
+		if ((int)(seq - (pos + 1)) < 0)
+			return NULL;
+
+		if (seq == pos + 1 &&
+		    __sync_bool_compare_and_swap(&ring->head, pos, pos + 1))
 			break;
-		}
+
+		pos = *(volatile u32 *)&ring->head;
 	}
 
-	mutex_unlock(&info->buf_lock);
+	buf = slot->buf;
+	mb();
+	slot->seq = pos + ring->mask + 1;
 
-	return found ? buf : NULL;
+	return buf;
 }
 
-struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf)
+static struct uip_buf *uip_buf_ring_get(struct uip_buf_ring *ring)
 {
-	mutex_lock(&info->buf_lock);
+	struct uip_buf *buf;
 
-	buf->status = UIP_BUF_STATUS_USED;
-	info->buf_used_nr++;
-	pthread_cond_signal(&info->buf_used_cond);
+	buf = uip_buf_ring_pop(ring);
+	if (buf)
+		return buf;
 
-	mutex_unlock(&info->buf_lock);
+	/*
+	 * Sleep until a producer pushes something. Advertising ourselves
+	 * before checking the ring again pairs with the barrier in
+	 * uip_buf_ring_put(), so that the wakeup cannot be missed.
+	 */
+	mutex_lock(&ring->lock);
+	__sync_fetch_and_add(&ring->waiters, 1);
+	while (!(buf = uip_buf_ring_pop(ring)))
+		pthread_cond_wait(&ring->cond, &ring->lock.mutex);
+	__sync_fetch_and_sub(&ring->waiters, 1);
+	mutex_unlock(&ring->lock);
 
 	return buf;
 }
 
-struct uip_buf *uip_buf_set_free(struct uip_info *info, struct uip_buf *buf)
+static void uip_buf_ring_put(struct uip_buf_ring *ring, struct uip_buf *buf)
 {
-	mutex_lock(&info->buf_lock);
+	/* There are never more buffers than slots */
+	if (!uip_buf_ring_push(ring, buf)) {
+		pr_warning("uip: buffer ring overflow");
+		return;
+	}
 
-	buf->status = UIP_BUF_STATUS_FREE;
-	info->buf_free_nr++;
-	pthread_cond_signal(&info->buf_free_cond);
+	mb();
+	if (!ring->waiters)
+		return;
 
-	mutex_unlock(&info->buf_lock);
+	mutex_lock(&ring->lock);
+	pthread_cond_signal(&ring->cond);
+	mutex_unlock(&ring->lock);
+}
+
+struct uip_buf *uip_buf_get_used(struct uip_info *info)
+{
+	return uip_buf_ring_get(&info->buf_used);
+}
+
+struct uip_buf *uip_buf_get_free(struct uip_info *info)
+{
+	return uip_buf_ring_get(&info->buf_free);
+}
+
+struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf)
+{
+	uip_buf_ring_put(&info->buf_used, buf);
+
+	return buf;
+}
+
+struct uip_buf *uip_buf_set_free(struct uip_info *info, struct uip_buf *buf)
+{
+	uip_buf_ring_put(&info->buf_free, buf);
 
 	return buf;
 }
@@ -93,6 +169,12 @@ struct uip_buf *uip_buf_clone(struct uip_tx_arg *arg)
 
 	info = arg->info;
 
+	/*
+	 * The reply has to fit in a buffer
+	 */
+	if ((u32)arg->eth_len > info->buf_size)
+		return NULL;
+
 	/*
 	 * Get buffer from device to guest
 	 */
@@ -81,6 +81,9 @@ int uip_tx(struct iovec *iov, u16 out, struct uip_info *info)
 	case UIP_ETH_P_IP:
 		uip_tx_do_ipv4(&arg);
 		break;
+	case UIP_ETH_P_IPV6:
+		uip_tx_do_ipv6(&arg);
+		break;
 	}
 
 	free(vnet_buf);
@@ -116,77 +119,97 @@ int uip_rx(struct iovec *iov, u16 in, struct uip_info *info)
 void uip_static_init(struct uip_info *info)
 {
 	struct list_head *udp_socket_head;
-	struct list_head *tcp_socket_head;
-	struct list_head *buf_head;
+	int i;
 
 	udp_socket_head	= &info->udp_socket_head;
-	tcp_socket_head	= &info->tcp_socket_head;
-	buf_head	= &info->buf_head;
 
 	INIT_LIST_HEAD(udp_socket_head);
-	INIT_LIST_HEAD(tcp_socket_head);
-	INIT_LIST_HEAD(buf_head);
+	INIT_LIST_HEAD(&info->tcp_pending_head);
+
+	for (i = 0; i < UIP_TCP_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&info->tcp_socket_hash[i]);
 
 	mutex_init(&info->udp_socket_lock);
 	mutex_init(&info->tcp_socket_lock);
-	mutex_init(&info->buf_lock);
+	mutex_init(&info->buf_free.lock);
+	mutex_init(&info->buf_used.lock);
 
-	pthread_cond_init(&info->buf_used_cond, NULL);
-	pthread_cond_init(&info->buf_free_cond, NULL);
-
-	info->buf_used_nr = 0;
+	pthread_cond_init(&info->buf_free.cond, NULL);
+	pthread_cond_init(&info->buf_used.cond, NULL);
 }
 
 int uip_init(struct uip_info *info)
 {
-	struct list_head *buf_head;
 	struct uip_buf *buf;
-	int buf_nr;
-	int i;
+	size_t slot_size;
+	u32 buf_nr;
+	u8 *mem;
+	u32 i;
 
-	buf_head	= &info->buf_head;
 	buf_nr		= info->buf_nr;
 
+	/*
+	 * Without GSO the guest doesn't take frames larger than the MTU, so
+	 * don't waste 64KB per buffer.
+	 */
+	if (info->guest_gso)
+		info->buf_size = 1024*64;
+	else
+		info->buf_size = UIP_ETH_MTU + sizeof(struct uip_eth);
+
+	slot_size	= ALIGN(info->vnet_hdr_len, 8) + ALIGN(info->buf_size, 64);
+
+	info->bufs	= calloc(buf_nr, sizeof(*info->bufs));
+	info->buf_mem	= calloc(buf_nr, slot_size);
+	if (!info->bufs || !info->buf_mem)
+		goto err_free;
+
+	if (uip_buf_ring_init(&info->buf_free, buf_nr) ||
+	    uip_buf_ring_init(&info->buf_used, buf_nr))
+		goto err_free;
+
+	mem = info->buf_mem;
 	for (i = 0; i < buf_nr; i++) {
-		buf = malloc(sizeof(*buf));
-		memset(buf, 0, sizeof(*buf));
+		buf = &info->bufs[i];
 
-		buf->status	= UIP_BUF_STATUS_FREE;
 		buf->info	= info;
 		buf->id		= i;
-		list_add_tail(&buf->list, buf_head);
-	}
+		buf->vnet_len	= info->vnet_hdr_len;
+		buf->vnet	= mem;
+		buf->eth_len	= info->buf_size;
+		buf->eth	= mem + ALIGN(info->vnet_hdr_len, 8);
+		mem		+= slot_size;
 
-	list_for_each_entry(buf, buf_head, list) {
-		buf->vnet_len   = info->vnet_hdr_len;
-		buf->vnet	= malloc(buf->vnet_len);
-		buf->eth_len    = 1024*64 + sizeof(struct uip_pseudo_hdr);
-		buf->eth	= malloc(buf->eth_len);
-
-		memset(buf->vnet, 0, buf->vnet_len);
-		memset(buf->eth, 0, buf->eth_len);
+		uip_buf_set_free(info, buf);
 	}
 
-	info->buf_free_nr = buf_nr;
-
 	uip_dhcp_get_dns(info);
+	uip_ip6_init(info);
 
 	return 0;
+
+err_free:
+	uip_buf_ring_exit(&info->buf_free);
+	uip_buf_ring_exit(&info->buf_used);
+	free(info->buf_mem);
+	free(info->bufs);
+	info->buf_mem = NULL;
+	info->bufs = NULL;
+	return -ENOMEM;
 }
 
 void uip_exit(struct uip_info *info)
 {
-	struct uip_buf *buf, *next;
-
 	uip_udp_exit(info);
 	uip_tcp_exit(info);
 	uip_dhcp_exit(info);
 
-	list_for_each_entry_safe(buf, next, &info->buf_head, list) {
-		free(buf->vnet);
-		free(buf->eth);
-		list_del(&buf->list);
-		free(buf);
-	}
+	uip_buf_ring_exit(&info->buf_free);
+	uip_buf_ring_exit(&info->buf_used);
+	free(info->buf_mem);
+	free(info->bufs);
+	info->buf_mem = NULL;
+	info->bufs = NULL;
+
 	uip_static_init(info);
 }
@@ -1,24 +1,101 @@
 #include "kvm/uip.h"
 
-static u16 uip_csum(u16 csum, u8 *addr, u16 count)
+/*
+ * One's complement sum of 32-bit words into a 64-bit accumulator, so carries
+ * only need folding once at the end. Summing in host byte order gives the
+ * same folded result as summing network order 16-bit words (RFC 1071).
+ */
+static u64 uip_csum_add(u64 sum, const u8 *addr, u32 count)
 {
-	long sum = csum;
+	u32 w[8];
+	u16 last;
+
+	while (count >= sizeof(w)) {
+		memcpy(w, addr, sizeof(w));
+		sum	+= (u64)w[0] + w[1] + w[2] + w[3] +
+			   w[4] + w[5] + w[6] + w[7];
+		addr	+= sizeof(w);
+		count	-= sizeof(w);
+	}
 
-	while (count > 1) {
-		sum	+= *(u16 *)addr;
+	while (count >= 4) {
+		memcpy(w, addr, 4);
+		sum	+= w[0];
+		addr	+= 4;
+		count	-= 4;
+	}
+
+	if (count >= 2) {
+		memcpy(&last, addr, 2);
+		sum	+= last;
 		addr	+= 2;
 		count	-= 2;
 	}
 
-	if (count > 0)
-		sum += *(unsigned char *)addr;
+	/* Odd byte, padded with zero */
+	if (count > 0) {
+		last = 0;
+		memcpy(&last, addr, 1);
+		sum += last;
+	}
 
-	while (sum>>16)
-		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+static u16 uip_csum_fold(u64 sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
 
 	return ~sum;
 }
 
+static u16 uip_csum(u16 csum, u8 *addr, u16 count)
+{
+	return uip_csum_fold(uip_csum_add(csum, addr, count));
+}
+
+/*
+ * Sum of the pseudo header, without building it in the packet
+ */
+static u64 uip_csum_pseudo(struct uip_ip *ip, u16 len)
+{
+	return (u64)ip->sip + ip->dip + htons(ip->proto) + htons(len);
+}
+
+static u64 uip_csum_pseudo6(struct uip_ip6 *ip6, u8 proto, u32 len)
+{
+	u64 sum;
+
+	sum = uip_csum_add(0, (u8 *)&ip6->sip, 2 * sizeof(ip6->sip));
+
+	return sum + htonl(len) + htonl(proto);
+}
+
+/*
+ * Incremental update for a 16-bit word of a checksummed header changing
+ * from 'from' to 'to' (RFC 1624, eqn. 3)
+ */
+u16 uip_csum_replace2(u16 csum, u16 from, u16 to)
+{
+	u32 sum;
+
+	sum = (u16)~csum + (u16)~from + to;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+u16 uip_csum_replace4(u16 csum, u32 from, u32 to)
+{
+	csum = uip_csum_replace2(csum, from >> 16, to >> 16);
+
+	return uip_csum_replace2(csum, from & 0xffff, to & 0xffff);
+}
+
 u16 uip_csum_ip(struct uip_ip *ip)
 {
 	return uip_csum(0, &ip->vhl, uip_ip_hdrlen(ip));
@@ -29,62 +106,87 @@ u16 uip_csum_icmp(struct uip_icmp *icmp)
 	struct uip_ip *ip;
 
 	ip = &icmp->ip;
-	return icmp->csum = uip_csum(0, &icmp->type, htons(ip->len) - uip_ip_hdrlen(ip) - 8); /* icmp header len = 8 */
+	return icmp->csum = uip_csum(0, &icmp->type, uip_ip_len(ip) - uip_ip_hdrlen(ip));
 }
 
 u16 uip_csum_udp(struct uip_udp *udp)
 {
-	struct uip_pseudo_hdr hdr;
-	struct uip_ip *ip;
-	int udp_len;
 	u8 *udp_hdr = (u8 *)udp + offsetof(struct uip_udp, sport);
+	u16 udp_len = uip_udp_len(udp);
+	u64 sum;
 
-	ip	  = &udp->ip;
-
-	hdr.sip   = ip->sip;
-	hdr.dip	  = ip->dip;
-	hdr.zero  = 0;
-	hdr.proto = ip->proto;
-	hdr.len   = udp->len;
-
-	udp_len	  = uip_udp_len(udp);
+	sum = uip_csum_pseudo(&udp->ip, udp_len);
 
-	if (udp_len % 2) {
-		udp_hdr[udp_len] = 0;		/* zero padding */
-		memcpy(udp_hdr + udp_len + 1, &hdr, sizeof(hdr));
-		return uip_csum(0, udp_hdr, udp_len + 1 + sizeof(hdr));
-	} else {
-		memcpy(udp_hdr + udp_len, &hdr, sizeof(hdr));
-		return uip_csum(0, udp_hdr, udp_len + sizeof(hdr));
-	}
+	return uip_csum_fold(uip_csum_add(sum, udp_hdr, udp_len));
+}
 
+u16 uip_csum_udp_partial(struct uip_udp *udp)
+{
+	return ~uip_csum_fold(uip_csum_pseudo(&udp->ip, uip_udp_len(udp)));
 }
 
 u16 uip_csum_tcp(struct uip_tcp *tcp)
 {
-	struct uip_pseudo_hdr hdr;
-	struct uip_ip *ip;
-	u16 tcp_len;
 	u8 *tcp_hdr = (u8 *)tcp + offsetof(struct uip_tcp, sport);
+	u16 tcp_len;
+	u64 sum;
 
-	ip	  = &tcp->ip;
-	tcp_len   = ntohs(ip->len) - uip_ip_hdrlen(ip);
-
-	hdr.sip   = ip->sip;
-	hdr.dip	  = ip->dip;
-	hdr.zero  = 0;
-	hdr.proto = ip->proto;
-	hdr.len   = htons(tcp_len);
+	tcp_len = uip_tcp_len(tcp);
 
 	if (tcp_len > UIP_MAX_TCP_PAYLOAD + 20)
 		pr_warning("tcp_len(%d) is too large", tcp_len);
 
-	if (tcp_len % 2) {
-		tcp_hdr[tcp_len] = 0;		/* zero padding */
-		memcpy(tcp_hdr + tcp_len + 1, &hdr, sizeof(hdr));
-		return uip_csum(0, tcp_hdr, tcp_len + 1 + sizeof(hdr));
-	} else {
-		memcpy(tcp_hdr + tcp_len, &hdr, sizeof(hdr));
-		return uip_csum(0, tcp_hdr, tcp_len + sizeof(hdr));
-	}
+	sum = uip_csum_pseudo(&tcp->ip, tcp_len);
+
+	return uip_csum_fold(uip_csum_add(sum, tcp_hdr, tcp_len));
+}
+
+/*
+ * Pseudo header sum only, for the guest to complete when it segments
+ */
+u16 uip_csum_tcp_partial(struct uip_tcp *tcp)
+{
+	return ~uip_csum_fold(uip_csum_pseudo(&tcp->ip, uip_tcp_len(tcp)));
+}
+
+u16 uip_csum_icmp6(struct uip_icmp6 *icmp6)
+{
+	u16 len = uip_ip6_len(&icmp6->ip6);
+	u64 sum;
+
+	sum = uip_csum_pseudo6(&icmp6->ip6, UIP_IP_P_ICMPV6, len);
+
+	return uip_csum_fold(uip_csum_add(sum, &icmp6->type, len));
+}
+
+u16 uip_csum_udp6(struct uip_udp6 *udp6)
+{
+	u16 len = uip_udp6_len(udp6);
+	u64 sum;
+
+	sum = uip_csum_pseudo6(&udp6->ip6, UIP_IP_P_UDP, len);
+
+	return uip_csum_fold(uip_csum_add(sum, (u8 *)&udp6->sport, len));
+}
+
+u16 uip_csum_udp6_partial(struct uip_udp6 *udp6)
+{
+	return ~uip_csum_fold(uip_csum_pseudo6(&udp6->ip6, UIP_IP_P_UDP,
+					       uip_udp6_len(udp6)));
+}
+
+u16 uip_csum_tcp6(struct uip_tcp6 *tcp6)
+{
+	u16 len = uip_tcp6_len(tcp6);
+	u64 sum;
+
+	sum = uip_csum_pseudo6(&tcp6->ip6, UIP_IP_P_TCP, len);
+
+	return uip_csum_fold(uip_csum_add(sum, (u8 *)&tcp6->tcp, len));
+}
+
+u16 uip_csum_tcp6_partial(struct uip_tcp6 *tcp6)
+{
+	return ~uip_csum_fold(uip_csum_pseudo6(&tcp6->ip6, UIP_IP_P_TCP,
+					       uip_tcp6_len(tcp6)));
 }
@@ -155,6 +155,7 @@ static int uip_dhcp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, s
 
 	uip_dhcp_fill_option(info, dhcp, reply_msg_type);
 
+	sk->ipv6	= false;
 	sk->sip		= htonl(info->guest_ip);
 	sk->dip		= htonl(info->host_ip);
 	sk->sport	= htons(UIP_DHCP_PORT_CLIENT);
@@ -181,6 +182,8 @@ int uip_tx_do_ipv4_udp_dhcp(struct uip_tx_arg *arg)
 		return -1;
 
 	buf = uip_buf_clone(arg);
+	if (!buf)
+		return -1;
 	info = arg->info;
 
 	/*
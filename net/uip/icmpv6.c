@@ -0,0 +1,243 @@
+#include "kvm/uip.h"
+
+#include <arpa/inet.h>
+
+#define UIP_NDP_NA_FLAG_ROUTER		0x80
+#define UIP_NDP_NA_FLAG_SOLICITED	0x40
+#define UIP_NDP_NA_FLAG_OVERRIDE	0x20
+#define UIP_NDP_PREFIX_FLAG_ONLINK	0x80
+#define UIP_NDP_PREFIX_FLAG_AUTO	0x40
+
+/*
+ * Get a buffer with the ethernet and IPv6 headers of an ICMPv6 message
+ * from the host to the guest
+ */
+static struct uip_buf *uip_icmp6_buf(struct uip_info *info, struct in6_addr *sip, struct in6_addr *dip)
+{
+	struct uip_icmp6 *icmp6;
+	struct uip_buf *buf;
+
+	buf		= uip_buf_get_free(info);
+	icmp6		= (struct uip_icmp6 *)buf->eth;
+
+	icmp6->ip6.eth.src	= info->host_mac;
+	icmp6->ip6.eth.dst	= info->guest_mac;
+	icmp6->ip6.eth.type	= htons(UIP_ETH_P_IPV6);
+
+	icmp6->ip6.vtcflow	= htonl(UIP_IP6_VER << 24);
+	icmp6->ip6.nxt		= UIP_IP_P_ICMPV6;
+	icmp6->ip6.hlim		= UIP_IP6_HOP_LIMIT;
+	icmp6->ip6.sip		= *sip;
+	icmp6->ip6.dip		= *dip;
+
+	icmp6->code		= 0;
+	icmp6->csum		= 0;
+
+	return buf;
+}
+
+static void uip_icmp6_send(struct uip_info *info, struct uip_buf *buf, u8 type, u16 len)
+{
+	struct uip_icmp6 *icmp6;
+
+	icmp6		= (struct uip_icmp6 *)buf->eth;
+	icmp6->type	= type;
+	/*
+	 * ICMPv6 header + message body
+	 */
+	icmp6->ip6.plen	= htons(len + 4);
+	icmp6->csum	= uip_csum_icmp6(icmp6);
+
+	buf->vnet_len	= info->vnet_hdr_len;
+	memset(buf->vnet, 0, buf->vnet_len);
+	buf->eth_len	= sizeof(struct uip_ip6) + uip_ip6_len(&icmp6->ip6);
+
+	uip_buf_set_used(info, buf);
+}
+
+static int uip_icmp6_echo(struct uip_tx_arg *arg)
+{
+	struct uip_icmp6 *icmp6, *icmp6_2;
+	struct uip_info *info;
+	struct uip_buf *buf;
+	u16 old, new;
+
+	info		= arg->info;
+	icmp6		= (struct uip_icmp6 *)arg->eth;
+
+	buf		= uip_buf_clone(arg);
+	if (!buf)
+		return -1;
+
+	icmp6_2		= (struct uip_icmp6 *)buf->eth;
+
+	/*
+	 * Answer pings sent to multicast groups from our link-local address
+	 */
+	icmp6_2->ip6.dip	= icmp6->ip6.sip;
+	if (IN6_IS_ADDR_MULTICAST(&icmp6->ip6.dip)) {
+		icmp6_2->ip6.sip	= info->host_ll6;
+		icmp6_2->type		= UIP_ICMP6_ECHO_REPLY;
+		icmp6_2->csum		= 0;
+		icmp6_2->csum		= uip_csum_icmp6(icmp6_2);
+	} else {
+		/*
+		 * Swapping the addresses leaves the pseudo header sum
+		 * unchanged, only the type needs updating
+		 */
+		icmp6_2->ip6.sip	= icmp6->ip6.dip;
+		memcpy(&old, &icmp6_2->type, sizeof(old));
+		icmp6_2->type		= UIP_ICMP6_ECHO_REPLY;
+		memcpy(&new, &icmp6_2->type, sizeof(new));
+		icmp6_2->csum		= uip_csum_replace2(icmp6_2->csum, old, new);
+	}
+	icmp6_2->ip6.hlim	= UIP_IP_TTL;
+
+	uip_buf_set_used(info, buf);
+
+	return 0;
+}
+
+static int uip_icmp6_neigh_solicit(struct uip_tx_arg *arg)
+{
+	struct uip_icmp6 *icmp6, *icmp6_2;
+	struct in6_addr target, src;
+	struct uip_info *info;
+	struct uip_buf *buf;
+	u8 *msg;
+
+	info		= arg->info;
+	icmp6		= (struct uip_icmp6 *)arg->eth;
+
+	if (uip_ip6_len(&icmp6->ip6) < 4 + 4 + sizeof(target))
+		return -1;
+
+	/*
+	 * Only the host lives on the link besides the guest, and duplicate
+	 * address detection from the guest needs no answer
+	 */
+	memcpy(&target, &icmp6->data[4], sizeof(target));
+	src = icmp6->ip6.sip;
+	if (!uip_ip6_is_host(info, &target) || IN6_IS_ADDR_UNSPECIFIED(&src))
+		return 0;
+
+	buf		= uip_icmp6_buf(info, &target, &src);
+	icmp6_2		= (struct uip_icmp6 *)buf->eth;
+	msg		= icmp6_2->data;
+
+	memset(msg, 0, 4);
+	msg[0]		= UIP_NDP_NA_FLAG_ROUTER | UIP_NDP_NA_FLAG_SOLICITED |
+			  UIP_NDP_NA_FLAG_OVERRIDE;
+	memcpy(&msg[4], &target, sizeof(target));
+
+	msg[20]		= UIP_NDP_OPT_TGT_LLADDR;
+	msg[21]		= 1;
+	memcpy(&msg[22], &info->host_mac, sizeof(info->host_mac));
+
+	uip_icmp6_send(info, buf, UIP_ICMP6_NEIGH_ADVERT, 28);
+
+	return 0;
+}
+
+static int uip_icmp6_router_solicit(struct uip_tx_arg *arg)
+{
+	struct uip_icmp6 *icmp6, *icmp6_2;
+	struct in6_addr dst;
+	struct uip_info *info;
+	struct uip_buf *buf;
+	int i = 0;
+	u32 val;
+	u16 val16;
+	u8 *msg;
+
+	info		= arg->info;
+	icmp6		= (struct uip_icmp6 *)arg->eth;
+
+	/*
+	 * Solicitations from the unspecified address get a multicast answer
+	 */
+	dst = icmp6->ip6.sip;
+	if (IN6_IS_ADDR_UNSPECIFIED(&dst))
+		inet_pton(AF_INET6, "ff02::1", &dst);
+
+	buf		= uip_icmp6_buf(info, &info->host_ll6, &dst);
+	icmp6_2		= (struct uip_icmp6 *)buf->eth;
+	msg		= icmp6_2->data;
+
+	/*
+	 * Hop limit, no managed or other configuration: addresses come
+	 * from SLAAC and the DNS server from the RDNSS option below
+	 */
+	msg[i++]	= UIP_IP_TTL;
+	msg[i++]	= 0;
+	val16		= htons(UIP_NDP_ROUTER_LIFETIME);
+	memcpy(&msg[i], &val16, 2);
+	i		+= 2;
+	/*
+	 * Reachable time and retransmission timer: unspecified
+	 */
+	memset(&msg[i], 0, 8);
+	i		+= 8;
+
+	msg[i++]	= UIP_NDP_OPT_SRC_LLADDR;
+	msg[i++]	= 1;
+	memcpy(&msg[i], &info->host_mac, sizeof(info->host_mac));
+	i		+= sizeof(info->host_mac);
+
+	msg[i++]	= UIP_NDP_OPT_MTU;
+	msg[i++]	= 1;
+	memset(&msg[i], 0, 2);
+	i		+= 2;
+	val		= htonl(UIP_ETH_MTU);
+	memcpy(&msg[i], &val, 4);
+	i		+= 4;
+
+	msg[i++]	= UIP_NDP_OPT_PREFIX_INFO;
+	msg[i++]	= 4;
+	msg[i++]	= UIP_IP6_PREFIX_LEN;
+	msg[i++]	= UIP_NDP_PREFIX_FLAG_ONLINK | UIP_NDP_PREFIX_FLAG_AUTO;
+	val		= htonl(UIP_NDP_PREFIX_LIFETIME);
+	memcpy(&msg[i], &val, 4);
+	memcpy(&msg[i + 4], &val, 4);
+	memset(&msg[i + 8], 0, 4);
+	i		+= 12;
+	memcpy(&msg[i], &info->prefix6, sizeof(info->prefix6));
+	i		+= sizeof(info->prefix6);
+
+	/*
+	 * The host forwards DNS queries it receives to its own resolver
+	 */
+	if (info->dns_ip[0]) {
+		msg[i++]	= UIP_NDP_OPT_RDNSS;
+		msg[i++]	= 3;
+		memset(&msg[i], 0, 2);
+		i		+= 2;
+		val		= htonl(UIP_NDP_ROUTER_LIFETIME);
+		memcpy(&msg[i], &val, 4);
+		i		+= 4;
+		memcpy(&msg[i], &info->host_ip6, sizeof(info->host_ip6));
+		i		+= sizeof(info->host_ip6);
+	}
+
+	uip_icmp6_send(info, buf, UIP_ICMP6_ROUTER_ADVERT, i);
+
+	return 0;
+}
+
+int uip_tx_do_ipv6_icmp(struct uip_tx_arg *arg)
+{
+	struct uip_icmp6 *icmp6;
+
+	icmp6 = (struct uip_icmp6 *)arg->eth;
+
+	switch (icmp6->type) {
+	case UIP_ICMP6_ECHO_REQUEST:
+		return uip_icmp6_echo(arg);
+	case UIP_ICMP6_ROUTER_SOLICIT:
+		return uip_icmp6_router_solicit(arg);
+	case UIP_ICMP6_NEIGH_SOLICIT:
+		return uip_icmp6_neigh_solicit(arg);
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,64 @@
+#include "kvm/uip.h"
+
+#include <arpa/inet.h>
+
+void uip_ip6_init(struct uip_info *info)
+{
+	u8 *mac = info->host_mac.addr;
+	u8 *ll = info->host_ll6.s6_addr;
+
+	inet_pton(AF_INET6, UIP_IP6_PREFIX, &info->prefix6);
+
+	info->host_ip6 = info->prefix6;
+	info->host_ip6.s6_addr[15] = 1;
+
+	/*
+	 * fe80::/64, with the modified EUI-64 of the host MAC
+	 */
+	memset(ll, 0, sizeof(info->host_ll6));
+	ll[0]	= 0xfe;
+	ll[1]	= 0x80;
+	ll[8]	= mac[0] ^ 0x02;
+	ll[9]	= mac[1];
+	ll[10]	= mac[2];
+	ll[11]	= 0xff;
+	ll[12]	= 0xfe;
+	ll[13]	= mac[3];
+	ll[14]	= mac[4];
+	ll[15]	= mac[5];
+}
+
+bool uip_ip6_is_host(struct uip_info *info, struct in6_addr *addr)
+{
+	return IN6_ARE_ADDR_EQUAL(addr, &info->host_ip6) ||
+	       IN6_ARE_ADDR_EQUAL(addr, &info->host_ll6);
+}
+
+int uip_tx_do_ipv6(struct uip_tx_arg *arg)
+{
+	struct uip_ip6 *ip6;
+
+	ip6 = (struct uip_ip6 *)(arg->eth);
+
+	if ((u32)arg->eth_len < sizeof(*ip6) ||
+	    (u32)arg->eth_len < sizeof(*ip6) + uip_ip6_len(ip6)) {
+		pr_warning("IPv6 packet is truncated");
+		return -1;
+	}
+
+	switch (ip6->nxt) {
+	case UIP_IP_P_ICMPV6:
+		uip_tx_do_ipv6_icmp(arg);
+		break;
+	case UIP_IP_P_TCP:
+		uip_tx_do_ipv6_tcp(arg);
+		break;
+	case UIP_IP_P_UDP:
+		uip_tx_do_ipv6_udp(arg);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
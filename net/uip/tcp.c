@@ -1,42 +1,136 @@
 #include "kvm/uip.h"
+#include "kvm/virtio.h"
 
 #include <kvm/kvm.h>
 #include <linux/virtio_net.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <poll.h>
+
+/*
+ * All TCP sockets of a uip instance are driven by a single event thread, so a
+ * guest opening lots of connections doesn't create lots of host threads. The
+ * host sockets are non-blocking: the event thread completes the connect(),
+ * then reads from the socket, straight into guest frames, as long as the
+ * guest has room in its window.
+ * Sockets are polled one-shot: when the window is full the event thread
+ * doesn't re-arm the socket, until the TX path sees the guest ACK and queues
+ * the socket back to it.
+ */
+#define UIP_TCP_MAX_EVENTS	256
+
+/*
+ * Connections are looked up by a key socket holding the 4-tuple
+ */
+static u32 uip_tcp_socket_hash(struct uip_tcp_socket *key)
+{
+	u32 hash;
+	int i;
+
+	hash = (u32)key->sport << 16 | key->dport;
+	if (key->ipv6) {
+		for (i = 0; i < 4; i++)
+			hash ^= key->sip6.s6_addr32[i] ^ key->dip6.s6_addr32[i];
+	} else {
+		hash ^= key->sip ^ key->dip;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+
+	return hash & (UIP_TCP_HASH_SIZE - 1);
+}
 
-static int uip_tcp_socket_close(struct uip_tcp_socket *sk, int how)
+static void uip_tcp_socket_put(struct uip_tcp_socket *sk)
 {
-	shutdown(sk->fd, how);
+	int refcnt;
+
+	mutex_lock(sk->lock);
+	refcnt = --sk->refcnt;
+	mutex_unlock(sk->lock);
 
-	if (sk->write_done && sk->read_done) {
-		shutdown(sk->fd, SHUT_RDWR);
-		close(sk->fd);
+	if (refcnt)
+		return;
 
-		mutex_lock(sk->lock);
-		list_del(&sk->list);
-		mutex_unlock(sk->lock);
+	close(sk->fd);
+	free(sk);
+}
+
+/*
+ * Hand the socket over to the event thread, which re-evaluates its state
+ */
+static void uip_tcp_socket_queue(struct uip_tcp_socket *sk)
+{
+	struct uip_info *info = sk->info;
+	u64 val = 1;
+	bool wake = false;
 
-		free(sk->buf);
-		free(sk);
+	mutex_lock(sk->lock);
+	if (!sk->dead && list_empty(&sk->pending)) {
+		list_add_tail(&sk->pending, &info->tcp_pending_head);
+		wake = true;
 	}
+	mutex_unlock(sk->lock);
 
-	return 0;
+	if (wake && write(info->tcp_eventfd, &val, sizeof(val)) < 0)
+		pr_warning("uip: failed to wake up the TCP thread");
 }
 
-static struct uip_tcp_socket *uip_tcp_socket_find(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport)
+static int uip_tcp_socket_arm(struct uip_tcp_socket *sk)
 {
-	struct list_head *sk_head;
+	struct epoll_event ev = {
+		.events		= EPOLLIN | EPOLLONESHOT,
+		.data.ptr	= sk,
+	};
+
+	return epoll_ctl(sk->info->tcp_epollfd, EPOLL_CTL_MOD, sk->fd, &ev);
+}
+
+/* Only called from the event thread */
+static void uip_tcp_socket_release(struct uip_tcp_socket *sk)
+{
+	mutex_lock(sk->lock);
+	sk->dead = true;
+	hlist_del_init(&sk->node);
+	mutex_unlock(sk->lock);
+
+	epoll_ctl(sk->info->tcp_epollfd, EPOLL_CTL_DEL, sk->fd, NULL);
+	shutdown(sk->fd, SHUT_RDWR);
+
+	uip_tcp_socket_put(sk);
+}
+
+static bool uip_tcp_socket_match(struct uip_tcp_socket *sk, struct uip_tcp_socket *key)
+{
+	if (sk->ipv6 != key->ipv6 || sk->sport != key->sport || sk->dport != key->dport)
+		return false;
+
+	if (sk->ipv6)
+		return IN6_ARE_ADDR_EQUAL(&sk->sip6, &key->sip6) &&
+		       IN6_ARE_ADDR_EQUAL(&sk->dip6, &key->dip6);
+
+	return sk->sip == key->sip && sk->dip == key->dip;
+}
+
+/* Returns the socket with a reference held, the caller must put it */
+static struct uip_tcp_socket *uip_tcp_socket_find(struct uip_tx_arg *arg, struct uip_tcp_socket *key)
+{
+	struct hlist_head *sk_head;
 	struct mutex *sk_lock;
 	struct uip_tcp_socket *sk;
 
-	sk_head = &arg->info->tcp_socket_head;
+	sk_head = &arg->info->tcp_socket_hash[uip_tcp_socket_hash(key)];
 	sk_lock = &arg->info->tcp_socket_lock;
 
 	mutex_lock(sk_lock);
-	list_for_each_entry(sk, sk_head, list) {
-		if (sk->sip == sip && sk->dip == dip && sk->sport == sport && sk->dport == dport) {
+	hlist_for_each_entry(sk, sk_head, node) {
+		if (uip_tcp_socket_match(sk, key)) {
+			sk->refcnt++;
 			mutex_unlock(sk_lock);
 			return sk;
 		}
@@ -46,99 +140,173 @@ static struct uip_tcp_socket *uip_tcp_socket_find(struct uip_tx_arg *arg, u32 si
 	return NULL;
 }
 
-static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport)
+static void *uip_tcp_socket_thread(void *p);
+
+/* Caller holds the sk lock */
+static int uip_tcp_thread_start(struct uip_info *info)
+{
+	struct epoll_event ev = {
+		.events		= EPOLLIN,
+		.data.ptr	= NULL,
+	};
+
+	if (info->tcp_thread)
+		return 0;
+
+	info->tcp_epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (info->tcp_epollfd < 0)
+		return -1;
+
+	info->tcp_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (info->tcp_eventfd < 0)
+		goto err_close_epoll;
+
+	if (epoll_ctl(info->tcp_epollfd, EPOLL_CTL_ADD, info->tcp_eventfd, &ev))
+		goto err_close_eventfd;
+
+	if (pthread_create(&info->tcp_thread, NULL, uip_tcp_socket_thread, info))
+		goto err_close_eventfd;
+
+	return 0;
+
+err_close_eventfd:
+	close(info->tcp_eventfd);
+err_close_epoll:
+	close(info->tcp_epollfd);
+	info->tcp_thread = 0;
+	return -1;
+}
+
+static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, struct uip_tcp_socket *key, struct uip_tcp_hdr *tcp)
 {
-	struct list_head *sk_head;
+	struct hlist_head *sk_head;
 	struct uip_tcp_socket *sk;
+	struct epoll_event ev;
 	struct mutex *sk_lock;
-	struct uip_tcp *tcp;
-	struct uip_ip *ip;
+	socklen_t addrlen;
 	int ret;
 
-	tcp = (struct uip_tcp *)arg->eth;
-	ip = (struct uip_ip *)arg->eth;
-
-	sk_head = &arg->info->tcp_socket_head;
+	sk_head = &arg->info->tcp_socket_hash[uip_tcp_socket_hash(key)];
 	sk_lock = &arg->info->tcp_socket_lock;
 
-	sk = malloc(sizeof(*sk));
-	memset(sk, 0, sizeof(*sk));
+	sk = calloc(1, sizeof(*sk));
+	if (!sk)
+		return NULL;
 
 	sk->lock			= sk_lock;
 	sk->info			= arg->info;
+	/* One reference for the hash table, one for the caller */
+	sk->refcnt			= 2;
+	INIT_LIST_HEAD(&sk->pending);
+
+	sk->fd				= socket(key->ipv6 ? AF_INET6 : AF_INET,
+						 SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sk->fd < 0)
+		goto err_free;
+
+	if (key->ipv6) {
+		sk->addr6.sin6_family	= AF_INET6;
+		sk->addr6.sin6_port	= key->dport;
+		sk->addr6.sin6_addr	= key->dip6;
+
+		if (uip_ip6_is_host(arg->info, &key->dip6))
+			sk->addr6.sin6_addr = in6addr_loopback;
+		addrlen = sizeof(sk->addr6);
+	} else {
+		sk->addr.sin_family		= AF_INET;
+		sk->addr.sin_port		= key->dport;
+		sk->addr.sin_addr.s_addr	= key->dip;
+
+		if (ntohl(key->dip) == arg->info->host_ip)
+			sk->addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+		addrlen = sizeof(sk->addr);
+	}
 
-	sk->fd				= socket(AF_INET, SOCK_STREAM, 0);
-	sk->addr.sin_family		= AF_INET;
-	sk->addr.sin_port		= dport;
-	sk->addr.sin_addr.s_addr	= dip;
+	ret = connect(sk->fd, (struct sockaddr *)&sk->addr, addrlen);
+	if (ret && errno != EINPROGRESS)
+		goto err_close;
 
-	pthread_cond_init(&sk->cond, NULL);
+	sk->ipv6	= key->ipv6;
+	sk->sip		= key->sip;
+	sk->dip		= key->dip;
+	sk->sip6	= key->sip6;
+	sk->dip6	= key->dip6;
+	sk->sport	= key->sport;
+	sk->dport	= key->dport;
 
-	if (ntohl(dip) == arg->info->host_ip)
-		sk->addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	sk->window_size = ntohs(tcp->win);
 
-	ret = connect(sk->fd, (struct sockaddr *)&sk->addr, sizeof(sk->addr));
-	if (ret) {
-		free(sk);
-		return NULL;
-	}
+	/*
+	 * Setup ISN number
+	 */
+	sk->isn_guest  = ntohl(tcp->seq);
+	sk->isn_server = uip_tcp_isn_alloc();
 
-	sk->sip		= ip->sip;
-	sk->dip		= ip->dip;
-	sk->sport	= tcp->sport;
-	sk->dport	= tcp->dport;
+	sk->seq_server = sk->isn_server;
+	sk->ack_server = sk->isn_guest + 1;
 
 	mutex_lock(sk_lock);
-	list_add_tail(&sk->list, sk_head);
+	if (uip_tcp_thread_start(arg->info)) {
+		mutex_unlock(sk_lock);
+		goto err_close;
+	}
+	hlist_add_head(&sk->node, sk_head);
 	mutex_unlock(sk_lock);
 
+	/*
+	 * The event thread answers the guest SYN once the connection to the
+	 * remote host is established
+	 */
+	ev.events	= EPOLLOUT | EPOLLONESHOT;
+	ev.data.ptr	= sk;
+	if (epoll_ctl(arg->info->tcp_epollfd, EPOLL_CTL_ADD, sk->fd, &ev)) {
+		mutex_lock(sk_lock);
+		hlist_del(&sk->node);
+		mutex_unlock(sk_lock);
+		goto err_close;
+	}
+
 	return sk;
+
+err_close:
+	close(sk->fd);
+err_free:
+	free(sk);
+	return NULL;
 }
 
-/* Caller holds the sk lock */
-static void uip_tcp_socket_free(struct uip_tcp_socket *sk)
+static u32 uip_tcp_frame_hdrlen(struct uip_tcp_socket *sk)
 {
-	/*
-	 * Here we assume that the virtqueues are already inactive so we don't
-	 * race with uip_tx_do_ipv4_tcp. We are racing with
-	 * uip_tcp_socket_thread though, but holding the sk lock ensures that it
-	 * cannot free data concurrently.
-	 */
-	if (sk->thread) {
-		pthread_cancel(sk->thread);
-		pthread_join(sk->thread, NULL);
-	}
+	return sk->ipv6 ? sizeof(struct uip_tcp6) : sizeof(struct uip_tcp);
+}
 
-	sk->write_done = sk->read_done = 1;
-	uip_tcp_socket_close(sk, SHUT_RDWR);
+static u8 *uip_tcp_buf_payload(struct uip_tcp_socket *sk, struct uip_buf *buf)
+{
+	return buf->eth + uip_tcp_frame_hdrlen(sk);
 }
 
-static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_len)
+static void uip_tcp_frame_ip6(struct uip_tcp_socket *sk, struct uip_buf *buf, u16 payload_len)
 {
-	struct uip_info *info;
-	struct uip_eth *eth2;
-	struct uip_tcp *tcp2;
-	struct uip_buf *buf;
-	struct uip_ip *ip2;
+	struct uip_tcp6 *tcp6;
 
-	info		= sk->info;
+	tcp6			= (struct uip_tcp6 *)buf->eth;
 
-	/*
-	 * Get free buffer to send data to guest
-	 */
-	buf		= uip_buf_get_free(info);
+	tcp6->ip6.eth.type	= htons(UIP_ETH_P_IPV6);
+	tcp6->ip6.vtcflow	= htonl(UIP_IP6_VER << 24);
+	tcp6->ip6.plen		= htons(sizeof(tcp6->tcp) + payload_len);
+	tcp6->ip6.nxt		= UIP_IP_P_TCP;
+	tcp6->ip6.hlim		= UIP_IP_TTL;
+	tcp6->ip6.sip		= sk->dip6;
+	tcp6->ip6.dip		= sk->sip6;
+}
 
-	/*
-	 * Cook a ethernet frame
-	 */
-	tcp2		= (struct uip_tcp *)buf->eth;
-	eth2		= (struct uip_eth *)buf->eth;
-	ip2		= (struct uip_ip *)buf->eth;
+static void uip_tcp_frame_ip(struct uip_tcp_socket *sk, struct uip_buf *buf, u16 payload_len)
+{
+	struct uip_ip *ip2;
 
-	eth2->src	= info->host_mac;
-	eth2->dst	= info->guest_mac;
-	eth2->type	= htons(UIP_ETH_P_IP);
+	ip2		= (struct uip_ip *)buf->eth;
 
+	ip2->eth.type	= htons(UIP_ETH_P_IP);
 	ip2->vhl	= UIP_IP_VER_4 | UIP_IP_HDR_LEN;
 	ip2->tos	= 0;
 	ip2->id		= 0;
@@ -148,7 +316,45 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
 	ip2->csum	= 0;
 	ip2->sip	= sk->dip;
 	ip2->dip	= sk->sip;
+	ip2->len	= htons(sizeof(struct uip_tcp_hdr) + payload_len + uip_ip_hdrlen(ip2));
+	ip2->csum	= uip_csum_ip(ip2);
+}
 
+/*
+ * Cook the headers around payload_len bytes already in the buffer, and queue
+ * it to the guest
+ */
+static int uip_tcp_frame_send(struct uip_tcp_socket *sk, struct uip_buf *buf, u8 flag, u16 payload_len)
+{
+	struct virtio_net_hdr *vnet;
+	struct uip_tcp_hdr *tcp2;
+	struct uip_info *info;
+	struct uip_eth *eth2;
+	u16 mss, gso_type;
+	bool gso;
+
+	info		= sk->info;
+
+	/*
+	 * Cook a ethernet frame
+	 */
+	eth2		= (struct uip_eth *)buf->eth;
+	eth2->src	= info->host_mac;
+	eth2->dst	= info->guest_mac;
+
+	if (sk->ipv6) {
+		uip_tcp_frame_ip6(sk, buf, payload_len);
+		mss		= UIP_TCP6_MSS;
+		gso_type	= VIRTIO_NET_HDR_GSO_TCPV6;
+		gso		= info->guest_tso6;
+	} else {
+		uip_tcp_frame_ip(sk, buf, payload_len);
+		mss		= UIP_TCP_MSS;
+		gso_type	= VIRTIO_NET_HDR_GSO_TCPV4;
+		gso		= info->guest_tso4;
+	}
+
+	tcp2		= (struct uip_tcp_hdr *)(buf->eth + uip_tcp_frame_hdrlen(sk) - sizeof(*tcp2));
 	tcp2->sport	= sk->dport;
 	tcp2->dport	= sk->sport;
 	tcp2->seq	= htonl(sk->seq_server);
@@ -162,20 +368,41 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
 	tcp2->csum	= 0;
 	tcp2->urgent	= 0;
 
-	if (payload_len > 0)
-		memcpy(uip_tcp_payload(tcp2), sk->payload, payload_len);
-
-	ip2->len	= htons(uip_tcp_hdrlen(tcp2) + payload_len + uip_ip_hdrlen(ip2));
-	ip2->csum	= uip_csum_ip(ip2);
-	tcp2->csum	= uip_csum_tcp(tcp2);
-
 	/*
 	 * virtio_net_hdr
 	 */
 	buf->vnet_len	= info->vnet_hdr_len;
 	memset(buf->vnet, 0, buf->vnet_len);
+	vnet		= (struct virtio_net_hdr *)buf->vnet;
+
+	if (info->guest_csum) {
+		/*
+		 * Leave a partial checksum for the guest to complete, so that
+		 * it is right if the guest forwards the packet
+		 */
+		vnet->flags	  = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		vnet->csum_start  = virtio_host_to_guest_u16(info->vnet_endian,
+							     (u8 *)tcp2 - buf->eth);
+		vnet->csum_offset = virtio_host_to_guest_u16(info->vnet_endian,
+							     offsetof(struct uip_tcp_hdr, csum));
+		tcp2->csum	  = sk->ipv6 ?
+				    uip_csum_tcp6_partial((struct uip_tcp6 *)buf->eth) :
+				    uip_csum_tcp_partial((struct uip_tcp *)buf->eth);
+	} else {
+		tcp2->csum	  = sk->ipv6 ?
+				    uip_csum_tcp6((struct uip_tcp6 *)buf->eth) :
+				    uip_csum_tcp((struct uip_tcp *)buf->eth);
+	}
 
-	buf->eth_len	= ntohs(ip2->len) + uip_eth_hdrlen(&ip2->eth);
+	/* Let the guest see MSS sized segments */
+	if (gso && payload_len > mss) {
+		vnet->gso_type	  = gso_type;
+		vnet->hdr_len	  = virtio_host_to_guest_u16(info->vnet_endian,
+							     uip_tcp_frame_hdrlen(sk));
+		vnet->gso_size	  = virtio_host_to_guest_u16(info->vnet_endian, mss);
+	}
+
+	buf->eth_len	= uip_tcp_frame_hdrlen(sk) + payload_len;
 
 	/*
 	 * Increase server seq
@@ -190,150 +417,263 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
 	return 0;
 }
 
-static void *uip_tcp_socket_thread(void *p)
+static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_len)
 {
-	struct uip_tcp_socket *sk;
-	int len, left, ret;
-	u8 *pos;
+	struct uip_buf *buf;
 
-	kvm__set_thread_name("uip-tcp");
+	/*
+	 * Get free buffer to send data to guest
+	 */
+	buf = uip_buf_get_free(sk->info);
 
-	sk = p;
+	if (payload_len > 0)
+		memcpy(uip_tcp_buf_payload(sk, buf), sk->payload, payload_len);
 
-	while (1) {
-		pos = sk->buf;
+	return uip_tcp_frame_send(sk, buf, flag, payload_len);
+}
 
-		ret = read(sk->fd, sk->buf, UIP_MAX_TCP_PAYLOAD);
+static void uip_tcp_socket_connected(struct uip_tcp_socket *sk)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
 
-		if (ret <= 0 || ret > UIP_MAX_TCP_PAYLOAD)
-			goto out;
+	if (getsockopt(sk->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+		/*
+		 * Refuse the guest connection
+		 */
+		uip_tcp_payload_send(sk, UIP_TCP_FLAG_RST | UIP_TCP_FLAG_ACK, 0);
+		sk->write_done = sk->read_done = 1;
+		return;
+	}
 
-		left = ret;
+	sk->connected = true;
+	uip_tcp_payload_send(sk, UIP_TCP_FLAG_SYN | UIP_TCP_FLAG_ACK, 0);
+	sk->seq_server += 1;
 
-		while (left > 0) {
-			mutex_lock(sk->lock);
-			while ((len = sk->guest_acked + sk->window_size - sk->seq_server) <= 0)
-				pthread_cond_wait(&sk->cond, &sk->lock->mutex);
-			mutex_unlock(sk->lock);
+	uip_tcp_socket_arm(sk);
+}
 
-			sk->payload = pos;
-			if (len > left)
-				len = left;
-			if (len > UIP_MAX_TCP_PAYLOAD)
-				len = UIP_MAX_TCP_PAYLOAD;
-			left -= len;
-			pos += len;
+static void uip_tcp_socket_read(struct uip_tcp_socket *sk)
+{
+	struct uip_info *info = sk->info;
+	struct uip_buf *buf;
+	int len;
 
-			uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, len);
-		}
-	}
+	mutex_lock(sk->lock);
+	len = sk->guest_acked + sk->window_size - sk->seq_server;
+	if (len <= 0)
+		sk->stalled = true;
+	mutex_unlock(sk->lock);
 
-out:
 	/*
-	 * Close server to guest TCP connection
+	 * Guest window is full, wait for it to ACK before reading any more
 	 */
-	uip_tcp_socket_close(sk, SHUT_RD);
+	if (len <= 0)
+		return;
 
-	uip_tcp_payload_send(sk, UIP_TCP_FLAG_FIN | UIP_TCP_FLAG_ACK, 0);
-	sk->seq_server += 1;
+	len = min(len, UIP_MAX_TCP_PAYLOAD);
+	len = min_t(int, len, info->buf_size - uip_tcp_frame_hdrlen(sk));
 
-	sk->read_done = 1;
+	/* Segment here when the guest doesn't take TSO for this family */
+	if (sk->ipv6 && !info->guest_tso6)
+		len = min(len, UIP_TCP6_MSS);
+	else if (!sk->ipv6 && !info->guest_tso4)
+		len = min(len, UIP_TCP_MSS);
 
-	pthread_exit(NULL);
+	/*
+	 * Read straight into the frame going to the guest
+	 */
+	buf = uip_buf_get_free(info);
+	len = read(sk->fd, uip_tcp_buf_payload(sk, buf), len);
+	if (len <= 0)
+		uip_buf_set_free(info, buf);
+
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		uip_tcp_socket_arm(sk);
+		return;
+	}
 
-	return NULL;
+	if (len <= 0) {
+		/*
+		 * Close server to guest TCP connection
+		 */
+		shutdown(sk->fd, SHUT_RD);
+
+		uip_tcp_payload_send(sk, UIP_TCP_FLAG_FIN | UIP_TCP_FLAG_ACK, 0);
+		sk->seq_server += 1;
+
+		sk->read_done = 1;
+		return;
+	}
+
+	uip_tcp_frame_send(sk, buf, UIP_TCP_FLAG_ACK, len);
+
+	uip_tcp_socket_arm(sk);
 }
 
-static int uip_tcp_socket_receive(struct uip_tcp_socket *sk)
+static void uip_tcp_socket_event(struct uip_tcp_socket *sk, u32 events)
 {
-	int ret;
+	if (sk->read_done && sk->write_done)
+		return;
+
+	if (!sk->connected)
+		uip_tcp_socket_connected(sk);
+	else if (!sk->read_done && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		uip_tcp_socket_read(sk);
+
+	if (sk->read_done && sk->write_done)
+		uip_tcp_socket_queue(sk);
+}
+
+static void uip_tcp_socket_process_pending(struct uip_info *info)
+{
+	struct uip_tcp_socket *sk;
+	bool release, rearm;
+
+	mutex_lock(&info->tcp_socket_lock);
+	while (!list_empty(&info->tcp_pending_head)) {
+		sk = list_first_entry(&info->tcp_pending_head, struct uip_tcp_socket, pending);
+		list_del_init(&sk->pending);
+
+		release	= sk->read_done && sk->write_done;
+		rearm	= sk->connected && !sk->read_done && !sk->stalled;
+		mutex_unlock(&info->tcp_socket_lock);
 
-	if (sk->thread == 0) {
-		sk->buf = malloc(UIP_MAX_TCP_PAYLOAD);
-		if (!sk->buf)
-			return -ENOMEM;
-		ret = pthread_create(&sk->thread, NULL, uip_tcp_socket_thread,
-				     (void *)sk);
-		if (ret)
-			free(sk->buf);
-		return ret;
+		if (release)
+			uip_tcp_socket_release(sk);
+		else if (rearm)
+			uip_tcp_socket_arm(sk);
+
+		mutex_lock(&info->tcp_socket_lock);
 	}
+	mutex_unlock(&info->tcp_socket_lock);
+}
 
-	return 0;
+static void *uip_tcp_socket_thread(void *p)
+{
+	struct epoll_event events[UIP_TCP_MAX_EVENTS];
+	struct uip_info *info = p;
+	int nfds, i;
+	u64 val;
+
+	kvm__set_thread_name("uip-tcp");
+
+	while (1) {
+		nfds = epoll_wait(info->tcp_epollfd, events, UIP_TCP_MAX_EVENTS, -1);
+		if (nfds < 0)
+			continue;
+
+		for (i = 0; i < nfds; i++) {
+			/*
+			 * Woken up to process the pending sockets
+			 */
+			if (!events[i].data.ptr) {
+				if (read(info->tcp_eventfd, &val, sizeof(val)) < 0)
+					pr_warning("uip: failed to read the TCP eventfd");
+				continue;
+			}
+
+			uip_tcp_socket_event(events[i].data.ptr, events[i].events);
+		}
+
+		/*
+		 * Only release sockets once the batch is processed, so that no
+		 * event above refers to a socket that is gone
+		 */
+		uip_tcp_socket_process_pending(info);
+	}
+
+	return NULL;
 }
 
-static int uip_tcp_socket_send(struct uip_tcp_socket *sk, struct uip_tcp *tcp)
+static int uip_tcp_socket_send(struct uip_tcp_socket *sk, u8 *payload, int len)
 {
-	int len;
-	int ret;
-	u8 *payload;
+	struct pollfd pfd = {
+		.fd	= sk->fd,
+		.events	= POLLOUT,
+	};
+	int ret, done = 0;
 
 	if (sk->write_done)
 		return 0;
 
-	payload = uip_tcp_payload(tcp);
-	len = uip_tcp_payloadlen(tcp);
+	/*
+	 * The socket is non-blocking for the event thread. Wait for room in
+	 * the socket buffer here, as the guest is only ACKed what we wrote.
+	 */
+	while (done < len) {
+		ret = write(sk->fd, payload + done, len - done);
+		if (ret > 0) {
+			done += ret;
+			continue;
+		}
+
+		if (ret < 0 && errno == EINTR)
+			continue;
 
-	ret = write(sk->fd, payload, len);
-	if (ret != len)
+		if (ret < 0 && errno == EAGAIN && poll(&pfd, 1, -1) >= 0)
+			continue;
+
+		break;
+	}
+
+	if (done != len)
 		pr_warning("tcp send error");
 
-	return ret;
+	return done ? done : ret;
 }
 
-int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg)
+static int uip_tcp_tx(struct uip_tx_arg *arg, struct uip_tcp_socket *key,
+		      struct uip_tcp_hdr *tcp, u8 *payload, u16 payload_len)
 {
 	struct uip_tcp_socket *sk;
-	struct uip_tcp *tcp;
-	struct uip_ip *ip;
-	int ret;
+	bool wake = false;
+	int ret = 0;
+	int len;
 
-	tcp = (struct uip_tcp *)arg->eth;
-	ip = (struct uip_ip *)arg->eth;
+	/*
+	 * Find socket we have allocated
+	 */
+	sk = uip_tcp_socket_find(arg, key);
 
 	/*
 	 * Guest is trying to start a TCP session, let's fake SYN-ACK to guest
+	 * once we are connected. Retransmitted SYNs are ignored.
 	 */
-	if (uip_tcp_is_syn(tcp)) {
-		sk = uip_tcp_socket_alloc(arg, ip->sip, ip->dip, tcp->sport, tcp->dport);
+	if (tcp->flg & UIP_TCP_FLAG_SYN) {
+		if (sk)
+			goto out;
+
+		sk = uip_tcp_socket_alloc(arg, key, tcp);
 		if (!sk)
 			return -1;
 
-		sk->window_size = ntohs(tcp->win);
-
-		/*
-		 * Setup ISN number
-		 */
-		sk->isn_guest  = uip_tcp_isn(tcp);
-		sk->isn_server = uip_tcp_isn_alloc();
-
-		sk->seq_server = sk->isn_server;
-		sk->ack_server = sk->isn_guest + 1;
-		uip_tcp_payload_send(sk, UIP_TCP_FLAG_SYN | UIP_TCP_FLAG_ACK, 0);
-		sk->seq_server += 1;
-
-		/*
-		 * Start receive thread for data from remote to guest
-		 */
-		uip_tcp_socket_receive(sk);
-
 		goto out;
 	}
 
-	/*
-	 * Find socket we have allocated
-	 */
-	sk = uip_tcp_socket_find(arg, ip->sip, ip->dip, tcp->sport, tcp->dport);
 	if (!sk)
 		return -1;
 
+	if (tcp->flg & UIP_TCP_FLAG_RST) {
+		sk->write_done = sk->read_done = 1;
+		uip_tcp_socket_queue(sk);
+		goto out;
+	}
+
 	mutex_lock(sk->lock);
 	sk->window_size = ntohs(tcp->win);
 	sk->guest_acked = ntohl(tcp->ack);
-	pthread_cond_signal(&sk->cond);
+	len = sk->guest_acked + sk->window_size - sk->seq_server;
+	if (sk->stalled && len > 0) {
+		sk->stalled = false;
+		wake = true;
+	}
 	mutex_unlock(sk->lock);
 
-	if (uip_tcp_is_fin(tcp)) {
+	if (wake)
+		uip_tcp_socket_queue(sk);
+
+	if (tcp->flg & UIP_TCP_FLAG_FIN) {
 		if (sk->write_done)
 			goto out;
 
@@ -344,7 +684,9 @@ int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg)
 		/*
 		 * Close guest to server TCP connection
 		 */
-		uip_tcp_socket_close(sk, SHUT_WR);
+		shutdown(sk->fd, SHUT_WR);
+		if (sk->read_done)
+			uip_tcp_socket_queue(sk);
 
 		goto out;
 	}
@@ -352,31 +694,89 @@ int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg)
 	/*
 	 * Ignore guest to server frames with zero tcp payload
 	 */
-	if (uip_tcp_payloadlen(tcp) == 0)
+	if (payload_len == 0)
 		goto out;
 
 	/*
 	 * Sent out TCP data to remote host
 	 */
-	ret = uip_tcp_socket_send(sk, tcp);
+	ret = uip_tcp_socket_send(sk, payload, payload_len);
 	if (ret < 0)
-		return -1;
+		goto out;
 	/*
 	 * Send ACK to guest imediately
 	 */
 	sk->ack_server += ret;
 	uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, 0);
+	ret = 0;
 
 out:
-	return 0;
+	uip_tcp_socket_put(sk);
+	return ret < 0 ? -1 : 0;
+}
+
+int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg)
+{
+	struct uip_tcp_socket key;
+	struct uip_tcp *tcp;
+
+	tcp = (struct uip_tcp *)arg->eth;
+
+	memset(&key, 0, sizeof(key));
+	key.sip		= tcp->ip.sip;
+	key.dip		= tcp->ip.dip;
+	key.sport	= tcp->sport;
+	key.dport	= tcp->dport;
+
+	return uip_tcp_tx(arg, &key, (struct uip_tcp_hdr *)&tcp->sport,
+			  uip_tcp_payload(tcp), uip_tcp_payloadlen(tcp));
+}
+
+int uip_tx_do_ipv6_tcp(struct uip_tx_arg *arg)
+{
+	struct uip_tcp_socket key;
+	struct uip_tcp6 *tcp6;
+
+	tcp6 = (struct uip_tcp6 *)arg->eth;
+
+	memset(&key, 0, sizeof(key));
+	key.ipv6	= true;
+	key.sip6	= tcp6->ip6.sip;
+	key.dip6	= tcp6->ip6.dip;
+	key.sport	= tcp6->tcp.sport;
+	key.dport	= tcp6->tcp.dport;
+
+	return uip_tcp_tx(arg, &key, &tcp6->tcp, uip_tcp6_payload(tcp6),
+			  uip_tcp6_payloadlen(tcp6));
 }
 
 void uip_tcp_exit(struct uip_info *info)
 {
-	struct uip_tcp_socket *sk, *next;
+	struct uip_tcp_socket *sk;
+	struct hlist_node *next;
+	int i;
+
+	/*
+	 * Here we assume that the virtqueues are already inactive so we don't
+	 * race with uip_tcp_tx.
+	 */
+	if (info->tcp_thread) {
+		pthread_cancel(info->tcp_thread);
+		pthread_join(info->tcp_thread, NULL);
+		info->tcp_thread = 0;
+
+		close(info->tcp_eventfd);
+		close(info->tcp_epollfd);
+	}
 
 	mutex_lock(&info->tcp_socket_lock);
-	list_for_each_entry_safe(sk, next, &info->tcp_socket_head, list)
-		uip_tcp_socket_free(sk);
+	for (i = 0; i < UIP_TCP_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(sk, next, &info->tcp_socket_hash[i], node) {
+			hlist_del(&sk->node);
+			close(sk->fd);
+			free(sk);
+		}
+	}
+	INIT_LIST_HEAD(&info->tcp_pending_head);
 	mutex_unlock(&info->tcp_socket_lock);
 }
@@ -1,4 +1,5 @@
 #include "kvm/uip.h"
+#include "kvm/virtio.h"
 
 #include <kvm/kvm.h>
 #include <linux/virtio_net.h>
@@ -10,7 +11,51 @@
 
 #define UIP_UDP_MAX_EVENTS 1000
 
-static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport)
+static bool uip_udp_socket_match(struct uip_udp_socket *sk, struct uip_udp_socket *key)
+{
+	if (sk->ipv6 != key->ipv6 || sk->sport != key->sport || sk->dport != key->dport)
+		return false;
+
+	if (sk->ipv6)
+		return IN6_ARE_ADDR_EQUAL(&sk->sip6, &key->sip6) &&
+		       IN6_ARE_ADDR_EQUAL(&sk->dip6, &key->dip6);
+
+	return sk->sip == key->sip && sk->dip == key->dip;
+}
+
+/*
+ * Where to send what the guest sends to the key's destination
+ */
+static void uip_udp_socket_addr(struct uip_info *info, struct uip_udp_socket *sk,
+				struct uip_udp_socket *key)
+{
+	if (!key->ipv6) {
+		sk->addr.sin_family	 = AF_INET;
+		sk->addr.sin_addr.s_addr = key->dip;
+		sk->addr.sin_port	 = key->dport;
+		return;
+	}
+
+	/*
+	 * The router advertisement points the guest to the host for DNS,
+	 * which relays the queries to its own resolver
+	 */
+	if (uip_ip6_is_host(info, &key->dip6) && ntohs(key->dport) == 53 &&
+	    info->dns_ip[0]) {
+		sk->addr.sin_family	 = AF_INET;
+		sk->addr.sin_addr.s_addr = htonl(info->dns_ip[0]);
+		sk->addr.sin_port	 = key->dport;
+		return;
+	}
+
+	sk->addr6.sin6_family	= AF_INET6;
+	sk->addr6.sin6_addr	= key->dip6;
+	sk->addr6.sin6_port	= key->dport;
+	if (uip_ip6_is_host(info, &key->dip6))
+		sk->addr6.sin6_addr = in6addr_loopback;
+}
+
+static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, struct uip_udp_socket *key)
 {
 	struct list_head *sk_head;
 	struct uip_udp_socket *sk;
@@ -27,7 +72,7 @@ static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 si
 	 */
 	mutex_lock(sk_lock);
 	list_for_each_entry(sk, sk_head, list) {
-		if (sk->sip == sip && sk->dip == dip && sk->sport == sport && sk->dport == dport) {
+		if (uip_udp_socket_match(sk, key)) {
 			mutex_unlock(sk_lock);
 			return sk;
 		}
@@ -42,7 +87,9 @@ static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 si
 
 	sk->lock = sk_lock;
 
-	sk->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	uip_udp_socket_addr(arg->info, sk, key);
+
+	sk->fd = socket(sk->addr.sin_family, SOCK_DGRAM, 0);
 	if (sk->fd < 0)
 		goto out;
 
@@ -65,14 +112,13 @@ static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 si
 	if (ret == -1)
 		pr_warning("epoll_ctl error");
 
-	sk->addr.sin_family	 = AF_INET;
-	sk->addr.sin_addr.s_addr = dip;
-	sk->addr.sin_port	 = dport;
-
-	sk->sip			 = sip;
-	sk->dip			 = dip;
-	sk->sport		 = sport;
-	sk->dport		 = dport;
+	sk->ipv6		 = key->ipv6;
+	sk->sip			 = key->sip;
+	sk->dip			 = key->dip;
+	sk->sip6		 = key->sip6;
+	sk->dip6		 = key->dip6;
+	sk->sport		 = key->sport;
+	sk->dport		 = key->dport;
 
 	mutex_lock(sk_lock);
 	list_add_tail(&sk->list, sk_head);
@@ -85,26 +131,88 @@ out:
 	return NULL;
 }
 
-static int uip_udp_socket_send(struct uip_udp_socket *sk, struct uip_udp *udp)
+static int uip_udp_socket_send(struct uip_udp_socket *sk, u8 *payload, int len)
 {
-	int len;
+	socklen_t addrlen;
 	int ret;
 
-	len = ntohs(udp->len) - uip_udp_hdrlen(udp);
+	if (sk->addr.sin_family == AF_INET6)
+		addrlen = sizeof(sk->addr6);
+	else
+		addrlen = sizeof(sk->addr);
 
-	ret = sendto(sk->fd, udp->payload, len, 0, (struct sockaddr *)&sk->addr, sizeof(sk->addr));
+	ret = sendto(sk->fd, payload, len, 0, (struct sockaddr *)&sk->addr, addrlen);
 	if (ret != len)
 		return -1;
 
 	return 0;
 }
 
+/*
+ * Leave a partial checksum for the guest to complete, so that it is right if
+ * the guest forwards the packet.
+ */
+static void uip_udp_csum_partial(struct uip_info *info, struct uip_buf *buf,
+				 u16 csum_start, u16 csum_offset)
+{
+	struct virtio_net_hdr *vnet = (struct virtio_net_hdr *)buf->vnet;
+
+	vnet->flags	  = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	vnet->csum_start  = virtio_host_to_guest_u16(info->vnet_endian, csum_start);
+	vnet->csum_offset = virtio_host_to_guest_u16(info->vnet_endian, csum_offset);
+}
+
+static int uip_udp6_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct uip_buf *buf, u8 *payload, int payload_len)
+{
+	struct uip_udp6 *udp6;
+
+	udp6			= (struct uip_udp6 *)buf->eth;
+
+	udp6->ip6.eth.src	= info->host_mac;
+	udp6->ip6.eth.dst	= info->guest_mac;
+	udp6->ip6.eth.type	= htons(UIP_ETH_P_IPV6);
+
+	udp6->ip6.vtcflow	= htonl(UIP_IP6_VER << 24);
+	udp6->ip6.nxt		= UIP_IP_P_UDP;
+	udp6->ip6.hlim		= UIP_IP_TTL;
+	udp6->ip6.sip		= sk->dip6;
+	udp6->ip6.dip		= sk->sip6;
+
+	udp6->sport		= sk->dport;
+	udp6->dport		= sk->sport;
+	udp6->len		= htons(payload_len + 8);
+	udp6->csum		= 0;
+	udp6->ip6.plen		= udp6->len;
+
+	if (payload)
+		memcpy(udp6->payload, payload, payload_len);
+
+	buf->vnet_len		= info->vnet_hdr_len;
+	memset(buf->vnet, 0, buf->vnet_len);
+
+	if (info->guest_csum) {
+		uip_udp_csum_partial(info, buf, offsetof(struct uip_udp6, sport),
+				     offsetof(struct uip_udp6, csum) -
+				     offsetof(struct uip_udp6, sport));
+		udp6->csum = uip_csum_udp6_partial(udp6);
+	} else {
+		udp6->csum = uip_csum_udp6(udp6);
+	}
+
+	buf->eth_len		= sizeof(struct uip_ip6) + uip_ip6_len(&udp6->ip6);
+
+	return 0;
+}
+
 int uip_udp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct uip_buf *buf, u8* payload, int payload_len)
 {
 	struct uip_eth *eth2;
 	struct uip_udp *udp2;
 	struct uip_ip *ip2;
 
+	if (sk->ipv6)
+		return uip_udp6_make_pkg(info, sk, buf, payload, payload_len);
+
 	/*
 	 * Cook a ethernet frame
 	 */
@@ -137,7 +245,6 @@ int uip_udp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct ui
 
 	ip2->len	= udp2->len + htons(uip_ip_hdrlen(ip2));
 	ip2->csum	= uip_csum_ip(ip2);
-	udp2->csum	= uip_csum_udp(udp2);
 
 	/*
 	 * virtio_net_hdr
@@ -145,6 +252,15 @@ int uip_udp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct ui
 	buf->vnet_len	= info->vnet_hdr_len;
 	memset(buf->vnet, 0, buf->vnet_len);
 
+	if (info->guest_csum) {
+		uip_udp_csum_partial(info, buf, offsetof(struct uip_udp, sport),
+				     offsetof(struct uip_udp, csum) -
+				     offsetof(struct uip_udp, sport));
+		udp2->csum = uip_csum_udp_partial(udp2);
+	} else {
+		udp2->csum = uip_csum_udp(udp2);
+	}
+
 	buf->eth_len	= ntohs(ip2->len) + uip_eth_hdrlen(&ip2->eth);
 
 	return 0;
@@ -179,6 +295,13 @@ static void *uip_udp_socket_thread(void *p)
 			if (payload_len < 0)
 				continue;
 
+			/*
+			 * We don't fragment, drop what doesn't fit in a buffer
+			 */
+			if ((u32)payload_len > info->buf_size -
+			    (sk->ipv6 ? sizeof(struct uip_udp6) : sizeof(struct uip_udp)))
+				continue;
+
 			/*
 			 * Get free buffer to send data to guest
 			 */
@@ -202,34 +325,25 @@ static void *uip_udp_socket_thread(void *p)
 	return NULL;
 }
 
-int uip_tx_do_ipv4_udp(struct uip_tx_arg *arg)
+static int uip_udp_tx(struct uip_tx_arg *arg, struct uip_udp_socket *key, u8 *payload, int len)
 {
 	struct uip_udp_socket *sk;
 	struct uip_info *info;
-	struct uip_udp *udp;
-	struct uip_ip *ip;
 	int ret;
 
-	udp	= (struct uip_udp *)(arg->eth);
-	ip	= (struct uip_ip *)(arg->eth);
 	info	= arg->info;
 
-	if (uip_udp_is_dhcp(udp)) {
-		uip_tx_do_ipv4_udp_dhcp(arg);
-		return 0;
-	}
-
 	/*
 	 * Find socket we have allocated before, otherwise allocate one
 	 */
-	sk = uip_udp_socket_find(arg, ip->sip, ip->dip, udp->sport, udp->dport);
+	sk = uip_udp_socket_find(arg, key);
 	if (!sk)
 		return -1;
 
 	/*
 	 * Send out UDP data to remote host
 	 */
-	ret = uip_udp_socket_send(sk, udp);
+	ret = uip_udp_socket_send(sk, payload, len);
 	if (ret)
 		return -1;
 
@@ -244,6 +358,51 @@ int uip_tx_do_ipv4_udp(struct uip_tx_arg *arg)
 	return 0;
 }
 
+int uip_tx_do_ipv4_udp(struct uip_tx_arg *arg)
+{
+	struct uip_udp_socket key;
+	struct uip_udp *udp;
+
+	udp	= (struct uip_udp *)(arg->eth);
+
+	if (uip_udp_is_dhcp(udp)) {
+		uip_tx_do_ipv4_udp_dhcp(arg);
+		return 0;
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.sip		= udp->ip.sip;
+	key.dip		= udp->ip.dip;
+	key.sport	= udp->sport;
+	key.dport	= udp->dport;
+
+	return uip_udp_tx(arg, &key, udp->payload, uip_udp_len(udp) - uip_udp_hdrlen(udp));
+}
+
+int uip_tx_do_ipv6_udp(struct uip_tx_arg *arg)
+{
+	struct uip_udp_socket key;
+	struct uip_udp6 *udp6;
+
+	udp6	= (struct uip_udp6 *)(arg->eth);
+
+	/* The length covers the 8 byte header, within the IPv6 payload */
+	if (uip_udp6_len(udp6) < 8 ||
+	    uip_udp6_len(udp6) > uip_ip6_len(&udp6->ip6)) {
+		pr_warning("UDPv6 packet has an invalid length");
+		return -1;
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.ipv6	= true;
+	key.sip6	= udp6->ip6.sip;
+	key.dip6	= udp6->ip6.dip;
+	key.sport	= udp6->sport;
+	key.dport	= udp6->dport;
+
+	return uip_udp_tx(arg, &key, udp6->payload, uip_udp6_len(udp6) - 8);
+}
+
 void uip_udp_exit(struct uip_info *info)
 {
 	struct uip_udp_socket *sk, *next;
@@ -0,0 +1,598 @@
+#include "kvm/xdp.h"
+#include "kvm/barrier.h"
+#include "kvm/iovec.h"
+#include "kvm/util.h"
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/kernel.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/virtio_net.h>
+
+#include <errno.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#ifndef AF_XDP
+#define AF_XDP			44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP			283
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL	69
+#endif
+
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET	70
+#endif
+
+/*
+ * The UMEM is split in two: the first XDP_RX_FRAMES frames go round between
+ * the fill ring and the RX ring, the others are handed to the TX ring and come
+ * back through the completion ring. The fill ring is only used by the
+ * virtio-net RX thread and the completion ring by the TX thread, so neither
+ * side needs a lock. Both sides return frames to the kernel in batches, and
+ * only kick it when it asks for a wakeup.
+ */
+static u64 xdp_frame_addr(u32 frame)
+{
+	return (u64)frame * XDP_FRAME_SIZE;
+}
+
+static u32 xdp_ring_avail(struct xdp_ring *ring, u32 cons)
+{
+	u32 nr = *(volatile u32 *)ring->producer - cons;
+
+	/* Read the entries after the producer index */
+	rmb();
+	return nr;
+}
+
+static void xdp_ring_release(struct xdp_ring *ring, u32 cons)
+{
+	/* Done reading the entries before handing them back */
+	mb();
+	*(volatile u32 *)ring->consumer = cons;
+}
+
+static void xdp_ring_submit(struct xdp_ring *ring, u32 prod)
+{
+	/* Entries must be visible before the producer index */
+	wmb();
+	*(volatile u32 *)ring->producer = prod;
+}
+
+static bool xdp_ring_needs_wakeup(struct xdp_ring *ring)
+{
+	mb();
+	return *(volatile u32 *)ring->flags & XDP_RING_NEED_WAKEUP;
+}
+
+static u64 *xdp_ring_addr(struct xdp_ring *ring, u32 idx)
+{
+	return (u64 *)ring->ring + (idx & ring->mask);
+}
+
+static struct xdp_desc *xdp_ring_desc(struct xdp_ring *ring, u32 idx)
+{
+	return (struct xdp_desc *)ring->ring + (idx & ring->mask);
+}
+
+static int xdp_ring_map(struct xdp_info *info, struct xdp_ring *ring,
+			struct xdp_ring_offset *off, u32 nr, size_t desc_size,
+			off_t pgoff)
+{
+	ring->map_len	= off->desc + nr * desc_size;
+	ring->map	= mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, info->fd, pgoff);
+	if (ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		return -errno;
+	}
+
+	ring->producer	= ring->map + off->producer;
+	ring->consumer	= ring->map + off->consumer;
+	ring->flags	= ring->map + off->flags;
+	ring->ring	= ring->map + off->desc;
+	ring->mask	= nr - 1;
+
+	return 0;
+}
+
+static void xdp_ring_unmap(struct xdp_ring *ring)
+{
+	if (ring->map)
+		munmap(ring->map, ring->map_len);
+	ring->map = NULL;
+}
+
+static int xdp_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * The program redirects everything arriving on a queue to the socket bound to
+ * it, and lets the kernel have the packet when no socket is bound yet:
+ *
+ *	r2 = ctx->rx_queue_index
+ *	return bpf_redirect_map(&xsks_map, r2, XDP_PASS)
+ */
+static int xdp_prog_load(struct xdp_info *info)
+{
+	struct bpf_insn insns[] = {
+		{
+			.code		= BPF_LDX | BPF_MEM | BPF_W,
+			.dst_reg	= BPF_REG_2,
+			.src_reg	= BPF_REG_1,
+			.off		= offsetof(struct xdp_md, rx_queue_index),
+		}, {
+			.code		= BPF_LD | BPF_DW | BPF_IMM,
+			.dst_reg	= BPF_REG_1,
+			.src_reg	= BPF_PSEUDO_MAP_FD,
+			.imm		= info->map_fd,
+		}, {
+			/* Upper half of the 64bit immediate */
+		}, {
+			.code		= BPF_ALU64 | BPF_MOV | BPF_K,
+			.dst_reg	= BPF_REG_3,
+			.imm		= XDP_PASS,
+		}, {
+			.code		= BPF_JMP | BPF_CALL,
+			.imm		= BPF_FUNC_redirect_map,
+		}, {
+			.code		= BPF_JMP | BPF_EXIT,
+		},
+	};
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type		= BPF_MAP_TYPE_XSKMAP;
+	attr.key_size		= sizeof(u32);
+	attr.value_size		= sizeof(u32);
+	attr.max_entries	= info->queue + 1;
+
+	info->map_fd = xdp_bpf(BPF_MAP_CREATE, &attr);
+	if (info->map_fd < 0)
+		return -errno;
+
+	insns[1].imm = info->map_fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type		= BPF_PROG_TYPE_XDP;
+	attr.insns		= (unsigned long)insns;
+	attr.insn_cnt		= ARRAY_SIZE(insns);
+	attr.license		= (unsigned long)"GPL";
+
+	info->prog_fd = xdp_bpf(BPF_PROG_LOAD, &attr);
+	if (info->prog_fd < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int xdp_map_update(struct xdp_info *info)
+{
+	union bpf_attr attr;
+	u32 key = info->queue;
+	u32 value = info->fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd	= info->map_fd;
+	attr.key	= (unsigned long)&key;
+	attr.value	= (unsigned long)&value;
+	attr.flags	= BPF_ANY;
+
+	if (xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void xdp_nla_put(struct rtattr *nest, int type, const void *data,
+			int len)
+{
+	struct rtattr *rta = (void *)nest + RTA_ALIGN(nest->rta_len);
+
+	rta->rta_type	= type;
+	rta->rta_len	= RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	nest->rta_len	= RTA_ALIGN(nest->rta_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/*
+ * Attach (or detach, with a negative fd) an XDP program to the interface
+ * through rtnetlink, which is all libbpf would do for us.
+ */
+static int xdp_link_set(int ifindex, int prog_fd, u32 flags)
+{
+	struct {
+		struct nlmsghdr		nh;
+		struct ifinfomsg	ifi;
+		char			attrs[64];
+	} req;
+	char buf[256];
+	struct nlmsghdr *nh;
+	struct rtattr *nest;
+	int sock, ret;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len	= NLMSG_LENGTH(sizeof(req.ifi));
+	req.nh.nlmsg_type	= RTM_SETLINK;
+	req.nh.nlmsg_flags	= NLM_F_REQUEST | NLM_F_ACK;
+	req.ifi.ifi_family	= AF_UNSPEC;
+	req.ifi.ifi_index	= ifindex;
+
+	nest = (void *)&req + NLMSG_ALIGN(req.nh.nlmsg_len);
+	nest->rta_type	= NLA_F_NESTED | IFLA_XDP;
+	nest->rta_len	= RTA_LENGTH(0);
+	xdp_nla_put(nest, IFLA_XDP_FD, &prog_fd, sizeof(prog_fd));
+	if (flags)
+		xdp_nla_put(nest, IFLA_XDP_FLAGS, &flags, sizeof(flags));
+	req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + nest->rta_len;
+
+	sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sock < 0)
+		return -errno;
+
+	if (send(sock, &req, req.nh.nlmsg_len, 0) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	ret = recv(sock, buf, sizeof(buf), 0);
+	if (ret < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	nh = (struct nlmsghdr *)buf;
+	if (NLMSG_OK(nh, (u32)ret) && nh->nlmsg_type == NLMSG_ERROR)
+		ret = ((struct nlmsgerr *)NLMSG_DATA(nh))->error;
+	else
+		ret = -EPROTO;
+
+out:
+	close(sock);
+	return ret;
+}
+
+static int xdp_socket_setup(struct xdp_info *info)
+{
+	struct xdp_umem_reg mr = {
+		.addr		= (unsigned long)info->umem,
+		.len		= info->umem_len,
+		.chunk_size	= XDP_FRAME_SIZE,
+	};
+	struct sockaddr_xdp sxdp = {
+		.sxdp_family	= AF_XDP,
+		.sxdp_flags	= XDP_USE_NEED_WAKEUP,
+		.sxdp_ifindex	= info->ifindex,
+		.sxdp_queue_id	= info->queue,
+	};
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	int rx_nr = XDP_RX_FRAMES, tx_nr = XDP_TX_FRAMES;
+	int r;
+
+	if (setsockopt(info->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) ||
+	    setsockopt(info->fd, SOL_XDP, XDP_UMEM_FILL_RING, &rx_nr, sizeof(rx_nr)) ||
+	    setsockopt(info->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &tx_nr, sizeof(tx_nr)) ||
+	    setsockopt(info->fd, SOL_XDP, XDP_RX_RING, &rx_nr, sizeof(rx_nr)) ||
+	    setsockopt(info->fd, SOL_XDP, XDP_TX_RING, &tx_nr, sizeof(tx_nr)))
+		return -errno;
+
+	if (getsockopt(info->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen))
+		return -errno;
+
+	r = xdp_ring_map(info, &info->fill, &off.fr, rx_nr, sizeof(u64),
+			 XDP_UMEM_PGOFF_FILL_RING);
+	if (!r)
+		r = xdp_ring_map(info, &info->comp, &off.cr, tx_nr, sizeof(u64),
+				 XDP_UMEM_PGOFF_COMPLETION_RING);
+	if (!r)
+		r = xdp_ring_map(info, &info->rx, &off.rx, rx_nr,
+				 sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+	if (!r)
+		r = xdp_ring_map(info, &info->tx, &off.tx, tx_nr,
+				 sizeof(struct xdp_desc), XDP_PGOFF_TX_RING);
+	if (r)
+		return r;
+
+	if (info->busy_poll) {
+		int one = 1, budget = XDP_BATCH;
+
+		if (setsockopt(info->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) ||
+		    setsockopt(info->fd, SOL_SOCKET, SO_BUSY_POLL, &info->busy_poll, sizeof(info->busy_poll)) ||
+		    setsockopt(info->fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)))
+			pr_warning("xdp: busy polling not available on %s", info->ifname);
+	}
+
+	if (bind(info->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)))
+		return -errno;
+
+	return 0;
+}
+
+int xdp_init(struct xdp_info *info)
+{
+	u32 i;
+	int r;
+
+	info->fd = info->map_fd = info->prog_fd = -1;
+	info->attached = false;
+
+	info->ifindex = if_nametoindex(info->ifname);
+	if (!info->ifindex) {
+		pr_err("xdp: no such interface %s", info->ifname);
+		return -ENODEV;
+	}
+
+	info->umem_len = (size_t)XDP_NR_FRAMES * XDP_FRAME_SIZE;
+	info->umem = mmap(NULL, info->umem_len, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (info->umem == MAP_FAILED) {
+		info->umem = NULL;
+		return -ENOMEM;
+	}
+
+	info->tx_frames = calloc(XDP_TX_FRAMES, sizeof(*info->tx_frames));
+	if (!info->tx_frames) {
+		r = -ENOMEM;
+		goto fail;
+	}
+
+	info->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (info->fd < 0) {
+		r = -errno;
+		pr_err("xdp: unable to create AF_XDP socket (%d)", r);
+		goto fail;
+	}
+
+	r = xdp_socket_setup(info);
+	if (r) {
+		pr_err("xdp: unable to bind to %s queue %u (%d)",
+		       info->ifname, info->queue, r);
+		goto fail;
+	}
+
+	/* Hand all the RX frames to the kernel */
+	for (i = 0; i < XDP_RX_FRAMES; i++)
+		*xdp_ring_addr(&info->fill, i) = xdp_frame_addr(i);
+	xdp_ring_submit(&info->fill, XDP_RX_FRAMES);
+
+	for (i = 0; i < XDP_TX_FRAMES; i++)
+		info->tx_frames[i] = xdp_frame_addr(XDP_RX_FRAMES + i);
+	info->tx_nr_free = XDP_TX_FRAMES;
+
+	r = xdp_prog_load(info);
+	if (r) {
+		pr_err("xdp: unable to load redirect program (%d)", r);
+		goto fail;
+	}
+
+	r = xdp_link_set(info->ifindex, info->prog_fd,
+			 XDP_FLAGS_UPDATE_IF_NOEXIST);
+	if (r) {
+		pr_err("xdp: unable to attach program to %s (%d)",
+		       info->ifname, r);
+		goto fail;
+	}
+	info->attached = true;
+
+	r = xdp_map_update(info);
+	if (r) {
+		pr_err("xdp: unable to register socket (%d)", r);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	xdp_exit(info);
+	return r;
+}
+
+void xdp_exit(struct xdp_info *info)
+{
+	if (info->attached)
+		xdp_link_set(info->ifindex, -1, 0);
+	if (info->prog_fd >= 0)
+		close(info->prog_fd);
+	if (info->map_fd >= 0)
+		close(info->map_fd);
+
+	xdp_ring_unmap(&info->fill);
+	xdp_ring_unmap(&info->comp);
+	xdp_ring_unmap(&info->rx);
+	xdp_ring_unmap(&info->tx);
+
+	if (info->fd >= 0)
+		close(info->fd);
+	if (info->umem)
+		munmap(info->umem, info->umem_len);
+	free(info->tx_frames);
+
+	info->fd = info->map_fd = info->prog_fd = -1;
+	info->attached = false;
+	info->umem = NULL;
+	info->tx_frames = NULL;
+}
+
+/*
+ * Give the frames of the last RX batch back to the kernel through the fill
+ * ring. There is always room, since the fill ring can hold every RX frame.
+ */
+static void xdp_rx_recycle(struct xdp_info *info)
+{
+	u32 prod = *info->fill.producer;
+	u32 i;
+
+	if (!info->rx_done)
+		return;
+
+	for (i = 0; i < info->rx_done; i++) {
+		u64 addr = xdp_ring_desc(&info->rx, info->rx_cons + i)->addr;
+
+		*xdp_ring_addr(&info->fill, prod + i) = addr & ~(u64)(XDP_FRAME_SIZE - 1);
+	}
+
+	xdp_ring_submit(&info->fill, prod + info->rx_done);
+
+	info->rx_cons += info->rx_done;
+	xdp_ring_release(&info->rx, info->rx_cons);
+	info->rx_avail = info->rx_done = 0;
+}
+
+static void xdp_rx_wait(struct xdp_info *info)
+{
+	struct pollfd pfd = {
+		.fd	= info->fd,
+		.events	= POLLIN,
+	};
+
+	/*
+	 * When busy polling, recvfrom() runs the driver's NAPI loop from this
+	 * thread and we keep spinning, otherwise sleep until packets arrive.
+	 */
+	if (info->busy_poll || xdp_ring_needs_wakeup(&info->fill))
+		recvfrom(info->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+
+	if (!info->busy_poll)
+		poll(&pfd, 1, -1);
+}
+
+int xdp_rx(struct iovec *iov, u16 in, struct xdp_info *info)
+{
+	struct virtio_net_hdr_v1_hash vnet = {};
+	struct xdp_desc *desc;
+
+	if (info->rx_done == info->rx_avail) {
+		xdp_rx_recycle(info);
+
+		while (!(info->rx_avail = xdp_ring_avail(&info->rx, info->rx_cons)))
+			xdp_rx_wait(info);
+
+		info->rx_avail = min_t(u32, info->rx_avail, XDP_BATCH);
+	}
+
+	desc = xdp_ring_desc(&info->rx, info->rx_cons + info->rx_done++);
+
+	/* Frames come straight off the wire, with no offloads to describe */
+	memcpy_toiovecend(iov, (unsigned char *)&vnet, 0, info->vnet_hdr_len);
+	memcpy_toiovecend(iov, info->umem + desc->addr, info->vnet_hdr_len,
+			  desc->len);
+
+	return info->vnet_hdr_len + desc->len;
+}
+
+static void xdp_tx_complete(struct xdp_info *info)
+{
+	u32 nr, i;
+
+	nr = xdp_ring_avail(&info->comp, info->comp_cons);
+	if (!nr)
+		return;
+
+	for (i = 0; i < nr; i++)
+		info->tx_frames[info->tx_nr_free++] =
+			*xdp_ring_addr(&info->comp, info->comp_cons + i);
+
+	info->comp_cons += nr;
+	xdp_ring_release(&info->comp, info->comp_cons);
+}
+
+/*
+ * In copy mode each sendto() only sends a small batch, so keep kicking for as
+ * long as the kernel makes progress on the TX ring.
+ */
+static void xdp_tx_kick(struct xdp_info *info)
+{
+	u32 cons;
+
+	if (!xdp_ring_needs_wakeup(&info->tx))
+		return;
+
+	do {
+		cons = *(volatile u32 *)info->tx.consumer;
+		if (cons == info->tx_prod)
+			break;
+
+		sendto(info->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+	} while (*(volatile u32 *)info->tx.consumer != cons);
+}
+
+void xdp_tx_flush(struct xdp_info *info)
+{
+	if (!info->tx_pending)
+		return;
+
+	xdp_ring_submit(&info->tx, info->tx_prod);
+	info->tx_pending = 0;
+
+	xdp_tx_kick(info);
+	xdp_tx_complete(info);
+}
+
+static u64 xdp_tx_frame_get(struct xdp_info *info)
+{
+	struct pollfd pfd = {
+		.fd	= info->fd,
+		.events	= POLLOUT,
+	};
+
+	if (!info->tx_nr_free)
+		xdp_tx_complete(info);
+
+	/* Every frame is in flight, push what we have and wait for some back */
+	while (!info->tx_nr_free) {
+		xdp_tx_flush(info);
+		if (info->tx_nr_free)
+			break;
+
+		xdp_tx_kick(info);
+		poll(&pfd, 1, 1);
+		xdp_tx_complete(info);
+	}
+
+	return info->tx_frames[--info->tx_nr_free];
+}
+
+int xdp_tx(struct iovec *iov, u16 out, struct xdp_info *info)
+{
+	struct xdp_desc *desc;
+	int len, hdr_len = info->vnet_hdr_len;
+	u64 addr;
+
+	len = iov_size(iov, out);
+	if (len <= hdr_len || len - hdr_len > XDP_FRAME_SIZE) {
+		pr_warning("xdp: dropping %d byte frame", len - hdr_len);
+		return len;
+	}
+
+	addr = xdp_tx_frame_get(info);
+	memcpy_fromiovecend(info->umem + addr, iov, hdr_len, len - hdr_len);
+
+	/* A free frame means a free slot, the TX ring holds all of them */
+	desc = xdp_ring_desc(&info->tx, info->tx_prod++);
+	desc->addr	= addr;
+	desc->len	= len - hdr_len;
+	desc->options	= 0;
+
+	if (++info->tx_pending >= XDP_BATCH)
+		xdp_tx_flush(info);
+
+	return len;
+}
@@ -3,12 +3,14 @@
 #include <termios.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/uio.h>
 #include <signal.h>
 #include <pty.h>
 #include <utmp.h>
 
 #include "kvm/read-write.h"
+#include "kvm/mutex.h"
 #include "kvm/term.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
@@ -23,6 +25,39 @@ static int term_fds[TERM_MAX_DEVS][2];
 
 static pthread_t term_poll_thread;
 
+/*
+ * Guest output is staged in a ring per terminal and written out by a
+ * dedicated thread, so that vCPUs never wait on a slow tty or pipe unless
+ * the ring fills up and the overflow policy says so.
+ */
+#define TERM_RING_SIZE		(64 * 1024)
+/*
+ * How long to wait for a terminal that doesn't take output, before looking
+ * at the rings again
+ */
+#define TERM_OUT_POLL_MS	100
+
+struct term_ring {
+	char			buf[TERM_RING_SIZE];
+	u64			head;	/* written by the guest */
+	u64			tail;	/* written out to the host */
+	u64			dropped;
+};
+
+static struct term_ring	term_rings[TERM_MAX_DEVS];
+static DEFINE_MUTEX(term_out_lock);
+static pthread_cond_t	term_out_data = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	term_out_space = PTHREAD_COND_INITIALIZER;
+static pthread_t	term_out_thread;
+static bool		term_out_running;
+static bool		term_out_exiting;
+static bool		term_out_drop;
+
+static int		term_log_fd = -1;
+static const char	*term_log_path;
+static u64		term_log_size;
+static u64		term_log_max;
+
 /* ctrl-a is used for escape */
 #define term_escape_char	0x01
 
@@ -50,22 +85,43 @@ int term_getc(struct kvm *kvm, int term)
 	return c;
 }
 
-int term_putc(char *addr, int cnt, int term)
+/* Called with term_out_lock held */
+static int term_ring_put(struct term_ring *ring, const char *addr, int cnt)
 {
-	int ret;
-	int num_remaining = cnt;
+	int done = 0;
+	u64 pos, len;
+
+	while (done < cnt) {
+		while (ring->head - ring->tail == TERM_RING_SIZE) {
+			if (term_out_drop || !term_out_running) {
+				ring->dropped += cnt - done;
+				return cnt;
+			}
+			pthread_cond_wait(&term_out_space, &term_out_lock.mutex);
+		}
 
-	while (num_remaining) {
-		ret = write(term_fds[term][TERM_FD_OUT], addr, num_remaining);
-		if (ret < 0)
-			return cnt - num_remaining;
-		num_remaining -= ret;
-		addr += ret;
+		pos = ring->head % TERM_RING_SIZE;
+		len = min_t(u64, cnt - done, TERM_RING_SIZE - (ring->head - ring->tail));
+		len = min_t(u64, len, TERM_RING_SIZE - pos);
+
+		memcpy(ring->buf + pos, addr + done, len);
+		ring->head += len;
+		done += len;
 	}
 
 	return cnt;
 }
 
+int term_putc(char *addr, int cnt, int term)
+{
+	mutex_lock(&term_out_lock);
+	cnt = term_ring_put(&term_rings[term], addr, cnt);
+	pthread_cond_signal(&term_out_data);
+	mutex_unlock(&term_out_lock);
+
+	return cnt;
+}
+
 int term_getc_iov(struct kvm *kvm, struct iovec *iov, int iovcnt, int term)
 {
 	int c;
@@ -82,7 +138,219 @@ int term_getc_iov(struct kvm *kvm, struct iovec *iov, int iovcnt, int term)
 
 int term_putc_iov(struct iovec *iov, int iovcnt, int term)
 {
-	return writev(term_fds[term][TERM_FD_OUT], iov, iovcnt);
+	int i, cnt = 0;
+
+	mutex_lock(&term_out_lock);
+	for (i = 0; i < iovcnt; i++)
+		cnt += term_ring_put(&term_rings[term], iov[i].iov_base,
+				     iov[i].iov_len);
+	pthread_cond_signal(&term_out_data);
+	mutex_unlock(&term_out_lock);
+
+	return cnt;
+}
+
+static void term_log_open(void)
+{
+	term_log_fd = open(term_log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (term_log_fd < 0) {
+		pr_warning("unable to open console log %s", term_log_path);
+		return;
+	}
+
+	term_log_size = lseek(term_log_fd, 0, SEEK_END);
+}
+
+/* Keep one previous generation of the log, as <path>.1 */
+static void term_log_rotate(void)
+{
+	char old_path[PATH_MAX];
+
+	close(term_log_fd);
+
+	snprintf(old_path, sizeof(old_path), "%s.1", term_log_path);
+	if (rename(term_log_path, old_path) < 0)
+		pr_warning("unable to rotate console log %s", term_log_path);
+
+	term_log_open();
+}
+
+/* Log the first len bytes of iov, what the terminal took of it */
+static void term_log_write(struct iovec *iov, int iovcnt, ssize_t len)
+{
+	ssize_t left = len;
+	int i;
+
+	if (term_log_fd < 0 || len <= 0)
+		return;
+
+	for (i = 0; i < iovcnt && left; i++) {
+		iov[i].iov_len = min_t(size_t, iov[i].iov_len, left);
+		left -= iov[i].iov_len;
+	}
+	iovcnt = i;
+
+	if (term_log_max && term_log_size + len > term_log_max) {
+		term_log_rotate();
+		if (term_log_fd < 0)
+			return;
+	}
+
+	if (writev_in_full(term_log_fd, iov, iovcnt) == len)
+		term_log_size += len;
+}
+
+/*
+ * Write out what's pending in the ring of a terminal, with at most one
+ * writev. Called without term_out_lock held, returns the number of bytes
+ * consumed.
+ */
+static ssize_t term_ring_flush(int term, u64 head, u64 tail)
+{
+	struct term_ring *ring = &term_rings[term];
+	struct iovec iov[2];
+	u64 pos = tail % TERM_RING_SIZE;
+	u64 len = head - tail;
+	int iovcnt = 1;
+	ssize_t ret;
+
+	iov[0].iov_base = ring->buf + pos;
+	iov[0].iov_len = min_t(u64, len, TERM_RING_SIZE - pos);
+	if (iov[0].iov_len < len) {
+		iov[1].iov_base = ring->buf;
+		iov[1].iov_len = len - iov[0].iov_len;
+		iovcnt = 2;
+	}
+
+	ret = xwritev(term_fds[term][TERM_FD_OUT], iov, iovcnt);
+	if (ret < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		/* Nobody is listening anymore, discard the output */
+		ret = len;
+	}
+
+	term_log_write(iov, iovcnt, ret);
+
+	return ret;
+}
+
+/* Wait until one of the terminals with pending output can take some */
+static void term_out_wait(u64 *head, u64 *tail)
+{
+	struct pollfd fds[TERM_MAX_DEVS];
+	int i, nr = 0;
+
+	for (i = 0; i < TERM_MAX_DEVS; i++) {
+		if (head[i] == tail[i])
+			continue;
+
+		fds[nr++] = (struct pollfd) {
+			.fd	= term_fds[i][TERM_FD_OUT],
+			.events	= POLLOUT,
+		};
+	}
+
+	poll(fds, nr, TERM_OUT_POLL_MS);
+}
+
+static void *term_out_thread_loop(void *param)
+{
+	u64 head[TERM_MAX_DEVS], tail[TERM_MAX_DEVS];
+	ssize_t done[TERM_MAX_DEVS];
+	bool pending, progress;
+	int i;
+
+	kvm__set_thread_name("term-out");
+
+	mutex_lock(&term_out_lock);
+	for (;;) {
+		pending = false;
+		for (i = 0; i < TERM_MAX_DEVS; i++) {
+			head[i] = term_rings[i].head;
+			tail[i] = term_rings[i].tail;
+			pending |= head[i] != tail[i];
+		}
+
+		if (!pending) {
+			if (term_out_exiting)
+				break;
+			pthread_cond_wait(&term_out_data, &term_out_lock.mutex);
+			continue;
+		}
+		mutex_unlock(&term_out_lock);
+
+		progress = false;
+		for (i = 0; i < TERM_MAX_DEVS; i++) {
+			done[i] = 0;
+			if (head[i] != tail[i])
+				done[i] = term_ring_flush(i, head[i], tail[i]);
+			progress |= done[i] > 0;
+		}
+
+		if (!progress)
+			term_out_wait(head, tail);
+
+		mutex_lock(&term_out_lock);
+		for (i = 0; i < TERM_MAX_DEVS; i++)
+			term_rings[i].tail += done[i];
+		pthread_cond_broadcast(&term_out_space);
+
+		/* Don't hold up the exit for a terminal that is stuck */
+		if (!progress && term_out_exiting)
+			break;
+	}
+	mutex_unlock(&term_out_lock);
+
+	return NULL;
+}
+
+static int term_out_init(struct kvm *kvm)
+{
+	const char *policy = kvm->cfg.console_overflow;
+
+	if (policy && !strcmp(policy, "drop"))
+		term_out_drop = true;
+	else if (policy && strcmp(policy, "block"))
+		die("Unknown console overflow policy: %s", policy);
+
+	if (kvm->cfg.console_log) {
+		term_log_path = kvm->cfg.console_log;
+		term_log_max = (u64)kvm->cfg.console_log_size << 20;
+		term_log_open();
+	}
+
+	term_out_running = true;
+
+	if (pthread_create(&term_out_thread, NULL, term_out_thread_loop, NULL))
+		die("Unable to create console output thread\n");
+
+	return 0;
+}
+
+static void term_out_exit(void)
+{
+	int i;
+
+	if (!term_out_running)
+		return;
+
+	mutex_lock(&term_out_lock);
+	term_out_exiting = true;
+	pthread_cond_signal(&term_out_data);
+	mutex_unlock(&term_out_lock);
+
+	pthread_join(term_out_thread, NULL);
+	term_out_running = false;
+
+	for (i = 0; i < TERM_MAX_DEVS; i++)
+		if (term_rings[i].dropped)
+			pr_warning("%llu bytes of console %d output dropped",
+				   (unsigned long long)term_rings[i].dropped, i);
+
+	if (term_log_fd >= 0)
+		close(term_log_fd);
+	term_log_fd = -1;
 }
 
 bool term_readable(int term)
@@ -179,6 +447,13 @@ static int term_init(struct kvm *kvm)
 			term_fds[i][TERM_FD_OUT] = STDOUT_FILENO;
 		}
 
+	r = term_out_init(kvm);
+	if (r < 0)
+		return r;
+
+	/* Don't lose pending output when exiting on an error */
+	atexit(term_out_exit);
+
 	if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
 		return 0;
 
@@ -208,6 +483,8 @@ dev_init(term_init);
 
 static int term_exit(struct kvm *kvm)
 {
+	term_out_exit();
+
 	return 0;
 }
 dev_exit(term_exit);
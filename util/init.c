@@ -1,6 +1,8 @@
 #include <linux/list.h>
 #include <linux/kernel.h>
+#include <pthread.h>
 
+#include "kvm/boot-trace.h"
 #include "kvm/kvm.h"
 #include "kvm/util-init.h"
 
@@ -29,22 +31,109 @@ int exit_list_add(struct init_item *t, int (*init)(struct kvm *),
 	return 0;
 }
 
+struct init_job {
+	struct init_item	*t;
+	struct kvm		*kvm;
+	pthread_t		thread;
+	bool			started;
+	int			r;
+};
+
+static int init_item__run(struct kvm *kvm, struct init_item *t)
+{
+	u64 start = boot_trace__now();
+	int r;
+
+	r = t->init(kvm);
+	boot_trace__span(kvm, t->fn_name, start);
+
+	return r;
+}
+
+static void *init_job__thread(void *arg)
+{
+	struct init_job *job = arg;
+
+	kvm__set_thread_name("kvm-init");
+	job->r = init_item__run(job->kvm, job->t);
+
+	return NULL;
+}
+
+/*
+ * The parallel callbacks of the level are started first, then the others run
+ * in order. All of them are waited for before reporting a failure.
+ */
+static int init_list__run_level(struct kvm *kvm, struct hlist_head *list)
+{
+	struct init_job *jobs = NULL;
+	struct init_item *t, *failed = NULL;
+	unsigned int nr_jobs = 0, i;
+	int r = 0;
+
+	hlist_for_each_entry(t, list, n)
+		nr_jobs += t->parallel;
+
+	if (nr_jobs) {
+		jobs = calloc(nr_jobs, sizeof(*jobs));
+		if (!jobs)
+			return -ENOMEM;
+	}
+
+	i = 0;
+	hlist_for_each_entry(t, list, n) {
+		if (!t->parallel)
+			continue;
+
+		jobs[i] = (struct init_job) { .t = t, .kvm = kvm };
+		jobs[i].started = !pthread_create(&jobs[i].thread, NULL,
+						  init_job__thread, &jobs[i]);
+		i++;
+	}
+
+	hlist_for_each_entry(t, list, n) {
+		if (t->parallel)
+			continue;
+
+		r = init_item__run(kvm, t);
+		if (r < 0) {
+			failed = t;
+			break;
+		}
+	}
+
+	/* Jobs that couldn't get a thread run here, unless the level failed */
+	for (i = 0; i < nr_jobs; i++) {
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+		else if (!failed)
+			jobs[i].r = init_item__run(kvm, jobs[i].t);
+
+		if (jobs[i].r < 0 && !failed) {
+			failed = jobs[i].t;
+			r = jobs[i].r;
+		}
+	}
+
+	free(jobs);
+
+	if (failed)
+		pr_warning("Failed init: %s\n", failed->fn_name);
+
+	return r;
+}
+
 int init_list__init(struct kvm *kvm)
 {
 	unsigned int i;
 	int r = 0;
-	struct init_item *t;
 
-	for (i = 0; i < ARRAY_SIZE(init_lists); i++)
-		hlist_for_each_entry(t, &init_lists[i], n) {
-			r = t->init(kvm);
-			if (r < 0) {
-				pr_warning("Failed init: %s\n", t->fn_name);
-				goto fail;
-			}
-		}
+	for (i = 0; i < ARRAY_SIZE(init_lists); i++) {
+		r = init_list__run_level(kvm, &init_lists[i]);
+		if (r < 0)
+			break;
+	}
 
-fail:
 	return r;
 }
 
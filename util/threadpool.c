@@ -1,138 +1,275 @@
 #include "kvm/threadpool.h"
+#include "kvm/barrier.h"
 #include "kvm/mutex.h"
 #include "kvm/kvm.h"
 
+#include <linux/cpumask.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 
-static DEFINE_MUTEX(job_mutex);
-static DEFINE_MUTEX(thread_mutex);
-static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+/*
+ * Each worker owns a job queue. A job gets a home worker the first time it
+ * is queued and always goes back to that queue, so queueing a job only takes
+ * the lock of one worker and only wakes that worker up. Workers that run out
+ * of jobs steal from the other queues, and spin for a while before going to
+ * sleep. When the home worker is busy running a job, a sleeping worker is
+ * kicked so that it steals the new one: the running job may well be waiting
+ * for it.
+ */
+#define THREAD_POOL_SPIN_LOOPS	1000
+
+struct thread_pool__worker {
+	struct mutex		mutex;
+	pthread_cond_t		cond;
+	struct list_head	head;
+	bool			sleeping;
+	bool			kicked;
+	/* Only read as a hint, without the lock */
+	bool			busy;
+	pthread_t		thread;
+};
+
+static struct thread_pool__worker	*workers;
+static long				threadcount;
+static int				nr_sleeping;
+static unsigned int			next_worker;
+static bool				running;
+
+static struct thread_pool__job *
+thread_pool__job_pop_locked(struct thread_pool__worker *worker)
+{
+	struct thread_pool__job *job;
+
+	if (list_empty(&worker->head))
+		return NULL;
 
-static LIST_HEAD(head);
+	job = list_first_entry(&worker->head, struct thread_pool__job, queue);
+	list_del_init(&job->queue);
 
-static pthread_t	*threads;
-static long		threadcount;
-static bool		running;
+	return job;
+}
 
-static struct thread_pool__job *thread_pool__job_pop_locked(void)
+static struct thread_pool__job *
+thread_pool__job_pop(struct thread_pool__worker *worker, bool steal)
 {
 	struct thread_pool__job *job;
 
-	if (list_empty(&head))
+	/* Peek without the lock, to leave it to producers when idle */
+	if (list_empty(&worker->head))
 		return NULL;
 
-	job = list_first_entry(&head, struct thread_pool__job, queue);
-	list_del_init(&job->queue);
+	if (!steal)
+		mutex_lock(&worker->mutex);
+	else if (pthread_mutex_trylock(&worker->mutex.mutex))
+		return NULL;
+
+	job = thread_pool__job_pop_locked(worker);
+	mutex_unlock(&worker->mutex);
 
 	return job;
 }
 
-static void thread_pool__job_push_locked(struct thread_pool__job *job)
+static struct thread_pool__job *
+thread_pool__job_steal(struct thread_pool__worker *self)
 {
-	list_add_tail(&job->queue, &head);
+	struct thread_pool__job *job;
+	long i, idx = self - workers;
+
+	for (i = 1; i < threadcount; i++) {
+		job = thread_pool__job_pop(&workers[(idx + i) % threadcount],
+					   true);
+		if (job)
+			return job;
+	}
+
+	return NULL;
 }
 
-static struct thread_pool__job *thread_pool__job_pop(void)
+/* Wake up one sleeping worker other than self, to steal jobs */
+static void thread_pool__kick(struct thread_pool__worker *self)
 {
-	struct thread_pool__job *job;
+	struct thread_pool__worker *worker;
+	long i, idx = self - workers;
+	bool kicked;
+
+	for (i = 1; i < threadcount && nr_sleeping; i++) {
+		worker = &workers[(idx + i) % threadcount];
+
+		mutex_lock(&worker->mutex);
+		kicked = worker->sleeping && !worker->kicked;
+		if (kicked) {
+			worker->kicked = true;
+			pthread_cond_signal(&worker->cond);
+		}
+		mutex_unlock(&worker->mutex);
 
-	mutex_lock(&job_mutex);
-	job = thread_pool__job_pop_locked();
-	mutex_unlock(&job_mutex);
-	return job;
+		if (kicked)
+			break;
+	}
 }
 
 static void thread_pool__job_push(struct thread_pool__job *job)
 {
-	mutex_lock(&job_mutex);
-	thread_pool__job_push_locked(job);
-	mutex_unlock(&job_mutex);
+	struct thread_pool__worker *worker = &workers[job->worker];
+	bool wake;
+
+	mutex_lock(&worker->mutex);
+	list_add_tail(&job->queue, &worker->head);
+	wake = worker->sleeping;
+	mutex_unlock(&worker->mutex);
+
+	if (wake)
+		pthread_cond_signal(&worker->cond);
+	else if (worker->busy)
+		thread_pool__kick(worker);
 }
 
 static void thread_pool__handle_job(struct thread_pool__job *job)
 {
-	while (job) {
-		job->callback(job->kvm, job->data);
+	job->callback(job->kvm, job->data);
 
-		mutex_lock(&job->mutex);
-
-		if (--job->signalcount > 0)
-			/* If the job was signaled again while we were working */
-			thread_pool__job_push(job);
-
-		mutex_unlock(&job->mutex);
-
-		job = thread_pool__job_pop();
-	}
-}
-
-static void thread_pool__threadfunc_cleanup(void *param)
-{
-	mutex_unlock(&job_mutex);
+	/* If the job was signaled again while we were working */
+	if (__sync_sub_and_fetch(&job->signalcount, 1) > 0)
+		thread_pool__job_push(job);
 }
 
 static void *thread_pool__threadfunc(void *param)
 {
-	pthread_cleanup_push(thread_pool__threadfunc_cleanup, NULL);
+	struct thread_pool__worker *worker = param;
+	struct thread_pool__job *job;
+	int spins = 0;
 
 	kvm__set_thread_name("threadpool-worker");
 
 	while (running) {
-		struct thread_pool__job *curjob = NULL;
-
-		mutex_lock(&job_mutex);
-		while (running && (curjob = thread_pool__job_pop_locked()) == NULL)
-			pthread_cond_wait(&job_cond, &job_mutex.mutex);
-		mutex_unlock(&job_mutex);
+		job = thread_pool__job_pop(worker, false);
+		if (!job)
+			job = thread_pool__job_steal(worker);
+
+		if (job) {
+			worker->busy = true;
+			thread_pool__handle_job(job);
+			worker->busy = false;
+			spins = 0;
+			continue;
+		}
 
-		if (running)
-			thread_pool__handle_job(curjob);
+		if (spins++ < THREAD_POOL_SPIN_LOOPS) {
+			rmb();
+			continue;
+		}
+		spins = 0;
+
+		mutex_lock(&worker->mutex);
+		worker->sleeping = true;
+		__sync_fetch_and_add(&nr_sleeping, 1);
+		while (running && list_empty(&worker->head) && !worker->kicked)
+			pthread_cond_wait(&worker->cond, &worker->mutex.mutex);
+		__sync_fetch_and_sub(&nr_sleeping, 1);
+		worker->sleeping = false;
+		worker->kicked = false;
+		mutex_unlock(&worker->mutex);
 	}
 
-	pthread_cleanup_pop(0);
-
 	return NULL;
 }
 
-static int thread_pool__addthread(void)
+/* Returns 0, or the positive error number from pthread_create() */
+static int thread_pool__addthread(int cpu)
 {
+	struct thread_pool__worker *worker = &workers[threadcount];
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
 	int res;
-	void *newthreads;
 
-	mutex_lock(&thread_mutex);
-	newthreads = realloc(threads, (threadcount + 1) * sizeof(pthread_t));
-	if (newthreads == NULL) {
-		mutex_unlock(&thread_mutex);
-		return -1;
+	*worker = (struct thread_pool__worker) {
+		.mutex		= MUTEX_INITIALIZER,
+		.cond		= PTHREAD_COND_INITIALIZER,
+	};
+	INIT_LIST_HEAD(&worker->head);
+
+	pthread_attr_init(&attr);
+	if (cpu >= 0) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpu, &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
 	}
 
-	threads = newthreads;
-
-	res = pthread_create(threads + threadcount, NULL,
-			     thread_pool__threadfunc, NULL);
+	res = pthread_create(&worker->thread, &attr, thread_pool__threadfunc,
+			     worker);
+	pthread_attr_destroy(&attr);
 
 	if (res == 0)
 		threadcount++;
-	mutex_unlock(&thread_mutex);
 
 	return res;
 }
 
 int thread_pool__init(struct kvm *kvm)
 {
-	unsigned long i;
+	const char *affinity = kvm->cfg.threadpool_affinity;
 	unsigned int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	cpumask_t *cpumask = NULL;
+	int cpu = -1;
+	unsigned long i;
+
+	if (affinity) {
+		cpumask = calloc(1, cpumask_size());
+		if (!cpumask)
+			return -ENOMEM;
+
+		if (cpulist_parse(affinity, cpumask)) {
+			pr_err("Invalid thread pool affinity %s", affinity);
+			free(cpumask);
+			return -EINVAL;
+		}
+
+		/* One worker per CPU in the list */
+		thread_count = 0;
+		for_each_cpu(cpu, cpumask)
+			thread_count++;
+
+		if (!thread_count) {
+			pr_err("Empty thread pool affinity %s", affinity);
+			free(cpumask);
+			return -EINVAL;
+		}
+	}
+
+	workers = calloc(thread_count, sizeof(*workers));
+	if (!workers) {
+		free(cpumask);
+		return -ENOMEM;
+	}
 
 	running = true;
 
-	for (i = 0; i < thread_count; i++)
-		if (thread_pool__addthread() < 0)
-			return i;
+	if (cpumask)
+		cpu = cpumask_next(-1, cpumask);
+
+	for (i = 0; i < thread_count; i++) {
+		if (thread_pool__addthread(cpu) != 0)
+			break;
 
-	return i;
+		if (cpumask)
+			cpu = cpumask_next(cpu, cpumask);
+	}
+
+	free(cpumask);
+
+	if (!threadcount) {
+		pr_err("Failed to start any thread pool worker");
+		return -EAGAIN;
+	}
+
+	if (threadcount < thread_count)
+		pr_warning("Only started %ld of %u thread pool workers",
+			   threadcount, thread_count);
+
+	return threadcount;
 }
 late_init(thread_pool__init);
 
@@ -144,13 +281,13 @@ int thread_pool__exit(struct kvm *kvm)
 	running = false;
 
 	for (i = 0; i < threadcount; i++) {
-		mutex_lock(&job_mutex);
-		pthread_cond_signal(&job_cond);
-		mutex_unlock(&job_mutex);
+		mutex_lock(&workers[i].mutex);
+		pthread_cond_signal(&workers[i].cond);
+		mutex_unlock(&workers[i].mutex);
 	}
 
 	for (i = 0; i < threadcount; i++) {
-		pthread_join(threads[i], NUL);
+		pthread_join(workers[i].thread, NUL);
 	}
 
 	return 0;
@@ -164,20 +301,31 @@ void thread_pool__do_job(struct thread_pool__job *job)
 	if (jobinfo == NULL || jobinfo->callback == NULL)
 		return;
 
-	mutex_lock(&jobinfo->mutex);
-	if (jobinfo->signalcount++ == 0)
-		thread_pool__job_push(job);
-	mutex_unlock(&jobinfo->mutex);
+	/* Before the pool is up, or if it failed to start */
+	if (!threadcount) {
+		jobinfo->callback(jobinfo->kvm, jobinfo->data);
+		return;
+	}
 
-	mutex_lock(&job_mutex);
-	pthread_cond_signal(&job_cond);
-	mutex_unlock(&job_mutex);
+	/* Spread jobs over the workers, the first time they are queued */
+	if (jobinfo->worker < 0)
+		__sync_bool_compare_and_swap(&jobinfo->worker, -1,
+			__sync_fetch_and_add(&next_worker, 1) % threadcount);
+
+	if (__sync_fetch_and_add(&jobinfo->signalcount, 1) == 0)
+		thread_pool__job_push(job);
 }
 
 void thread_pool__cancel_job(struct thread_pool__job *job)
 {
+	struct thread_pool__worker *worker;
 	bool running;
 
+	if (job->worker < 0)
+		return;
+
+	worker = &workers[job->worker];
+
 	/*
 	 * If the job is queued but not running, remove it. Otherwise, wait for
 	 * the signalcount to drop to 0, indicating that it has finished
@@ -185,7 +333,7 @@ void thread_pool__cancel_job(struct thread_pool__job *job)
 	 * thread_pool__do_job() isn't called - while this function is running.
 	 */
 	do {
-		mutex_lock(&job_mutex);
+		mutex_lock(&worker->mutex);
 		if (list_empty(&job->queue)) {
 			running = job->signalcount > 0;
 		} else {
@@ -193,6 +341,6 @@ void thread_pool__cancel_job(struct thread_pool__job *job)
 			job->signalcount = 0;
 			running = false;
 		}
-		mutex_unlock(&job_mutex);
+		mutex_unlock(&worker->mutex);
 	} while (running);
 }
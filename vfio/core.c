@@ -3,6 +3,8 @@
 #include "kvm/ioport.h"
 
 #include <linux/list.h>
+#include <linux/sizes.h>
+
 
 #define VFIO_DEV_DIR		"/dev/vfio"
 #define VFIO_DEV_NODE		VFIO_DEV_DIR "/vfio"
@@ -160,8 +162,8 @@ static void vfio_ioport_mmio(struct kvm_cpu *vcpu, u64 addr, u8 *data, u32 len,
 		vfio_ioport_in(region, offset, data, len);
 }
 
-static void vfio_mmio_access(struct kvm_cpu *vcpu, u64 addr, u8 *data, u32 len,
-			     u8 is_write, void *ptr)
+void vfio_mmio_access(struct kvm_cpu *vcpu, u64 addr, u8 *data, u32 len,
+		      u8 is_write, void *ptr)
 {
 	u64 val;
 	ssize_t nr;
@@ -363,25 +365,98 @@ static int vfio_get_iommu_type(void)
 	return -ENODEV;
 }
 
-static int vfio_map_mem_bank(struct kvm *kvm, struct kvm_mem_bank *bank, void *data)
+/*
+ * Pinning and mapping guest RAM is the bulk of VFIO startup time, and it
+ * scales with the size of the guest. Map each RAM bank in chunks so that
+ * progress can be reported. Type1 holds its lock for the whole of a map
+ * ioctl, so mapping chunks from several threads wouldn't be any faster.
+ */
+#define VFIO_DMA_CHUNK_SIZE	SZ_1G
+
+struct vfio_dma_map_progress {
+	u64				total;
+	u64				mapped;
+	unsigned int			last_percent;
+};
+
+static int vfio_map_dma_chunk(u64 iova, u64 vaddr, u64 size)
 {
-	int ret = 0;
 	struct vfio_iommu_type1_dma_map dma_map = {
 		.argsz	= sizeof(dma_map),
 		.flags	= VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
-		.vaddr	= (unsigned long)bank->host_addr,
-		.iova	= (u64)bank->guest_phys_addr,
-		.size	= bank->size,
+		.vaddr	= vaddr,
+		.iova	= iova,
+		.size	= size,
 	};
+	int ret;
 
 	/* Map the guest memory for DMA (i.e. provide isolation) */
 	if (ioctl(vfio_container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
 		ret = -errno;
 		pr_err("Failed to map 0x%llx -> 0x%llx (%llu) for DMA",
 		       dma_map.iova, dma_map.vaddr, dma_map.size);
+		return ret;
 	}
 
-	return ret;
+	return 0;
+}
+
+static int vfio_count_mem_bank(struct kvm *kvm, struct kvm_mem_bank *bank,
+			       void *data)
+{
+	struct vfio_dma_map_progress *progress = data;
+
+	progress->total += bank->size;
+
+	return 0;
+}
+
+static int vfio_map_mem_bank(struct kvm *kvm, struct kvm_mem_bank *bank,
+			     void *data)
+{
+	struct vfio_dma_map_progress *progress = data;
+	u64 chunk_size, offset, size;
+	unsigned int percent;
+	int ret;
+
+	/*
+	 * Keep chunk boundaries on huge page boundaries so that the IOMMU
+	 * driver can still use block mappings.
+	 */
+	chunk_size = ALIGN(VFIO_DMA_CHUNK_SIZE, kvm->ram_pagesize);
+
+	for (offset = 0; offset < bank->size; offset += size) {
+		size = min(chunk_size, bank->size - offset);
+
+		ret = vfio_map_dma_chunk(bank->guest_phys_addr + offset,
+					 (unsigned long)bank->host_addr + offset,
+					 size);
+		if (ret)
+			return ret;
+
+		progress->mapped += size;
+		percent = progress->mapped * 100 / progress->total;
+		if (percent / 10 > progress->last_percent / 10) {
+			progress->last_percent = percent;
+			pr_info("Mapped %llu/%llu MB of guest memory for DMA (%u%%)",
+				(unsigned long long)(progress->mapped >> 20),
+				(unsigned long long)(progress->total >> 20),
+				percent);
+		}
+	}
+
+	return 0;
+}
+
+static int vfio_map_mem_banks(struct kvm *kvm)
+{
+	struct vfio_dma_map_progress progress = {};
+
+	kvm__for_each_mem_bank(kvm, KVM_MEM_TYPE_RAM, vfio_count_mem_bank,
+			       &progress);
+
+	return kvm__for_each_mem_bank(kvm, KVM_MEM_TYPE_RAM, vfio_map_mem_bank,
+				      &progress);
 }
 
 static int vfio_unmap_mem_bank(struct kvm *kvm, struct kvm_mem_bank *bank, void *data)
@@ -641,8 +716,7 @@ static int vfio_container_init(struct kvm *kvm)
 		pr_info("Using IOMMU type %d for VFIO container", iommu_type);
 	}
 
-	return kvm__for_each_mem_bank(kvm, KVM_MEM_TYPE_RAM, vfio_map_mem_bank,
-				      NULL);
+	return vfio_map_mem_banks(kvm);
 }
 
 static int vfio__init(struct kvm *kvm)
@@ -17,6 +17,10 @@
 #define PCI_CAP_EXP_RC_ENDPOINT_SIZEOF_V1	12
 #endif
 
+#ifndef VFIO_REGION_INFO_CAP_MSIX_MAPPABLE
+#define VFIO_REGION_INFO_CAP_MSIX_MAPPABLE	3
+#endif
+
 /* Wrapper around UAPI vfio_irq_set */
 union vfio_irq_eventfd {
 	struct vfio_irq_set	irq;
@@ -271,6 +275,8 @@ static void vfio_pci_msix_pba_access(struct kvm_cpu *vcpu, u64 addr, u8 *data,
 	u64 offset = addr - pba->guest_phys_addr;
 	struct vfio_device *vdev = container_of(pdev, struct vfio_device, pci);
 
+	__sync_fetch_and_add(&pdev->msix_pba_exits, 1);
+
 	if (offset >= pba->size) {
 		vfio_dev_err(vdev, "access outside of the MSIX PBA");
 		return;
@@ -295,6 +301,8 @@ static void vfio_pci_msix_table_access(struct kvm_cpu *vcpu, u64 addr, u8 *data,
 	struct vfio_pci_device *pdev = ptr;
 	struct vfio_device *vdev = container_of(pdev, struct vfio_device, pci);
 
+	__sync_fetch_and_add(&pdev->msix_table_exits, 1);
+
 	u64 offset = addr - pdev->msix_table.guest_phys_addr;
 	if (offset >= pdev->msix_table.size) {
 		vfio_dev_err(vdev, "access outside of the MSI-X table");
@@ -492,6 +500,214 @@ out_unlock:
 	mutex_unlock(&pdev->msi.mutex);
 }
 
+/*
+ * When the MSI-X table BAR is mappable, only the pages containing the MSI-X
+ * table and the PBA are trapped. The gaps between them are mapped straight
+ * into the guest, so that accesses to the rest of the BAR don't exit. Device
+ * registers sharing a page with the table or the PBA are trapped as well,
+ * and forwarded to the device.
+ */
+struct vfio_pci_bar_gap {
+	u64				start;
+	u64				size;
+};
+
+#define VFIO_PCI_MSIX_BAR_GAPS		3
+/* Each of the two holes can have a trap before and after what it emulates */
+#define VFIO_PCI_MSIX_BAR_TRAPS		4
+
+struct vfio_pci_msix_bar_layout {
+	/* Mapped into the guest, or trapped if the BAR can't be mapped */
+	struct vfio_pci_bar_gap		gaps[VFIO_PCI_MSIX_BAR_GAPS];
+	size_t				nr_gaps;
+	/* Parts of the trapped pages outside of the table and the PBA */
+	struct vfio_pci_bar_gap		traps[VFIO_PCI_MSIX_BAR_TRAPS];
+	size_t				nr_traps;
+};
+
+static void vfio_pci_bar_gap_add(struct vfio_pci_bar_gap *gaps, size_t *nr,
+				 size_t max, u64 start, u64 end)
+{
+	if (start < end && !WARN_ON(*nr == max))
+		gaps[(*nr)++] = (struct vfio_pci_bar_gap) {
+			.start	= start,
+			.size	= end - start,
+		};
+}
+
+static void vfio_pci_msix_bar_layout(struct vfio_pci_device *pdev,
+				     struct vfio_region *region,
+				     struct vfio_pci_msix_bar_layout *layout)
+{
+	struct vfio_pci_msix_table *table = &pdev->msix_table;
+	struct vfio_pci_msix_pba *pba = &pdev->msix_pba;
+	u64 page_size = sysconf(_SC_PAGESIZE);
+	u64 start[2], end[2], emul_start[2], emul_end[2], tmp;
+	size_t i, j, nr_emul = 1, nr_holes;
+	u64 pos = 0, hole_pos;
+
+	*layout = (struct vfio_pci_msix_bar_layout) { };
+
+	emul_start[0] = table->bar_offset;
+	emul_end[0] = (u64)table->bar_offset + table->size;
+
+	if (pba->bar == table->bar) {
+		emul_start[1] = pba->bar_offset;
+		emul_end[1] = (u64)pba->bar_offset + pba->size;
+		nr_emul = 2;
+
+		if (emul_start[1] < emul_start[0]) {
+			tmp = emul_start[0], emul_start[0] = emul_start[1], emul_start[1] = tmp;
+			tmp = emul_end[0], emul_end[0] = emul_end[1], emul_end[1] = tmp;
+		}
+	}
+
+	for (i = 0; i < nr_emul; i++) {
+		start[i] = round_down(emul_start[i], page_size);
+		end[i] = ALIGN(emul_end[i], page_size);
+	}
+
+	/* Table and PBA share a page, or are in adjacent pages */
+	nr_holes = nr_emul;
+	if (nr_holes == 2 && start[1] <= end[0]) {
+		end[0] = max(end[0], end[1]);
+		nr_holes = 1;
+	}
+
+	for (i = 0; i < nr_holes; i++) {
+		vfio_pci_bar_gap_add(layout->gaps, &layout->nr_gaps,
+				     VFIO_PCI_MSIX_BAR_GAPS, pos, start[i]);
+		pos = end[i];
+	}
+	vfio_pci_bar_gap_add(layout->gaps, &layout->nr_gaps,
+			     VFIO_PCI_MSIX_BAR_GAPS, pos, region->info.size);
+
+	/* What the table and PBA handlers don't cover in the holes */
+	for (i = 0; i < nr_holes; i++) {
+		hole_pos = start[i];
+		for (j = 0; j < nr_emul; j++) {
+			if (emul_end[j] <= hole_pos || emul_start[j] >= end[i])
+				continue;
+
+			vfio_pci_bar_gap_add(layout->traps, &layout->nr_traps,
+					     VFIO_PCI_MSIX_BAR_TRAPS, hole_pos,
+					     emul_start[j]);
+			hole_pos = max(hole_pos, emul_end[j]);
+		}
+		vfio_pci_bar_gap_add(layout->traps, &layout->nr_traps,
+				     VFIO_PCI_MSIX_BAR_TRAPS, hole_pos,
+				     min(end[i], region->info.size));
+	}
+}
+
+static void vfio_pci_unmap_msix_bar(struct kvm *kvm, struct vfio_device *vdev,
+				    struct vfio_region *region)
+{
+	struct vfio_pci_msix_bar_layout layout;
+	struct vfio_pci_bar_gap *gap;
+	size_t i;
+
+	vfio_pci_msix_bar_layout(&vdev->pci, region, &layout);
+
+	for (i = 0; i < layout.nr_gaps; i++) {
+		gap = &layout.gaps[i];
+		if (region->host_addr)
+			kvm__destroy_mem(kvm, region->guest_phys_addr + gap->start,
+					 gap->size, region->host_addr + gap->start);
+		else
+			kvm__deregister_mmio(kvm, region->guest_phys_addr + gap->start);
+	}
+
+	for (i = 0; i < layout.nr_traps; i++)
+		kvm__deregister_mmio(kvm, region->guest_phys_addr +
+				     layout.traps[i].start);
+
+	if (region->host_addr) {
+		munmap(region->host_addr, region->info.size);
+		region->host_addr = NULL;
+	}
+}
+
+static int vfio_pci_map_msix_bar(struct kvm *kvm, struct vfio_device *vdev,
+				 struct vfio_region *region)
+{
+	struct vfio_pci_msix_bar_layout layout;
+	struct vfio_pci_bar_gap *gap;
+	size_t i, nr_traps;
+	int ret, prot = 0;
+	void *base;
+
+	vfio_pci_msix_bar_layout(&vdev->pci, region, &layout);
+
+	for (nr_traps = 0; nr_traps < layout.nr_traps; nr_traps++) {
+		gap = &layout.traps[nr_traps];
+		ret = kvm__register_mmio(kvm, region->guest_phys_addr + gap->start,
+					 gap->size, false, vfio_mmio_access,
+					 region);
+		if (ret < 0)
+			goto err_traps;
+	}
+
+	if (!layout.nr_gaps)
+		return 0;
+
+	if (region->info.flags & VFIO_REGION_INFO_FLAG_READ)
+		prot |= PROT_READ;
+	if (region->info.flags & VFIO_REGION_INFO_FLAG_WRITE)
+		prot |= PROT_WRITE;
+
+	base = mmap(NULL, region->info.size, prot, MAP_SHARED, vdev->fd,
+		    region->info.offset);
+	if (base == MAP_FAILED) {
+		vfio_dev_warn(vdev, "failed to mmap MSI-X BAR %u, falling back to trapping",
+			      region->info.index);
+
+		for (i = 0; i < layout.nr_gaps; i++) {
+			gap = &layout.gaps[i];
+			ret = kvm__register_mmio(kvm,
+						 region->guest_phys_addr + gap->start,
+						 gap->size, false,
+						 vfio_mmio_access, region);
+			if (ret < 0)
+				goto err_gaps;
+		}
+
+		return 0;
+	}
+	region->host_addr = base;
+
+	for (i = 0; i < layout.nr_gaps; i++) {
+		gap = &layout.gaps[i];
+		ret = kvm__register_dev_mem(kvm, region->guest_phys_addr + gap->start,
+					    gap->size, base + gap->start);
+		if (ret) {
+			vfio_dev_err(vdev, "failed to register MSI-X BAR with KVM");
+			goto err_unmap;
+		}
+	}
+
+	return 0;
+
+err_unmap:
+	while (i--)
+		kvm__destroy_mem(kvm, region->guest_phys_addr + layout.gaps[i].start,
+				 layout.gaps[i].size, base + layout.gaps[i].start);
+	munmap(base, region->info.size);
+	region->host_addr = NULL;
+	goto err_traps;
+
+err_gaps:
+	while (i--)
+		kvm__deregister_mmio(kvm, region->guest_phys_addr +
+				     layout.gaps[i].start);
+err_traps:
+	while (nr_traps--)
+		kvm__deregister_mmio(kvm, region->guest_phys_addr +
+				     layout.traps[nr_traps].start);
+
+	return ret;
+}
+
 static int vfio_pci_bar_activate(struct kvm *kvm,
 				 struct pci_device_header *pci_hdr,
 				 int bar_num, void *data)
@@ -517,23 +733,32 @@ static int vfio_pci_bar_activate(struct kvm *kvm,
 		region->guest_phys_addr = bar_addr;
 
 	if (has_msix && (u32)bar_num == table->bar) {
-		table->guest_phys_addr = region->guest_phys_addr;
+		table->guest_phys_addr = region->guest_phys_addr + table->bar_offset;
 		ret = kvm__register_mmio(kvm, table->guest_phys_addr,
 					 table->size, false,
 					 vfio_pci_msix_table_access, pdev);
+		if (ret < 0)
+			goto out;
+
+		if (table->mappable) {
+			ret = vfio_pci_map_msix_bar(kvm, vdev, region);
+			if (ret < 0)
+				goto out;
+		}
+
 		/*
 		 * The MSIX table and the PBA structure can share the same BAR,
 		 * but for convenience we register different regions for mmio
 		 * emulation. We want to we update both if they share the same
 		 * BAR.
 		 */
-		if (ret < 0 || table->bar != pba->bar)
+		if (table->bar != pba->bar)
 			goto out;
 	}
 
 	if (has_msix && (u32)bar_num == pba->bar) {
 		if (pba->bar == table->bar)
-			pba->guest_phys_addr = table->guest_phys_addr + pba->bar_offset;
+			pba->guest_phys_addr = region->guest_phys_addr + pba->bar_offset;
 		else
 			pba->guest_phys_addr = region->guest_phys_addr;
 		ret = kvm__register_mmio(kvm, pba->guest_phys_addr,
@@ -565,6 +790,9 @@ static int vfio_pci_bar_deactivate(struct kvm *kvm,
 	has_msix = pdev->irq_modes & VFIO_PCI_IRQ_MODE_MSIX;
 
 	if (has_msix && (u32)bar_num == table->bar) {
+		if (table->mappable)
+			vfio_pci_unmap_msix_bar(kvm, vdev, region);
+
 		success = kvm__deregister_mmio(kvm, table->guest_phys_addr);
 		/* kvm__deregister_mmio fails when the region is not found. */
 		ret = (success ? 0 : -ENOENT);
@@ -851,8 +1079,12 @@ static int vfio_pci_fixup_cfg_space(struct vfio_device *vdev)
 		pdev->msix_pba.fd_offset = vdev->regions[pba_index].info.offset +
 					   pba_bar_offset;
 
-		/* Tidy up the capability */
+		/*
+		 * Tidy up the capability. The table stays at its physical
+		 * offset when the rest of the BAR is mapped into the guest.
+		 */
 		msix->table_offset &= PCI_MSIX_TABLE_BIR;
+		msix->table_offset |= pdev->msix_table.bar_offset;
 		if (pdev->msix_table.bar == pdev->msix_pba.bar) {
 			/* Keep the same offset as the MSIX cap. */
 			pdev->msix_pba.bar_offset = pba_bar_offset;
@@ -913,6 +1145,62 @@ static int vfio_pci_get_region_info(struct vfio_device *vdev, u32 index,
 	return 0;
 }
 
+/*
+ * Check whether VFIO allows mmapping the BAR that holds the MSI-X table. In
+ * that case the table can stay at its physical offset in the BAR and
+ * everything else in the BAR can be accessed by the guest without exits.
+ */
+static bool vfio_pci_msix_bar_is_mappable(struct vfio_device *vdev, u32 index)
+{
+	struct vfio_info_cap_header *cap;
+	struct vfio_region_info *info;
+	bool mappable = false;
+	u32 argsz, offset;
+
+	argsz = sizeof(*info);
+	info = calloc(1, argsz);
+	if (!info)
+		return false;
+
+	for (;;) {
+		info->argsz = argsz;
+		info->index = index;
+
+		if (ioctl(vdev->fd, VFIO_DEVICE_GET_REGION_INFO, info))
+			goto out_free;
+
+		if (!(info->flags & VFIO_REGION_INFO_FLAG_MMAP) ||
+		    !(info->flags & VFIO_REGION_INFO_FLAG_CAPS))
+			goto out_free;
+
+		if (info->argsz <= argsz)
+			break;
+
+		/* Retry with enough room for the capability chain */
+		argsz = info->argsz;
+		free(info);
+		info = calloc(1, argsz);
+		if (!info)
+			return false;
+	}
+
+	for (offset = info->cap_offset; offset; offset = cap->next) {
+		if (offset + sizeof(*cap) > argsz)
+			break;
+
+		cap = (void *)info + offset;
+		if (cap->id == VFIO_REGION_INFO_CAP_MSIX_MAPPABLE) {
+			mappable = true;
+			break;
+		}
+	}
+
+out_free:
+	free(info);
+
+	return mappable;
+}
+
 static int vfio_pci_create_msix_table(struct kvm *kvm, struct vfio_device *vdev)
 {
 	int ret;
@@ -925,6 +1213,7 @@ static int vfio_pci_create_msix_table(struct kvm *kvm, struct vfio_device *vdev)
 	struct vfio_pci_msix_table *table = &pdev->msix_table;
 	struct msix_cap *msix = PCI_CAP(&pdev->hdr, pdev->msix.pos);
 	struct vfio_region_info info;
+	u32 bar_addr;
 
 	table->bar = msix->table_offset & PCI_MSIX_TABLE_BIR;
 	pba->bar = msix->pba_offset & PCI_MSIX_TABLE_BIR;
@@ -948,13 +1237,21 @@ static int vfio_pci_create_msix_table(struct kvm *kvm, struct vfio_device *vdev)
 	if (!info.size)
 		return -EINVAL;
 
+	table->mappable = vfio_pci_msix_bar_is_mappable(vdev, table->bar);
+	if (table->mappable) {
+		table->bar_offset = msix->table_offset & PCI_MSIX_TABLE_OFFSET;
+		if (table->bar_offset + table->size > info.size)
+			die("MSIX table exceeds the size of the region");
+	}
+
 	map_size = ALIGN(info.size, MAX_PAGE_SIZE);
-	table->guest_phys_addr = pci_get_mmio_block(map_size);
-	if (!table->guest_phys_addr) {
+	bar_addr = pci_get_mmio_block(map_size);
+	if (!bar_addr) {
 		pr_err("cannot allocate MMIO space");
 		ret = -ENOMEM;
 		goto out_free;
 	}
+	table->guest_phys_addr = bar_addr + table->bar_offset;
 
 	/*
 	 * We could map the physical PBA directly into the guest, but it's
@@ -968,11 +1265,12 @@ static int vfio_pci_create_msix_table(struct kvm *kvm, struct vfio_device *vdev)
 		u32 pba_bar_offset = msix->pba_offset & PCI_MSIX_PBA_OFFSET;
 
 		/* Sanity checks. */
-		if (table->size > pba_bar_offset)
+		if (table->bar_offset < pba_bar_offset + pba->size &&
+		    pba_bar_offset < table->bar_offset + table->size)
 			die("MSIX table overlaps with PBA");
 		if (pba_bar_offset + pba->size > info.size)
 			die("PBA exceeds the size of the region");
-		pba->guest_phys_addr = table->guest_phys_addr + pba_bar_offset;
+		pba->guest_phys_addr = bar_addr + pba_bar_offset;
 	} else {
 		ret = vfio_pci_get_region_info(vdev, pba->bar, &info);
 		if (ret)
@@ -1042,7 +1340,8 @@ static int vfio_pci_configure_bar(struct kvm *kvm, struct vfio_device *vdev,
 	if (pdev->irq_modes & VFIO_PCI_IRQ_MODE_MSIX) {
 		/* Trap and emulate MSI-X table */
 		if (nr == pdev->msix_table.bar) {
-			region->guest_phys_addr = pdev->msix_table.guest_phys_addr;
+			region->guest_phys_addr = pdev->msix_table.guest_phys_addr -
+						  pdev->msix_table.bar_offset;
 			return 0;
 		} else if (nr == pdev->msix_pba.bar) {
 			region->guest_phys_addr = pdev->msix_pba.guest_phys_addr;
@@ -1425,8 +1724,18 @@ void vfio_pci_teardown_device(struct kvm *kvm, struct vfio_device *vdev)
 	size_t i;
 	struct vfio_pci_device *pdev = &vdev->pci;
 
-	for (i = 0; i < vdev->info.num_regions; i++)
+	if (pdev->msix_table_exits || pdev->msix_pba_exits)
+		vfio_dev_info(vdev, "%llu MSI-X table and %llu PBA accesses trapped",
+			      (unsigned long long)pdev->msix_table_exits,
+			      (unsigned long long)pdev->msix_pba_exits);
+
+	for (i = 0; i < vdev->info.num_regions; i++) {
+		if ((pdev->irq_modes & VFIO_PCI_IRQ_MODE_MSIX) &&
+		    pdev->msix_table.mappable && i == pdev->msix_table.bar)
+			vfio_pci_unmap_msix_bar(kvm, vdev, &vdev->regions[i]);
+
 		vfio_unmap_region(kvm, &vdev->regions[i]);
+	}
 
 	device__unregister(&vdev->dev_hdr);
 
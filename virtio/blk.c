@@ -15,27 +15,44 @@
 
 #include <linux/virtio_ring.h>
 #include <linux/virtio_blk.h>
+#include <linux/byteorder.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/types.h>
 #include <pthread.h>
 
-#define VIRTIO_BLK_MAX_DEV		4
-
 /*
- * the header and status consume too entries
+ * The guest picks the queue size, up to VIRTIO_BLK_QUEUE_MAX_SIZE. With
+ * indirect descriptors a request isn't limited by the queue size, only by
+ * DISK_SEG_MAX data segments of at most DISK_SEG_SIZE_MAX bytes each. The
+ * header and status consume two more entries.
  */
-#define DISK_SEG_MAX			(VIRTIO_BLK_QUEUE_SIZE - 2)
-#define VIRTIO_BLK_QUEUE_SIZE		128
+#define VIRTIO_BLK_QUEUE_MAX_SIZE	1024
+#define DISK_SEG_MAX			254
+#define DISK_SEG_SIZE_MAX		(1024 * 1024)
+#define DISK_REQ_IOV_MAX		(DISK_SEG_MAX + 2)
 #define NUM_VIRT_QUEUES			1
 
+/*
+ * Limits of discard and write zeroes requests: one range is at most 4GB,
+ * and a request carries as many ranges as fit in a page.
+ */
+#define DISK_DISCARD_SECTORS_MAX	(UINT32_MAX >> SECTOR_SHIFT)
+#define DISK_DISCARD_SEG_MAX		\
+	(4096 / sizeof(struct virtio_blk_discard_write_zeroes))
+
 struct blk_dev_req {
 	struct virt_queue		*vq;
 	struct blk_dev			*bdev;
-	struct iovec			iov[VIRTIO_BLK_QUEUE_SIZE];
+	struct iovec			iov[DISK_REQ_IOV_MAX];
 	u16				out, in, head;
 	u8				*status;
 	struct kvm			*kvm;
+	/* Discard and write zeroes requests run from the thread pool */
+	struct thread_pool__job		job;
+	u32				type;
+	struct iovec			*ranges_iov;
+	size_t				ranges_iovcount;
 };
 
 struct blk_dev {
@@ -49,7 +66,10 @@ struct blk_dev {
 	struct disk_image		*disk;
 
 	struct virt_queue		vqs[NUM_VIRT_QUEUES];
-	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
+	u32				queue_size;
+	/* One per descriptor, indexed by head */
+	struct blk_dev_req		*reqs;
+	u32				nr_reqs;
 
 	pthread_t			io_thread;
 	int				io_efd;
@@ -67,9 +87,12 @@ void virtio_blk_complete(void *param, long len)
 	int queueid = req->vq - bdev->vqs;
 	u8 *status;
 
-	/* status */
+	/* status, unless the request had no room for it */
 	status = req->status;
-	*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+	if (status)
+		*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+	else
+		len = 0;
 
 	mutex_lock(&bdev->mutex);
 	virt_queue__set_used_elem(req->vq, req->head, len, req->in + req->out);
@@ -98,6 +121,81 @@ static void dump_req(struct blk_dev_req* req) {
 }
 #endif
 
+static int virtio_blk_do_discard(struct blk_dev *bdev, u32 type,
+				 struct iovec *iov, size_t iovcount)
+{
+	struct virtio_blk_discard_write_zeroes range;
+	u32 nr_ranges, nr_sectors, flags;
+	u64 sector;
+	int r;
+
+	nr_ranges = iov_size(iov, iovcount) / sizeof(range);
+	if (!nr_ranges || nr_ranges > DISK_DISCARD_SEG_MAX)
+		return -EINVAL;
+
+	while (nr_ranges--) {
+		if (memcpy_fromiovec_safe(&range, &iov, sizeof(range), &iovcount))
+			return -EINVAL;
+
+		/* The ranges are always little-endian */
+		sector		= le64_to_cpu(range.sector);
+		nr_sectors	= le32_to_cpu(range.num_sectors);
+		flags		= le32_to_cpu(range.flags);
+
+		if (nr_sectors > DISK_DISCARD_SECTORS_MAX ||
+		    sector > bdev->capacity ||
+		    nr_sectors > bdev->capacity - sector)
+			return -EINVAL;
+
+		if (type == VIRTIO_BLK_T_DISCARD) {
+			if (flags)
+				return -EINVAL;
+			r = disk_image__discard(bdev->disk, sector, nr_sectors);
+		} else {
+			r = disk_image__write_zeroes(bdev->disk, sector, nr_sectors,
+					flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+		}
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static void virtio_blk_discard_job(struct kvm *kvm, void *param)
+{
+	struct blk_dev_req *req = param;
+	struct disk_image *disk = req->bdev->disk;
+	long len;
+
+	len = virtio_blk_do_discard(req->bdev, req->type, req->ranges_iov,
+				    req->ranges_iovcount);
+	disk->disk_req_cb(req, len);
+}
+
+/* Bytes a request writes, as far as the throttle is concerned */
+static size_t virtio_blk_discard_bytes(u32 type, const struct iovec *iov,
+				       size_t iovcount)
+{
+	struct virtio_blk_discard_write_zeroes range;
+	size_t i, nr_ranges, bytes = 0;
+
+	if (type != VIRTIO_BLK_T_WRITE_ZEROES)
+		return 0;
+
+	nr_ranges = iov_size(iov, iovcount) / sizeof(range);
+	if (nr_ranges > DISK_DISCARD_SEG_MAX)
+		return 0;
+
+	for (i = 0; i < nr_ranges; i++) {
+		memcpy_fromiovecend((void *)&range, iov, i * sizeof(range),
+				    sizeof(range));
+		bytes += (size_t)le32_to_cpu(range.num_sectors) << SECTOR_SHIFT;
+	}
+
+	return bytes;
+}
+
 static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, struct blk_dev_req *req)
 {
 	struct virtio_blk_outhdr req_hdr;
@@ -111,6 +209,22 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 	bdev		= req->bdev;
 	iov		= req->iov;
 
+	/*
+	 * Only the last descriptor of an oversized chain, the status, is kept.
+	 * Fail the request, without a status if that descriptor is empty, but
+	 * always give it back so that the guest doesn't wait for it forever.
+	 */
+	if (req->out + req->in > DISK_REQ_IOV_MAX) {
+		pr_warning("virtio-blk: request of %u descriptors",
+			   req->out + req->in);
+		iov = &req->iov[DISK_REQ_IOV_MAX - 1];
+		req->status = NULL;
+		if (iov->iov_len)
+			req->status = iov->iov_base + iov->iov_len - 1;
+		virtio_blk_complete(req, -EINVAL);
+		return;
+	}
+
 	iovcount = req->out;
 	len = memcpy_fromiovec_safe(&req_hdr, &iov, sizeof(req_hdr), &iovcount);
 	if (len) {
@@ -147,6 +261,15 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 		len = disk_image__flush(bdev->disk);
 		virtio_blk_complete(req, len);
 		break;
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		req->type		= type;
+		req->ranges_iov		= iov;
+		req->ranges_iovcount	= iovcount;
+		disk_image__queue_job(bdev->disk,
+				      virtio_blk_discard_bytes(type, iov, iovcount),
+				      &req->job);
+		break;
 	case VIRTIO_BLK_T_GET_ID:
 		len = disk_image__get_serial(bdev->disk, iov, iovcount,
 					     VIRTIO_BLK_ID_BYTES);
@@ -167,14 +290,14 @@ static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq, struct blk_
 		if (vq->is_packed) {
 			head		= vq->last_avail_idx;
 			req		= &bdev->reqs[head];
-			req->head	= virt_queue_packed__get_head_iov(vq, req->iov, &req->out,
-					&req->in, head, kvm);
+			req->head	= virt_queue_packed__get_head_iov(vq, req->iov,
+					DISK_REQ_IOV_MAX, &req->out, &req->in, head, kvm);
 			virt_queue_packed__pop(vq, req->out + req->in);
 		} else {
 			head		= virt_queue_split__pop(vq);
 			req		= &bdev->reqs[head];
-			req->head	= virt_queue_split__get_head_iov(vq, req->iov, &req->out,
-					&req->in, head, kvm);
+			req->head	= virt_queue_split__get_head_iov(vq, req->iov,
+					DISK_REQ_IOV_MAX, &req->out, &req->in, head, kvm);
 		}
 		req->vq		= vq;
 		virtio_blk_do_io_request(kvm, vq, req);
@@ -198,14 +321,24 @@ static size_t get_config_size(struct kvm *kvm, void *dev)
 static u64 get_host_features(struct kvm *kvm, void *dev)
 {
 	struct blk_dev *bdev = dev;
+	u64 features;
 
-	return	1UL << VIRTIO_BLK_F_SEG_MAX
+	features = 1UL << VIRTIO_BLK_F_SEG_MAX
+		| 1UL << VIRTIO_BLK_F_SIZE_MAX
 		| 1UL << VIRTIO_BLK_F_FLUSH
+		| 1UL << VIRTIO_BLK_F_BLK_SIZE
+		| 1UL << VIRTIO_BLK_F_TOPOLOGY
 		| 1UL << VIRTIO_RING_F_EVENT_IDX
+		| 1UL << VIRTIO_RING_F_INDIRECT_DESC
 		| 1UL << VIRTIO_F_ANY_LAYOUT
-		| 1UL << VIRTIO_F_RING_PACKED
+		| 1ULL << VIRTIO_F_RING_PACKED
 		| (bdev->disk->readonly ? 1UL << VIRTIO_BLK_F_RO : 0);
-	//| 1UL << VIRTIO_RING_F_INDIRECT_DESC
+
+	if (disk_image__can_discard(bdev->disk))
+		features |= 1UL << VIRTIO_BLK_F_DISCARD
+			| 1UL << VIRTIO_BLK_F_WRITE_ZEROES;
+
+	return features;
 }
 
 static void notify_status(struct kvm *kvm, void *dev, u32 status)
@@ -218,6 +351,33 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 
 	conf->capacity = virtio_host_to_guest_u64(bdev->vdev.endian, bdev->capacity);
 	conf->seg_max = virtio_host_to_guest_u32(bdev->vdev.endian, DISK_SEG_MAX);
+	conf->size_max = virtio_host_to_guest_u32(bdev->vdev.endian,
+						  DISK_SEG_SIZE_MAX);
+
+	/* Capacity stays in 512-byte sectors whatever the block size */
+	conf->blk_size = virtio_host_to_guest_u32(bdev->vdev.endian,
+						  bdev->disk->blk_size);
+	conf->physical_block_exp = __builtin_ctz(bdev->disk->phys_blk_size /
+						 bdev->disk->blk_size);
+	conf->min_io_size = virtio_host_to_guest_u16(bdev->vdev.endian,
+				bdev->disk->phys_blk_size / bdev->disk->blk_size);
+
+	if (disk_image__can_discard(bdev->disk)) {
+		u16 endian = bdev->vdev.endian;
+		u32 granularity = max(bdev->disk->discard_granularity, 1U);
+
+		conf->max_discard_sectors = virtio_host_to_guest_u32(endian,
+						DISK_DISCARD_SECTORS_MAX);
+		conf->max_discard_seg = virtio_host_to_guest_u32(endian,
+						DISK_DISCARD_SEG_MAX);
+		conf->discard_sector_alignment = virtio_host_to_guest_u32(endian,
+						granularity);
+		conf->max_write_zeroes_sectors = virtio_host_to_guest_u32(endian,
+						DISK_DISCARD_SECTORS_MAX);
+		conf->max_write_zeroes_seg = virtio_host_to_guest_u32(endian,
+						DISK_DISCARD_SEG_MAX);
+		conf->write_zeroes_may_unmap = 1;
+	}
 }
 
 static void *virtio_blk_thread(void *dev)
@@ -246,17 +406,27 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 
 	compat__remove_message(compat_id);
 
-	virtio_init_device_vq(kvm, &bdev->vdev, &bdev->vqs[vq],
-			      VIRTIO_BLK_QUEUE_SIZE);
-
 	if (vq != 0)
 		return 0;
 
-	for (i = 0; i < ARRAY_SIZE(bdev->reqs); i++) {
+	/* exit_vq() waited for the requests of a previous queue */
+	free(bdev->reqs);
+	bdev->nr_reqs = 0;
+	bdev->reqs = calloc(bdev->queue_size, sizeof(*bdev->reqs));
+	if (!bdev->reqs)
+		return -ENOMEM;
+	bdev->nr_reqs = bdev->queue_size;
+
+	virtio_init_device_vq(kvm, &bdev->vdev, &bdev->vqs[vq],
+			      bdev->queue_size);
+
+	for (i = 0; i < bdev->nr_reqs; i++) {
 		bdev->reqs[i] = (struct blk_dev_req) {
 			.bdev = bdev,
 			.kvm = kvm,
 		};
+		thread_pool__init_job(&bdev->reqs[i].job, kvm,
+				      virtio_blk_discard_job, &bdev->reqs[i]);
 	}
 
 	mutex_init(&bdev->mutex);
@@ -273,6 +443,7 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
+	u32 i;
 
 	if (vq != 0)
 		return;
@@ -282,6 +453,13 @@ static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 	pthread_join(bdev->io_thread, NULL);
 
 	disk_image__wait(bdev->disk);
+
+	/* Requests that are still queued are dropped along with the rings */
+	for (i = 0; i < bdev->nr_reqs; i++)
+		thread_pool__cancel_job(&bdev->reqs[i].job);
+
+	/* A reset device offers the largest queue again */
+	bdev->queue_size = VIRTIO_BLK_QUEUE_MAX_SIZE;
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -306,13 +484,23 @@ static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	/* FIXME: dynamic */
-	return VIRTIO_BLK_QUEUE_SIZE;
+	struct blk_dev *bdev = dev;
+
+	return bdev->queue_size;
 }
 
 static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 {
-	/* FIXME: dynamic */
+	struct blk_dev *bdev = dev;
+
+	/* Both ring layouts wrap indices with a mask */
+	if (size <= 0 || size > VIRTIO_BLK_QUEUE_MAX_SIZE ||
+	    !is_power_of_two(size)) {
+		pr_warning("virtio-blk: invalid queue size %d", size);
+		return bdev->queue_size;
+	}
+
+	bdev->queue_size = size;
 	return size;
 }
 
@@ -350,6 +538,7 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 	*bdev = (struct blk_dev) {
 		.disk			= disk,
 		.capacity		= disk->size / SECTOR_SIZE,
+		.queue_size		= VIRTIO_BLK_QUEUE_MAX_SIZE,
 		.kvm			= kvm,
 	};
 
@@ -373,6 +562,7 @@ static int virtio_blk__exit_one(struct kvm *kvm, struct blk_dev *bdev)
 {
 	list_del(&bdev->list);
 	virtio_exit(kvm, &bdev->vdev);
+	free(bdev->reqs);
 	free(bdev);
 
 	return 0;
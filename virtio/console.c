@@ -11,22 +11,65 @@
 #include "kvm/threadpool.h"
 #include "kvm/irq.h"
 #include "kvm/guest_compat.h"
+#include "kvm/iovec.h"
+#include "kvm/read-write.h"
 
 #include <linux/virtio_console.h>
 #include <linux/virtio_ring.h>
 #include <linux/virtio_blk.h>
 
+#include <linux/list.h>
+
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <poll.h>
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #define VIRTIO_CONSOLE_QUEUE_SIZE	128
-#define VIRTIO_CONSOLE_NUM_QUEUES	2
+#define VIRTIO_CONSOLE_MAX_PORTS	16
 #define VIRTIO_CONSOLE_RX_QUEUE		0
 #define VIRTIO_CONSOLE_TX_QUEUE		1
+#define VIRTIO_CONSOLE_CTRL_RX_QUEUE	2
+#define VIRTIO_CONSOLE_CTRL_TX_QUEUE	3
+/* Port 0 is the console, other ports get a queue pair after the control queues */
+#define VIRTIO_CONSOLE_PORT_RX_QUEUE(p)	(2 + 2 * (p))
+#define VIRTIO_CONSOLE_PORT_TX_QUEUE(p)	(3 + 2 * (p))
+#define VIRTIO_CONSOLE_NUM_QUEUES	(2 * (VIRTIO_CONSOLE_MAX_PORTS + 1))
+#define VIRTIO_CONSOLE_NUM_JOBS		4
+
+/*
+ * Additional ports are data channels backed by a UNIX socket that we listen
+ * on, or by a file descriptor inherited from the caller. Each of them is
+ * served by its own thread, which moves data straight between the backend
+ * and guest buffers.
+ */
+struct con_port {
+	struct kvm			*kvm;
+	u32				id;
+	const char			*name;
+	const char			*socket_path;
+	int				listen_fd;
+	int				fd;
+	int				kick_fd;
+	bool				readable;
+	bool				guest_open;
+	bool				started;
+	pthread_t			thread;
+};
+
+struct con_ctrl_msg {
+	struct list_head		list;
+	size_t				len;
+	struct virtio_console_control	ctrl;
+	char				name[];
+};
 
 struct con_dev {
 	struct mutex			mutex;
@@ -36,14 +79,26 @@ struct con_dev {
 	struct virtio_console_config	config;
 	int				vq_ready;
 
-	struct thread_pool__job		jobs[VIRTIO_CONSOLE_NUM_QUEUES];
+	struct thread_pool__job		jobs[VIRTIO_CONSOLE_NUM_JOBS];
+
+	/* Ports other than the console, and pending control messages */
+	struct con_port			ports[VIRTIO_CONSOLE_MAX_PORTS];
+	u32				nr_ports;
+	struct list_head		ctrl_msgs;
 };
 
 static struct con_dev cdev = {
 	.mutex				= MUTEX_INITIALIZER,
 	.vq_ready			= 0,
+	.nr_ports			= 1,
+	.ctrl_msgs			= LIST_HEAD_INIT(cdev.ctrl_msgs),
 };
 
+static bool virtio_console__multiport(void)
+{
+	return cdev.nr_ports > 1;
+}
+
 static int compat_id = -1;
 
 /*
@@ -106,6 +161,411 @@ static void virtio_console_handle_callback(struct kvm *kvm, void *param)
 
 }
 
+/* Called with cdev.mutex held */
+static void virtio_console__flush_ctrl(struct kvm *kvm)
+{
+	struct virt_queue *vq = &cdev.vqs[VIRTIO_CONSOLE_CTRL_RX_QUEUE];
+	struct iovec iov[VIRTIO_CONSOLE_QUEUE_SIZE];
+	struct con_ctrl_msg *msg;
+	bool signal = false;
+	u16 out, in, head;
+
+	while (!list_empty(&cdev.ctrl_msgs) && virt_queue__available(vq)) {
+		msg = list_first_entry(&cdev.ctrl_msgs, struct con_ctrl_msg, list);
+		list_del(&msg->list);
+
+		head = virt_queue_split__get_iov(vq, iov, &out, &in, kvm);
+		if (iov_size(iov + out, in) >= msg->len) {
+			memcpy_toiovec(iov + out, (void *)&msg->ctrl, msg->len);
+			virt_queue_split__set_used_elem(vq, head, msg->len);
+		} else {
+			virt_queue_split__set_used_elem(vq, head, 0);
+		}
+		signal = true;
+
+		free(msg);
+	}
+
+	if (signal)
+		cdev.vdev.ops->signal_vq(kvm, &cdev.vdev,
+					 VIRTIO_CONSOLE_CTRL_RX_QUEUE);
+}
+
+static void virtio_console__send_ctrl(struct kvm *kvm, u32 id, u16 event,
+				      u16 value, const char *name)
+{
+	struct con_ctrl_msg *msg;
+	size_t name_len = name ? strlen(name) + 1 : 0;
+	u16 endian = cdev.vdev.endian;
+
+	msg = calloc(1, sizeof(*msg) + name_len);
+	if (!msg)
+		return;
+
+	msg->ctrl = (struct virtio_console_control) {
+		.id	= virtio_host_to_guest_u32(endian, id),
+		.event	= virtio_host_to_guest_u16(endian, event),
+		.value	= virtio_host_to_guest_u16(endian, value),
+	};
+	msg->len = sizeof(msg->ctrl) + name_len;
+	if (name)
+		memcpy(msg->name, name, name_len);
+
+	mutex_lock(&cdev.mutex);
+	list_add_tail(&msg->list, &cdev.ctrl_msgs);
+	virtio_console__flush_ctrl(kvm);
+	mutex_unlock(&cdev.mutex);
+}
+
+static struct con_port *virtio_console__get_port(u32 id)
+{
+	if (id == 0 || id >= cdev.nr_ports)
+		return NULL;
+
+	return &cdev.ports[id];
+}
+
+static void virtio_console__handle_ctrl(struct kvm *kvm,
+					struct virtio_console_control *ctrl)
+{
+	u16 endian = cdev.vdev.endian;
+	u32 id = virtio_guest_to_host_u32(endian, ctrl->id);
+	u16 event = virtio_guest_to_host_u16(endian, ctrl->event);
+	u16 value = virtio_guest_to_host_u16(endian, ctrl->value);
+	struct con_port *port;
+	u32 i;
+
+	switch (event) {
+	case VIRTIO_CONSOLE_DEVICE_READY:
+		if (!value)
+			break;
+		/* Port 0 is only a console when the guest uses virtio for it */
+		if (kvm->cfg.active_console == CONSOLE_VIRTIO)
+			virtio_console__send_ctrl(kvm, 0, VIRTIO_CONSOLE_PORT_ADD,
+						  0, NULL);
+		for (i = 1; i < cdev.nr_ports; i++)
+			virtio_console__send_ctrl(kvm, i, VIRTIO_CONSOLE_PORT_ADD,
+						  0, NULL);
+		break;
+	case VIRTIO_CONSOLE_PORT_READY:
+		if (!value)
+			break;
+		if (id == 0) {
+			virtio_console__send_ctrl(kvm, 0, VIRTIO_CONSOLE_CONSOLE_PORT,
+						  1, NULL);
+			virtio_console__send_ctrl(kvm, 0, VIRTIO_CONSOLE_PORT_OPEN,
+						  1, NULL);
+			break;
+		}
+
+		port = virtio_console__get_port(id);
+		if (!port)
+			break;
+		if (port->name)
+			virtio_console__send_ctrl(kvm, id, VIRTIO_CONSOLE_PORT_NAME,
+						  0, port->name);
+		virtio_console__send_ctrl(kvm, id, VIRTIO_CONSOLE_PORT_OPEN,
+					  port->fd >= 0, NULL);
+		break;
+	case VIRTIO_CONSOLE_PORT_OPEN:
+		port = virtio_console__get_port(id);
+		if (!port)
+			break;
+		port->guest_open = value;
+		/* Let the port thread check for pending input */
+		if (eventfd_write(port->kick_fd, 1) < 0)
+			pr_warning("virtio-console: failed to kick port %u", id);
+		break;
+	default:
+		break;
+	}
+}
+
+static void virtio_console__ctrl_tx_callback(struct kvm *kvm, void *param)
+{
+	struct iovec iov[VIRTIO_CONSOLE_QUEUE_SIZE];
+	struct virtio_console_control ctrl;
+	struct virt_queue *vq = param;
+	u16 out, in, head;
+
+	while (virt_queue__available(vq)) {
+		head = virt_queue_split__get_iov(vq, iov, &out, &in, kvm);
+		if (iov_size(iov, out) >= sizeof(ctrl) &&
+		    memcpy_fromiovec((void *)&ctrl, iov, sizeof(ctrl)) == 0)
+			virtio_console__handle_ctrl(kvm, &ctrl);
+		virt_queue_split__set_used_elem(vq, head, 0);
+	}
+
+	cdev.vdev.ops->signal_vq(kvm, &cdev.vdev, VIRTIO_CONSOLE_CTRL_TX_QUEUE);
+}
+
+static void virtio_console__ctrl_rx_callback(struct kvm *kvm, void *param)
+{
+	mutex_lock(&cdev.mutex);
+	virtio_console__flush_ctrl(kvm);
+	mutex_unlock(&cdev.mutex);
+}
+
+static void virtio_console__port_connect(struct kvm *kvm, struct con_port *port)
+{
+	int fd;
+
+	fd = accept4(port->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (port->fd >= 0) {
+		/* Only one client at a time */
+		close(fd);
+		return;
+	}
+
+	port->fd = fd;
+	port->readable = true;
+	virtio_console__send_ctrl(kvm, port->id, VIRTIO_CONSOLE_PORT_OPEN, 1,
+				  NULL);
+}
+
+static void virtio_console__port_disconnect(struct kvm *kvm,
+					    struct con_port *port)
+{
+	close(port->fd);
+	port->fd = -1;
+	virtio_console__send_ctrl(kvm, port->id, VIRTIO_CONSOLE_PORT_OPEN, 0,
+				  NULL);
+}
+
+/* Guest to host: write the buffers straight from guest memory */
+static void virtio_console__port_tx(struct kvm *kvm, struct con_port *port)
+{
+	u32 vq_idx = VIRTIO_CONSOLE_PORT_TX_QUEUE(port->id);
+	struct virt_queue *vq = &cdev.vqs[vq_idx];
+	struct iovec iov[VIRTIO_CONSOLE_QUEUE_SIZE];
+	bool signal = false;
+	u16 out, in, head;
+
+	while (virt_queue__available(vq)) {
+		head = virt_queue_split__get_iov(vq, iov, &out, &in, kvm);
+
+		if (port->fd >= 0 && writev_in_full(port->fd, iov, out) < 0)
+			virtio_console__port_disconnect(kvm, port);
+
+		virt_queue_split__set_used_elem(vq, head, 0);
+		signal = true;
+	}
+
+	if (signal && virtio_queue__should_signal(vq))
+		cdev.vdev.ops->signal_vq(kvm, &cdev.vdev, vq_idx);
+}
+
+/*
+ * Returns the number of bytes waiting on the backend, 0 if there is nothing
+ * to read yet, or -1 if the other end went away.
+ */
+static int virtio_console__port_pending(struct con_port *port)
+{
+	struct pollfd pollfd = {
+		.fd	= port->fd,
+		.events	= POLLIN,
+	};
+	int nr;
+
+	if (poll(&pollfd, 1, 0) <= 0 || !(pollfd.revents & (POLLIN | POLLHUP)))
+		return 0;
+
+	/* Not every backend can tell, let readv() find out */
+	if (ioctl(port->fd, FIONREAD, &nr) < 0)
+		return 1;
+
+	return nr > 0 ? nr : -1;
+}
+
+/* Host to guest: read from the backend straight into guest buffers */
+static void virtio_console__port_rx(struct kvm *kvm, struct con_port *port)
+{
+	u32 vq_idx = VIRTIO_CONSOLE_PORT_RX_QUEUE(port->id);
+	struct virt_queue *vq = &cdev.vqs[vq_idx];
+	struct iovec iov[VIRTIO_CONSOLE_QUEUE_SIZE];
+	bool signal = false;
+	u16 out, in, head;
+	ssize_t len;
+	int pending;
+
+	while (port->fd >= 0 && port->readable && virt_queue__available(vq)) {
+		/* Only take a buffer from the guest once there is data for it */
+		pending = virtio_console__port_pending(port);
+		if (!pending)
+			break;
+
+		if (pending < 0) {
+			virtio_console__port_disconnect(kvm, port);
+			break;
+		}
+
+		head = virt_queue_split__get_iov(vq, iov, &out, &in, kvm);
+
+		len = readv(port->fd, iov + out, in);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+			len = 0;
+		} else if (len <= 0) {
+			virtio_console__port_disconnect(kvm, port);
+			len = 0;
+		}
+
+		virt_queue_split__set_used_elem(vq, head, len);
+		signal = true;
+	}
+
+	if (signal)
+		cdev.vdev.ops->signal_vq(kvm, &cdev.vdev, vq_idx);
+}
+
+static void *virtio_console__port_thread(void *p)
+{
+	struct con_port *port = p;
+	struct kvm *kvm = port->kvm;
+	struct virt_queue *rx_vq;
+	struct pollfd fds[2];
+	eventfd_t kicks;
+	char name[16];
+
+	snprintf(name, sizeof(name), "virtio-con-%u", port->id);
+	kvm__set_thread_name(name);
+
+	rx_vq = &cdev.vqs[VIRTIO_CONSOLE_PORT_RX_QUEUE(port->id)];
+
+	for (;;) {
+		fds[0] = (struct pollfd) {
+			.fd	= port->kick_fd,
+			.events	= POLLIN,
+		};
+
+		/*
+		 * Only wait for input when the guest can take it, otherwise
+		 * wait for the guest to add receive buffers.
+		 */
+		fds[1] = (struct pollfd) { .fd = -1 };
+		if (port->fd < 0)
+			fds[1].fd = port->listen_fd;
+		else if (port->readable && port->guest_open &&
+			 virt_queue__available(rx_vq))
+			fds[1].fd = port->fd;
+		fds[1].events = POLLIN;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[0].revents & POLLIN)
+			eventfd_read(port->kick_fd, &kicks);
+
+		if (port->fd < 0 && fds[1].fd >= 0 && fds[1].revents)
+			virtio_console__port_connect(kvm, port);
+
+		virtio_console__port_tx(kvm, port);
+
+		if (port->guest_open)
+			virtio_console__port_rx(kvm, port);
+	}
+
+	return NULL;
+}
+
+static int virtio_console__port_setup(struct con_port *port)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+
+	port->kick_fd = eventfd(0, EFD_CLOEXEC);
+	if (port->kick_fd < 0)
+		return -errno;
+
+	if (!port->socket_path) {
+		struct stat st;
+		int flags;
+
+		flags = fcntl(port->fd, F_GETFL);
+		if (flags < 0 || fstat(port->fd, &st) < 0)
+			return -errno;
+
+		/*
+		 * Only read from descriptors that were opened for it and can
+		 * signal new input. Regular files always poll as readable and
+		 * hit EOF straight away, which would close a log port.
+		 */
+		port->readable = (flags & O_ACCMODE) != O_WRONLY &&
+				 !S_ISREG(st.st_mode);
+		return 0;
+	}
+
+	if (strlen(port->socket_path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, port->socket_path);
+
+	port->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (port->listen_fd < 0)
+		return -errno;
+
+	unlink(port->socket_path);
+	if (bind(port->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(port->listen_fd, 1) < 0) {
+		pr_err("virtio-console: cannot listen on %s", port->socket_path);
+		close(port->listen_fd);
+		return -errno;
+	}
+
+	return 0;
+}
+
+int virtio_console_port_parser(const struct option *opt, const char *arg,
+			       int unset)
+{
+	struct con_port *port;
+	char *buf, *cur, *val;
+
+	if (cdev.nr_ports == VIRTIO_CONSOLE_MAX_PORTS)
+		die("Too many virtio console ports");
+
+	port = &cdev.ports[cdev.nr_ports];
+	*port = (struct con_port) {
+		.id		= cdev.nr_ports,
+		.listen_fd	= -1,
+		.fd		= -1,
+		.kick_fd	= -1,
+	};
+
+	buf = strdup(arg);
+	if (!buf)
+		return -ENOMEM;
+
+	for (cur = strtok(buf, ","); cur; cur = strtok(NULL, ",")) {
+		val = strchr(cur, '=');
+		if (!val)
+			die("Invalid console port option: %s", cur);
+		*val++ = '\0';
+
+		if (!strcmp(cur, "name"))
+			port->name = strdup(val);
+		else if (!strcmp(cur, "socket"))
+			port->socket_path = strdup(val);
+		else if (!strcmp(cur, "fd"))
+			port->fd = atoi(val);
+		else
+			die("Unknown console port option: %s", cur);
+	}
+	free(buf);
+
+	if (!port->socket_path == (port->fd < 0))
+		die("Console port needs exactly one of socket= or fd=");
+
+	cdev.nr_ports++;
+
+	return 0;
+}
+
 static u8 *get_config(struct kvm *kvm, void *dev)
 {
 	struct con_dev *cdev = dev;
@@ -122,7 +582,12 @@ static size_t get_config_size(struct kvm *kvm, void *dev)
 
 static u64 get_host_features(struct kvm *kvm, void *dev)
 {
-	return 1 << VIRTIO_F_ANY_LAYOUT;
+	u64 features = 1 << VIRTIO_F_ANY_LAYOUT;
+
+	if (virtio_console__multiport())
+		features |= 1 << VIRTIO_CONSOLE_F_MULTIPORT;
+
+	return features;
 }
 
 static void notify_status(struct kvm *kvm, void *dev, u32 status)
@@ -135,12 +600,14 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 
 	conf->cols = virtio_host_to_guest_u16(cdev->vdev.endian, 80);
 	conf->rows = virtio_host_to_guest_u16(cdev->vdev.endian, 24);
-	conf->max_nr_ports = virtio_host_to_guest_u32(cdev->vdev.endian, 1);
+	conf->max_nr_ports = virtio_host_to_guest_u32(cdev->vdev.endian,
+						      cdev->nr_ports);
 }
 
 static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct virt_queue *queue;
+	struct con_port *port;
 
 	BUG_ON(vq >= VIRTIO_CONSOLE_NUM_QUEUES);
 
@@ -150,7 +617,19 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 
 	virtio_init_device_vq(kvm, &cdev.vdev, queue, VIRTIO_CONSOLE_QUEUE_SIZE);
 
-	if (vq == VIRTIO_CONSOLE_TX_QUEUE) {
+	if (vq >= VIRTIO_CONSOLE_NUM_JOBS) {
+		/* Start the port thread once both of its queues exist */
+		port = &cdev.ports[(vq - 2) / 2];
+		port->kvm = kvm;
+		if (vq == VIRTIO_CONSOLE_PORT_TX_QUEUE(port->id) &&
+		    !pthread_create(&port->thread, NULL,
+				    virtio_console__port_thread, port))
+			port->started = true;
+	} else if (vq == VIRTIO_CONSOLE_CTRL_TX_QUEUE) {
+		thread_pool__init_job(&cdev.jobs[vq], kvm, virtio_console__ctrl_tx_callback, queue);
+	} else if (vq == VIRTIO_CONSOLE_CTRL_RX_QUEUE) {
+		thread_pool__init_job(&cdev.jobs[vq], kvm, virtio_console__ctrl_rx_callback, queue);
+	} else if (vq == VIRTIO_CONSOLE_TX_QUEUE) {
 		thread_pool__init_job(&cdev.jobs[vq], kvm, virtio_console_handle_callback, queue);
 	} else if (vq == VIRTIO_CONSOLE_RX_QUEUE) {
 		thread_pool__init_job(&cdev.jobs[vq], kvm, virtio_console__inject_interrupt_callback, queue);
@@ -165,7 +644,27 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 
 static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	if (vq == VIRTIO_CONSOLE_RX_QUEUE) {
+	struct con_ctrl_msg *msg, *tmp;
+	struct con_port *port;
+
+	if (vq >= VIRTIO_CONSOLE_NUM_JOBS) {
+		port = &cdev.ports[(vq - 2) / 2];
+		if (port->started) {
+			pthread_cancel(port->thread);
+			pthread_join(port->thread, NULL);
+			port->started = false;
+		}
+	} else if (vq == VIRTIO_CONSOLE_CTRL_RX_QUEUE) {
+		thread_pool__cancel_job(&cdev.jobs[vq]);
+		mutex_lock(&cdev.mutex);
+		list_for_each_entry_safe(msg, tmp, &cdev.ctrl_msgs, list) {
+			list_del(&msg->list);
+			free(msg);
+		}
+		mutex_unlock(&cdev.mutex);
+	} else if (vq == VIRTIO_CONSOLE_CTRL_TX_QUEUE) {
+		thread_pool__cancel_job(&cdev.jobs[vq]);
+	} else if (vq == VIRTIO_CONSOLE_RX_QUEUE) {
 		mutex_lock(&cdev.mutex);
 		cdev.vq_ready = 0;
 		mutex_unlock(&cdev.mutex);
@@ -178,8 +677,16 @@ static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct con_dev *cdev = dev;
+	struct con_port *port;
 
-	thread_pool__do_job(&cdev->jobs[vq]);
+	if (vq < VIRTIO_CONSOLE_NUM_JOBS) {
+		thread_pool__do_job(&cdev->jobs[vq]);
+		return 0;
+	}
+
+	port = &cdev->ports[(vq - 2) / 2];
+	if (eventfd_write(port->kick_fd, 1) < 0)
+		pr_warning("virtio-console: failed to kick port %u", port->id);
 
 	return 0;
 }
@@ -204,7 +711,11 @@ static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 
 static unsigned int get_vq_count(struct kvm *kvm, void *dev)
 {
-	return VIRTIO_CONSOLE_NUM_QUEUES;
+	if (!virtio_console__multiport())
+		return 2;
+
+	/* Console port, control queues, and the other ports */
+	return 2 + 2 * cdev.nr_ports;
 }
 
 static struct virtio_ops con_dev_virtio_ops = {
@@ -223,11 +734,19 @@ static struct virtio_ops con_dev_virtio_ops = {
 
 int virtio_console__init(struct kvm *kvm)
 {
+	u32 i;
 	int r;
 
-	if (kvm->cfg.active_console != CONSOLE_VIRTIO)
+	if (kvm->cfg.active_console != CONSOLE_VIRTIO &&
+	    !virtio_console__multiport())
 		return 0;
 
+	for (i = 1; i < cdev.nr_ports; i++) {
+		r = virtio_console__port_setup(&cdev.ports[i]);
+		if (r < 0)
+			return r;
+	}
+
 	r = virtio_init(kvm, &cdev, &cdev.vdev, &con_dev_virtio_ops,
 			kvm->cfg.virtio_transport, PCI_DEVICE_ID_VIRTIO_CONSOLE,
 			VIRTIO_ID_CONSOLE, PCI_CLASS_CONSOLE);
@@ -243,8 +762,23 @@ virtio_dev_init(virtio_console__init);
 
 int virtio_console__exit(struct kvm *kvm)
 {
+	struct con_port *port;
+	u32 i;
+
 	virtio_exit(kvm, &cdev.vdev);
 
+	for (i = 1; i < cdev.nr_ports; i++) {
+		port = &cdev.ports[i];
+		if (port->fd >= 0)
+			close(port->fd);
+		if (port->listen_fd >= 0) {
+			close(port->listen_fd);
+			unlink(port->socket_path);
+		}
+		if (port->kick_fd >= 0)
+			close(port->kick_fd);
+	}
+
 	return 0;
 }
 virtio_dev_exit(virtio_console__exit);
@@ -208,8 +208,20 @@ static unsigned next_packed_desc(struct virt_queue *vq, struct vring_packed_desc
 	return min(next, max);
 }
 
-u16 virt_queue_split__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm)
+/*
+ * A chain longer than iov_max entries keeps its last descriptor, which
+ * devices usually expect the status in, in the last entry. out and in still
+ * count the whole chain, so callers see it didn't fit.
+ */
+static struct iovec *virt_queue__iov_slot(struct iovec iov[], u16 iov_max,
+					  u16 out, u16 in)
+{
+	return &iov[min_t(u32, out + in, iov_max - 1)];
+}
+
+u16 virt_queue_split__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 iov_max, u16 *out, u16 *in, u16 head, struct kvm *kvm)
 {
+	struct iovec *slot;
 	struct vring_desc *desc;
 	u16 idx;
 	u16 max;
@@ -227,21 +239,24 @@ u16 virt_queue_split__get_head_iov(struct virt_queue *vq, struct iovec iov[], u1
 
 	do {
 		/* Grab the first descriptor, and check it's OK. */
-		iov[*out + *in].iov_len = virtio_guest_to_host_u32(vq->endian, desc[idx].len);
-		iov[*out + *in].iov_base = guest_flat_to_host(kvm,
-							      virtio_guest_to_host_u64(vq->endian, desc[idx].addr));
+		slot = virt_queue__iov_slot(iov, iov_max, *out, *in);
+		slot->iov_len = virtio_guest_to_host_u32(vq->endian, desc[idx].len);
+		slot->iov_base = guest_flat_to_host(kvm,
+						    virtio_guest_to_host_u64(vq->endian, desc[idx].addr));
 		/* If this is an input descriptor, increment that count. */
 		if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_WRITE))
 			(*in)++;
 		else
 			(*out)++;
-	} while ((idx = next_desc(vq, desc, idx, max)) != max);
+	} while ((idx = next_desc(vq, desc, idx, max)) != max &&
+		 *out + *in < max);
 
 	return head;
 }
 
-u16 virt_queue_packed__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm)
+u16 virt_queue_packed__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 iov_max, u16 *out, u16 *in, u16 head, struct kvm *kvm)
 {
+	struct iovec *slot;
 	struct vring_packed_desc *desc;
 	u16 idx;
 	u16 max;
@@ -264,9 +279,10 @@ u16 virt_queue_packed__get_head_iov(struct virt_queue *vq, struct iovec iov[], u
 
 	do {
 		/* Grab the first descriptor, and check it's OK. */
-		iov[*out + *in].iov_len = virtio_guest_to_host_u32(vq->endian, desc[idx].len);
-		iov[*out + *in].iov_base = guest_flat_to_host(kvm,
-							      virtio_guest_to_host_u64(vq->endian, desc[idx].addr));
+		slot = virt_queue__iov_slot(iov, iov_max, *out, *in);
+		slot->iov_len = virtio_guest_to_host_u32(vq->endian, desc[idx].len);
+		slot->iov_base = guest_flat_to_host(kvm,
+						    virtio_guest_to_host_u64(vq->endian, desc[idx].addr));
 		/* If this is an input descriptor, increment that count. */
 		if (virt_desc_packed__test_flag(vq, &desc[idx], VRING_DESC_F_WRITE))
 			(*in)++;
@@ -286,7 +302,7 @@ u16 virt_queue_packed__get_head_iov(struct virt_queue *vq, struct iovec iov[], u
 			buffer_id = virtio_guest_to_host_u16(vq->endian, desc[idx].id);
 			idx = next_packed_desc(vq, desc, idx, max);
 		}
-	} while (idx != max);
+	} while (idx != max && *out + *in < max);
 
 	// the valid id is saved at the last descriptor
 	return buffer_id;
@@ -298,7 +314,8 @@ u16 virt_queue_split__get_iov(struct virt_queue *vq, struct iovec iov[], u16 *ou
 
 	head = virt_queue_split__pop(vq);
 
-	return virt_queue_split__get_head_iov(vq, iov, out, in, head, kvm);
+	return virt_queue_split__get_head_iov(vq, iov, vq->vring.num, out, in,
+					      head, kvm);
 }
 
 /* in and out are relative to guest */
@@ -353,7 +370,7 @@ void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
 		u64 avail = (u64)addr->avail_hi << 32 | addr->avail_lo;
 		u64 used = (u64)addr->used_hi << 32 | addr->used_lo;
 
-		vq->is_packed= !!(vdev->features & (1UL << VIRTIO_F_RING_PACKED));
+		vq->is_packed= !!(vdev->features & (1ULL << VIRTIO_F_RING_PACKED));
 
 		if (!vq->is_packed) {
 			vq->vring = (struct vring) {
@@ -5,10 +5,14 @@
 #include "kvm/util.h"
 #include "kvm/kvm.h"
 #include "kvm/uip.h"
+#include "kvm/xdp.h"
 #include "kvm/guest_compat.h"
 #include "kvm/iovec.h"
+#include "kvm/rwsem.h"
 #include "kvm/strbuf.h"
 
+#include <linux/byteorder.h>
+#include <linux/cpumask.h>
 #include <linux/list.h>
 #include <linux/vhost.h>
 #include <linux/virtio_net.h>
@@ -29,11 +33,21 @@
 #define VIRTIO_NET_QUEUE_SIZE		256
 #define VIRTIO_NET_NUM_QUEUES		8
 
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE	40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN	128
+#define VIRTIO_NET_RSS_HASH_TYPES	(VIRTIO_NET_RSS_HASH_TYPE_IPv4	\
+					 | VIRTIO_NET_RSS_HASH_TYPE_TCPv4	\
+					 | VIRTIO_NET_RSS_HASH_TYPE_UDPv4	\
+					 | VIRTIO_NET_RSS_HASH_TYPE_IPv6	\
+					 | VIRTIO_NET_RSS_HASH_TYPE_TCPv6	\
+					 | VIRTIO_NET_RSS_HASH_TYPE_UDPv6)
+
 struct net_dev;
 
 struct net_dev_operations {
 	int (*rx)(struct iovec *iov, u16 in, struct net_dev *ndev);
 	int (*tx)(struct iovec *iov, u16 in, struct net_dev *ndev);
+	void (*tx_flush)(struct net_dev *ndev);
 };
 
 struct net_dev_queue {
@@ -43,6 +57,23 @@ struct net_dev_queue {
 	pthread_t			thread;
 	struct mutex			lock;
 	pthread_cond_t			cond;
+	/* Serializes RX threads steering packets into this queue */
+	struct mutex			rx_lock;
+};
+
+/*
+ * Hash configuration programmed by the guest, either for steering (RSS) or
+ * only for reporting the hash in the vnet header (HASH_REPORT).
+ */
+struct net_dev_rss {
+	pthread_rwlock_t		lock;
+	bool				steering;
+	u32				hash_types;
+	u16				table_mask;
+	u16				unclassified_queue;
+	u16				table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+	u8				key_len;
+	u8				key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
 };
 
 struct net_dev {
@@ -53,15 +84,26 @@ struct net_dev {
 	struct net_dev_queue		queues[VIRTIO_NET_NUM_QUEUES * 2 + 1];
 	struct virtio_net_config	config;
 	u32				queue_pairs;
+	struct net_dev_rss		rss;
+	/* Host CPU of each queue pair's RX and TX threads, or -1 */
+	int				queue_cpus[VIRTIO_NET_NUM_QUEUES];
 
-	int				vhost_fd;
-	int				tap_fd;
+	/*
+	 * With vhost, each queue pair has its own vhost device and TAP queue.
+	 * Otherwise all pairs share the first TAP queue.
+	 */
+	int				vhost_fds[VIRTIO_NET_NUM_QUEUES];
+	int				tap_fds[VIRTIO_NET_NUM_QUEUES];
+	u32				nr_tap_fds;
+	/* Queue pairs the guest enabled with VIRTIO_NET_CTRL_MQ */
+	u32				active_pairs;
 	char				tap_name[IFNAMSIZ];
 	bool				tap_ufo;
 
 	int				mode;
 
 	struct uip_info			info;
+	struct xdp_info			xdp;
 	struct net_dev_operations	*ops;
 	struct kvm			*kvm;
 
@@ -75,11 +117,14 @@ static int compat_id = -1;
 
 static bool has_virtio_feature(struct net_dev *ndev, u32 feature)
 {
-	return ndev->vdev.features & (1 << feature);
+	return ndev->vdev.features & (1ULL << feature);
 }
 
 static int virtio_net_hdr_len(struct net_dev *ndev)
 {
+	if (has_virtio_feature(ndev, VIRTIO_NET_F_HASH_REPORT))
+		return sizeof(struct virtio_net_hdr_v1_hash);
+
 	if (has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF) ||
 	    !ndev->vdev.legacy)
 		return sizeof(struct virtio_net_hdr_mrg_rxbuf);
@@ -87,36 +132,234 @@ static int virtio_net_hdr_len(struct net_dev *ndev)
 	return sizeof(struct virtio_net_hdr);
 }
 
-static void *virtio_net_rx_thread(void *p)
+static u32 virtio_net_toeplitz(const u8 *key, int key_len, const u8 *data,
+			       int len)
+{
+	u32 hash = 0, v;
+	int i, bit;
+
+	v = (u32)key[0] << 24 | (u32)key[1] << 16 | (u32)key[2] << 8 | key[3];
+	for (i = 0; i < len; i++) {
+		for (bit = 7; bit >= 0; bit--) {
+			if (data[i] & (1 << bit))
+				hash ^= v;
+			v <<= 1;
+			if (i + 4 < key_len && (key[i + 4] & (1 << bit)))
+				v |= 1;
+		}
+	}
+
+	return hash;
+}
+
+/*
+ * Pick the hash input from the most specific type the guest enabled, and
+ * return the matching VIRTIO_NET_HASH_REPORT_* type, or NONE.
+ */
+static u16 virtio_net_rss_hash(struct net_dev_rss *rss, const u8 *eth, int len,
+			       u32 *hash)
+{
+	u8 input[36];
+	const u8 *l3, *l4 = NULL;
+	int input_len, l3_len;
+	u16 proto, report;
+	u8 l4_proto;
+
+	if (len < 14)
+		return VIRTIO_NET_HASH_REPORT_NONE;
+
+	proto = (u16)eth[12] << 8 | eth[13];
+	l3 = eth + 14;
+	l3_len = len - 14;
+	if (proto == 0x8100 && l3_len >= 4) {
+		proto = (u16)l3[2] << 8 | l3[3];
+		l3 += 4;
+		l3_len -= 4;
+	}
+
+	if (proto == 0x0800 && l3_len >= 20 && (l3[0] >> 4) == 4) {
+		int ihl = (l3[0] & 0xf) * 4;
+		bool frag = ((l3[6] & 0x3f) | l3[7]) != 0;
+
+		l4_proto = l3[9];
+		if (!frag && ihl >= 20 && l3_len >= ihl + 4)
+			l4 = l3 + ihl;
+
+		memcpy(input, l3 + 12, 8);
+		input_len = 8;
+		if (l4 && l4_proto == 6 &&
+		    (rss->hash_types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4))
+			report = VIRTIO_NET_HASH_REPORT_TCPv4;
+		else if (l4 && l4_proto == 17 &&
+			 (rss->hash_types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4))
+			report = VIRTIO_NET_HASH_REPORT_UDPv4;
+		else if (rss->hash_types & VIRTIO_NET_RSS_HASH_TYPE_IPv4)
+			report = VIRTIO_NET_HASH_REPORT_IPv4;
+		else
+			return VIRTIO_NET_HASH_REPORT_NONE;
+	} else if (proto == 0x86dd && l3_len >= 40 && (l3[0] >> 4) == 6) {
+		l4_proto = l3[6];
+		if (l3_len >= 44)
+			l4 = l3 + 40;
+
+		memcpy(input, l3 + 8, 32);
+		input_len = 32;
+		if (l4 && l4_proto == 6 &&
+		    (rss->hash_types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6))
+			report = VIRTIO_NET_HASH_REPORT_TCPv6;
+		else if (l4 && l4_proto == 17 &&
+			 (rss->hash_types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6))
+			report = VIRTIO_NET_HASH_REPORT_UDPv6;
+		else if (rss->hash_types & VIRTIO_NET_RSS_HASH_TYPE_IPv6)
+			report = VIRTIO_NET_HASH_REPORT_IPv6;
+		else
+			return VIRTIO_NET_HASH_REPORT_NONE;
+	} else {
+		return VIRTIO_NET_HASH_REPORT_NONE;
+	}
+
+	/* Both ports, right after the addresses */
+	if (report != VIRTIO_NET_HASH_REPORT_IPv4 &&
+	    report != VIRTIO_NET_HASH_REPORT_IPv6) {
+		memcpy(input + input_len, l4, 4);
+		input_len += 4;
+	}
+
+	*hash = virtio_net_toeplitz(rss->key, rss->key_len, input, input_len);
+	return report;
+}
+
+/*
+ * Work out which queue pair a received packet belongs to, and fill in the
+ * hash report if the guest asked for one.
+ */
+static struct net_dev_queue *virtio_net_rx_steer(struct net_dev *ndev,
+						 struct net_dev_queue *queue,
+						 u8 *buffer, int len)
+{
+	struct net_dev_rss *rss = &ndev->rss;
+	bool report = has_virtio_feature(ndev, VIRTIO_NET_F_HASH_REPORT);
+	int hdr_len = virtio_net_hdr_len(ndev);
+	struct virtio_net_hdr_v1_hash *hdr = (void *)buffer;
+	u16 type, pair = queue->id / 2;
+	u32 hash = 0;
+
+	/* Packets read by the thread of a disabled pair go to an enabled one */
+	pair %= ndev->active_pairs;
+
+	if (!rss->hash_types || len < hdr_len)
+		goto out;
+
+	down_read(&rss->lock);
+	type = virtio_net_rss_hash(rss, buffer + hdr_len, len - hdr_len, &hash);
+	if (rss->steering) {
+		if (type == VIRTIO_NET_HASH_REPORT_NONE)
+			pair = rss->unclassified_queue;
+		else
+			pair = rss->table[hash & rss->table_mask];
+	}
+	up_read(&rss->lock);
+
+	if (report) {
+		hdr->hash_value = cpu_to_le32(hash);
+		hdr->hash_report = cpu_to_le16(type);
+		hdr->padding = 0;
+	}
+
+	return &ndev->queues[pair * 2];
+
+out:
+	if (report) {
+		hdr->hash_value = 0;
+		hdr->hash_report = cpu_to_le16(VIRTIO_NET_HASH_REPORT_NONE);
+		hdr->padding = 0;
+	}
+
+	return &ndev->queues[pair * 2];
+}
+
+/*
+ * Copy a packet into the guest buffers of an RX queue. With RSS the packet
+ * may have been read by another queue's thread, hence the lock. Like a real
+ * NIC, the packet is dropped if that queue has no buffers.
+ */
+static void virtio_net_rx_deliver(struct net_dev_queue *queue, u8 *buffer,
+				  int len)
 {
 	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
+	struct virt_queue *vq = &queue->vq;
+	struct net_dev *ndev = queue->ndev;
+	struct kvm *kvm = ndev->kvm;
+	struct virtio_net_hdr_mrg_rxbuf *hdr;
+	u16 out, in, head, num_buffers;
+	int copied;
+
+	mutex_lock(&queue->rx_lock);
+
+	if (!virt_queue__available(vq)) {
+		mutex_unlock(&queue->rx_lock);
+		return;
+	}
+
+	copied = num_buffers = 0;
+	head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+	hdr = iov[0].iov_base;
+	while (copied < len) {
+		size_t iovsize = min_t(size_t, len - copied,
+				       iov_size(iov, min_t(u16, in, ARRAY_SIZE(iov))));
+
+		memcpy_toiovec(iov, buffer + copied, iovsize);
+		copied += iovsize;
+		virt_queue__set_used_elem(vq, head, iovsize, in + out);
+		num_buffers++;
+
+		if (copied == len)
+			break;
+		while (!virt_queue__available(vq))
+			sleep(0);
+		head = virt_queue_split__get_iov(vq, iov, &out, &in, kvm);
+	}
+
+	/*
+	 * The device MUST set num_buffers, except in the case
+	 * where the legacy driver did not negotiate
+	 * VIRTIO_NET_F_MRG_RXBUF and the field does not exist.
+	 */
+	if (has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF) ||
+	    !ndev->vdev.legacy)
+		hdr->num_buffers = virtio_host_to_guest_u16(vq->endian, num_buffers);
+
+	if (!vq->is_packed)
+		virt_queue_split__used_idx_advance(vq, num_buffers);
+
+	mutex_unlock(&queue->rx_lock);
+
+	/* We should interrupt guest right now, otherwise latency is huge. */
+	if (virtio_queue__should_signal(vq))
+		ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+}
+
+static void *virtio_net_rx_thread(void *p)
+{
 	struct net_dev_queue *queue = p;
 	struct virt_queue *vq = &queue->vq;
 	struct net_dev *ndev = queue->ndev;
-	struct kvm *kvm;
-	u16 out, in;
-	u16 head;
-	int len, copied;
+	int len;
 
 	kvm__set_thread_name("virtio-net-rx");
 
-	kvm = ndev->kvm;
 	while (1) {
 		mutex_lock(&queue->lock);
 		if (!virt_queue__available(vq))
 			pthread_cond_wait(&queue->cond, &queue->lock.mutex);
 		mutex_unlock(&queue->lock);
 
-		printf("virtio-net-rx: vq %u available packed: %d\n", queue->id, vq->is_packed);
 		while (virt_queue__available(vq)) {
-			//dump_virtqueue_all_desc(vq);
-			unsigned char buffer[MAX_PACKET_SIZE + sizeof(struct virtio_net_hdr_mrg_rxbuf)];
+			unsigned char buffer[MAX_PACKET_SIZE + sizeof(struct virtio_net_hdr_v1_hash)];
 			struct iovec dummy_iov = {
 				.iov_base = buffer,
 				.iov_len  = sizeof(buffer),
 			};
-			struct virtio_net_hdr_mrg_rxbuf *hdr;
-			u16 num_buffers;
 
 			len = ndev->ops->rx(&dummy_iov, 1, ndev);
 			if (len < 0) {
@@ -125,39 +368,8 @@ static void *virtio_net_rx_thread(void *p)
 				goto out_err;
 			}
 
-			copied = num_buffers = 0;
-			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			hdr = iov[0].iov_base;
-			while (copied < len) {
-				size_t iovsize = min_t(size_t, len - copied, iov_size(iov, in));
-
-				memcpy_toiovec(iov, buffer + copied, iovsize);
-				copied += iovsize;
-				virt_queue__set_used_elem(vq, head, iovsize, in + out);
-				num_buffers++;
-
-				if (copied == len)
-					break;
-				while (!virt_queue__available(vq))
-					sleep(0);
-				head = virt_queue_split__get_iov(vq, iov, &out, &in, kvm);
-			}
-			
-			/*
-			 * The device MUST set num_buffers, except in the case
-			 * where the legacy driver did not negotiate
-			 * VIRTIO_NET_F_MRG_RXBUF and the field does not exist.
-			 */
-			if (has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF) ||
-			    !ndev->vdev.legacy)
-				hdr->num_buffers = virtio_host_to_guest_u16(vq->endian, num_buffers);
-
-			if (!vq->is_packed)
-				virt_queue_split__used_idx_advance(vq, num_buffers);
-
-			/* We should interrupt guest right now, otherwise latency is huge. */
-			if (virtio_queue__should_signal(vq))
-				ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+			virtio_net_rx_deliver(virtio_net_rx_steer(ndev, queue, buffer, len),
+					      buffer, len);
 		}
 	}
 
@@ -192,7 +404,8 @@ static void *virtio_net_tx_thread(void *p)
 			//printf("virtio-net-tx: vq %u available packed: %d\n", queue->id, vq->is_packed);
 			//dump_virtqueue_all_desc(vq);
 			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			len = ndev->ops->tx(iov, out, ndev);
+			len = ndev->ops->tx(iov, min_t(u16, out, ARRAY_SIZE(iov)),
+					    ndev);
 			if (len < 0) {
 				pr_warning("%s: tx on vq %u failed (%d)\n",
 						__func__, queue->id, errno);
@@ -204,6 +417,10 @@ static void *virtio_net_tx_thread(void *p)
 			//dump_virtqueue_all_desc(vq);
 		}
 
+		/* Backends that batch transmissions send the rest now */
+		if (ndev->ops->tx_flush)
+			ndev->ops->tx_flush(ndev);
+
 		if (virtio_queue__should_signal(vq))
 			ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
 	}
@@ -213,12 +430,128 @@ out_err:
 	return NULL;
 }
 
-static virtio_net_ctrl_ack virtio_net_handle_mq(struct kvm* kvm, struct net_dev *ndev, struct virtio_net_ctrl_hdr *ctrl)
+/*
+ * RSS_CONFIG and HASH_CONFIG share a layout, HASH_CONFIG only has reserved
+ * fields where the steering parameters go.
+ */
+static virtio_net_ctrl_ack virtio_net_handle_rss(struct net_dev *ndev, u8 *data,
+						 size_t len, bool steering)
 {
-	/* Not much to do here */
+	struct net_dev_rss *rss = &ndev->rss;
+	u16 table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+	u16 mask, unclassified;
+	u32 hash_types, nr;
+	size_t off;
+	u8 key_len;
+	u32 i;
+
+	if (len < 8)
+		return VIRTIO_NET_ERR;
+
+	hash_types = le32_to_cpu(*(__le32 *)data);
+	mask = steering ? le16_to_cpu(*(__le16 *)(data + 4)) : 0;
+	unclassified = steering ? le16_to_cpu(*(__le16 *)(data + 6)) : 0;
+	nr = mask + 1;
+
+	if (nr > VIRTIO_NET_RSS_MAX_TABLE_LEN || (nr & mask) ||
+	    unclassified >= ndev->queue_pairs)
+		return VIRTIO_NET_ERR;
+
+	/* The table, max_tx_vq and the key length */
+	off = 8 + nr * 2 + 2;
+	if (len < off + 1)
+		return VIRTIO_NET_ERR;
+
+	for (i = 0; i < nr; i++) {
+		table[i] = steering ? le16_to_cpu(*(__le16 *)(data + 8 + i * 2)) : 0;
+		if (table[i] >= ndev->queue_pairs)
+			return VIRTIO_NET_ERR;
+	}
+
+	key_len = data[off++];
+	if (key_len > VIRTIO_NET_RSS_MAX_KEY_SIZE || len < off + key_len ||
+	    (hash_types && key_len < 4))
+		return VIRTIO_NET_ERR;
+
+	down_write(&rss->lock);
+	rss->steering		= steering;
+	rss->hash_types		= hash_types & VIRTIO_NET_RSS_HASH_TYPES;
+	rss->table_mask		= mask;
+	rss->unclassified_queue	= unclassified;
+	rss->key_len		= key_len;
+	memcpy(rss->table, table, nr * sizeof(table[0]));
+	memcpy(rss->key, data + off, key_len);
+	up_write(&rss->lock);
+
 	return VIRTIO_NET_OK;
 }
 
+/*
+ * Only the first pairs queue pairs carry packets. With vhost, the TAP queues
+ * of the other pairs are detached, so that the host stops steering packets to
+ * them.
+ */
+static int virtio_net_set_pairs(struct net_dev *ndev, u32 pairs)
+{
+	struct ifreq ifr = { };
+	u32 i;
+
+	for (i = 1; ndev->vdev.use_vhost && i < ndev->nr_tap_fds; i++) {
+		if ((i < pairs) == (i < ndev->active_pairs))
+			continue;
+
+		ifr.ifr_flags = i < pairs ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+		if (ioctl(ndev->tap_fds[i], TUNSETQUEUE, &ifr) < 0) {
+			pr_warning("Failed to %s TAP queue %u: %s",
+				   i < pairs ? "attach" : "detach", i,
+				   strerror(errno));
+			return -errno;
+		}
+	}
+
+	ndev->active_pairs = pairs;
+	return 0;
+}
+
+static virtio_net_ctrl_ack virtio_net_handle_mq(struct kvm* kvm, struct net_dev *ndev,
+						struct virtio_net_ctrl_hdr *ctrl,
+						u8 *data, size_t len)
+{
+	struct net_dev_rss *rss = &ndev->rss;
+	u16 pairs;
+
+	switch (ctrl->cmd) {
+	case VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET:
+		if (len < sizeof(pairs))
+			return VIRTIO_NET_ERR;
+
+		pairs = virtio_guest_to_host_u16(ndev->vdev.endian,
+						 *(u16 *)data);
+		if (pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+		    pairs > ndev->queue_pairs)
+			return VIRTIO_NET_ERR;
+
+		/* Back to automatic steering, each queue keeps its packets */
+		down_write(&rss->lock);
+		rss->steering = false;
+		up_write(&rss->lock);
+
+		if (virtio_net_set_pairs(ndev, pairs) < 0)
+			return VIRTIO_NET_ERR;
+		return VIRTIO_NET_OK;
+	case VIRTIO_NET_CTRL_MQ_RSS_CONFIG:
+		if (!has_virtio_feature(ndev, VIRTIO_NET_F_RSS))
+			return VIRTIO_NET_ERR;
+		return virtio_net_handle_rss(ndev, data, len, true);
+	case VIRTIO_NET_CTRL_MQ_HASH_CONFIG:
+		if (!has_virtio_feature(ndev, VIRTIO_NET_F_HASH_REPORT))
+			return VIRTIO_NET_ERR;
+		return virtio_net_handle_rss(ndev, data, len, false);
+	default:
+		return VIRTIO_NET_ERR;
+	}
+}
+
 static void *virtio_net_ctrl_thread(void *p)
 {
 	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
@@ -229,6 +562,7 @@ static void *virtio_net_ctrl_thread(void *p)
 	struct kvm *kvm = ndev->kvm;
 	struct virtio_net_ctrl_hdr ctrl;
 	virtio_net_ctrl_ack ack;
+	u8 data[512];
 	size_t len;
 
 	kvm__set_thread_name("virtio-net-ctrl");
@@ -242,18 +576,33 @@ static void *virtio_net_ctrl_thread(void *p)
 		while (virt_queue__available(vq)) {
 			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
 
-			len = min(iov_size(iov, in), sizeof(ctrl));
-			memcpy_fromiovec((void *)&ctrl, iov, len);
+			/* The command comes in the out buffers, the ack goes after */
+			if (!in || out + in > ARRAY_SIZE(iov)) {
+				ack = VIRTIO_NET_ERR;
+				goto ack;
+			}
+
+			len = iov_size(iov, out);
+			if (len < sizeof(ctrl)) {
+				ack = VIRTIO_NET_ERR;
+				goto ack;
+			}
+
+			memcpy_fromiovec((void *)&ctrl, iov, sizeof(ctrl));
+			len = min(len - sizeof(ctrl), sizeof(data));
+			memcpy_fromiovec(data, iov, len);
 
 			switch (ctrl.class) {
 			case VIRTIO_NET_CTRL_MQ:
-				ack = virtio_net_handle_mq(kvm, ndev, &ctrl);
+				ack = virtio_net_handle_mq(kvm, ndev, &ctrl, data, len);
 				break;
 			default:
 				ack = VIRTIO_NET_ERR;
 				break;
 			}
-			memcpy_toiovec(iov + in, &ack, sizeof(ack));
+ack:
+			if (in && out + in <= ARRAY_SIZE(iov))
+				memcpy_toiovec(iov + out, &ack, sizeof(ack));
 			virt_queue__set_used_elem(vq, head, sizeof(ack), in + out);
 		}
 
@@ -280,17 +629,34 @@ static void virtio_net_handle_callback(struct kvm *kvm, struct net_dev *ndev, in
 	mutex_unlock(&net_queue->lock);
 }
 
-static int virtio_net_request_tap(struct net_dev *ndev, struct ifreq *ifr,
-				  const char *tapname)
+/* Settings of the TAP device that macvtap keeps per queue */
+static int virtio_net_tap_ioctl(struct net_dev *ndev, unsigned long req,
+				unsigned long arg)
+{
+	u32 i;
+
+	for (i = 0; i < ndev->nr_tap_fds; i++) {
+		if (ioctl(ndev->tap_fds[i], req, arg) < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
+static int virtio_net_request_tap(struct net_dev *ndev, int fd,
+				  struct ifreq *ifr, const char *tapname,
+				  bool mq)
 {
 	int ret;
 
 	memset(ifr, 0, sizeof(*ifr));
 	ifr->ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+	if (mq)
+		ifr->ifr_flags |= IFF_MULTI_QUEUE;
 	if (tapname)
 		strlcpy(ifr->ifr_name, tapname, sizeof(ifr->ifr_name));
 
-	ret = ioctl(ndev->tap_fd, TUNSETIFF, ifr);
+	ret = ioctl(fd, TUNSETIFF, ifr);
 
 	if (ret >= 0)
 		strlcpy(ndev->tap_name, ifr->ifr_name, sizeof(ndev->tap_name));
@@ -326,7 +692,7 @@ static bool virtio_net__tap_init(struct net_dev *ndev)
 	bool skipconf = !!params->tapif;
 
 	hdr_len = virtio_net_hdr_len(ndev);
-	if (ioctl(ndev->tap_fd, TUNSETVNETHDRSZ, &hdr_len) < 0)
+	if (virtio_net_tap_ioctl(ndev, TUNSETVNETHDRSZ, (unsigned long)&hdr_len) < 0)
 		pr_warning("Config tap device TUNSETVNETHDRSZ error");
 
 	if (strcmp(params->script, "none")) {
@@ -360,8 +726,8 @@ static bool virtio_net__tap_init(struct net_dev *ndev)
 fail:
 	if (sock >= 0)
 		close(sock);
-	if (ndev->tap_fd >= 0)
-		close(ndev->tap_fd);
+	while (ndev->nr_tap_fds)
+		close(ndev->tap_fds[--ndev->nr_tap_fds]);
 
 	return 0;
 }
@@ -383,36 +749,86 @@ static void virtio_net__tap_exit(struct net_dev *ndev)
 	close(sock);
 }
 
+/*
+ * Open one more queue of the TAP device for each queue pair after the first.
+ * A macvtap device gets a new queue each time it is opened.
+ */
+static void virtio_net__tap_add_queues(struct net_dev *ndev,
+				       const char *tap_file, bool macvtap)
+{
+	struct ifreq ifr;
+	int fd;
+
+	while (ndev->nr_tap_fds < ndev->queue_pairs) {
+		fd = open(tap_file, O_RDWR);
+		if (fd < 0)
+			break;
+
+		if (!macvtap &&
+		    virtio_net_request_tap(ndev, fd, &ifr, ndev->tap_name, true) < 0) {
+			close(fd);
+			break;
+		}
+
+		ndev->tap_fds[ndev->nr_tap_fds++] = fd;
+	}
+
+	if (ndev->nr_tap_fds < ndev->queue_pairs) {
+		pr_warning("Only %u TAP queues available for vhost",
+			   ndev->nr_tap_fds);
+		ndev->queue_pairs = ndev->nr_tap_fds;
+	}
+}
+
 static bool virtio_net__tap_create(struct net_dev *ndev)
 {
 	int offload;
 	struct ifreq ifr;
 	const struct virtio_net_params *params = ndev->params;
 	bool macvtap = (!!params->tapif) && (params->tapif[0] == '/');
+	bool mq = params->vhost && ndev->queue_pairs > 1;
+	const char *tap_file = "/dev/net/tun";
 
-	/* Did the user already gave us the FD? */
-	if (params->fd)
-		ndev->tap_fd = params->fd;
-	else {
-		const char *tap_file = "/dev/net/tun";
-
-		/* Did the user ask us to use macvtap? */
-		if (macvtap)
-			tap_file = params->tapif;
+	/* Did the user ask us to use macvtap? */
+	if (macvtap)
+		tap_file = params->tapif;
 
-		ndev->tap_fd = open(tap_file, O_RDWR);
-		if (ndev->tap_fd < 0) {
+	/* Did the user already gave us the FD? */
+	if (params->fd) {
+		ndev->tap_fds[0] = params->fd;
+		if (mq) {
+			pr_warning("multiqueue vhost needs to open the TAP device");
+			ndev->queue_pairs = 1;
+			mq = false;
+		}
+	} else {
+		ndev->tap_fds[0] = open(tap_file, O_RDWR);
+		if (ndev->tap_fds[0] < 0) {
 			pr_warning("Unable to open %s", tap_file);
 			return 0;
 		}
 	}
+	ndev->nr_tap_fds = 1;
+
+	/* An existing TAP device may not have been created multiqueue */
+	if (!macvtap && mq &&
+	    virtio_net_request_tap(ndev, ndev->tap_fds[0], &ifr, params->tapif,
+				   true) < 0) {
+		pr_warning("TAP device %s isn't multiqueue", params->tapif);
+		ndev->queue_pairs = 1;
+		mq = false;
+	}
 
-	if (!macvtap &&
-	    virtio_net_request_tap(ndev, &ifr, params->tapif) < 0) {
+	if (!macvtap && !mq &&
+	    virtio_net_request_tap(ndev, ndev->tap_fds[0], &ifr, params->tapif,
+				   false) < 0) {
 		pr_warning("Config tap device error. Are you root?");
 		goto fail;
 	}
 
+	if (mq)
+		virtio_net__tap_add_queues(ndev, tap_file, macvtap);
+
 	/*
 	 * The UFO support had been removed from kernel in commit:
 	 * ID: fb652fdfe83710da0ca13448a41b7ed027d0a984
@@ -423,13 +839,13 @@ static bool virtio_net__tap_create(struct net_dev *ndev)
 	 */
 	ndev->tap_ufo = true;
 	offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_UFO;
-	if (ioctl(ndev->tap_fd, TUNSETOFFLOAD, offload) < 0) {
+	if (virtio_net_tap_ioctl(ndev, TUNSETOFFLOAD, offload) < 0) {
 		/*
 		 * Is this failure caused by kernel remove the UFO support?
 		 * Try TUNSETOFFLOAD without TUN_F_UFO.
 		 */
 		offload &= ~TUN_F_UFO;
-		if (ioctl(ndev->tap_fd, TUNSETOFFLOAD, offload) < 0) {
+		if (virtio_net_tap_ioctl(ndev, TUNSETOFFLOAD, offload) < 0) {
 			pr_warning("Config tap device TUNSETOFFLOAD error");
 			goto fail;
 		}
@@ -439,20 +855,23 @@ static bool virtio_net__tap_create(struct net_dev *ndev)
 	return 1;
 
 fail:
-	if ((ndev->tap_fd >= 0) || (!params->fd) )
-		close(ndev->tap_fd);
+	while (ndev->nr_tap_fds > 1)
+		close(ndev->tap_fds[--ndev->nr_tap_fds]);
+	if (!params->fd)
+		close(ndev->tap_fds[0]);
+	ndev->nr_tap_fds = 0;
 
 	return 0;
 }
 
 static inline int tap_ops_tx(struct iovec *iov, u16 out, struct net_dev *ndev)
 {
-	return writev(ndev->tap_fd, iov, out);
+	return writev(ndev->tap_fds[0], iov, out);
 }
 
 static inline int tap_ops_rx(struct iovec *iov, u16 in, struct net_dev *ndev)
 {
-	return readv(ndev->tap_fd, iov, in);
+	return readv(ndev->tap_fds[0], iov, in);
 }
 
 static inline int uip_ops_tx(struct iovec *iov, u16 out, struct net_dev *ndev)
@@ -465,6 +884,21 @@ static inline int uip_ops_rx(struct iovec *iov, u16 in, struct net_dev *ndev)
 	return uip_rx(iov, in, &ndev->info);
 }
 
+static inline int xdp_ops_tx(struct iovec *iov, u16 out, struct net_dev *ndev)
+{
+	return xdp_tx(iov, out, &ndev->xdp);
+}
+
+static inline int xdp_ops_rx(struct iovec *iov, u16 in, struct net_dev *ndev)
+{
+	return xdp_rx(iov, in, &ndev->xdp);
+}
+
+static inline void xdp_ops_tx_flush(struct net_dev *ndev)
+{
+	xdp_tx_flush(&ndev->xdp);
+}
+
 static struct net_dev_operations tap_ops = {
 	.rx	= tap_ops_rx,
 	.tx	= tap_ops_tx,
@@ -475,6 +909,12 @@ static struct net_dev_operations uip_ops = {
 	.tx	= uip_ops_tx,
 };
 
+static struct net_dev_operations xdp_ops = {
+	.rx		= xdp_ops_rx,
+	.tx		= xdp_ops_tx,
+	.tx_flush	= xdp_ops_tx_flush,
+};
+
 static u8 *get_config(struct kvm *kvm, void *dev)
 {
 	struct net_dev *ndev = dev;
@@ -496,6 +936,7 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 
 	features = 1UL << VIRTIO_NET_F_MAC
 		| 1UL << VIRTIO_NET_F_CSUM
+		| 1UL << VIRTIO_NET_F_GUEST_CSUM
 		| 1UL << VIRTIO_NET_F_HOST_TSO4
 		| 1UL << VIRTIO_NET_F_HOST_TSO6
 		| 1UL << VIRTIO_NET_F_GUEST_TSO4
@@ -504,10 +945,15 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 		| 1UL << VIRTIO_RING_F_INDIRECT_DESC
 		| 1UL << VIRTIO_NET_F_CTRL_VQ
 		| 1UL << VIRTIO_NET_F_MRG_RXBUF
-		| 1UL << VIRTIO_F_RING_PACKED
+		| 1ULL << VIRTIO_F_RING_PACKED
 		| 1UL << (ndev->queue_pairs > 1 ? VIRTIO_NET_F_MQ : 0)
+		| 1ULL << VIRTIO_NET_F_HASH_REPORT
 		| 1UL << VIRTIO_F_ANY_LAYOUT;
 
+	/* Steering only makes sense with several queues to choose from */
+	if (ndev->queue_pairs > 1)
+		features |= 1ULL << VIRTIO_NET_F_RSS;
+
 	/*
 	 * The UFO feature for host and guest only can be enabled when the
 	 * kernel has TAP UFO support.
@@ -516,12 +962,26 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 		features |= (1UL << VIRTIO_NET_F_HOST_UFO
 				| 1UL << VIRTIO_NET_F_GUEST_UFO);
 
-	if (ndev->vhost_fd) {
+	/* AF_XDP moves plain frames, there is nobody to do the offloads */
+	if (ndev->mode == NET_MODE_XDP)
+		features &= ~(1UL << VIRTIO_NET_F_CSUM
+				| 1UL << VIRTIO_NET_F_GUEST_CSUM
+				| 1UL << VIRTIO_NET_F_HOST_TSO4
+				| 1UL << VIRTIO_NET_F_HOST_TSO6
+				| 1UL << VIRTIO_NET_F_GUEST_TSO4
+				| 1UL << VIRTIO_NET_F_GUEST_TSO6);
+
+	if (ndev->vdev.use_vhost) {
 		u64 vhost_features;
 
-		if (ioctl(ndev->vhost_fd, VHOST_GET_FEATURES, &vhost_features) != 0)
+		if (ioctl(ndev->vhost_fds[0], VHOST_GET_FEATURES, &vhost_features) != 0)
 			die_perror("VHOST_GET_FEATURES failed");
 
+		/* The control queue stays with us, vhost only has the data */
+		if (ndev->queue_pairs > 1)
+			vhost_features |= 1UL << VIRTIO_NET_F_CTRL_VQ
+					| 1UL << VIRTIO_NET_F_MQ;
+
 		features &= vhost_features;
 	}
 
@@ -532,18 +992,42 @@ static void virtio_net_start(struct net_dev *ndev)
 {
 	/* VHOST_NET_F_VIRTIO_NET_HDR clashes with VIRTIO_F_ANY_LAYOUT! */
 	u64 features = ndev->vdev.features & ~(1UL << VHOST_NET_F_VIRTIO_NET_HDR);
+	u32 i;
+
+	/* Control features aren't vhost's business */
+	features &= ~(1UL << VIRTIO_NET_F_CTRL_VQ | 1UL << VIRTIO_NET_F_MQ);
 
 	if (ndev->mode == NET_MODE_TAP) {
 		if (!virtio_net__tap_init(ndev))
 			die_perror("TAP device initialized failed because");
 
-		if (ndev->vhost_fd && virtio_vhost_set_features(ndev->vhost_fd,
-								features))
-			die_perror("VHOST_SET_FEATURES failed");
+		for (i = 0; ndev->vdev.use_vhost && i < ndev->queue_pairs; i++) {
+			if (virtio_vhost_set_features(ndev->vhost_fds[i], features))
+				die_perror("VHOST_SET_FEATURES failed");
+		}
+	} else if (ndev->mode == NET_MODE_XDP) {
+		ndev->xdp.vnet_hdr_len = virtio_net_hdr_len(ndev);
+		if (xdp_init(&ndev->xdp))
+			die("Failed to set up AF_XDP on %s", ndev->xdp.ifname);
 	} else {
 		ndev->info.vnet_hdr_len = virtio_net_hdr_len(ndev);
-		uip_init(&ndev->info);
+		ndev->info.vnet_endian = ndev->vdev.endian;
+		ndev->info.guest_csum = has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_CSUM);
+		/* GSO packets carry a partial checksum, which needs GUEST_CSUM */
+		ndev->info.guest_tso4 = ndev->info.guest_csum &&
+					has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_TSO4);
+		ndev->info.guest_tso6 = ndev->info.guest_csum &&
+					has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_TSO6);
+		ndev->info.guest_gso = ndev->info.guest_tso4 ||
+				       ndev->info.guest_tso6 ||
+				       (ndev->info.guest_csum &&
+					has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_UFO));
+		if (uip_init(&ndev->info))
+			die("Failed to initialize user networking");
 	}
+
+	/* The device starts with a single queue pair */
+	virtio_net_set_pairs(ndev, 1);
 }
 
 static void virtio_net_stop(struct net_dev *ndev)
@@ -551,6 +1035,8 @@ static void virtio_net_stop(struct net_dev *ndev)
 	/* Undo whatever start() did */
 	if (ndev->mode == NET_MODE_TAP)
 		virtio_net__tap_exit(ndev);
+	else if (ndev->mode == NET_MODE_XDP)
+		xdp_exit(&ndev->xdp);
 	else
 		uip_exit(&ndev->info);
 }
@@ -578,8 +1064,9 @@ static void virtio_net_update_endian(struct net_dev *ndev)
 			disable_req = TUNSETVNETLE;
 		}
 
-		ioctl(ndev->tap_fd, disable_req, &disable_val);
-		if (ioctl(ndev->tap_fd, enable_req, &enable_val) < 0)
+		virtio_net_tap_ioctl(ndev, disable_req, (unsigned long)&disable_val);
+		if (virtio_net_tap_ioctl(ndev, enable_req,
+					 (unsigned long)&enable_val) < 0)
 			pr_err("Config tap device TUNSETVNETLE/BE error");
 	}
 }
@@ -602,9 +1089,15 @@ static bool is_ctrl_vq(struct net_dev *ndev, u32 vq)
 	return vq == (u32)(ndev->queue_pairs * 2);
 }
 
+/* Each vhost device has the RX and TX queues of one pair, at index 0 and 1 */
+static int vhost_fd(struct net_dev *ndev, u32 vq)
+{
+	return ndev->vhost_fds[vq / 2];
+}
+
 static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	struct vhost_vring_file file = { .index = vq };
+	struct vhost_vring_file file = { .index = vq % 2 };
 	struct net_dev_queue *net_queue;
 	struct net_dev *ndev = dev;
 	struct virt_queue *queue;
@@ -619,27 +1112,43 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 	virtio_init_device_vq(kvm, &ndev->vdev, queue, VIRTIO_NET_QUEUE_SIZE);
 
 	mutex_init(&net_queue->lock);
+	mutex_init(&net_queue->rx_lock);
 	pthread_cond_init(&net_queue->cond, NULL);
 	if (is_ctrl_vq(ndev, vq)) {
 		pthread_create(&net_queue->thread, NULL, virtio_net_ctrl_thread,
 			       net_queue);
 
 		return 0;
-	} else if (ndev->vhost_fd == 0 ) {
+	} else if (!ndev->vdev.use_vhost) {
+		pthread_attr_t attr;
+		cpu_set_t cpuset;
+		int cpu = ndev->queue_cpus[vq / 2];
+
+		/* Both threads of a pair run on the same CPU, if asked to */
+		pthread_attr_init(&attr);
+		if (cpu >= 0) {
+			CPU_ZERO(&cpuset);
+			CPU_SET(cpu, &cpuset);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+		}
+
 		if (vq & 1)
-			pthread_create(&net_queue->thread, NULL,
+			pthread_create(&net_queue->thread, &attr,
 				       virtio_net_tx_thread, net_queue);
 		else
-			pthread_create(&net_queue->thread, NULL,
+			pthread_create(&net_queue->thread, &attr,
 				       virtio_net_rx_thread, net_queue);
 
+		pthread_attr_destroy(&attr);
 		return 0;
 	}
 
-	virtio_vhost_set_vring(kvm, ndev->vhost_fd, vq, queue);
+	virtio_vhost_set_vring(kvm, vhost_fd(ndev, vq), vq % 2, queue);
+	/* Interrupts are for the virtio queue, not the vhost one */
+	queue->index = vq;
 
-	file.fd = ndev->tap_fd;
-	r = ioctl(ndev->vhost_fd, VHOST_NET_SET_BACKEND, &file);
+	file.fd = ndev->tap_fds[vq / 2];
+	r = ioctl(vhost_fd(ndev, vq), VHOST_NET_SET_BACKEND, &file);
 	if (r < 0)
 		die_perror("VHOST_NET_SET_BACKEND failed");
 
@@ -651,15 +1160,15 @@ static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 	struct net_dev *ndev = dev;
 	struct net_dev_queue *queue = &ndev->queues[vq];
 
-	virtio_vhost_reset_vring(kvm, ndev->vhost_fd, vq, &queue->vq);
-
 	/*
 	 * TODO: vhost reset owner. It's the only way to cleanly stop vhost, but
 	 * we can't restart it at the moment.
 	 */
-	if (ndev->vhost_fd && !is_ctrl_vq(ndev, vq)) {
+	if (ndev->vdev.use_vhost && !is_ctrl_vq(ndev, vq)) {
+		virtio_vhost_reset_vring(kvm, vhost_fd(ndev, vq), vq % 2,
+					 &queue->vq);
 		pr_warning("Cannot reset VHOST queue");
-		ioctl(ndev->vhost_fd, VHOST_RESET_OWNER);
+		ioctl(vhost_fd(ndev, vq), VHOST_RESET_OWNER);
 		return;
 	}
 
@@ -676,7 +1185,7 @@ static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
 	struct net_dev *ndev = dev;
 	struct net_dev_queue *queue = &ndev->queues[vq];
 
-	if (ndev->vhost_fd == 0 || is_ctrl_vq(ndev, vq))
+	if (!ndev->vdev.use_vhost || is_ctrl_vq(ndev, vq))
 		return;
 
 	virtio_vhost_set_vring_irqfd(kvm, gsi, &queue->vq);
@@ -686,10 +1195,10 @@ static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
 {
 	struct net_dev *ndev = dev;
 
-	if (ndev->vhost_fd == 0 || is_ctrl_vq(ndev, vq))
+	if (!ndev->vdev.use_vhost || is_ctrl_vq(ndev, vq))
 		return;
 
-	virtio_vhost_set_vring_kick(kvm, ndev->vhost_fd, vq, efd);
+	virtio_vhost_set_vring_kick(kvm, vhost_fd(ndev, vq), vq % 2, efd);
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -745,16 +1254,15 @@ static struct virtio_ops net_dev_virtio_ops = {
 
 static void virtio_net__vhost_init(struct kvm *kvm, struct net_dev *ndev)
 {
-	if (ndev->queue_pairs > 1) {
-		pr_warning("multiqueue is not supported with vhost yet");
-		return;
-	}
+	u32 i;
 
-	ndev->vhost_fd = open("/dev/vhost-net", O_RDWR);
-	if (ndev->vhost_fd < 0)
-		die_perror("Failed openning vhost-net device");
+	for (i = 0; i < ndev->queue_pairs; i++) {
+		ndev->vhost_fds[i] = open("/dev/vhost-net", O_RDWR);
+		if (ndev->vhost_fds[i] < 0)
+			die_perror("Failed openning vhost-net device");
 
-	virtio_vhost_init(kvm, ndev->vhost_fd);
+		virtio_vhost_init(kvm, ndev->vhost_fds[i]);
+	}
 
 	ndev->vdev.use_vhost = true;
 }
@@ -779,11 +1287,13 @@ static int set_net_param(struct kvm *kvm, struct virtio_net_params *p,
 			p->mode = NET_MODE_USER;
 		} else if (!strncmp(val, "tap", 3)) {
 			p->mode = NET_MODE_TAP;
+		} else if (!strncmp(val, "xdp", 3)) {
+			p->mode = NET_MODE_XDP;
 		} else if (!strncmp(val, "none", 4)) {
 			kvm->cfg.no_net = 1;
 			return -1;
 		} else
-			die("Unknown network mode %s, please use user, tap or none", kvm->cfg.network);
+			die("Unknown network mode %s, please use user, tap, xdp or none", kvm->cfg.network);
 	} else if (strcmp(param, "script") == 0) {
 		p->script = strdup(val);
 	} else if (strcmp(param, "downscript") == 0) {
@@ -796,12 +1306,20 @@ static int set_net_param(struct kvm *kvm, struct virtio_net_params *p,
 		p->trans = strdup(val);
 	} else if (strcmp(param, "tapif") == 0) {
 		p->tapif = strdup(val);
+	} else if (strcmp(param, "xdpif") == 0) {
+		p->xdpif = strdup(val);
+	} else if (strcmp(param, "xdpq") == 0) {
+		p->xdp_queue = atoi(val);
+	} else if (strcmp(param, "busy_poll") == 0) {
+		p->busy_poll = atoi(val);
 	} else if (strcmp(param, "vhost") == 0) {
 		p->vhost = atoi(val);
 	} else if (strcmp(param, "fd") == 0) {
 		p->fd = atoi(val);
 	} else if (strcmp(param, "mq") == 0) {
 		p->mq = atoi(val);
+	} else if (strcmp(param, "cpus") == 0) {
+		p->cpus = strdup(val);
 	} else
 		die("Unknown network parameter %s", param);
 
@@ -858,6 +1376,55 @@ done:
 	return 0;
 }
 
+/*
+ * Queue pair i runs on the i-th CPU of the list, wrapping around if the list
+ * is shorter. Entries are separated by ':' since ',' separates parameters.
+ */
+static int virtio_net__parse_cpus(struct net_dev *ndev, const char *cpus)
+{
+	cpumask_t *cpumask;
+	char *list, *c;
+	int cpu = -1, nr = 0, i;
+
+	for (i = 0; i < VIRTIO_NET_NUM_QUEUES; i++)
+		ndev->queue_cpus[i] = -1;
+
+	if (!cpus)
+		return 0;
+
+	list = strdup(cpus);
+	cpumask = calloc(1, cpumask_size());
+	if (!list || !cpumask) {
+		free(list);
+		free(cpumask);
+		return -ENOMEM;
+	}
+
+	for (c = list; *c; c++)
+		if (*c == ':')
+			*c = ',';
+
+	if (cpulist_parse(list, cpumask)) {
+		pr_err("virtio-net: invalid CPU list %s", cpus);
+		free(list);
+		free(cpumask);
+		return -EINVAL;
+	}
+
+	for_each_cpu(cpu, cpumask) {
+		if (nr == VIRTIO_NET_NUM_QUEUES)
+			break;
+		ndev->queue_cpus[nr++] = cpu;
+	}
+
+	for (i = nr; nr && i < VIRTIO_NET_NUM_QUEUES; i++)
+		ndev->queue_cpus[i] = ndev->queue_cpus[i % nr];
+
+	free(list);
+	free(cpumask);
+	return 0;
+}
+
 static int virtio_net__init_one(struct virtio_net_params *params)
 {
 	enum virtio_trans trans = params->kvm->cfg.virtio_transport;
@@ -880,6 +1447,20 @@ static int virtio_net__init_one(struct virtio_net_params *params)
 
 	mutex_init(&ndev->mutex);
 	ndev->queue_pairs = max(1, min(VIRTIO_NET_NUM_QUEUES, params->mq));
+	ndev->active_pairs = ndev->queue_pairs;
+	pthread_rwlock_init(&ndev->rss.lock, NULL);
+
+	r = virtio_net__parse_cpus(ndev, params->cpus);
+	if (r < 0) {
+		list_del(&ndev->list);
+		free(ops);
+		free(ndev);
+		return r;
+	}
+
+	ndev->config.rss_max_key_size			= VIRTIO_NET_RSS_MAX_KEY_SIZE;
+	ndev->config.rss_max_indirection_table_length	= cpu_to_le16(VIRTIO_NET_RSS_MAX_TABLE_LEN);
+	ndev->config.supported_hash_types		= cpu_to_le32(VIRTIO_NET_RSS_HASH_TYPES);
 
 	for (i = 0 ; i < 6 ; i++) {
 		ndev->config.mac[i]		= params->guest_mac[i];
@@ -888,11 +1469,25 @@ static int virtio_net__init_one(struct virtio_net_params *params)
 	}
 
 	ndev->mode = params->mode;
-	printf("virtio-net: %s mode\n", ndev->mode == NET_MODE_TAP ? "TAP" : "USER");
+	printf("virtio-net: %s mode\n", ndev->mode == NET_MODE_TAP ? "TAP" :
+	       ndev->mode == NET_MODE_XDP ? "XDP" : "USER");
 	if (ndev->mode == NET_MODE_TAP) {
 		ndev->ops = &tap_ops;
 		if (!virtio_net__tap_create(ndev))
 			die_perror("You have requested a TAP device, but creation of one has failed because");
+	} else if (ndev->mode == NET_MODE_XDP) {
+		if (!params->xdpif)
+			die("XDP mode needs an interface, please use xdpif=<name>");
+		if (params->vhost)
+			die("XDP mode cannot be used with vhost");
+		if (ndev->queue_pairs > 1) {
+			pr_warning("multiqueue is not supported with XDP yet");
+			ndev->queue_pairs = 1;
+		}
+		ndev->xdp.ifname	= params->xdpif;
+		ndev->xdp.queue		= params->xdp_queue;
+		ndev->xdp.busy_poll	= params->busy_poll;
+		ndev->ops = &xdp_ops;
 	} else {
 		ndev->info.host_ip		= ntohl(inet_addr(params->host_ip));
 		ndev->info.guest_ip		= ntohl(inet_addr(params->guest_ip));
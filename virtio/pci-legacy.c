@@ -88,7 +88,7 @@ static bool virtio_pci__specific_data_out(struct kvm *kvm, struct virtio_device
 			if (gsi < 0)
 				break;
 
-			vpci->config_gsi = gsi;
+			virtio_pci__set_config_gsi(vpci, gsi);
 			break;
 		case VIRTIO_MSI_QUEUE_VECTOR:
 			vec = ioport__read16(data);
@@ -98,7 +98,7 @@ static bool virtio_pci__specific_data_out(struct kvm *kvm, struct virtio_device
 			if (gsi < 0)
 				break;
 
-			vpci->gsis[vpci->queue_selector] = gsi;
+			virtio_pci__set_vq_gsi(vpci, vpci->queue_selector, gsi);
 			if (vdev->ops->notify_vq_gsi)
 				vdev->ops->notify_vq_gsi(kvm, vpci->dev,
 							 vpci->queue_selector,
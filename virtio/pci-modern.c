@@ -62,7 +62,7 @@ static bool virtio_pci__common_write(struct virtio_device *vdev,
 		if (gsi < 0)
 			break;
 
-		vpci->config_gsi = gsi;
+		virtio_pci__set_config_gsi(vpci, gsi);
 		break;
 	case VIRTIO_PCI_COMMON_STATUS:
 		vpci->status = ioport__read8(data);
@@ -87,7 +87,7 @@ static bool virtio_pci__common_write(struct virtio_device *vdev,
 		if (gsi < 0)
 			break;
 
-		vpci->gsis[vpci->queue_selector] = gsi;
+		virtio_pci__set_vq_gsi(vpci, vpci->queue_selector, gsi);
 		if (vdev->ops->notify_vq_gsi)
 			vdev->ops->notify_vq_gsi(vpci->kvm, vpci->dev,
 						 vpci->queue_selector, gsi);
@@ -9,10 +9,12 @@
 #include "kvm/ioeventfd.h"
 #include "kvm/util.h"
 
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <linux/virtio_pci.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
 
 /* The bit of the ISR which indicates a queue change. */
 #define VIRTIO_PCI_ISR_QUEUE	0x1
@@ -47,6 +49,56 @@ static void virtio_pci__del_msix_route(struct virtio_pci *vpci, u32 gsi)
 	irq__update_msix_route(vpci->kvm, gsi, &msg);
 }
 
+/*
+ * Bind an eventfd to the GSI routing a vector, so that userspace devices
+ * signal the guest with a write() rather than going through KVM_SIGNAL_MSI
+ * or KVM_IRQ_LINE. Without one, signalling falls back to the ioctls.
+ */
+static void virtio_pci__bind_irqfd(struct virtio_pci *vpci, int *irqfd,
+				   u32 old_gsi, u32 gsi)
+{
+	if (*irqfd && old_gsi)
+		irq__del_irqfd(vpci->kvm, old_gsi, *irqfd);
+
+	if (!*irqfd) {
+		*irqfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (*irqfd < 0) {
+			*irqfd = 0;
+			return;
+		}
+	}
+
+	if (irq__add_irqfd(vpci->kvm, gsi, *irqfd, -1) < 0) {
+		pr_warning("virtio-pci: KVM_IRQFD failed, using ioctls");
+		close(*irqfd);
+		*irqfd = 0;
+	}
+}
+
+static void virtio_pci__unbind_irqfd(struct virtio_pci *vpci, int *irqfd,
+				     u32 gsi)
+{
+	if (!*irqfd)
+		return;
+
+	if (gsi)
+		irq__del_irqfd(vpci->kvm, gsi, *irqfd);
+	close(*irqfd);
+	*irqfd = 0;
+}
+
+void virtio_pci__set_config_gsi(struct virtio_pci *vpci, u32 gsi)
+{
+	virtio_pci__bind_irqfd(vpci, &vpci->config_irqfd, vpci->config_gsi, gsi);
+	vpci->config_gsi = gsi;
+}
+
+void virtio_pci__set_vq_gsi(struct virtio_pci *vpci, u32 vq, u32 gsi)
+{
+	virtio_pci__bind_irqfd(vpci, &vpci->vq_irqfd[vq], vpci->gsis[vq], gsi);
+	vpci->gsis[vq] = gsi;
+}
+
 static void virtio_pci__ioevent_callback(struct kvm *kvm, void *param)
 {
 	struct virtio_pci_ioevent_param *ioeventfd = param;
@@ -131,6 +183,7 @@ void virtio_pci_exit_vq(struct kvm *kvm, struct virtio_device *vdev, int vq)
 	u16 port_addr = virtio_pci__port_addr(vpci);
 	off_t offset = vpci->doorbell_offset;
 
+	virtio_pci__unbind_irqfd(vpci, &vpci->vq_irqfd[vq], vpci->gsis[vq]);
 	virtio_pci__del_msix_route(vpci, vpci->gsis[vq]);
 	vpci->gsis[vq] = 0;
 	vpci->vq_vector[vq] = VIRTIO_MSI_NO_VECTOR;
@@ -139,6 +192,79 @@ void virtio_pci_exit_vq(struct kvm *kvm, struct virtio_device *vdev, int vq)
 	virtio_exit_vq(kvm, vdev, vpci->dev, vq);
 }
 
+static void virtio_pci__signal_msi(struct kvm *kvm, struct virtio_pci *vpci,
+				   int vec)
+{
+	struct kvm_msi msi = {
+		.address_lo = vpci->msix_table[vec].msg.address_lo,
+		.address_hi = vpci->msix_table[vec].msg.address_hi,
+		.data = vpci->msix_table[vec].msg.data,
+	};
+
+	if (kvm->msix_needs_devid) {
+		msi.flags = KVM_MSI_VALID_DEVID;
+		msi.devid = vpci->dev_hdr.dev_num << 3;
+	}
+
+	irq__signal_msi(kvm, &msi);
+}
+
+static bool virtio_pci__vector_masked(struct virtio_pci *vpci, int vec)
+{
+	return vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
+	       vpci->msix_table[vec].ctrl & cpu_to_le16(PCI_MSIX_ENTRY_CTRL_MASKBIT);
+}
+
+static void virtio_pci__inject_vector(struct kvm *kvm, struct virtio_pci *vpci,
+				      int vec, u32 gsi, int irqfd)
+{
+	u64 val = 1;
+
+	__sync_fetch_and_add(&vpci->msix_injections[vec], 1);
+
+	if (irqfd && write(irqfd, &val, sizeof(val)) == sizeof(val))
+		return;
+
+	if (vpci->signal_msi)
+		virtio_pci__signal_msi(kvm, vpci, vec);
+	else
+		kvm__irq_trigger(kvm, gsi);
+}
+
+/*
+ * Deliver the interrupt a vector may have accumulated in the PBA while it
+ * was masked, now that it may not be anymore.
+ */
+static void virtio_pci__msix_deliver_pending(struct kvm *kvm,
+					     struct virtio_pci *vpci, int vec)
+{
+	u64 bit = 1ULL << vec;
+	u32 vq;
+
+	if (!(vpci->msix_pba & bit) || virtio_pci__vector_masked(vpci, vec))
+		return;
+
+	if (!(__sync_fetch_and_and(&vpci->msix_pba, ~bit) & bit))
+		return;
+
+	if (vec == vpci->config_vector) {
+		virtio_pci__inject_vector(kvm, vpci, vec, vpci->config_gsi,
+					  vpci->config_irqfd);
+		return;
+	}
+
+	for (vq = 0; vq < VIRTIO_PCI_MAX_VQ; vq++) {
+		if (vpci->vq_vector[vq] == vec) {
+			virtio_pci__inject_vector(kvm, vpci, vec, vpci->gsis[vq],
+						  vpci->vq_irqfd[vq]);
+			return;
+		}
+	}
+
+	if (vpci->signal_msi)
+		virtio_pci__signal_msi(kvm, vpci, vec);
+}
+
 static void update_msix_map(struct virtio_pci *vpci,
 			    struct msix_table *msix_entry, u32 vecnum)
 {
@@ -205,23 +331,24 @@ static void virtio_pci__msix_mmio_callback(struct kvm_cpu *vcpu,
 	/* Did we just update the address or payload? */
 	if (offset < offsetof(struct msix_table, ctrl))
 		update_msix_map(vpci, table, vecnum);
+
+	/* Or maybe unmask it */
+	if (offset + len > offsetof(struct msix_table, ctrl))
+		virtio_pci__msix_deliver_pending(vcpu->kvm, vpci, vecnum);
 }
 
-static void virtio_pci__signal_msi(struct kvm *kvm, struct virtio_pci *vpci,
-				   int vec)
+static void virtio_pci__msix_signal(struct kvm *kvm, struct virtio_pci *vpci,
+				    int vec, u32 gsi, int irqfd)
 {
-	struct kvm_msi msi = {
-		.address_lo = vpci->msix_table[vec].msg.address_lo,
-		.address_hi = vpci->msix_table[vec].msg.address_hi,
-		.data = vpci->msix_table[vec].msg.data,
-	};
-
-	if (kvm->msix_needs_devid) {
-		msi.flags = KVM_MSI_VALID_DEVID;
-		msi.devid = vpci->dev_hdr.dev_num << 3;
+	if (!virtio_pci__vector_masked(vpci, vec)) {
+		virtio_pci__inject_vector(kvm, vpci, vec, gsi, irqfd);
+		return;
 	}
 
-	irq__signal_msi(kvm, &msi);
+	__sync_fetch_and_or(&vpci->msix_pba, 1ULL << vec);
+
+	/* The guest may have unmasked the vector before it saw the PBA bit */
+	virtio_pci__msix_deliver_pending(kvm, vpci, vec);
 }
 
 int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
@@ -230,17 +357,8 @@ int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
 	int tbl = vpci->vq_vector[vq];
 
 	if (virtio_pci__msix_enabled(vpci) && tbl != VIRTIO_MSI_NO_VECTOR) {
-		if (vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
-		    vpci->msix_table[tbl].ctrl & cpu_to_le16(PCI_MSIX_ENTRY_CTRL_MASKBIT)) {
-
-			vpci->msix_pba |= 1 << tbl;
-			return 0;
-		}
-
-		if (vpci->signal_msi)
-			virtio_pci__signal_msi(kvm, vpci, vpci->vq_vector[vq]);
-		else
-			kvm__irq_trigger(kvm, vpci->gsis[vq]);
+		virtio_pci__msix_signal(kvm, vpci, tbl, vpci->gsis[vq],
+					vpci->vq_irqfd[vq]);
 	} else {
 		vpci->isr |= VIRTIO_PCI_ISR_QUEUE;
 		kvm__irq_line(kvm, vpci->legacy_irq_line, VIRTIO_IRQ_HIGH);
@@ -254,17 +372,8 @@ int virtio_pci__signal_config(struct kvm *kvm, struct virtio_device *vdev)
 	int tbl = vpci->config_vector;
 
 	if (virtio_pci__msix_enabled(vpci) && tbl != VIRTIO_MSI_NO_VECTOR) {
-		if (vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
-		    vpci->msix_table[tbl].ctrl & cpu_to_le16(PCI_MSIX_ENTRY_CTRL_MASKBIT)) {
-
-			vpci->msix_pba |= 1 << tbl;
-			return 0;
-		}
-
-		if (vpci->signal_msi)
-			virtio_pci__signal_msi(kvm, vpci, tbl);
-		else
-			kvm__irq_trigger(kvm, vpci->config_gsi);
+		virtio_pci__msix_signal(kvm, vpci, tbl, vpci->config_gsi,
+					vpci->config_irqfd);
 	} else {
 		vpci->isr |= VIRTIO_PCI_ISR_CONFIG;
 		kvm__irq_line(kvm, vpci->legacy_irq_line, VIRTIO_IRQ_HIGH);
@@ -273,6 +382,27 @@ int virtio_pci__signal_config(struct kvm *kvm, struct virtio_device *vdev)
 	return 0;
 }
 
+/*
+ * Clearing the function mask in the MSI-X capability releases the pending
+ * vectors. Apply the write first, the PCI core would only do it after us.
+ */
+static void virtio_pci__cfg_write(struct kvm *kvm,
+				  struct pci_device_header *pci_hdr,
+				  u16 offset, void *data, int sz)
+{
+	struct virtio_pci *vpci = container_of(pci_hdr, struct virtio_pci, pci_hdr);
+	u16 ctrl = PCI_CAP_OFF(pci_hdr, msix) + offsetof(struct msix_cap, ctrl);
+	int vec;
+
+	if (offset >= ctrl + sizeof(u16) || offset + sz <= ctrl)
+		return;
+
+	memcpy((void *)pci_hdr + offset, data, sz);
+
+	for (vec = 0; vec < VIRTIO_NR_MSIX; vec++)
+		virtio_pci__msix_deliver_pending(kvm, vpci, vec);
+}
+
 static int virtio_pci__bar_activate(struct kvm *kvm,
 				    struct pci_device_header *pci_hdr,
 				    int bar_num, void *data)
@@ -375,6 +505,9 @@ int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		.bar_size[0]		= cpu_to_le32(PCI_IO_SIZE),
 		.bar_size[1]		= cpu_to_le32(PCI_IO_SIZE),
 		.bar_size[2]		= cpu_to_le32(VIRTIO_MSIX_BAR_SIZE),
+		.cfg_ops		= {
+			.write		= virtio_pci__cfg_write,
+		},
 	};
 
 	r = pci__register_bar_regions(kvm, &vpci->pci_hdr,
@@ -433,6 +566,7 @@ int virtio_pci__reset(struct kvm *kvm, struct virtio_device *vdev)
 	unsigned int vq;
 	struct virtio_pci *vpci = vdev->virtio;
 
+	virtio_pci__unbind_irqfd(vpci, &vpci->config_irqfd, vpci->config_gsi);
 	virtio_pci__del_msix_route(vpci, vpci->config_gsi);
 	vpci->config_gsi = 0;
 	vpci->config_vector = VIRTIO_MSI_NO_VECTOR;
@@ -446,6 +580,13 @@ int virtio_pci__reset(struct kvm *kvm, struct virtio_device *vdev)
 int virtio_pci__exit(struct kvm *kvm, struct virtio_device *vdev)
 {
 	struct virtio_pci *vpci = vdev->virtio;
+	int vec;
+
+	for (vec = 0; vec < VIRTIO_NR_MSIX; vec++)
+		if (vpci->msix_injections[vec])
+			pr_debug("virtio-pci %02x: vector %d: %llu interrupts",
+				 vpci->dev_hdr.dev_num, vec,
+				 (unsigned long long)vpci->msix_injections[vec]);
 
 	virtio_pci__reset(kvm, vdev);
 	kvm__deregister_mmio(kvm, virtio_pci__mmio_addr(vpci));
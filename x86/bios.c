@@ -51,18 +51,16 @@ static void setup_irq_handler(struct kvm *kvm, struct irq_handler *handler)
 }
 
 /**
- * e820_setup - setup some simple E820 memory map
+ * e820__fill - describe the guest memory as E820 entries
  * @kvm - guest system descriptor
+ * @mem_map - array of at least E820_X_MAX entries
+ *
+ * Returns the number of entries.
  */
-static void e820_setup(struct kvm *kvm)
+unsigned int e820__fill(struct kvm *kvm, struct e820entry *mem_map)
 {
-	struct e820map *e820;
-	struct e820entry *mem_map;
 	unsigned int i = 0;
 
-	e820		= guest_flat_to_host(kvm, E820_MAP_START);
-	mem_map		= e820->map;
-
 	mem_map[i++]	= (struct e820entry) {
 		.addr		= REAL_MODE_IVT_BEGIN,
 		.size		= EBDA_START - REAL_MODE_IVT_BEGIN,
@@ -99,7 +97,19 @@ static void e820_setup(struct kvm *kvm)
 
 	BUG_ON(i > E820_X_MAX);
 
-	e820->nr_map = i;
+	return i;
+}
+
+/**
+ * e820_setup - setup some simple E820 memory map
+ * @kvm - guest system descriptor
+ */
+static void e820_setup(struct kvm *kvm)
+{
+	struct e820map *e820;
+
+	e820		= guest_flat_to_host(kvm, E820_MAP_START);
+	e820->nr_map	= e820__fill(kvm, e820->map);
 }
 
 static void setup_vga_rom(struct kvm *kvm)
@@ -1,6 +1,7 @@
 #ifndef BIOS_EXPORT_H_
 #define BIOS_EXPORT_H_
 
+struct e820entry;
 struct kvm;
 
 extern char bios_rom[0];
@@ -9,5 +10,6 @@ extern char bios_rom_end[0];
 #define bios_rom_size		(bios_rom_end - bios_rom)
 
 extern void setup_bios(struct kvm *kvm);
+extern unsigned int e820__fill(struct kvm *kvm, struct e820entry *mem_map);
 
 #endif /* BIOS_EXPORT_H_ */
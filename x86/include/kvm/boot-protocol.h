@@ -13,4 +13,55 @@
 #define BZ_KERNEL_START			0x100000UL
 #define INITRD_START			0x1000000UL
 
+/*
+ * PVH boot protocol: an uncompressed vmlinux is entered in 32-bit protected
+ * mode at the address given by its XEN_ELFNOTE_PHYS32_ENTRY note, with the
+ * physical address of struct hvm_start_info in %ebx. See
+ * xen/include/public/arch-x86/hvm/start_info.h.
+ */
+#define XEN_ELFNOTE_PHYS32_ENTRY	18
+#define XEN_HVM_START_MAGIC_VALUE	0x336ec578
+
+#define PVH_GDT_START			0x500
+#define PVH_START_INFO			0x6000
+#define PVH_MEMMAP_START		0x7000
+
+#define PVH_CODE_SELECTOR		0x08
+#define PVH_DATA_SELECTOR		0x10
+#define PVH_TSS_SELECTOR		0x18
+
+#ifndef __ASSEMBLER__
+
+#include <linux/types.h>
+
+struct hvm_start_info {
+	u32 magic;
+	u32 version;
+	u32 flags;
+	u32 nr_modules;
+	u64 modlist_paddr;
+	u64 cmdline_paddr;
+	u64 rsdp_paddr;
+	/* Version 1 and later */
+	u64 memmap_paddr;
+	u32 memmap_entries;
+	u32 reserved;
+};
+
+struct hvm_modlist_entry {
+	u64 paddr;
+	u64 size;
+	u64 cmdline_paddr;
+	u64 reserved;
+};
+
+struct hvm_memmap_table_entry {
+	u64 addr;
+	u64 size;
+	u32 type;
+	u32 reserved;
+};
+
+#endif /* __ASSEMBLER__ */
+
 #endif /* BOOT_PROTOCOL_H_ */
@@ -37,6 +37,9 @@ struct kvm_arch {
 	u16			boot_selector;
 	u16			boot_ip;
 	u16			boot_sp;
+	/* PVH entry of an ELF kernel, which starts in protected mode */
+	bool			boot_pvh;
+	u32			boot_pvh_entry;
 
 	struct interrupt_table	interrupt_table;
 };
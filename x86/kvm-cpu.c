@@ -1,5 +1,6 @@
 #include "kvm/kvm-cpu.h"
 
+#include "kvm/boot-protocol.h"
 #include "kvm/symbol.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
@@ -193,6 +194,18 @@ static void kvm_cpu__setup_fpu(struct kvm_cpu *vcpu)
 
 static void kvm_cpu__setup_regs(struct kvm_cpu *vcpu)
 {
+	if (vcpu->kvm->arch.boot_pvh) {
+		vcpu->regs = (struct kvm_regs) {
+			.rflags	= 0x0000000000000002ULL,
+			.rip	= vcpu->kvm->arch.boot_pvh_entry,
+			.rbx	= PVH_START_INFO,
+		};
+
+		if (ioctl(vcpu->vcpu_fd, KVM_SET_REGS, &vcpu->regs) < 0)
+			die_perror("KVM_SET_REGS failed");
+		return;
+	}
+
 	vcpu->regs = (struct kvm_regs) {
 		/* We start the guest in 16-bit real mode  */
 		.rflags	= 0x0000000000000002ULL,
@@ -209,6 +222,46 @@ static void kvm_cpu__setup_regs(struct kvm_cpu *vcpu)
 		die_perror("KVM_SET_REGS failed");
 }
 
+/* Flat 32-bit protected mode, with paging disabled, for the PVH entry point */
+static void kvm_cpu__setup_pvh_sregs(struct kvm_cpu *vcpu)
+{
+	struct kvm_segment seg = {
+		.base		= 0,
+		.limit		= 0xffffffff,
+		.selector	= PVH_CODE_SELECTOR,
+		.type		= 0xb,
+		.present	= 1,
+		.db		= 1,
+		.s		= 1,
+		.g		= 1,
+	};
+
+	if (ioctl(vcpu->vcpu_fd, KVM_GET_SREGS, &vcpu->sregs) < 0)
+		die_perror("KVM_GET_SREGS failed");
+
+	vcpu->sregs.cs = seg;
+
+	seg.selector	= PVH_DATA_SELECTOR;
+	seg.type	= 0x3;
+	vcpu->sregs.ds = vcpu->sregs.es = vcpu->sregs.fs = seg;
+	vcpu->sregs.gs = vcpu->sregs.ss = seg;
+
+	vcpu->sregs.tr = (struct kvm_segment) {
+		.limit		= 0x67,
+		.selector	= PVH_TSS_SELECTOR,
+		.type		= 0xb,
+		.present	= 1,
+	};
+
+	vcpu->sregs.gdt.base	= PVH_GDT_START;
+	vcpu->sregs.gdt.limit	= 4 * sizeof(u64) - 1;
+	vcpu->sregs.cr0		= 0x1;
+	vcpu->sregs.cr4		= 0;
+
+	if (ioctl(vcpu->vcpu_fd, KVM_SET_SREGS, &vcpu->sregs) < 0)
+		die_perror("KVM_SET_SREGS failed");
+}
+
 static void kvm_cpu__setup_sregs(struct kvm_cpu *vcpu)
 {
 	if (ioctl(vcpu->vcpu_fd, KVM_GET_SREGS, &vcpu->sregs) < 0)
@@ -237,7 +290,10 @@ static void kvm_cpu__setup_sregs(struct kvm_cpu *vcpu)
 void kvm_cpu__reset_vcpu(struct kvm_cpu *vcpu)
 {
 	kvm_cpu__setup_cpuid(vcpu);
-	kvm_cpu__setup_sregs(vcpu);
+	if (vcpu->kvm->arch.boot_pvh)
+		kvm_cpu__setup_pvh_sregs(vcpu);
+	else
+		kvm_cpu__setup_sregs(vcpu);
 	kvm_cpu__setup_regs(vcpu);
 	kvm_cpu__setup_fpu(vcpu);
 	kvm_cpu__setup_msrs(vcpu);
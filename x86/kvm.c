@@ -1,6 +1,7 @@
 #include "kvm/kvm.h"
 #include "kvm/boot-protocol.h"
 #include "kvm/cpufeature.h"
+#include "kvm/e820.h"
 #include "kvm/interrupt.h"
 #include "kvm/mptable.h"
 #include "kvm/util.h"
@@ -10,7 +11,9 @@
 #include <asm/bootparam.h>
 #include <linux/kvm.h>
 #include <linux/kernel.h>
+#include <linux/fs.h>
 
+#include <elf.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -218,6 +221,68 @@ static inline void *guest_real_to_host(struct kvm *kvm, u16 selector, u16 offset
 	return guest_flat_to_host(kvm, flat);
 }
 
+/*
+ * A private mapping still follows the file until the guest writes to a page,
+ * so it is only safe when nobody can change the file underneath us: a memfd
+ * sealed against writes and shrinking, or a file marked immutable.
+ */
+static bool file_is_frozen(int fd)
+{
+	int seals_needed = F_SEAL_WRITE | F_SEAL_SHRINK;
+	int seals, flags;
+
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals >= 0 && (seals & seals_needed) == seals_needed)
+		return true;
+
+	return ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0 &&
+	       (flags & FS_IMMUTABLE_FL);
+}
+
+/*
+ * Place len bytes at offset in the file at guest address gpa. When the file
+ * can't change and it agrees with guest memory on the offset within a page,
+ * the whole pages are mapped privately from the file instead of being copied:
+ * they are read in when the guest first touches them, and shared with the
+ * host page cache until the guest writes to them. Everything else, and guest
+ * RAM from hugetlbfs, is copied.
+ */
+static void load_file(struct kvm *kvm, int fd, off_t offset, u64 gpa,
+		      u64 len, const char *what)
+{
+	u64 pagesize = getpagesize();
+	u64 start = ALIGN(gpa, pagesize);
+	u64 end = (gpa + len) & ~(pagesize - 1);
+	void *map;
+
+	if (kvm->ram_pagesize != pagesize ||
+	    (gpa & (pagesize - 1)) != (offset & (pagesize - 1)) || start >= end ||
+	    !file_is_frozen(fd))
+		start = end = gpa + len;
+
+	if (start != end) {
+		map = mmap(guest_flat_to_host(kvm, start), end - start, PROT_RW,
+			   MAP_PRIVATE | MAP_FIXED, fd, offset + start - gpa);
+		if (map == MAP_FAILED)
+			start = end = gpa + len;
+		else
+			madvise(map, end - start, MADV_MERGEABLE);
+	}
+
+	/* Copy the partial pages at both ends, or everything */
+	if (pread_in_full(fd, guest_flat_to_host(kvm, gpa), start - gpa,
+			  offset) != (ssize_t)(start - gpa) ||
+	    pread_in_full(fd, guest_flat_to_host(kvm, end), gpa + len - end,
+			  offset + end - gpa) != (ssize_t)(gpa + len - end))
+		die_perror(what);
+}
+
+/* Highest guest address below which RAM is contiguous */
+static u64 low_ram_end(struct kvm *kvm)
+{
+	return min_t(u64, kvm->ram_size, KVM_32BIT_GAP_START);
+}
+
 static bool load_flat_binary(struct kvm *kvm, int fd_kernel)
 {
 	void *p;
@@ -246,6 +311,7 @@ static bool load_bzimage(struct kvm *kvm, int fd_kernel, int fd_initrd,
 	struct boot_params boot;
 	size_t cmdline_size;
 	ssize_t file_size;
+	struct stat st;
 	void *p;
 	u16 vidmode;
 
@@ -274,11 +340,12 @@ static bool load_bzimage(struct kvm *kvm, int fd_kernel, int fd_initrd,
 		die_perror("kernel setup read");
 
 	/* read actual kernel image (vmlinux.bin) to BZ_KERNEL_START */
-	p = guest_flat_to_host(kvm, BZ_KERNEL_START);
-	file_size = read_file(fd_kernel, p,
-			      kvm->cfg.ram_size - BZ_KERNEL_START);
-	if (file_size < 0)
-		die_perror("kernel read");
+	if (fstat(fd_kernel, &st))
+		die_perror("fstat");
+	if (st.st_size - file_size > (off_t)(low_ram_end(kvm) - BZ_KERNEL_START))
+		die("Not enough memory for the kernel");
+	load_file(kvm, fd_kernel, file_size, BZ_KERNEL_START,
+		  st.st_size - file_size, "kernel read");
 
 	p = guest_flat_to_host(kvm, BOOT_CMDLINE_OFFSET);
 	if (kernel_cmdline) {
@@ -327,9 +394,8 @@ static bool load_bzimage(struct kvm *kvm, int fd_kernel, int fd_initrd,
 			addr -= 0x100000;
 		}
 
-		p = guest_flat_to_host(kvm, addr);
-		if (read_in_full(fd_initrd, p, initrd_stat.st_size) < 0)
-			die("Failed to read initrd");
+		load_file(kvm, fd_initrd, 0, addr, initrd_stat.st_size,
+			  "Failed to read initrd");
 
 		kern_boot->hdr.ramdisk_image	= addr;
 		kern_boot->hdr.ramdisk_size	= initrd_stat.st_size;
@@ -346,12 +412,195 @@ static bool load_bzimage(struct kvm *kvm, int fd_kernel, int fd_initrd,
 	return true;
 }
 
+/* Find the 32-bit entry point in the notes of a PVH capable kernel */
+static u32 elf_pvh_entry(int fd, Elf64_Phdr *phdr)
+{
+	Elf64_Nhdr *nhdr;
+	u64 off, next;
+	u32 entry = 0;
+	void *notes;
+
+	if (phdr->p_type != PT_NOTE || phdr->p_filesz > SZ_1M)
+		return 0;
+
+	notes = malloc(phdr->p_filesz);
+	if (!notes)
+		die("Failed to allocate ELF notes");
+
+	if (pread_in_full(fd, notes, phdr->p_filesz, phdr->p_offset) !=
+	    (ssize_t)phdr->p_filesz)
+		die_perror("ELF notes read");
+
+	for (off = 0; off + sizeof(*nhdr) <= phdr->p_filesz; off = next) {
+		nhdr = notes + off;
+		next = off + sizeof(*nhdr) + ALIGN((u64)nhdr->n_namesz, 4) +
+		       ALIGN((u64)nhdr->n_descsz, 4);
+		if (next > phdr->p_filesz)
+			break;
+
+		if (nhdr->n_type == XEN_ELFNOTE_PHYS32_ENTRY &&
+		    nhdr->n_namesz == 4 && !memcmp(nhdr + 1, "Xen", 4) &&
+		    nhdr->n_descsz >= sizeof(entry)) {
+			memcpy(&entry, (void *)(nhdr + 1) + 4, sizeof(entry));
+			break;
+		}
+	}
+
+	free(notes);
+	return entry;
+}
+
+static void setup_pvh_start_info(struct kvm *kvm, u64 initrd_addr,
+				 u64 initrd_size)
+{
+	struct hvm_memmap_table_entry *memmap;
+	struct e820entry e820[E820_X_MAX];
+	struct hvm_modlist_entry *mod;
+	struct hvm_start_info *info;
+	unsigned int i, nr;
+	u64 *gdt;
+
+	/* Flat code and data segments, and the TSS that VMX wants */
+	gdt = guest_flat_to_host(kvm, PVH_GDT_START);
+	gdt[0] = 0;
+	gdt[PVH_CODE_SELECTOR / 8] = 0x00cf9b000000ffffULL;
+	gdt[PVH_DATA_SELECTOR / 8] = 0x00cf93000000ffffULL;
+	gdt[PVH_TSS_SELECTOR / 8] = 0x00008b0000000067ULL;
+
+	nr = e820__fill(kvm, e820);
+	memmap = guest_flat_to_host(kvm, PVH_MEMMAP_START);
+	for (i = 0; i < nr; i++) {
+		memmap[i] = (struct hvm_memmap_table_entry) {
+			.addr	= e820[i].addr,
+			.size	= e820[i].size,
+			.type	= e820[i].type,
+		};
+	}
+
+	info = guest_flat_to_host(kvm, PVH_START_INFO);
+	*info = (struct hvm_start_info) {
+		.magic		= XEN_HVM_START_MAGIC_VALUE,
+		.version	= 1,
+		.cmdline_paddr	= BOOT_CMDLINE_OFFSET,
+		.memmap_paddr	= PVH_MEMMAP_START,
+		.memmap_entries	= nr,
+	};
+
+	if (initrd_size) {
+		mod = (void *)(info + 1);
+		*mod = (struct hvm_modlist_entry) {
+			.paddr	= initrd_addr,
+			.size	= initrd_size,
+		};
+		info->nr_modules = 1;
+		info->modlist_paddr = PVH_START_INFO + sizeof(*info);
+	}
+}
+
+/*
+ * Boot an uncompressed vmlinux through its PVH entry point. The kernel
+ * doesn't need to decompress itself, and its segments are mapped from the
+ * file when they are page aligned.
+ */
+static bool load_elf(struct kvm *kvm, int fd_kernel, int fd_initrd,
+		     const char *kernel_cmdline)
+{
+	u64 kernel_end = 0, initrd_addr = 0, initrd_size = 0;
+	size_t phdrs_size, cmdline_size;
+	Elf64_Phdr *phdrs, *phdr;
+	struct stat initrd_stat;
+	Elf64_Ehdr ehdr;
+	u32 entry = 0;
+	int i;
+
+	if (pread_in_full(fd_kernel, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr))
+		return false;
+
+	if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+	    ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+	    ehdr.e_machine != EM_X86_64)
+		return false;
+
+	if (ehdr.e_phentsize != sizeof(*phdrs) || !ehdr.e_phnum)
+		die("Invalid ELF program headers");
+
+	phdrs_size = ehdr.e_phnum * sizeof(*phdrs);
+	phdrs = malloc(phdrs_size);
+	if (!phdrs)
+		die("Failed to allocate ELF program headers");
+
+	if (pread_in_full(fd_kernel, phdrs, phdrs_size, ehdr.e_phoff) !=
+	    (ssize_t)phdrs_size)
+		die_perror("ELF program headers read");
+
+	for (i = 0; i < ehdr.e_phnum && !entry; i++)
+		entry = elf_pvh_entry(fd_kernel, &phdrs[i]);
+	if (!entry)
+		die("ELF kernel has no PVH entry point, build it with CONFIG_PVH");
+
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		phdr = &phdrs[i];
+		if (phdr->p_type != PT_LOAD || !phdr->p_memsz)
+			continue;
+
+		if (phdr->p_paddr < BZ_KERNEL_START ||
+		    phdr->p_paddr >= low_ram_end(kvm) ||
+		    phdr->p_filesz > phdr->p_memsz ||
+		    phdr->p_memsz > low_ram_end(kvm) - phdr->p_paddr)
+			die("Kernel segment at 0x%llx doesn't fit in guest memory",
+			    (unsigned long long)phdr->p_paddr);
+
+		/* Guest memory is still zero, which takes care of the bss */
+		load_file(kvm, fd_kernel, phdr->p_offset, phdr->p_paddr,
+			  phdr->p_filesz, "kernel read");
+		kernel_end = max_t(u64, kernel_end, phdr->p_paddr + phdr->p_memsz);
+	}
+	free(phdrs);
+
+	if (kernel_cmdline) {
+		cmdline_size = strlen(kernel_cmdline) + 1;
+		if (cmdline_size > EBDA_START - BOOT_CMDLINE_OFFSET)
+			die("Kernel command line too long");
+		memcpy(guest_flat_to_host(kvm, BOOT_CMDLINE_OFFSET),
+		       kernel_cmdline, cmdline_size);
+	}
+
+	/* The initrd goes as high as possible, like with bzImage */
+	if (fd_initrd >= 0) {
+		if (fstat(fd_initrd, &initrd_stat))
+			die_perror("fstat");
+
+		initrd_size = initrd_stat.st_size;
+		if (initrd_size > low_ram_end(kvm) - kernel_end)
+			die("Not enough memory for initrd");
+
+		initrd_addr = (low_ram_end(kvm) - initrd_size) & ~0xfffffULL;
+		if (initrd_addr < kernel_end)
+			initrd_addr = ALIGN(kernel_end, getpagesize());
+		/* Aligning the end of the kernel up may not leave enough room */
+		if (initrd_addr > low_ram_end(kvm) ||
+		    initrd_size > low_ram_end(kvm) - initrd_addr)
+			die("Not enough memory for initrd");
+		load_file(kvm, fd_initrd, 0, initrd_addr, initrd_size,
+			  "Failed to read initrd");
+	}
+
+	setup_pvh_start_info(kvm, initrd_addr, initrd_size);
+
+	kvm->arch.boot_pvh = true;
+	kvm->arch.boot_pvh_entry = entry;
+
+	return true;
+}
+
 bool kvm__arch_load_kernel_image(struct kvm *kvm, int fd_kernel, int fd_initrd,
 				 const char *kernel_cmdline)
 {
 	if (load_bzimage(kvm, fd_kernel, fd_initrd, kernel_cmdline))
 		return true;
-	pr_warning("Kernel image is not a bzImage.");
+	if (load_elf(kvm, fd_kernel, fd_initrd, kernel_cmdline))
+		return true;
+	pr_warning("Kernel image is not a bzImage or an ELF vmlinux.");
 	pr_warning("Trying to load it as a flat binary (no cmdline support)");
 
 	if (fd_initrd != -1)